@@ -20,59 +20,84 @@
 
 #include "kindle_tool.h"
 
-int kindle_read_bundle_header(UpdateHeader *header, FILE *input)
+// Per-run settings for convert, shared (read-only) by every file we convert
+struct kt_convert_opts
 {
-    if(fread(header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH, input) < 1 || ferror(input) != 0)
+    int info_only;
+    int keep_ori;
+    int extract_sig;
+    unsigned int fake_sign;
+    unsigned int unwrap_only;
+    unsigned int to_stdout;
+    unsigned int build_index;
+};
+
+// Shared state for convert -j
+struct kt_convert_batch
+{
+    const struct kt_convert_opts *opts;
+    char **inputs;
+    unsigned int num_inputs;
+    unsigned int next;                  // Index of the next input to hand out
+    unsigned int failed;                // How many inputs failed to convert
+    unsigned int flushed;               // How many logs we've already flushed
+    unsigned int with_unknown_devcodes; // Inherited from the main thread's context
+    pthread_mutex_t lock;
+};
+
+static int kindle_convert_bundle(const KTHeader *, FILE *, FILE *, FILE *, const unsigned int, const unsigned int, FILE *, char *);
+static int kindle_convert_file(const char *, const struct kt_convert_opts *);
+static void *kindle_convert_worker(void *);
+
+int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned int fake_sign, const unsigned int unwrap_only, FILE *unwrap_output, char *header_md5)
+{
+    KTHeader header;
+    KTHeaderBuffer hbuf;
+    int ret;
+
+    // The whole header, in a single buffer (or a mapping of the input), which the parsed header points into
+    memset(&hbuf, 0, sizeof(hbuf));
+    if(kt_header_read(&header, &hbuf, input) < 0)
     {
+        kt_header_buffer_free(&hbuf);
         return -1;
     }
-    return 0;
+    ret = kindle_convert_bundle(&header, input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5);
+    kt_header_buffer_free(&hbuf);
+
+    return ret;
 }
 
-int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned int fake_sign, const unsigned int unwrap_only, FILE *unwrap_output, char *header_md5)
+static int kindle_convert_bundle(const KTHeader *header, FILE *input, FILE *output, FILE *sig_output, const unsigned int fake_sign, const unsigned int unwrap_only, FILE *unwrap_output, char *header_md5)
 {
-    UpdateHeader header;
-    BundleVersion bundle_version;
-    // Zero init to make Valgrind happy
-    // (it considers a variable to be uninitialized if any variable or memory location used in its calculation were uninitialized,
-    // and we effectiveley only initialize the first MAGIC_NUMBER_LENGTH bytes of header with kindle_read_bundle_header, so it shouts at us
-    // later during the header.magic_number printf (asking for a MAGIC_NUMBER_LENGTH field width also helps) ;)).
-    memset(&header, 0, sizeof(UpdateHeader));
-
     unsigned char buffer[BUFFER_SIZE];
     size_t count;
 
-    if(kindle_read_bundle_header(&header, input) < 0)
-    {
-        fprintf(stderr, "Cannot read input file: %s.\n", strerror(errno));
-        return -1;
-    }
-    if(get_bundle_version(header.magic_number) == UnknownUpdate)
+    if(header->version == UnknownUpdate)
     {
         // Cf. http://stackoverflow.com/questions/3555791
-        fprintf(stderr, "Bundle         Unknown (0x%02X%02X%02X%02X [%.*s])\n", (unsigned)(unsigned char)header.magic_number[0], (unsigned)(unsigned char)header.magic_number[1], (unsigned)(unsigned char)header.magic_number[2], (unsigned)(unsigned char)header.magic_number[3], MAGIC_NUMBER_LENGTH, header.magic_number);
+        fprintf(kt_stderr, "Bundle         Unknown (0x%02X%02X%02X%02X [%.*s])\n", (unsigned)(unsigned char)header->magic_number[0], (unsigned)(unsigned char)header->magic_number[1], (unsigned)(unsigned char)header->magic_number[2], (unsigned)(unsigned char)header->magic_number[3], MAGIC_NUMBER_LENGTH, header->magic_number);
     }
     else
-        fprintf(stderr, "Bundle         %.*s%s%s\n", MAGIC_NUMBER_LENGTH, header.magic_number, (get_bundle_version(header.magic_number) == UserDataPackage ? "" : " "), convert_magic_number(header.magic_number));
-    bundle_version = get_bundle_version(header.magic_number);
-    switch(bundle_version)
+        fprintf(kt_stderr, "Bundle         %.*s%s%s\n", MAGIC_NUMBER_LENGTH, header->magic_number, (header->version == UserDataPackage ? "" : " "), convert_magic_number(header->magic_number));
+    switch(header->version)
     {
         case OTAUpdateV2:
             if(unwrap_only)
             {
-                fprintf(stderr, "Nothing to unwrap!\n");
+                fprintf(kt_stderr, "Nothing to unwrap!\n");
                 return 0;
             }
             else
             {
-                fprintf(stderr, "Bundle Type    %s\n", "OTA V2");
-                return kindle_convert_ota_update_v2(input, output, fake_sign, header_md5); // No absolute size, so no struct to pass
+                fprintf(kt_stderr, "Bundle Type    %s\n", "OTA V2");
+                return kindle_convert_ota_update_v2(header, input, output, fake_sign, header_md5);
             }
             break;
         case UpdateSignature:
-            if(kindle_convert_signature(&header, input, sig_output) < 0)
+            if(kindle_convert_signature(header, input, sig_output) < 0)
             {
-                fprintf(stderr, "Cannot extract signature file!\n");
+                fprintf(kt_stderr, "Cannot extract signature file!\n");
                 return -1;
             }
             // If we asked to simply unwrap the package, just write our unwrapped package ;).
@@ -82,7 +107,8 @@ int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned i
                 {
                     if(fwrite(buffer, sizeof(unsigned char), count, unwrap_output) < count)
                     {
-                        fprintf(stderr, "Error writing unwrapped update to output: %s.\n", strerror(errno));
+                        fprintf(kt_stderr, "Error writing unwrapped update to output: %s.\n", strerror(errno));
+                        kt_set_error(KT_ERR_IO);
                         return -1;
                     }
                 }
@@ -97,37 +123,37 @@ int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned i
         case OTAUpdate:
             if(unwrap_only)
             {
-                fprintf(stderr, "Nothing to unwrap!\n");
+                fprintf(kt_stderr, "Nothing to unwrap!\n");
                 return 0;
             }
             else
             {
-                fprintf(stderr, "Bundle Type    %s\n", "OTA V1");
-                return kindle_convert_ota_update(&header, input, output, fake_sign, header_md5);
+                fprintf(kt_stderr, "Bundle Type    %s\n", "OTA V1");
+                return kindle_convert_ota_update(header, input, output, fake_sign, header_md5);
             }
             break;
         case RecoveryUpdate:
             if(unwrap_only)
             {
-                fprintf(stderr, "Nothing to unwrap!\n");
+                fprintf(kt_stderr, "Nothing to unwrap!\n");
                 return 0;
             }
             else
             {
-                fprintf(stderr, "Bundle Type    %s\n", "Recovery");
-                return kindle_convert_recovery(&header, input, output, fake_sign, header_md5);
+                fprintf(kt_stderr, "Bundle Type    %s\n", "Recovery");
+                return kindle_convert_recovery(header, input, output, fake_sign, header_md5);
             }
             break;
         case RecoveryUpdateV2:
             if(unwrap_only)
             {
-                fprintf(stderr, "Nothing to unwrap!\n");
+                fprintf(kt_stderr, "Nothing to unwrap!\n");
                 return 0;
             }
             else
             {
-                fprintf(stderr, "Bundle Type    %s\n", "Recovery V2");
-                return kindle_convert_recovery_v2(input, output, fake_sign, header_md5);
+                fprintf(kt_stderr, "Bundle Type    %s\n", "Recovery V2");
+                return kindle_convert_recovery_v2(header, input, output, fake_sign, header_md5);
             }
             break;
         case UserDataPackage:
@@ -140,7 +166,8 @@ int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned i
                 {
                     if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
                     {
-                        fprintf(stderr, "Error writing userdata tarball to output: %s.\n", strerror(errno));
+                        fprintf(kt_stderr, "Error writing userdata tarball to output: %s.\n", strerror(errno));
+                        kt_set_error(KT_ERR_IO);
                         return -1;
                     }
                 }
@@ -150,70 +177,39 @@ int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const unsigned i
             break;
         case UnknownUpdate:
         default:
-            fprintf(stderr, "Unknown update bundle version!\n");
+            fprintf(kt_stderr, "Unknown update bundle version!\n");
+            kt_set_error(KT_ERR_FORMAT);
             break;
     }
     return -1; // If we get here, there has been an error
 }
 
-int kindle_convert_ota_update_v2(FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
+int kindle_convert_ota_update_v2(const KTHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
 {
-    unsigned char *data;
-    size_t hindex;
-    uint64_t source_revision;
-    uint64_t target_revision;
-    uint16_t num_devices;
-    uint16_t device;
-    //uint16_t *devices;
-    uint8_t critical;
-    uint8_t padding;
-    char *pkg_md5_sum;
-    uint16_t num_metadata;
-    size_t meta_strlen;
+    const unsigned char *cursor;
+    const unsigned char *metastring;
+    unsigned char chunk[BUFFER_SIZE];
     uint16_t metastring_length;
-    char *metastring;
-    //unsigned char **metastrings;
-    size_t read_size __attribute__((unused));
-
-    // First read the set block size and determine how much to resize
-    data = malloc(OTA_UPDATE_V2_BLOCK_SIZE * sizeof(unsigned char));
-    read_size = fread(data, sizeof(unsigned char), OTA_UPDATE_V2_BLOCK_SIZE, input);
-    hindex = 0;
-
-    // NOTE: Use memcpy to avoid unaligned accesses on ARM...
-    // (Because for some reason, even the A8 eats dirt (the alignment trap throws a SIGILL) on some vld1.64 :64 instructions,
-    // and my non-existent understanding of ARM assembly & GCC innards is no help at all ;D).
-    //source_revision = *(uint64_t *)&data[hindex];
-    memcpy(&source_revision, &data[hindex], sizeof(uint64_t));
-    hindex += sizeof(uint64_t);
-    fprintf(stderr, "Minimum OTA    %llu\n", (long long) source_revision);
-    //target_revision = *(uint64_t *)&data[hindex];
-    memcpy(&target_revision, &data[hindex], sizeof(uint64_t));
-    hindex += sizeof(uint64_t);
-    fprintf(stderr, "Target OTA     %llu\n", (long long) target_revision);
-    //num_devices = *(uint16_t *)&data[hindex];
-    memcpy(&num_devices, &data[hindex], sizeof(uint16_t));
-    //hindex += sizeof(uint16_t);       // Shut clang's sa up
-    fprintf(stderr, "Devices        %hd\n", num_devices);
-    free(data);
+    uint16_t device;
+    size_t len;
+    size_t i;
+    unsigned int n;
 
-    // Now get the data
-    data = malloc(num_devices * sizeof(uint16_t));      // NOTE: This upsets clang's sa... While theoretically dangerous, I don't *think* we do anything wrong with it...
-    read_size = fread(data, sizeof(uint16_t), num_devices, input);
-    for(hindex = 0; hindex < num_devices * sizeof(uint16_t); hindex += sizeof(uint16_t))
+    fprintf(kt_stderr, "Minimum OTA    %llu\n", (long long) header->source_revision);
+    fprintf(kt_stderr, "Target OTA     %llu\n", (long long) header->target_revision);
+    fprintf(kt_stderr, "Devices        %hd\n", header->num_devices);
+    for(n = 0; n < header->num_devices; n++)
     {
-        //device = *(uint16_t *)&data[hindex];
-        memcpy(&device, &data[hindex], sizeof(uint16_t));
-        // Slightly hackish way to detect unknown devices, because I don't want to refactor convert_device_id()
-        if(strcmp(convert_device_id(device), "Unknown") == 0)
+        device = kt_header_device(header, n);
+        if(kt_device_name(device) == NULL)
         {
-            fprintf(stderr, "Device         Unknown (0x%02X)\n", device);
+            fprintf(kt_stderr, "Device         Unknown (0x%02X)\n", device);
         }
         else
         {
             if(kt_with_unknown_devcodes)
             {
-                fprintf(stderr, "Device         %s", convert_device_id(device));
+                fprintf(kt_stderr, "Device         %s", convert_device_id(device));
                 // Handle the new device ID scheme...
                 if(device > 0xFF)
                 {
@@ -221,63 +217,42 @@ int kindle_convert_ota_update_v2(FILE *input, FILE *output, const unsigned int f
                     dev_id = to_base(device, 32);
                     char *pad = "000";
                     // NOTE: 0 padding a string with actual zeroes is fun.... (cf. https://stackoverflow.com/questions/4133318)
-                    fprintf(stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, device);
+                    fprintf(kt_stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, device);
                     free(dev_id);
                 }
                 else
                 {
-                    fprintf(stderr, " (0x%02X)\n", device);
+                    fprintf(kt_stderr, " (0x%02X)\n", device);
                 }
             }
             else
             {
-                fprintf(stderr, "Device         %s\n", convert_device_id(device));
+                fprintf(kt_stderr, "Device         %s\n", convert_device_id(device));
             }
         }
     }
-    free(data);
 
-    // Now get second part of set sized data
-    data = malloc(OTA_UPDATE_V2_PART_2_BLOCK_SIZE * sizeof(unsigned char));
-    read_size = fread(data, sizeof(unsigned char), OTA_UPDATE_V2_PART_2_BLOCK_SIZE, input);
-    hindex = 0;
-
-    // NOTE: Here, the alignment is identical between critical & data, so we can get away with it safely.
-    critical = *(uint8_t *)&data[hindex];       // Apparently critical really is supposed to be 1 byte + 1 padding byte, so obey that...
-    hindex += sizeof(uint8_t);
-    fprintf(stderr, "Critical       %hhu\n", critical);
-    padding = *(uint8_t *)&data[hindex];        // Print the (garbage?) padding byte found in official updates...
-    hindex += sizeof(uint8_t);
-    fprintf(stderr, "Padding Byte   %hhu (0x%02X)\n", padding, padding);
-    pkg_md5_sum = (char *)&data[hindex];
-    dm((unsigned char *)pkg_md5_sum, MD5_HASH_LENGTH);
-    hindex += MD5_HASH_LENGTH;
-    fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
-    strncpy(header_md5, pkg_md5_sum, MD5_HASH_LENGTH);
-    //num_metadata = *(uint16_t *)&data[hindex];
-    memcpy(&num_metadata, &data[hindex], sizeof(uint16_t));
-    //hindex += sizeof(uint16_t);       // Shut clang's sa up
-    fprintf(stderr, "Metadata       %hd\n", num_metadata);
-    free(data);
-
-    // Finally, get the metastrings
-    for(hindex = 0; hindex < num_metadata; hindex++)
-    {
-        // Get correct meta string length because of the endianness swap...
-        read_size = fread(&((uint8_t *)&meta_strlen)[1], sizeof(uint8_t), 1, input);
-        read_size = fread(&((uint8_t *)&meta_strlen)[0], sizeof(uint8_t), 1, input);
-        metastring_length = (uint16_t)meta_strlen;
-        metastring = malloc(metastring_length);
-        read_size = fread(metastring, sizeof(char), metastring_length, input);
-        dm((unsigned char *)metastring, metastring_length);      // Deobfuscate string (FIXME: Should meta strings really be obfuscated?)
-        fprintf(stderr, "Metastring     %.*s\n", metastring_length, metastring);
-        free(metastring);
-    }
+    fprintf(kt_stderr, "Critical       %hhu\n", header->critical);   // Apparently critical really is supposed to be 1 byte + 1 padding byte...
+    fprintf(kt_stderr, "Padding Byte   %hhu (0x%02X)\n", header->padding, header->padding);  // Print the (garbage?) padding byte found in official updates...
+    fprintf(kt_stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->md5_sum);
+    memcpy(header_md5, header->md5_sum, MD5_HASH_LENGTH);
+    header_md5[MD5_HASH_LENGTH] = '\0';
+    fprintf(kt_stderr, "Metadata       %hd\n", header->num_meta);
 
-    if(ferror(input) != 0)
+    // Finally, the metastrings, deobfuscated a chunk at a time, since they're still munged in the header (FIXME: Should meta strings really be obfuscated?)
+    cursor = header->meta;
+    for(n = 0; n < header->num_meta; n++)
     {
-        fprintf(stderr, "Cannot read update correctly: %s.\n", strerror(errno));
-        return -1;
+        metastring = kt_header_next_meta(&cursor, &metastring_length);
+        fprintf(kt_stderr, "Metastring     ");
+        for(i = 0; i < metastring_length; i += len)
+        {
+            len = (metastring_length - i < sizeof(chunk) ? metastring_length - i : sizeof(chunk));
+            memcpy(chunk, metastring + i, len);
+            dm(chunk, len);
+            fwrite(chunk, sizeof(unsigned char), len, kt_stderr);
+        }
+        fprintf(kt_stderr, "\n");
     }
 
     if(output == NULL)
@@ -289,20 +264,15 @@ int kindle_convert_ota_update_v2(FILE *input, FILE *output, const unsigned int f
     return demunger(input, output, 0, fake_sign);
 }
 
-int kindle_convert_signature(UpdateHeader *header, FILE *input, FILE *output)
+int kindle_convert_signature(const KTHeader *header, FILE *input, FILE *output)
 {
     CertificateNumber cert_num;
     char *cert_name;
     size_t seek;
     unsigned char *signature;
 
-    if(fread(header->data.signature_header_data, sizeof(unsigned char), UPDATE_SIGNATURE_BLOCK_SIZE, input) < UPDATE_SIGNATURE_BLOCK_SIZE)
-    {
-        fprintf(stderr, "Cannot read signature header: %s.\n", strerror(errno));
-        return -1;
-    }
-    cert_num = (CertificateNumber)(header->data.signature.certificate_number);
-    fprintf(stderr, "Cert number    %u\n", cert_num);
+    cert_num = (CertificateNumber)(header->certificate_number);
+    fprintf(kt_stderr, "Cert number    %u\n", cert_num);
     switch(cert_num)
     {
         case CertificateDeveloper:
@@ -319,27 +289,41 @@ int kindle_convert_signature(UpdateHeader *header, FILE *input, FILE *output)
             break;
         case CertificateUnknown:
         default:
-            fprintf(stderr, "Unknown signature size, cannot continue.\n");
+            fprintf(kt_stderr, "Unknown signature size, cannot continue.\n");
+            kt_set_error(KT_ERR_FORMAT);
             return -1;
             break;
     }
-    fprintf(stderr, "Cert file      %s\n", cert_name);
+    fprintf(kt_stderr, "Cert file      %s\n", cert_name);
     if(output == NULL)
     {
-        return fseeko(input, (off_t)seek, SEEK_CUR);
+        if(fseeko(input, (off_t)seek, SEEK_CUR) == 0)
+            return 0;
+        // We can't seek in a pipe, so just eat it
+        signature = malloc(seek);
+        if(fread(signature, sizeof(unsigned char), seek, input) < seek)
+        {
+            fprintf(kt_stderr, "Cannot read signature! %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            free(signature);
+            return -1;
+        }
+        free(signature);
     }
     else
     {
         signature = malloc(seek);
         if(fread(signature, sizeof(unsigned char), seek, input) < seek)
         {
-            fprintf(stderr, "Cannot read signature! %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot read signature! %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
             free(signature);
             return -1;
         }
         if(fwrite(signature, sizeof(unsigned char), seek, output) < seek)
         {
-            fprintf(stderr, "Cannot write signature file! %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot write signature file! %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
             free(signature);
             return -1;
         }
@@ -348,41 +332,36 @@ int kindle_convert_signature(UpdateHeader *header, FILE *input, FILE *output)
     return 0;
 }
 
-int kindle_convert_ota_update(UpdateHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
+int kindle_convert_ota_update(const KTHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
 {
-    if(fread(header->data.ota_header_data, sizeof(unsigned char), OTA_UPDATE_BLOCK_SIZE, input) < OTA_UPDATE_BLOCK_SIZE)
-    {
-        fprintf(stderr, "Cannot read OTA header: %s.\n", strerror(errno));
-        return -1;
-    }
-    dm((unsigned char *)header->data.ota_update.md5_sum, MD5_HASH_LENGTH);
-    fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.ota_update.md5_sum);
-    strncpy(header_md5, header->data.ota_update.md5_sum, MD5_HASH_LENGTH);
-    fprintf(stderr, "Minimum OTA    %u\n", header->data.ota_update.source_revision);
-    fprintf(stderr, "Target OTA     %u\n", header->data.ota_update.target_revision);
+    fprintf(kt_stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->md5_sum);
+    memcpy(header_md5, header->md5_sum, MD5_HASH_LENGTH);
+    header_md5[MD5_HASH_LENGTH] = '\0';
+    fprintf(kt_stderr, "Minimum OTA    %u\n", (unsigned int) header->source_revision);
+    fprintf(kt_stderr, "Target OTA     %u\n", (unsigned int) header->target_revision);
     if(kt_with_unknown_devcodes)
     {
-        fprintf(stderr, "Device         %s", convert_device_id(header->data.ota_update.device));
+        fprintf(kt_stderr, "Device         %s", convert_device_id(header->device));
         // Handle the new device ID scheme...
-        if(header->data.ota_update.device > 0xFF)
+        if(header->device > 0xFF)
         {
             char *dev_id;
-            dev_id = to_base(header->data.ota_update.device, 32);
+            dev_id = to_base(header->device, 32);
             char *pad = "000";
-            fprintf(stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, header->data.ota_update.device);
+            fprintf(kt_stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, header->device);
             free(dev_id);
         }
         else
         {
-            fprintf(stderr, " (0x%02X)\n", header->data.ota_update.device);
+            fprintf(kt_stderr, " (0x%02X)\n", header->device);
         }
     }
     else
     {
-        fprintf(stderr, "Device         %s\n", convert_device_id(header->data.ota_update.device));
+        fprintf(kt_stderr, "Device         %s\n", convert_device_id(header->device));
     }
-    fprintf(stderr, "Optional       %hhu\n", header->data.ota_update.optional);
-    fprintf(stderr, "Padding Byte   %hhu (0x%02X)\n", header->data.ota_update.unused, header->data.ota_update.unused);  // Print the (garbage?) padding byte... (The python tool puts 0x13 in there)
+    fprintf(kt_stderr, "Optional       %hhu\n", header->optional);
+    fprintf(kt_stderr, "Padding Byte   %hhu (0x%02X)\n", header->padding, header->padding);  // Print the (garbage?) padding byte... (The python tool puts 0x13 in there)
 
     if(output == NULL)
     {
@@ -392,57 +371,52 @@ int kindle_convert_ota_update(UpdateHeader *header, FILE *input, FILE *output, c
     return demunger(input, output, 0, fake_sign);
 }
 
-int kindle_convert_recovery(UpdateHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
+int kindle_convert_recovery(const KTHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
 {
-    if(fread(header->data.recovery_header_data, sizeof(unsigned char), RECOVERY_UPDATE_BLOCK_SIZE, input) < RECOVERY_UPDATE_BLOCK_SIZE)
-    {
-        fprintf(stderr, "Cannot read recovery update header: %s.\n", strerror(errno));
-        return -1;
-    }
-    dm((unsigned char *)header->data.recovery_update.md5_sum, MD5_HASH_LENGTH);
-    fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->data.recovery_update.md5_sum);
-    strncpy(header_md5, header->data.recovery_update.md5_sum, MD5_HASH_LENGTH);
-    fprintf(stderr, "Magic 1        %d\n", header->data.recovery_update.magic_1);
-    fprintf(stderr, "Magic 2        %d\n", header->data.recovery_update.magic_2);
-    fprintf(stderr, "Minor          %d\n", header->data.recovery_update.minor);
+    fprintf(kt_stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->md5_sum);
+    memcpy(header_md5, header->md5_sum, MD5_HASH_LENGTH);
+    header_md5[MD5_HASH_LENGTH] = '\0';
+    fprintf(kt_stderr, "Magic 1        %d\n", header->magic_1);
+    fprintf(kt_stderr, "Magic 2        %d\n", header->magic_2);
+    fprintf(kt_stderr, "Minor          %d\n", header->minor);
 
     // Handle V2 header rev...
-    if(header->data.recovery_h2_update.header_rev == 2)
+    if(header->header_rev == 2)
     {
-        fprintf(stderr, "Header Rev     %d\n", header->data.recovery_h2_update.header_rev);
-        // Slightly ugly way to detect unknown platforms...
-        if(strcmp(convert_platform_id(header->data.recovery_h2_update.platform), "Unknown") == 0)
-            fprintf(stderr, "Platform       Unknown (0x%02X)\n", header->data.recovery_h2_update.platform);
+        fprintf(kt_stderr, "Header Rev     %d\n", header->header_rev);
+        // Detect unknown platforms...
+        if(kt_platform_name(header->platform) == NULL)
+            fprintf(kt_stderr, "Platform       Unknown (0x%02X)\n", header->platform);
         else
-            fprintf(stderr, "Platform       %s\n", convert_platform_id(header->data.recovery_h2_update.platform));
+            fprintf(kt_stderr, "Platform       %s\n", convert_platform_id(header->platform));
         // Same shtick for unknown boards...
-        if(strcmp(convert_board_id(header->data.recovery_h2_update.board), "Unknown") == 0)
-            fprintf(stderr, "Board          Unknown (0x%02X)\n", header->data.recovery_h2_update.board);
+        if(kt_board_name(header->board) == NULL)
+            fprintf(kt_stderr, "Board          Unknown (0x%02X)\n", header->board);
         else
-            fprintf(stderr, "Board          %s\n", convert_board_id(header->data.recovery_h2_update.board));
+            fprintf(kt_stderr, "Board          %s\n", convert_board_id(header->board));
     }
     else
     {
         if(kt_with_unknown_devcodes)
         {
-            fprintf(stderr, "Device         %s", convert_device_id(header->data.recovery_update.device));
+            fprintf(kt_stderr, "Device         %s", convert_device_id(header->device));
                 // Handle the new device ID scheme...
-                if(header->data.recovery_update.device > 0xFF)
+                if(header->device > 0xFF)
                 {
                     char *dev_id;
-                    dev_id = to_base(header->data.recovery_update.device, 32);
+                    dev_id = to_base(header->device, 32);
                     char *pad = "000";
-                    fprintf(stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, header->data.recovery_update.device);
+                    fprintf(kt_stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, header->device);
                     free(dev_id);
                 }
                 else
                 {
-                    fprintf(stderr, " (0x%02X)\n", header->data.recovery_update.device);
+                    fprintf(kt_stderr, " (0x%02X)\n", header->device);
                 }
         }
         else
         {
-            fprintf(stderr, "Device         %s\n", convert_device_id(header->data.recovery_update.device));
+            fprintf(kt_stderr, "Device         %s\n", convert_device_id(header->device));
         }
     }
 
@@ -454,114 +428,57 @@ int kindle_convert_recovery(UpdateHeader *header, FILE *input, FILE *output, con
     return demunger(input, output, 0, fake_sign);
 }
 
-int kindle_convert_recovery_v2(FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
-{
-    unsigned char *data;
-    size_t hindex;
-    uint64_t target_revision;
-    char *pkg_md5_sum;
-    uint32_t magic_1;
-    uint32_t magic_2;
-    uint32_t minor;
-    uint32_t platform;
-    uint32_t header_rev;
-    uint32_t board;
+int kindle_convert_recovery_v2(const KTHeader *header, FILE *input, FILE *output, const unsigned int fake_sign, char *header_md5)
+{
     uint16_t device;
-    uint8_t num_devices;
     unsigned int i;
-    //uint16_t *devices;
-    size_t read_size __attribute__((unused));
-
-    // Its size is set, there's just some wonky padding involved. Read it all!
-    data = malloc(RECOVERY_UPDATE_BLOCK_SIZE * sizeof(unsigned char));
-    read_size = fread(data, sizeof(unsigned char), RECOVERY_UPDATE_BLOCK_SIZE, input);
-    hindex = 0;
-
-    hindex += sizeof(uint32_t); // Padding
-    //target_revision = *(uint64_t *)&data[hindex];
-    memcpy(&target_revision, &data[hindex], sizeof(uint64_t));
-    hindex += sizeof(uint64_t);
-    fprintf(stderr, "Target OTA     %llu\n", (long long) target_revision);
-    pkg_md5_sum = (char *)&data[hindex];
-    dm((unsigned char *)pkg_md5_sum, MD5_HASH_LENGTH);
-    hindex += MD5_HASH_LENGTH;
-    fprintf(stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, pkg_md5_sum);
-    strncpy(header_md5, pkg_md5_sum, MD5_HASH_LENGTH);
-    //magic_1 = *(uint32_t *)&data[hindex];
-    memcpy(&magic_1, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    fprintf(stderr, "Magic 1        %d\n", magic_1);
-    //magic_2 = *(uint32_t *)&data[hindex];
-    memcpy(&magic_2, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    fprintf(stderr, "Magic 2        %d\n", magic_2);
-    //minor = *(uint32_t *)&data[hindex];
-    memcpy(&minor, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    fprintf(stderr, "Minor          %d\n", minor);
-    //platform = *(uint32_t *)&data[hindex];
-    memcpy(&platform, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    // Slightly hackish way to detect unknown platforms...
-    if(strcmp(convert_platform_id(platform), "Unknown") == 0)
-        fprintf(stderr, "Platform       Unknown (0x%02X)\n", platform);
+
+    fprintf(kt_stderr, "Target OTA     %llu\n", (long long) header->target_revision);
+    fprintf(kt_stderr, "MD5 Hash       %.*s\n", MD5_HASH_LENGTH, header->md5_sum);
+    memcpy(header_md5, header->md5_sum, MD5_HASH_LENGTH);
+    header_md5[MD5_HASH_LENGTH] = '\0';
+    fprintf(kt_stderr, "Magic 1        %d\n", header->magic_1);
+    fprintf(kt_stderr, "Magic 2        %d\n", header->magic_2);
+    fprintf(kt_stderr, "Minor          %d\n", header->minor);
+    // Detect unknown platforms...
+    if(kt_platform_name(header->platform) == NULL)
+        fprintf(kt_stderr, "Platform       Unknown (0x%02X)\n", header->platform);
     else
-        fprintf(stderr, "Platform       %s\n", convert_platform_id(platform));
-    //header_rev = *(uint32_t *)&data[hindex];
-    memcpy(&header_rev, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    fprintf(stderr, "Header Rev     %d\n", header_rev);
-    //board = *(uint32_t *)&data[hindex];
-    memcpy(&board, &data[hindex], sizeof(uint32_t));
-    hindex += sizeof(uint32_t);
-    // Slightly hackish way to detect unknown boards (Not to be confused with the 'Unspecified' board, which permits skipping the device/board check)...
-    if(strcmp(convert_board_id(board), "Unknown") == 0)
-        fprintf(stderr, "Board          %s (0x%02X)\n", convert_board_id(board), board);
+        fprintf(kt_stderr, "Platform       %s\n", convert_platform_id(header->platform));
+    fprintf(kt_stderr, "Header Rev     %d\n", header->header_rev);
+    // Detect unknown boards (Not to be confused with the 'Unspecified' board, which permits skipping the device/board check)...
+    if(kt_board_name(header->board) == NULL)
+        fprintf(kt_stderr, "Board          %s (0x%02X)\n", convert_board_id(header->board), header->board);
     else
-        fprintf(stderr, "Board          %s\n", convert_board_id(board));
-    hindex += sizeof(uint32_t); // Padding
-    hindex += sizeof(uint16_t); // ... Padding
-    hindex += sizeof(uint8_t);  // And more weird padding
-    num_devices = *(uint8_t *)&data[hindex];
-    hindex += sizeof(uint8_t);
-    fprintf(stderr, "Devices        %hhd\n", num_devices);
-    for(i = 0; i < num_devices; i++)
-    {
-        //device = *(uint16_t *)&data[hindex];
-        memcpy(&device, &data[hindex], sizeof(uint16_t));
-        // Slightly hackish way to detect unknown devices...
-        if(strcmp(convert_device_id(device), "Unknown") == 0)
-            fprintf(stderr, "Device         Unknown (0x%02X)\n", device);
+        fprintf(kt_stderr, "Board          %s\n", convert_board_id(header->board));
+    fprintf(kt_stderr, "Devices        %hhd\n", (uint8_t) header->num_devices);
+    for(i = 0; i < header->num_devices; i++)
+    {
+        device = kt_header_device(header, i);
+        if(kt_device_name(device) == NULL)
+            fprintf(kt_stderr, "Device         Unknown (0x%02X)\n", device);
         else
             if(kt_with_unknown_devcodes)
             {
-                fprintf(stderr, "Device         %s", convert_device_id(device));
+                fprintf(kt_stderr, "Device         %s", convert_device_id(device));
                 // Handle the new device ID scheme...
                 if(device > 0xFF)
                 {
                     char *dev_id;
                     dev_id = to_base(device, 32);
                     char *pad = "000";
-                    fprintf(stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, device);
+                    fprintf(kt_stderr, " (%.*s%s -> 0x%02X)\n", ((int) strlen(pad) < (int) strlen(dev_id)) ? 0 : (int) strlen(pad) - (int) strlen(dev_id), pad, dev_id, device);
                     free(dev_id);
                 }
                 else
                 {
-                    fprintf(stderr, " (0x%02X)\n", device);
+                    fprintf(kt_stderr, " (0x%02X)\n", device);
                 }
             }
             else
             {
-                fprintf(stderr, "Device         %s\n", convert_device_id(device));
+                fprintf(kt_stderr, "Device         %s\n", convert_device_id(device));
             }
-        hindex += sizeof(uint16_t);
-    }
-    free(data);
-
-    if(ferror(input) != 0)
-    {
-        fprintf(stderr, "Cannot read update correctly: %s.\n", strerror(errno));
-        return -1;
     }
 
     if(output == NULL)
@@ -573,293 +490,204 @@ int kindle_convert_recovery_v2(FILE *input, FILE *output, const unsigned int fak
     return demunger(input, output, 0, fake_sign);
 }
 
-int kindle_convert_main(int argc, char *argv[])
+// Convert a single package, according to the settings we parsed in kindle_convert_main
+static int kindle_convert_file(const char *in_name, const struct kt_convert_opts *opts)
 {
-    int opt;
-    int opt_index;
-    static const struct option opts[] =
-    {
-        { "stdout", no_argument, NULL, 'c' },
-        { "info", no_argument, NULL, 'i' },
-        { "keep", no_argument, NULL, 'k' },
-        { "sig", no_argument, NULL, 's' },
-        { "unsigned", no_argument, NULL, 'u' },
-        { "unwrap", no_argument, NULL, 'w' },
-        { NULL, 0, NULL, 0 }
-    };
-    FILE *input;
+    FILE *input = NULL;
     FILE *output;
-    FILE *sig_output;
-    FILE *unwrap_output;
-    const char *in_name;
+    FILE *sig_output = NULL;
+    FILE *unwrap_output = NULL;
     char *out_name = NULL;
     char *sig_name = NULL;
     char *unwrapped_name = NULL;
+    char *index_name = NULL;
     size_t len;
     struct stat st;
-    int info_only;
-    int keep_ori;
-    int extract_sig;
-    unsigned int fake_sign;
-    unsigned int unwrap_only;
+    const int info_only = opts->info_only;
+    const int keep_ori = opts->keep_ori;
+    const int extract_sig = opts->extract_sig;
+    const unsigned int fake_sign = opts->fake_sign;
+    const unsigned int unwrap_only = opts->unwrap_only;
     unsigned int ext_offset;
-    int fail;
+    int fail = 0;
     char header_md5[MD5_HASH_LENGTH + 1];
 
-    sig_output = NULL;
-    unwrap_output = NULL;
-    output = NULL;
-    info_only = 0;
-    keep_ori = 0;
-    extract_sig = 0;
-    fake_sign = 0;
-    unwrap_only = 0;
-    ext_offset = 0;
-    fail = 1;
-    while((opt = getopt_long(argc, argv, "icksuw", opts, &opt_index)) != -1)
-    {
-        switch(opt)
-        {
-            case 'i':
-                info_only = 1;
-                break;
-            case 'k':
-                keep_ori = 1;
-                break;
-            case 'c':
-                output = stdout;
-                break;
-            case 's':
-                extract_sig = 1;
-                break;
-            case 'u':
-                fake_sign = 1;
-                break;
-            case 'w':
-                unwrap_only = 1;
-                break;
-            case ':':
-                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
-                return -1;
-                break;
-            case '?':
-                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
-                return -1;
-                break;
-            default:
-                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
-                return -1;
-                break;
-        }
-    }
-    // Don't try to output to stdout or extract/unwrap the package sig if we asked for info only
-    if(info_only)
-    {
-        output = NULL;
-        extract_sig = 0;
-        unwrap_only = 0;
-    }
-    // Don't try to extract or unwrap the signature of an unsiged package
-    if(fake_sign)
+    output = (opts->to_stdout ? stdout : NULL);
+    // Check that a valid package input properly ends in .bin or .stgz, unless we just want to parse the header
+    if(!info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name)))
     {
-        extract_sig = 0;
-        unwrap_only = 0;
+        fprintf(kt_stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n", in_name);
+        return -1;  // It's fatal, go away
     }
-    // Don't try to output anywhere if we only want to unwrap the package
-    if(unwrap_only)
+    // Set the appropriate file extension offset...
+    if(IS_STGZ(in_name))
+        ext_offset = 1;
+    else
+        ext_offset = 0;
+    if(!info_only && !unwrap_only && output != stdout) // Not info only, not unwrap only AND not stdout
     {
-        output = NULL;
+        len = strlen(in_name);
+        out_name = malloc(len + 1 + (13 - ext_offset));
+        memcpy(out_name, in_name, len - (4 + ext_offset));
+        out_name[len - (4 + ext_offset)] = 0;    // . => \0
+        strncat(out_name, "_converted.tar.gz", 17);
+        if((output = fopen(out_name, "wb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open output '%s' for writing.\n", out_name);
+            free(out_name);
+            return -1;  // It's fatal, go away
+        }
     }
-
-    if(optind < argc)
+    if(extract_sig) // We want the payload sig (implies not info only)
     {
-        // Iterate over non-options (the file(s) we passed) (stdout output is probably pretty dumb when passing multiple files...)
-        while(optind < argc)
+        len = strlen(in_name);
+        sig_name = malloc(len + 1 + (1 - ext_offset));
+        memcpy(sig_name, in_name, len - (4 + ext_offset));
+        sig_name[len - (4 + ext_offset)] = 0;  // . => \0
+        strncat(sig_name, ".psig", 5);
+        if((sig_output = fopen(sig_name, "wb")) == NULL)
         {
-            fail = 0;
-            in_name = argv[optind++];
-            // Check that a valid package input properly ends in .bin or .stgz, unless we just want to parse the header
-            if(!info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name)))
-            {
-                fprintf(stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n", in_name);
-                fail = 1;
-                continue;   // It's fatal, go away
-            }
-            // Set the appropriate file extension offset...
-            if(IS_STGZ(in_name))
-                ext_offset = 1;
-            else
-                ext_offset = 0;
-            if(!info_only && !unwrap_only && output != stdout) // Not info only, not unwrap only AND not stdout
-            {
-                len = strlen(in_name);
-                out_name = malloc(len + 1 + (13 - ext_offset));
-                memcpy(out_name, in_name, len - (4 + ext_offset));
-                out_name[len - (4 + ext_offset)] = 0;    // . => \0
-                strncat(out_name, "_converted.tar.gz", 17);
-                if((output = fopen(out_name, "wb")) == NULL)
-                {
-                    fprintf(stderr, "Cannot open output '%s' for writing.\n", out_name);
-                    fail = 1;
-                    free(out_name);
-                    continue;   // It's fatal, go away
-                }
-            }
-            if(extract_sig) // We want the payload sig (implies not info only)
-            {
-                len = strlen(in_name);
-                sig_name = malloc(len + 1 + (1 - ext_offset));
-                memcpy(sig_name, in_name, len - (4 + ext_offset));
-                sig_name[len - (4 + ext_offset)] = 0;  // . => \0
-                strncat(sig_name, ".psig", 5);
-                if((sig_output = fopen(sig_name, "wb")) == NULL)
-                {
-                    fprintf(stderr, "Cannot open signature output '%s' for writing.\n", sig_name);
-                    fail = 1;
-                    if(!info_only && !unwrap_only && output != stdout)
-                    {
-                        if(output != NULL)
-                        {
-                            fclose(output);
-                            unlink(out_name);
-                        }
-                        free(out_name);
-                    }
-                    free(sig_name);
-                    continue;   // It's fatal, go away
-                }
-            }
-            if(unwrap_only)     // We want an unwrapped package (implies not info only)
+            fprintf(kt_stderr, "Cannot open signature output '%s' for writing.\n", sig_name);
+            if(!info_only && !unwrap_only && output != stdout)
             {
-                len = strlen(in_name);
-                unwrapped_name = malloc(len + 1 + (10 - ext_offset));
-                memcpy(unwrapped_name, in_name, len - (4 + ext_offset));
-                unwrapped_name[len - (4 + ext_offset)] = 0;  // . => \0
-                // If input is an userdata package, we can safely assume we'll end up with a tarballl
-                if(ext_offset)
-                    strncat(unwrapped_name, "_unwrapped.tgz", 14);
-                else
-                    strncat(unwrapped_name, "_unwrapped.bin", 14);
-                if((unwrap_output = fopen(unwrapped_name, "wb")) == NULL)
+                if(output != NULL)
                 {
-                    fprintf(stderr, "Cannot open unwrapped package output '%s' for writing.\n", unwrapped_name);
-                    fail = 1;
-                    free(unwrapped_name);
-                    if(extract_sig)
-                    {
-                        if(sig_output != NULL)
-                        {
-                            fclose(sig_output);
-                            unlink(sig_name);
-                        }
-                        free(sig_name);
-                    }
-                    continue;   // It's fatal, go away
+                    fclose(output);
+                    unlink(out_name);
                 }
+                free(out_name);
             }
-            if((input = fopen(in_name, "rb")) == NULL)
+            free(sig_name);
+            return -1;  // It's fatal, go away
+        }
+    }
+    if(unwrap_only)     // We want an unwrapped package (implies not info only)
+    {
+        len = strlen(in_name);
+        unwrapped_name = malloc(len + 1 + (10 - ext_offset));
+        memcpy(unwrapped_name, in_name, len - (4 + ext_offset));
+        unwrapped_name[len - (4 + ext_offset)] = 0;  // . => \0
+        // If input is an userdata package, we can safely assume we'll end up with a tarballl
+        if(ext_offset)
+            strncat(unwrapped_name, "_unwrapped.tgz", 14);
+        else
+            strncat(unwrapped_name, "_unwrapped.bin", 14);
+        if((unwrap_output = fopen(unwrapped_name, "wb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open unwrapped package output '%s' for writing.\n", unwrapped_name);
+            free(unwrapped_name);
+            if(extract_sig)
             {
-                fprintf(stderr, "Cannot open input '%s' for reading.\n", in_name);
-                fail = 1;
-                if(!info_only && !unwrap_only && output != stdout)
-                {
-                    // Don't leave 0-byte files behind...
-                    if(output != NULL)
-                    {
-                        fclose(output);
-                        unlink(out_name);
-                    }
-                    free(out_name);
-                }
-                if(extract_sig)
-                {
-                    if(sig_output != NULL)
-                    {
-                        fclose(sig_output);
-                        unlink(sig_name);
-                    }
-                    free(sig_name);
-                }
-                if(unwrap_only)
+                if(sig_output != NULL)
                 {
-                    if(unwrap_output != NULL)
-                    {
-                        fclose(unwrap_output);
-                        unlink(unwrapped_name);
-                    }
-                    free(unwrapped_name);
+                    fclose(sig_output);
+                    unlink(sig_name);
                 }
-                continue;   // It's fatal, go away
-            }
-            // If we're outputting to stdout, set a dummy human readable output name
-            if(!info_only && output == stdout)
-            {
-                out_name = strdup("standard output");
-            }
-            // Print a recap of what we're doing
-            if(info_only)
-            {
-                fprintf(stderr, "Checking %s%s package '%s'.\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
-            }
-            else if(unwrap_only)
-            {
-                fprintf(stderr, "Unwrapping %s package '%s' to '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name, unwrapped_name);
-            }
-            else
-            {
-                fprintf(stderr, "Converting %s%s package '%s' to '%s' (%s, %s).\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name, out_name, (extract_sig ? "with sig" : "without sig"), (keep_ori ? "keep input" : "delete input"));
-            }
-            if(kindle_convert(input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5) < 0)
-            {
-                fprintf(stderr, "Error converting %s package '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
-                if(output != NULL && output != stdout)
-                    unlink(out_name); // Clean up our mess, if we made one
-                fail = 1;
-            }
-            if(output != stdout && !info_only && !keep_ori && !fail) // If output was some file, and we didn't ask to keep it, and we didn't fail to convert it, delete the original
-                unlink(in_name);
-
-            // Clean up behind us
-            if(!info_only && !unwrap_only)
-            {
-                free(out_name);
+                free(sig_name);
             }
-            if(output != NULL && output != stdout)
+            return -1;  // It's fatal, go away
+        }
+    }
+    if((input = fopen(in_name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input '%s' for reading.\n", in_name);
+        if(!info_only && !unwrap_only && output != stdout)
+        {
+            // Don't leave 0-byte files behind...
+            if(output != NULL)
             {
                 fclose(output);
+                unlink(out_name);
             }
-            if(input != NULL)
-                fclose(input);
+            free(out_name);
+        }
+        if(extract_sig)
+        {
             if(sig_output != NULL)
-                fclose(sig_output);
-            if(unwrap_output != NULL)
-                fclose(unwrap_output);
-            // Remove empty sigs (since we have to open the fd before calling kindle_convert, we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
-            if(extract_sig)
             {
-                stat(sig_name, &st);
-                if(st.st_size == 0)
-                    unlink(sig_name);
-                free(sig_name);
+                fclose(sig_output);
+                unlink(sig_name);
             }
-            // Same thing for unwrapped packages...
-            if(unwrap_only)
+            free(sig_name);
+        }
+        if(unwrap_only)
+        {
+            if(unwrap_output != NULL)
             {
-                stat(unwrapped_name, &st);
-                if(st.st_size == 0)
-                    unlink(unwrapped_name);
-                free(unwrapped_name);
+                fclose(unwrap_output);
+                unlink(unwrapped_name);
             }
-
-            // If we're not the last file, throw an LF to untangle the output
-            if(optind < argc)
-                fprintf(stderr, "\n");
+            free(unwrapped_name);
         }
+        return -1;  // It's fatal, go away
+    }
+    // If we're outputting to stdout, set a dummy human readable output name
+    if(!info_only && output == stdout)
+    {
+        out_name = strdup("standard output");
+    }
+    // Print a recap of what we're doing
+    if(info_only)
+    {
+        fprintf(kt_stderr, "Checking %s%s package '%s'.\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
+    }
+    else if(unwrap_only)
+    {
+        fprintf(kt_stderr, "Unwrapping %s package '%s' to '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name, unwrapped_name);
     }
     else
     {
-        fprintf(stderr, "No input specified.\n");
-        return -1;
+        fprintf(kt_stderr, "Converting %s%s package '%s' to '%s' (%s, %s).\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name, out_name, (extract_sig ? "with sig" : "without sig"), (keep_ori ? "keep input" : "delete input"));
+    }
+    if(kindle_convert(input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5) < 0)
+    {
+        fprintf(kt_stderr, "Error converting %s package '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
+        if(output != NULL && output != stdout)
+            unlink(out_name); // Clean up our mess, if we made one
+        fail = 1;
+    }
+    if(opts->build_index && !fail)
+    {
+        if((index_name = kt_index_default_name(in_name)) == NULL || kt_index_build(in_name, index_name, fake_sign) < 0)
+        {
+            fprintf(kt_stderr, "Error indexing %s package '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
+            fail = 1;
+        }
+        free(index_name);
+    }
+    if(output != stdout && !info_only && !keep_ori && !fail) // If output was some file, and we didn't ask to keep it, and we didn't fail to convert it, delete the original
+        unlink(in_name);
+
+    // Clean up behind us
+    if(!info_only && !unwrap_only)
+    {
+        free(out_name);
+    }
+    if(output != NULL && output != stdout)
+    {
+        fclose(output);
+    }
+    if(input != NULL)
+        fclose(input);
+    if(sig_output != NULL)
+        fclose(sig_output);
+    if(unwrap_output != NULL)
+        fclose(unwrap_output);
+    // Remove empty sigs (since we have to open the fd before calling kindle_convert, we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
+    if(extract_sig)
+    {
+        stat(sig_name, &st);
+        if(st.st_size == 0)
+            unlink(sig_name);
+        free(sig_name);
+    }
+    // Same thing for unwrapped packages...
+    if(unwrap_only)
+    {
+        stat(unwrapped_name, &st);
+        if(st.st_size == 0)
+            unlink(unwrapped_name);
+        free(unwrapped_name);
     }
 
     // Return
@@ -869,167 +697,2090 @@ int kindle_convert_main(int argc, char *argv[])
         return 0;
 }
 
-// Heavily inspired from libarchive's tar/read.c ;)
-int libarchive_extract(const char *filename, const char *prefix)
+// Worker for convert -j: grab the next input, convert it with its own context, and flush its (buffered) log in one go
+static void *kindle_convert_worker(void *arg)
 {
-    struct archive *a;
-    struct archive_entry *entry;
-    int flags;
-    int r;
-    const char *path = NULL;
-    char *fixed_path = NULL;
-    size_t len;
-
-    // Select which attributes we want to restore.
-    flags = ARCHIVE_EXTRACT_TIME;
-    // Don't preserve permissions, as most files in kindle packages will be owned by root, and if the perms are effed up, it gets annoying.
-    // We could also just rewrite every entry in the archive with sane permissions, but that seems a bit overkill.
-    //flags |= ARCHIVE_EXTRACT_PERM;
-    //flags |= ARCHIVE_EXTRACT_ACL;
-    flags |= ARCHIVE_EXTRACT_FFLAGS;
-
-    a = archive_read_new();
-    // Let's handle a wide range or tar formats, just to be on the safe side
-    archive_read_support_format_tar(a);
-    archive_read_support_format_gnutar(a);
-    archive_read_support_filter_gzip(a);
+    struct kt_convert_batch *batch = arg;
+    KTContext *ctx;
+    FILE *log;
+    char *log_buf;
+    size_t log_size;
+    unsigned int idx;
+    int ret;
 
-    if(filename != NULL && strcmp(filename, "-") == 0)
-        filename = NULL;
-    if((r = archive_read_open_filename(a, filename, 10240)))
+    if((ctx = kt_context_new()) == NULL)
     {
-        fprintf(stderr, "archive_read_open_file() failure: %s.\n", archive_error_string(a));
-        archive_read_free(a);
-        return 1;
+        pthread_mutex_lock(&batch->lock);
+        fprintf(stderr, "Cannot allocate a new context: %s.\n", strerror(errno));
+        // Make sure our share of the work doesn't go unnoticed...
+        batch->failed++;
+        pthread_mutex_unlock(&batch->lock);
+        return NULL;
     }
+    ctx->with_unknown_devcodes = batch->with_unknown_devcodes;
+    kt_context_attach(ctx);
 
     for(;;)
     {
-        r = archive_read_next_header(a, &entry);
-        if(r == ARCHIVE_EOF)
+        pthread_mutex_lock(&batch->lock);
+        idx = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if(idx >= batch->num_inputs)
             break;
-        if(r != ARCHIVE_OK)
-            fprintf(stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
-        if(r < ARCHIVE_WARN)
-            goto cleanup;
 
-        // Print what we're extracting, like bsdtar
-        path = archive_entry_pathname(entry);
-        fprintf(stderr, "x %s\n", path);
-        // Rewrite the entry's pathname to extract in the right output directory
-        len = strlen(prefix) + 1 + strlen(path) + 1;
-        fixed_path = malloc(len);
-        snprintf(fixed_path, len, "%s/%s", prefix, path);
-        archive_entry_copy_pathname(entry, fixed_path);
-
-        // archive_read_extract should take care of everything for us...
-        // (creating a write_disk archive, setting a standard lookup, the flags we asked for, writing our entry header & content, and destroying the write_disk archive ;))
-        r = archive_read_extract(a, entry, flags);
-        if(r != ARCHIVE_OK)
-        {
-            fprintf(stderr, "archive_read_extract() failed: %s.\n", archive_error_string(a));
-            free(fixed_path);
-            goto cleanup;
-        }
+        // Buffer this file's output, if we can't, it'll just go straight to stderr...
+        log_buf = NULL;
+        log_size = 0;
+        log = kt_open_memstream(&log_buf, &log_size);
+        kt_context_set_log(ctx, log);
 
-        // Cleanup
-        free(fixed_path);
-    }
-    archive_read_close(a);
-    archive_read_free(a);
+        ret = kindle_convert_file(batch->inputs[idx], batch->opts);
 
-    return 0;
+        kt_context_set_log(ctx, NULL);
+        if(log != NULL)
+            fclose(log);
 
-cleanup:
-    archive_read_close(a);
-    archive_read_free(a);
+        pthread_mutex_lock(&batch->lock);
+        if(ret < 0)
+            batch->failed++;
+        if(log_buf != NULL)
+        {
+            // Throw an LF between files to untangle the output, like in the sequential case
+            if(batch->flushed++ > 0)
+                fputc('\n', stderr);
+            fwrite(log_buf, sizeof(char), log_size, stderr);
+            fflush(stderr);
+        }
+        pthread_mutex_unlock(&batch->lock);
+        free(log_buf);
+    }
 
-    return 1;
+    kt_context_attach(NULL);
+    kt_context_free(ctx);
+    return NULL;
 }
 
-int kindle_extract_main(int argc, char *argv[])
+int kindle_convert_main(int argc, char *argv[])
 {
     int opt;
     int opt_index;
     static const struct option opts[] =
     {
+        { "stdout", no_argument, NULL, 'c' },
+        { "info", no_argument, NULL, 'i' },
+        { "keep", no_argument, NULL, 'k' },
+        { "sig", no_argument, NULL, 's' },
         { "unsigned", no_argument, NULL, 'u' },
+        { "unwrap", no_argument, NULL, 'w' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "index", no_argument, NULL, 'I' },
         { NULL, 0, NULL, 0 }
     };
-    unsigned int fake_sign;
+    struct kt_convert_opts convert_opts;
+    struct kt_convert_batch batch;
+    pthread_t *workers;
+    unsigned int num_workers;
+    unsigned int jobs;
+    unsigned int i;
+    unsigned int failed;
+
+    memset(&convert_opts, 0, sizeof(convert_opts));
+    jobs = 1;
+    failed = 0;
+    while((opt = getopt_long(argc, argv, "icksuwj:I", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                convert_opts.info_only = 1;
+                break;
+            case 'k':
+                convert_opts.keep_ori = 1;
+                break;
+            case 'c':
+                convert_opts.to_stdout = 1;
+                break;
+            case 's':
+                convert_opts.extract_sig = 1;
+                break;
+            case 'u':
+                convert_opts.fake_sign = 1;
+                break;
+            case 'w':
+                convert_opts.unwrap_only = 1;
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &jobs) < 0)
+                    return -1;
+                break;
+            case 'I':
+                convert_opts.build_index = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+    // An index is useless without the package it points into
+    if(convert_opts.build_index)
+    {
+        convert_opts.keep_ori = 1;
+    }
+    // Don't try to output to stdout or extract/unwrap the package sig if we asked for info only
+    if(convert_opts.info_only)
+    {
+        convert_opts.to_stdout = 0;
+        convert_opts.extract_sig = 0;
+        convert_opts.unwrap_only = 0;
+    }
+    // Don't try to extract or unwrap the signature of an unsiged package
+    if(convert_opts.fake_sign)
+    {
+        convert_opts.extract_sig = 0;
+        convert_opts.unwrap_only = 0;
+    }
+    // Don't try to output anywhere if we only want to unwrap the package
+    if(convert_opts.unwrap_only)
+    {
+        convert_opts.to_stdout = 0;
+    }
+    // Concatenating several tarballs on stdout in whatever order they happen to complete would be even dumber than it already is...
+    if(convert_opts.to_stdout && jobs > 1)
+    {
+        fprintf(kt_stderr, "Cannot write to standard output with more than one job.\n");
+        return -1;
+    }
+
+    if(optind >= argc)
+    {
+        fprintf(kt_stderr, "No input specified.\n");
+        return -1;
+    }
+
+    // Don't spawn more workers than we have inputs
+    num_workers = ((unsigned int) (argc - optind) < jobs ? (unsigned int) (argc - optind) : jobs);
+    if(num_workers <= 1)
+    {
+        // Iterate over non-options (the file(s) we passed) (stdout output is probably pretty dumb when passing multiple files...)
+        while(optind < argc)
+        {
+            if(kindle_convert_file(argv[optind++], &convert_opts) < 0)
+                failed++;
+
+            // If we're not the last file, throw an LF to untangle the output
+            if(optind < argc)
+                fprintf(kt_stderr, "\n");
+        }
+    }
+    else
+    {
+        memset(&batch, 0, sizeof(batch));
+        batch.opts = &convert_opts;
+        batch.inputs = &argv[optind];
+        batch.num_inputs = (unsigned int) (argc - optind);
+        batch.with_unknown_devcodes = kt_with_unknown_devcodes;
+        pthread_mutex_init(&batch.lock, NULL);
+
+        if((workers = malloc(num_workers * sizeof(*workers))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate worker pool: %s.\n", strerror(errno));
+            pthread_mutex_destroy(&batch.lock);
+            return -1;
+        }
+        for(i = 0; i < num_workers; i++)
+        {
+            if(pthread_create(&workers[i], NULL, kindle_convert_worker, &batch) != 0)
+            {
+                fprintf(kt_stderr, "Cannot spawn worker thread, continuing with %u.\n", i);
+                break;
+            }
+        }
+        // If we couldn't even spawn a single worker, do it ourselves
+        if(i == 0)
+            kindle_convert_worker(&batch);
+        num_workers = i;
+        for(i = 0; i < num_workers; i++)
+            pthread_join(workers[i], NULL);
+        free(workers);
+        pthread_mutex_destroy(&batch.lock);
+        failed = batch.failed;
+
+        if(failed > 0)
+            fprintf(kt_stderr, "\n%u out of %u packages failed to convert.\n", failed, batch.num_inputs);
+    }
+
+    // Return
+    if(failed > 0)
+        return -1;
+    else
+        return 0;
+}
+
+// Don't buffer files larger than this for the writer pool, the decompression thread writes them itself
+#define KT_EXTRACT_MAX_BUFFERED_FILE (8 * 1024 * 1024)
+// And don't keep more than this much data in flight
+#define KT_EXTRACT_MAX_QUEUED_BYTES (32 * 1024 * 1024)
+
+// A regular file, fully read in memory, waiting for a writer thread
+struct kt_extract_job
+{
+    struct archive_entry *entry;
+    void *data;
+    size_t size;
+    struct kt_extract_job *next;
+};
+
+// Shared state between the decompression thread & the writer threads
+struct kt_extract_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct kt_extract_job *head;
+    struct kt_extract_job *tail;
+    size_t queued_bytes;
+    int done;                   // The decompression thread won't queue anything else
+    int failed;                 // Something went wrong, stop ASAP
+    int flags;                  // ARCHIVE_EXTRACT_* flags
+    KTStore *store;             // Write regular files to the object store instead (NULL if there's none)
+    KTContext *ctx;             // The caller's context: each writer gets its own, with the same settings
+    KTError error;              // The first error flagged by a writer, for the caller's context
+};
+
+// Setup a write_disk archive with the flags we want
+static struct archive *kt_write_disk_new(int flags)
+{
+    struct archive *disk;
+
+    if((disk = archive_write_disk_new()) == NULL)
+        return NULL;
+    archive_write_disk_set_options(disk, flags);
+    archive_write_disk_set_standard_lookup(disk);
+
+    return disk;
+}
+
+// Write a whole entry (header & in-memory data) to disk
+static int kt_write_disk_entry(struct archive *disk, struct archive_entry *entry, const void *data, size_t size)
+{
+    int r;
+
+    r = archive_write_header(disk, entry);
+    if(r != ARCHIVE_OK)
+        fprintf(kt_stderr, "archive_write_header() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+    if(r < ARCHIVE_WARN)
+        return -1;
+    if(r == ARCHIVE_OK && size > 0)
+    {
+        if(archive_write_data(disk, data, size) < 0)
+        {
+            fprintf(kt_stderr, "archive_write_data() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+            return -1;
+        }
+    }
+    r = archive_write_finish_entry(disk);
+    if(r != ARCHIVE_OK)
+        fprintf(kt_stderr, "archive_write_finish_entry() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+    if(r < ARCHIVE_WARN)
+        return -1;
+
+    return 0;
+}
+
+// Stream the current entry of a read archive straight to disk (like archive_read_extract, but with our own write_disk archive)
+static int kt_copy_entry_to_disk(struct archive *a, struct archive *disk, struct archive_entry *entry)
+{
+    const void *buff;
+    size_t size;
+    int64_t offset;
+    int r;
+
+    r = archive_write_header(disk, entry);
+    if(r != ARCHIVE_OK)
+        fprintf(kt_stderr, "archive_write_header() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+    if(r < ARCHIVE_WARN)
+        return -1;
+    if(r == ARCHIVE_OK && archive_entry_size(entry) > 0)
+    {
+        for(;;)
+        {
+            r = archive_read_data_block(a, &buff, &size, &offset);
+            if(r == ARCHIVE_EOF)
+                break;
+            if(r != ARCHIVE_OK)
+            {
+                fprintf(kt_stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
+                return -1;
+            }
+            if(archive_write_data_block(disk, buff, size, offset) < 0)
+            {
+                fprintf(kt_stderr, "archive_write_data_block() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+                return -1;
+            }
+        }
+    }
+    r = archive_write_finish_entry(disk);
+    if(r != ARCHIVE_OK)
+        fprintf(kt_stderr, "archive_write_finish_entry() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(disk));
+    if(r < ARCHIVE_WARN)
+        return -1;
+
+    return 0;
+}
+
+static void kt_extract_job_free(struct kt_extract_job *job)
+{
+    archive_entry_free(job->entry);
+    free(job->data);
+    free(job);
+}
+
+// A writer is done: hand its first error over to the caller (cf. kt_extract_pool_join)
+static void kt_extract_writer_done(struct kt_extract_pool *pool, KTContext *ctx)
+{
+    pthread_mutex_lock(&pool->lock);
+    if(pool->error == KT_OK)
+        pool->error = kt_context_error(ctx);
+    pthread_mutex_unlock(&pool->lock);
+    kt_context_attach(NULL);
+    kt_context_free(ctx);
+}
+
+// Writer thread: pop files off the queue, and write them with our very own write_disk archive (and context)
+static void *kt_extract_writer(void *arg)
+{
+    struct kt_extract_pool *pool = arg;
+    struct kt_extract_job *job;
+    struct archive *disk;
+    KTContext *ctx;
+    int failed;
+    int r;
+
+    if((ctx = kt_context_new()) == NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        fprintf((pool->ctx->log != NULL ? pool->ctx->log : stderr), "Cannot allocate a new context: %s.\n", strerror(errno));
+        if(pool->error == KT_OK)
+            pool->error = KT_ERR_NOMEM;
+        pool->failed = 1;
+        pthread_cond_broadcast(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    ctx->with_unknown_devcodes = pool->ctx->with_unknown_devcodes;
+    ctx->log = pool->ctx->log;
+    kt_context_attach(ctx);
+    if((disk = kt_write_disk_new(pool->flags)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a write_disk archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = 1;
+        pthread_cond_broadcast(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+        kt_extract_writer_done(pool, ctx);
+        return NULL;
+    }
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->done)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if(pool->head == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if(pool->head == NULL)
+            pool->tail = NULL;
+        pool->queued_bytes -= job->size;
+        failed = pool->failed;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        // Once something has failed, just drain the queue
+        if(failed)
+        {
+            kt_extract_job_free(job);
+            continue;
+        }
+        if(pool->store != NULL)
+            r = kt_store_add_data(pool->store, job->data, job->size, job->entry, archive_entry_pathname(job->entry));
+        else
+            r = kt_write_disk_entry(disk, job->entry, job->data, job->size);
+        if(r < 0)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_cond_broadcast(&pool->not_full);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        kt_extract_job_free(job);
+    }
+
+    archive_write_close(disk);
+    archive_write_free(disk);
+    kt_extract_writer_done(pool, ctx);
+    return NULL;
+}
+
+// Tell the writers there's nothing else coming (or to give up), wait for them, and pass the first error one of them flagged on to our own context
+static void kt_extract_pool_join(struct kt_extract_pool *pool, pthread_t *writers, unsigned int num_writers, int abort_queue)
+{
+    KTError error;
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    if(abort_queue)
+        pool->failed = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < num_writers; i++)
+        pthread_join(writers[i], NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    error = pool->error;
+    pthread_mutex_unlock(&pool->lock);
+    if(error != KT_OK)
+        kt_set_error(error);
+}
+
+// Read the current entry's data in memory
+static int kt_read_entry_data(struct archive *a, struct archive_entry *entry, void **data, size_t *data_size)
+{
+    size_t size = (size_t) archive_entry_size(entry);
+    size_t total = 0;
+    ssize_t bytes_read;
+    void *buf = NULL;
+
+    if(size > 0 && (buf = malloc(size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate %zu bytes for '%s': %s.\n", size, archive_entry_pathname(entry), strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    while(total < size)
+    {
+        bytes_read = archive_read_data(a, (unsigned char *) buf + total, size - total);
+        if(bytes_read < 0)
+        {
+            fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            free(buf);
+            return -1;
+        }
+        if(bytes_read == 0)
+            break;
+        total += (size_t) bytes_read;
+    }
+    *data = buf;
+    *data_size = total;
+
+    return 0;
+}
+
+// Read the current entry's data in memory, and hand it over to the writer pool (blocks while the queue is full)
+static int kt_extract_queue_file(struct kt_extract_pool *pool, struct archive *a, struct archive_entry *entry)
+{
+    struct kt_extract_job *job;
+
+    if((job = calloc(1, sizeof(*job))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate extraction job: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if(kt_read_entry_data(a, entry, &job->data, &job->size) < 0)
+    {
+        free(job);
+        return -1;
+    }
+    if((job->entry = archive_entry_clone(entry)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate extraction job: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        kt_extract_job_free(job);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    // Always let at least one job through, no matter its size
+    while(pool->head != NULL && pool->queued_bytes + job->size > KT_EXTRACT_MAX_QUEUED_BYTES && !pool->failed)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    if(pool->failed)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        kt_extract_job_free(job);
+        return -1;
+    }
+    if(pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued_bytes += job->size;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+// Directories we know exist on disk, so that we don't have to check (or create) them again for every single entry
+struct kt_dir_cache
+{
+    char **paths;
+    size_t count;
+    size_t size;
+    KTHashTable index;          // Of paths
+};
+
+static size_t kt_dir_cache_hash(void *arg, size_t index)
+{
+    const struct kt_dir_cache *cache = arg;
+
+    return kt_hash_path(cache->paths[index], strlen(cache->paths[index]));
+}
+
+static int kt_dir_cache_match(void *arg, size_t index, const void *path, size_t len)
+{
+    const struct kt_dir_cache *cache = arg;
+
+    return strncmp(cache->paths[index], path, len) == 0 && cache->paths[index][len] == '\0';
+}
+
+static void kt_dir_cache_init(struct kt_dir_cache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    kt_hash_table_init(&cache->index, kt_dir_cache_hash, kt_dir_cache_match, cache);
+}
+
+static int kt_dir_cache_has(const struct kt_dir_cache *cache, const char *path, size_t len)
+{
+    return kt_hash_table_find(&cache->index, kt_hash_path(path, len), path, len) != KT_HASH_NONE;
+}
+
+static int kt_dir_cache_add(struct kt_dir_cache *cache, const char *path, size_t len)
+{
+    char **paths;
+
+    if(cache->count == cache->size)
+    {
+        if((paths = realloc(cache->paths, (cache->size ? cache->size * 2 : 256) * sizeof(*paths))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate directory cache: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            return -1;
+        }
+        cache->paths = paths;
+        cache->size = (cache->size ? cache->size * 2 : 256);
+    }
+    if((cache->paths[cache->count] = malloc(len + 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate directory cache entry: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    memcpy(cache->paths[cache->count], path, len);
+    cache->paths[cache->count][len] = '\0';
+    if(kt_hash_table_insert(&cache->index, cache->count) < 0)
+    {
+        fprintf(kt_stderr, "Cannot allocate directory cache: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        free(cache->paths[cache->count]);
+        return -1;
+    }
+    cache->count++;
+
+    return 0;
+}
+
+static void kt_dir_cache_free(struct kt_dir_cache *cache)
+{
+    size_t i;
+
+    for(i = 0; i < cache->count; i++)
+        free(cache->paths[i]);
+    free(cache->paths);
+    kt_hash_table_free(&cache->index);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Make sure the first len bytes of path are an existing directory, creating it (and its parents) if need be.
+// path is temporarily modified, but always restored.
+static int kt_dir_cache_mkdirs(struct kt_dir_cache *cache, char *path, size_t len)
+{
+    size_t parent_len;
+    char c;
+    int r;
+
+    // Skip trailing slashes
+    while(len > 1 && path[len - 1] == '/')
+        len--;
+    if(len == 0 || kt_dir_cache_has(cache, path, len))
+        return 0;
+
+    // Parents first
+    parent_len = len;
+    while(parent_len > 0 && path[parent_len - 1] != '/')
+        parent_len--;
+    if(parent_len > 1 && kt_dir_cache_mkdirs(cache, path, parent_len - 1) < 0)
+        return -1;
+
+    c = path[len];
+    path[len] = '\0';
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    r = mkdir(path);
+#else
+    r = mkdir(path, 0777);
+#endif
+    if(r != 0 && errno != EEXIST)
+    {
+        fprintf(kt_stderr, "Cannot create directory '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        path[len] = c;
+        return -1;
+    }
+    path[len] = c;
+
+    return kt_dir_cache_add(cache, path, len);
+}
+
+// Prefix path with our output directory, in a buffer that we only ever grow
+static char *kt_prefix_path(char **buf, size_t *buf_size, const char *prefix, size_t prefix_len, const char *path)
+{
+    size_t len = prefix_len + 1 + strlen(path) + 1;
+    char *new_buf;
+
+    if(len > *buf_size)
+    {
+        if((new_buf = realloc(*buf, len)) == NULL)
+            return NULL;
+        *buf = new_buf;
+        *buf_size = len;
+    }
+    memcpy(*buf, prefix, prefix_len);
+    (*buf)[prefix_len] = '/';
+    memcpy(*buf + prefix_len + 1, path, len - prefix_len - 1);
+
+    return *buf;
+}
+
+#ifdef KT_WITH_IO_URING
+// How many small files we write in a single io_uring submission (each of them takes an open, a write & a close SQE)
+#define KT_URING_BATCH_FILES 64
+
+// A batch of in-memory files, written via linked openat -> write -> close chains on direct descriptors
+struct kt_uring_batch
+{
+    struct io_uring ring;
+    struct archive_entry *entries[KT_URING_BATCH_FILES];
+    void *data[KT_URING_BATCH_FILES];
+    size_t size[KT_URING_BATCH_FILES];
+    int res[KT_URING_BATCH_FILES];  // First error for each file (negative errno), 0 on success
+    unsigned int count;
+};
+
+// Returns NULL (with errno set) if the kernel can't do it, so that the caller can fall back to write_disk
+static struct kt_uring_batch *kt_uring_batch_new(void)
+{
+    struct kt_uring_batch *batch;
+    int r;
+
+    if((batch = calloc(1, sizeof(*batch))) == NULL)
+        return NULL;
+    if((r = io_uring_queue_init(KT_URING_BATCH_FILES * 3, &batch->ring, 0)) < 0)
+    {
+        free(batch);
+        errno = -r;
+        return NULL;
+    }
+    // We open straight into a sparse fixed file table, which saves us the fd installation & the lookups (Linux >= 5.15)
+    if((r = io_uring_register_files_sparse(&batch->ring, KT_URING_BATCH_FILES)) < 0)
+    {
+        io_uring_queue_exit(&batch->ring);
+        free(batch);
+        errno = -r;
+        return NULL;
+    }
+
+    return batch;
+}
+
+static void kt_uring_batch_free(struct kt_uring_batch *batch)
+{
+    unsigned int i;
+
+    if(batch == NULL)
+        return;
+    for(i = 0; i < batch->count; i++)
+    {
+        archive_entry_free(batch->entries[i]);
+        free(batch->data[i]);
+    }
+    io_uring_queue_exit(&batch->ring);
+    free(batch);
+}
+
+// Write every queued file, and restore their times. Files the kernel refused are retried through write_disk, which knows how to deal with the weird cases (existing symlinks, directories, ...).
+static int kt_uring_batch_flush(struct kt_uring_batch *batch, struct archive *disk)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct timespec times[2];
+    unsigned int pending = 0;
+    unsigned int i;
+    uint64_t tag;
+    int ret = 0;
+
+    if(batch->count == 0)
+        return 0;
+
+    for(i = 0; i < batch->count; i++)
+    {
+        batch->res[i] = 0;
+        // We don't restore permissions, so the umask applies, just like with write_disk
+        sqe = io_uring_get_sqe(&batch->ring);
+        io_uring_prep_openat_direct(sqe, AT_FDCWD, archive_entry_pathname(batch->entries[i]), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, archive_entry_perm(batch->entries[i]) & 0777, i);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        io_uring_sqe_set_data64(sqe, (uint64_t) i * 3);
+        pending++;
+        if(batch->size[i] > 0)
+        {
+            sqe = io_uring_get_sqe(&batch->ring);
+            io_uring_prep_write(sqe, (int) i, batch->data[i], (unsigned int) batch->size[i], 0);
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+            io_uring_sqe_set_data64(sqe, (uint64_t) i * 3 + 1);
+            pending++;
+        }
+        sqe = io_uring_get_sqe(&batch->ring);
+        io_uring_prep_close_direct(sqe, i);
+        io_uring_sqe_set_data64(sqe, (uint64_t) i * 3 + 2);
+        pending++;
+    }
+    if(io_uring_submit(&batch->ring) < 0)
+    {
+        // Nothing was queued, write_disk it is
+        for(i = 0; i < batch->count; i++)
+            batch->res[i] = -EAGAIN;
+        pending = 0;
+    }
+
+    while(pending > 0)
+    {
+        if(io_uring_wait_cqe(&batch->ring, &cqe) < 0)
+        {
+            fprintf(kt_stderr, "io_uring_wait_cqe() failed: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            ret = -1;
+            break;
+        }
+        tag = io_uring_cqe_get_data64(cqe);
+        i = (unsigned int) (tag / 3);
+        // Keep the first failure of each chain, the following links just report -ECANCELED
+        if(batch->res[i] == 0)
+        {
+            if(cqe->res < 0 && cqe->res != -ECANCELED)
+                batch->res[i] = cqe->res;
+            else if(tag % 3 == 1 && (size_t) cqe->res != batch->size[i])
+                batch->res[i] = -EIO;
+        }
+        io_uring_cqe_seen(&batch->ring, cqe);
+        pending--;
+    }
+
+    for(i = 0; i < batch->count && ret == 0; i++)
+    {
+        if(batch->res[i] == 0)
+        {
+            // There's no io_uring opcode for that (yet), so do it the old-fashioned way
+            times[0].tv_sec = archive_entry_atime(batch->entries[i]);
+            times[0].tv_nsec = archive_entry_atime_is_set(batch->entries[i]) ? archive_entry_atime_nsec(batch->entries[i]) : UTIME_NOW;
+            times[1].tv_sec = archive_entry_mtime(batch->entries[i]);
+            times[1].tv_nsec = archive_entry_mtime_is_set(batch->entries[i]) ? archive_entry_mtime_nsec(batch->entries[i]) : UTIME_NOW;
+            if(utimensat(AT_FDCWD, archive_entry_pathname(batch->entries[i]), times, AT_SYMLINK_NOFOLLOW) != 0)
+                fprintf(kt_stderr, "Cannot restore the times of '%s': %s.\n", archive_entry_pathname(batch->entries[i]), strerror(errno));
+        }
+        else if(kt_write_disk_entry(disk, batch->entries[i], batch->data[i], batch->size[i]) < 0)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            ret = -1;
+        }
+    }
+
+    for(i = 0; i < batch->count; i++)
+    {
+        archive_entry_free(batch->entries[i]);
+        free(batch->data[i]);
+    }
+    batch->count = 0;
+
+    return ret;
+}
+
+// Read the current entry in memory, and add it to the batch (flushing it first if it's full)
+static int kt_uring_batch_add(struct kt_uring_batch *batch, struct archive *disk, struct archive *a, struct archive_entry *entry)
+{
+    unsigned int i;
+
+    if(batch->count == KT_URING_BATCH_FILES && kt_uring_batch_flush(batch, disk) < 0)
+        return -1;
+    i = batch->count;
+    if(kt_read_entry_data(a, entry, &batch->data[i], &batch->size[i]) < 0)
+        return -1;
+    batch->entries[i] = archive_entry_clone(entry);
+    batch->count++;
+
+    return 0;
+}
+#endif
+
+// Where the entries we extract come from: either a single archive we read sequentially, or the wanted entries of an indexed package
+struct kt_extract_source
+{
+    struct archive *a;          // The archive the current entry comes from
+    const KTIndex *idx;         // If set, we seek to each wanted entry in bin
+    FILE *bin;
+    uint32_t *wanted;           // Entry numbers, in archive order
+    uint32_t num_wanted;
+    uint32_t next;              // Next wanted entry
+    uint32_t pos;               // The entry the current archive is about to read
+    KTDigestCache *digests;     // extract --incremental: what we know about the files already on disk (NULL otherwise)
+};
+
+// What we were asked to extract
+struct kt_extract_filter
+{
+    char **patterns;
+    unsigned int num_patterns;
+    unsigned char *matched;     // This pattern matched at least one entry
+    unsigned char *done;        // This literal path has been extracted, and it wasn't a directory, so there's nothing more to come for it
+    unsigned int literals_left;
+    unsigned int num_globs;
+};
+
+static struct archive *kt_extract_read_new(void)
+{
+    struct archive *a;
+
+    if((a = archive_read_new()) == NULL)
+        return NULL;
+    // Let's handle a wide range or tar formats, just to be on the safe side
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    archive_read_support_filter_gzip(a);
+
+    return a;
+}
+
+static int kt_extract_next_header(struct kt_extract_source *source, struct archive_entry **entry)
+{
+    uint32_t e;
+
+    if(source->idx == NULL)
+        return archive_read_next_header(source->a, entry);
+
+    if(source->next >= source->num_wanted)
+        return ARCHIVE_EOF;
+    e = source->wanted[source->next++];
+    // Only seek if the wanted entry isn't the one coming up next anyway
+    if(source->a == NULL || source->pos != e)
+    {
+        if(source->a != NULL)
+            archive_read_free(source->a);
+        if((source->a = kt_extract_read_new()) == NULL || kt_index_read_open_at(source->a, source->idx, source->bin, source->idx->entries[e].offset) < 0)
+        {
+            if(source->a != NULL)
+                archive_read_free(source->a);
+            source->a = NULL;
+            return ARCHIVE_FATAL;
+        }
+    }
+    source->pos = e + 1;
+
+    return archive_read_next_header(source->a, entry);
+}
+
+static int kt_is_glob(const char *pattern)
+{
+    return strpbrk(pattern, "*?[\\") != NULL;
+}
+
+// Match a single pattern element (a plain character, ?, a [] class or an escaped character) against c, and skip past it on success
+static int kt_glob_char(const char **pp, const char *pe, char c)
+{
+    const char *p = *pp;
+    const char *q;
+    int negate = 0;
+    int match = 0;
+
+    if(*p == '?')
+    {
+        *pp = p + 1;
+        return 1;
+    }
+    if(*p == '[')
+    {
+        q = p + 1;
+        if(q < pe && (*q == '!' || *q == '^'))
+        {
+            negate = 1;
+            q++;
+        }
+        // A ] right at the start is a literal one
+        if(q < pe && *q == ']')
+        {
+            match = (c == ']');
+            q++;
+        }
+        while(q < pe && *q != ']')
+        {
+            if(q + 2 < pe && q[1] == '-' && q[2] != ']')
+            {
+                if(c >= q[0] && c <= q[2])
+                    match = 1;
+                q += 3;
+            }
+            else
+            {
+                if(c == *q)
+                    match = 1;
+                q++;
+            }
+        }
+        // Unterminated class, treat the [ as a plain character
+        if(q >= pe)
+        {
+            if(c != '[')
+                return 0;
+            *pp = p + 1;
+            return 1;
+        }
+        if(match == negate)
+            return 0;
+        *pp = q + 1;
+        return 1;
+    }
+    if(*p == '\\' && p + 1 < pe)
+        p++;
+    if(*p != c)
+        return 0;
+    *pp = p + 1;
+    return 1;
+}
+
+// Shell-style globbing, like tar, * & ? also match slashes
+static int kt_glob_match(const char *p, const char *pe, const char *s, const char *se)
+{
+    const char *star_p = NULL;
+    const char *star_s = NULL;
+
+    while(s < se)
+    {
+        if(p < pe && *p == '*')
+        {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if(p < pe && kt_glob_char(&p, pe, *s))
+        {
+            s++;
+            continue;
+        }
+        // Let the last star eat one more character
+        if(star_p != NULL)
+        {
+            p = star_p;
+            s = ++star_s;
+            continue;
+        }
+        return 0;
+    }
+    while(p < pe && *p == '*')
+        p++;
+
+    return p == pe;
+}
+
+// Does path match pattern? Like tar, a pattern matching a directory matches everything inside it, too. *exact is set if it's not because of that.
+static int kt_extract_pattern_match(const char *pattern, const char *path, int *exact)
+{
+    const char *p;
+    const char *s;
+    size_t plen;
+    size_t slen;
+    size_t i;
+
+    p = kt_normalize_entry_path(pattern, &plen);
+    s = kt_normalize_entry_path(path, &slen);
+    *exact = 0;
+    if(!kt_is_glob(pattern))
+    {
+        if(slen < plen || memcmp(s, p, plen) != 0)
+            return 0;
+        if(slen == plen)
+        {
+            *exact = 1;
+            return 1;
+        }
+        return s[plen] == '/';
+    }
+    if(kt_glob_match(p, p + plen, s, s + slen))
+    {
+        *exact = 1;
+        return 1;
+    }
+    // Try the parent directories
+    for(i = 1; i < slen; i++)
+    {
+        if(s[i] == '/' && kt_glob_match(p, p + plen, s, s + i))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int kt_extract_filter_init(struct kt_extract_filter *filter, const ExtractOptions *opts)
+{
+    unsigned int i;
+
+    memset(filter, 0, sizeof(*filter));
+    if(opts == NULL || opts->num_patterns == 0)
+        return 0;
+    filter->patterns = opts->patterns;
+    filter->num_patterns = opts->num_patterns;
+    if((filter->matched = calloc(filter->num_patterns, 1)) == NULL || (filter->done = calloc(filter->num_patterns, 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate pattern list: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        free(filter->matched);
+        return -1;
+    }
+    for(i = 0; i < filter->num_patterns; i++)
+    {
+        if(kt_is_glob(filter->patterns[i]))
+            filter->num_globs++;
+        else
+            filter->literals_left++;
+    }
+
+    return 0;
+}
+
+static void kt_extract_filter_free(struct kt_extract_filter *filter)
+{
+    free(filter->matched);
+    free(filter->done);
+}
+
+// Do we want this entry?
+static int kt_extract_filter_match(struct kt_extract_filter *filter, const char *path, int is_dir)
+{
+    unsigned int i;
+    int exact;
+    int wanted = 0;
+
+    if(filter->num_patterns == 0)
+        return 1;
+    for(i = 0; i < filter->num_patterns; i++)
+    {
+        if(!kt_extract_pattern_match(filter->patterns[i], path, &exact))
+            continue;
+        wanted = 1;
+        filter->matched[i] = 1;
+        if(exact && !is_dir && !filter->done[i] && !kt_is_glob(filter->patterns[i]))
+        {
+            filter->done[i] = 1;
+            filter->literals_left--;
+        }
+    }
+
+    return wanted;
+}
+
+// When we're only looking for literal paths, we can stop as soon as we've got all of them
+static int kt_extract_filter_complete(const struct kt_extract_filter *filter)
+{
+    return filter->num_patterns > 0 && filter->num_globs == 0 && filter->literals_left == 0;
+}
+
+// What extract --incremental did with the files that were already there
+struct kt_extract_incremental
+{
+    unsigned int unchanged;     // Identical, left alone
+    unsigned int rewritten;     // Small enough to be rewritten in one go
+    unsigned int patched;       // Only the blocks that changed were rewritten
+    uint64_t patched_bytes;
+};
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define KT_EXTRACT_BINARY O_BINARY
+#define kt_extract_lstat stat
+#else
+#define KT_EXTRACT_BINARY 0
+#define kt_extract_lstat lstat
+#endif
+
+static void kt_extract_md5_hex(const void *data, size_t size, char *md5)
+{
+    struct md5_ctx ctx;
+    uint8_t digest[MD5_DIGEST_SIZE];
+
+    md5_init(&ctx);
+    md5_update(&ctx, size, (const uint8_t *) data);
+    md5_digest(&ctx, sizeof(digest), digest);
+    base16_encode_update(md5, sizeof(digest), digest);
+    md5[MD5_HASH_LENGTH] = '\0';
+}
 
-    char *bin_filename;
-    char tgz_filename[] = KT_TMPDIR "/kindletool_extract_tgz_XXXXXX";
-    char *output_dir;
-    FILE *bin_input;
-    int tgz_fd;
-    FILE *tgz_output;
-    char header_md5[MD5_HASH_LENGTH + 1] = {'\0'};
-    char actual_md5[MD5_HASH_LENGTH + 1] = {'\0'};
+// Read exactly size bytes from fd, at offset. Returns 0 if we couldn't (which just means it's not what we expected).
+static int kt_extract_read_at(int fd, unsigned char *buf, size_t size, int64_t offset)
+{
+    size_t total = 0;
+    ssize_t n;
 
-    fake_sign = 0;
-    bin_filename = NULL;
-    output_dir = NULL;
-    while((opt = getopt_long(argc, argv, "u", opts, &opt_index)) != -1)
+    if(lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1)
+        return 0;
+    while(total < size)
+    {
+        if((n = read(fd, buf + total, size - total)) <= 0)
+            return 0;
+        total += (size_t) n;
+    }
+    return 1;
+}
+
+// Compare a block of a large entry with what's on disk, and only overwrite it if it differs
+static int kt_extract_patch_block(int fd, const char *path, const void *data, size_t size, int64_t offset, unsigned char **buf, size_t *buf_size, uint64_t *patched)
+{
+    unsigned char *new_buf;
+    size_t total = 0;
+    ssize_t n;
+
+    if(size > *buf_size)
+    {
+        if((new_buf = realloc(*buf, size)) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate %zu bytes for '%s': %s.\n", size, path, strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            return -1;
+        }
+        *buf = new_buf;
+        *buf_size = size;
+    }
+    if(kt_extract_read_at(fd, *buf, size, offset) && memcmp(*buf, data, size) == 0)
+        return 0;
+
+    if(lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1)
+    {
+        fprintf(kt_stderr, "Cannot seek in '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    while(total < size)
+    {
+        if((n = write(fd, (const unsigned char *) data + total, size - total)) < 0)
+        {
+            fprintf(kt_stderr, "Cannot write to '%s': %s.\n", path, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        total += (size_t) n;
+    }
+    *patched += size;
+
+    return 0;
+}
+
+// A large file, streamed through & compared block by block with the one on disk, which we patch in place where they differ
+static int kt_extract_incremental_patch(KTDigestCache *digests, struct archive *a, struct archive_entry *entry, const char *rel, int fd, struct kt_extract_incremental *stats)
+{
+    static const unsigned char zeroes[16384];
+    const char *path = archive_entry_pathname(entry);
+    int64_t entry_size = archive_entry_size(entry);
+    struct md5_ctx ctx;
+    uint8_t digest[MD5_DIGEST_SIZE];
+    char md5[MD5_HASH_LENGTH + 1];
+    unsigned char *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t patched = 0;
+    const void *buff;
+    size_t size;
+    int64_t offset;
+    int64_t pos = 0;
+    size_t hole;
+    struct stat st;
+    int r;
+    int ret = -1;
+
+    md5_init(&ctx);
+    for(;;)
+    {
+        r = archive_read_data_block(a, &buff, &size, &offset);
+        if(r != ARCHIVE_OK && r != ARCHIVE_EOF)
+        {
+            fprintf(kt_stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        if(r == ARCHIVE_EOF)
+            offset = entry_size;
+        // Holes in sparse entries read as zeroes
+        while(pos < offset)
+        {
+            hole = (offset - pos > (int64_t) sizeof(zeroes) ? sizeof(zeroes) : (size_t) (offset - pos));
+            md5_update(&ctx, hole, zeroes);
+            if(kt_extract_patch_block(fd, path, zeroes, hole, pos, &buf, &buf_size, &patched) < 0)
+                goto cleanup;
+            pos += (int64_t) hole;
+        }
+        if(r == ARCHIVE_EOF)
+            break;
+        md5_update(&ctx, size, (const uint8_t *) buff);
+        if(kt_extract_patch_block(fd, path, buff, size, offset, &buf, &buf_size, &patched) < 0)
+            goto cleanup;
+        pos = offset + (int64_t) size;
+    }
+    md5_digest(&ctx, sizeof(digest), digest);
+    base16_encode_update(md5, sizeof(digest), digest);
+    md5[MD5_HASH_LENGTH] = '\0';
+
+    if(patched > 0)
+    {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+        // Like write_disk would have
+        struct timespec times[2];
+        times[0].tv_sec = archive_entry_mtime(entry);
+        times[0].tv_nsec = archive_entry_mtime_nsec(entry);
+        times[1] = times[0];
+        if(futimens(fd, times) != 0)
+            fprintf(kt_stderr, "Cannot restore the times of '%s': %s.\n", path, strerror(errno));
+#endif
+        stats->patched++;
+        stats->patched_bytes += patched;
+    }
+    else
+        stats->unchanged++;
+    if(fstat(fd, &st) == 0 && kt_digest_cache_update(digests, rel, &st, md5) < 0)
+        goto cleanup;
+    ret = 1;
+
+cleanup:
+    free(buf);
+
+    return ret;
+}
+
+// extract --incremental: deal with a regular file that may already be on disk.
+// Returns 1 if we took care of it, 0 if it should be extracted as usual, and -1 on error.
+static int kt_extract_incremental(KTDigestCache *digests, struct archive *a, struct archive *disk, KTStore *store, struct archive_entry *entry, const char *rel, struct kt_extract_incremental *stats)
+{
+    const char *path = archive_entry_pathname(entry);
+    struct stat st;
+    const char *expected;
+    const char *cached;
+    char md5[MD5_HASH_LENGTH + 1];
+    void *data = NULL;
+    size_t size = 0;
+    unsigned char *buf;
+    int same = 0;
+    int fd;
+    int r;
+
+    if(kt_extract_lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || (int64_t) st.st_size != archive_entry_size(entry))
+        return 0;
+    expected = kt_digest_cache_expected(digests, rel);
+    cached = kt_digest_cache_lookup(digests, rel, &st);
+
+    // Best case: we know both digests, so we don't even have to look at the data
+    if(expected != NULL && cached != NULL && strcasecmp(expected, cached) == 0)
+    {
+        if(archive_read_data_skip(a) < ARCHIVE_WARN)
+        {
+            fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            return -1;
+        }
+        stats->unchanged++;
+        return 1;
+    }
+
+    if(archive_entry_size(entry) > KT_EXTRACT_MAX_BUFFERED_FILE)
+    {
+        // Don't patch a file that's shared with something else (like an object store)
+        if(st.st_nlink > 1 || store != NULL)
+            return 0;
+        if((fd = open(path, O_RDWR | KT_EXTRACT_BINARY)) < 0)
+            return 0;
+        r = kt_extract_incremental_patch(digests, a, entry, rel, fd, stats);
+        close(fd);
+        return r;
+    }
+
+    // Small files are read in memory, and compared with the cached digest, or with the file itself
+    if(kt_read_entry_data(a, entry, &data, &size) < 0)
+        return -1;
+    kt_extract_md5_hex(data, size, md5);
+    if(cached != NULL)
+        same = (strcmp(md5, cached) == 0);
+    else if((fd = open(path, O_RDONLY | KT_EXTRACT_BINARY)) >= 0)
+    {
+        if(size == 0)
+            same = 1;
+        else if((buf = malloc(size)) != NULL)
+        {
+            same = (kt_extract_read_at(fd, buf, size, 0) && memcmp(buf, data, size) == 0);
+            free(buf);
+        }
+        close(fd);
+    }
+    if(same)
+    {
+        stats->unchanged++;
+        r = (cached == NULL ? kt_digest_cache_update(digests, rel, &st, md5) : 0);
+        free(data);
+        return (r < 0 ? -1 : 1);
+    }
+
+    // Otherwise, we've already read it, so write it out ourselves
+    if(store != NULL)
+        r = kt_store_add_data(store, data, size, entry, path);
+    else if((r = kt_write_disk_entry(disk, entry, data, size)) < 0)
+        kt_set_error(KT_ERR_ARCHIVE);
+    free(data);
+    if(r < 0)
+        return -1;
+    stats->rewritten++;
+    if(kt_extract_lstat(path, &st) == 0 && kt_digest_cache_update(digests, rel, &st, md5) < 0)
+        return -1;
+
+    return 1;
+}
+
+// Heavily inspired from libarchive's tar/read.c ;)
+// If idx isn't NULL, record the entries in it as we go.
+static int kt_extract_entries(struct kt_extract_source *source, const char *prefix, const ExtractOptions *opts, KTIndex *idx)
+{
+    struct archive *a = source->a;
+    struct archive *disk = NULL;
+    struct archive_entry *entry;
+    int flags;
+    int failed;
+    int r;
+    const char *path = NULL;
+    const char *hardlink = NULL;
+    char *path_buf = NULL;
+    size_t path_buf_size = 0;
+    size_t prefix_len;
+    struct kt_dir_cache dir_cache;
+    struct kt_extract_pool pool;
+    pthread_t *writers = NULL;
+    unsigned int num_writers = 0;
+    int pool_started = 0;
+    unsigned int i;
+    struct archive_entry **hardlinks = NULL;
+    size_t num_hardlinks = 0;
+    size_t h;
+    struct kt_extract_filter filter;
+#ifdef KT_WITH_IO_URING
+    struct kt_uring_batch *uring = NULL;
+#endif
+    KTStore *store = NULL;
+    struct kt_extract_incremental incremental;
+    char *rel_buf = NULL;
+    size_t rel_buf_size = 0;
+    unsigned int num_entries = 0;
+    unsigned int num_files = 0;
+    uint64_t total_bytes = 0;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    char backend[64];
+    int ret = 1;
+
+    // Select which attributes we want to restore.
+    flags = ARCHIVE_EXTRACT_TIME;
+    // Don't preserve permissions, as most files in kindle packages will be owned by root, and if the perms are effed up, it gets annoying.
+    // We could also just rewrite every entry in the archive with sane permissions, but that seems a bit overkill.
+    //flags |= ARCHIVE_EXTRACT_PERM;
+    //flags |= ARCHIVE_EXTRACT_ACL;
+    flags |= ARCHIVE_EXTRACT_FFLAGS;
+    // We take care of the parent directories ourselves, with a cache, instead of letting libarchive check every component of every path
+    flags |= ARCHIVE_EXTRACT_NO_AUTODIR;
+
+    kt_dir_cache_init(&dir_cache);
+    memset(&incremental, 0, sizeof(incremental));
+    if(kt_extract_filter_init(&filter, opts) < 0)
+        return 1;
+    prefix_len = strlen(prefix);
+    // Strip trailing slashes from the output directory, we add our own
+    while(prefix_len > 1 && prefix[prefix_len - 1] == '/')
+        prefix_len--;
+
+    // A single write_disk archive for the whole extraction (its uid/gid lookup cache included), instead of the one archive_read_extract sets up for every call
+    if((disk = kt_write_disk_new(flags)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a write_disk archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    snprintf(backend, sizeof(backend), "write_disk");
+
+    // Regular files go to the object store, wherever they're written from
+    if(opts != NULL && opts->store != NULL)
+    {
+        if((store = kt_store_open(opts->store)) == NULL)
+            goto cleanup;
+        snprintf(backend, sizeof(backend), "object store");
+    }
+
+    // io_uring batches the small files from this thread, so it takes precedence over the writer pool (but it has no business writing to the store)
+    if(opts != NULL && opts->io_uring && store != NULL)
+        fprintf(kt_stderr, "io_uring can't write to the object store, using the classic write path.\n");
+    else if(opts != NULL && opts->io_uring)
+    {
+#ifdef KT_WITH_IO_URING
+        if((uring = kt_uring_batch_new()) != NULL)
+            snprintf(backend, sizeof(backend), "io_uring");
+        else
+            fprintf(kt_stderr, "io_uring is unavailable (%s), using the classic write path.\n", strerror(errno));
+#else
+        fprintf(kt_stderr, "io_uring support wasn't enabled at build time, using the classic write path.\n");
+#endif
+    }
+
+    // If we were asked to, spin up a pool of writer threads. We keep everything that has ordering constraints (directories, links, ...) in this thread.
+    memset(&pool, 0, sizeof(pool));
+#ifdef KT_WITH_IO_URING
+    if(opts != NULL && opts->jobs > 1 && uring == NULL)
+#else
+    if(opts != NULL && opts->jobs > 1)
+#endif
+    {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.not_empty, NULL);
+        pthread_cond_init(&pool.not_full, NULL);
+        pool_started = 1;
+        pool.flags = flags;
+        pool.store = store;
+        pool.ctx = kt_context_current();
+        if((writers = malloc(opts->jobs * sizeof(*writers))) != NULL)
+        {
+            for(num_writers = 0; num_writers < opts->jobs; num_writers++)
+            {
+                if(pthread_create(&writers[num_writers], NULL, kt_extract_writer, &pool) != 0)
+                    break;
+            }
+        }
+        if(num_writers == 0)
+            fprintf(kt_stderr, "Cannot spawn writer threads, extracting sequentially.\n");
+        else
+            snprintf(backend, sizeof(backend), "%u writer threads%s", num_writers, (store != NULL ? ", object store" : ""));
+    }
+
+    for(;;)
+    {
+        // Don't read any further than we need to
+        if(kt_extract_filter_complete(&filter))
+            break;
+        r = kt_extract_next_header(source, &entry);
+        a = source->a;
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK && a != NULL)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        if(idx != NULL && kt_index_add_entry(idx, archive_read_header_position(a), entry) < 0)
+            goto cleanup;
+        // Skip whatever we weren't asked for (and the index create --seekable embeds, that one's ours, not the device's)
+        if(!kt_extract_filter_match(&filter, archive_entry_pathname(entry), archive_entry_filetype(entry) == AE_IFDIR) || strcmp(archive_entry_pathname(entry), KT_INDEX_SEEK_NAME) == 0)
+        {
+            if(archive_read_data_skip(a) < ARCHIVE_WARN)
+            {
+                fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+                kt_set_error(KT_ERR_ARCHIVE);
+                goto cleanup;
+            }
+            continue;
+        }
+
+        // Print what we're extracting, like bsdtar
+        path = archive_entry_pathname(entry);
+        num_entries++;
+        if(archive_entry_filetype(entry) == AE_IFREG && archive_entry_hardlink(entry) == NULL)
+        {
+            num_files++;
+            total_bytes += (uint64_t) archive_entry_size(entry);
+        }
+        fprintf(kt_stderr, "x %s\n", path);
+        // The digest cache is keyed by the path in the package, which we're about to lose
+        if(source->digests != NULL)
+        {
+            size_t len;
+            const char *rel = kt_normalize_entry_path(path, &len);
+            if(len + 1 > rel_buf_size)
+            {
+                char *new_buf;
+                if((new_buf = realloc(rel_buf, len + 1)) == NULL)
+                {
+                    fprintf(kt_stderr, "Cannot allocate path buffer: %s.\n", strerror(errno));
+                    kt_set_error(KT_ERR_NOMEM);
+                    goto cleanup;
+                }
+                rel_buf = new_buf;
+                rel_buf_size = len + 1;
+            }
+            memcpy(rel_buf, rel, len);
+            rel_buf[len] = '\0';
+        }
+        // Rewrite the entry's pathname to extract in the right output directory
+        if(kt_prefix_path(&path_buf, &path_buf_size, prefix, prefix_len, path) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate path buffer: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        // Make sure its parent directory exists (directories always exist before their children)
+        {
+            size_t len = strlen(path_buf);
+            while(len > 1 && path_buf[len - 1] == '/')
+                len--;
+            while(len > 0 && path_buf[len - 1] != '/')
+                len--;
+            if(len > 1 && kt_dir_cache_mkdirs(&dir_cache, path_buf, len - 1) < 0)
+                goto cleanup;
+        }
+        archive_entry_copy_pathname(entry, path_buf);
+        // Same thing for hardlink targets, which are relative to the root of the archive
+        hardlink = archive_entry_hardlink(entry);
+        if(hardlink != NULL)
+        {
+            if(kt_prefix_path(&path_buf, &path_buf_size, prefix, prefix_len, hardlink) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate path buffer: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            archive_entry_copy_hardlink(entry, path_buf);
+        }
+
+        // Don't bother going on if a writer already failed
+        if(num_writers > 0)
+        {
+            pthread_mutex_lock(&pool.lock);
+            failed = pool.failed;
+            pthread_mutex_unlock(&pool.lock);
+            if(failed)
+                goto cleanup;
+        }
+        // Leave the files that are already up to date alone
+        if(source->digests != NULL && hardlink == NULL && archive_entry_filetype(entry) == AE_IFREG)
+        {
+            if((r = kt_extract_incremental(source->digests, a, disk, store, entry, rel_buf, &incremental)) < 0)
+                goto cleanup;
+            if(r > 0)
+                continue;
+        }
+        if(hardlink != NULL && num_writers > 0)
+        {
+            // Hardlinks need their target to be on disk, so keep them for the end
+            struct archive_entry **new_hardlinks;
+            if((new_hardlinks = realloc(hardlinks, (num_hardlinks + 1) * sizeof(*hardlinks))) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate hardlink list: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            hardlinks = new_hardlinks;
+            if((hardlinks[num_hardlinks] = archive_entry_clone(entry)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate hardlink entry: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            num_hardlinks++;
+        }
+        else if(num_writers > 0 && archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) <= KT_EXTRACT_MAX_BUFFERED_FILE)
+        {
+            // Regular files go to the pool
+            if(kt_extract_queue_file(&pool, a, entry) < 0)
+                goto cleanup;
+        }
+        else if(store != NULL && hardlink == NULL && archive_entry_filetype(entry) == AE_IFREG)
+        {
+            // Large files are hashed on their way to the store
+            if(kt_store_add_entry(store, a, entry, archive_entry_pathname(entry)) < 0)
+                goto cleanup;
+        }
+#ifdef KT_WITH_IO_URING
+        else if(uring != NULL && hardlink == NULL && archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) <= KT_EXTRACT_MAX_BUFFERED_FILE)
+        {
+            // Small regular files get batched
+            if(kt_uring_batch_add(uring, disk, a, entry) < 0)
+                goto cleanup;
+        }
+#endif
+        else
+        {
+#ifdef KT_WITH_IO_URING
+            // Keep the on-disk order intact: whatever we're about to write may depend on the files still sitting in the batch
+            if(uring != NULL && kt_uring_batch_flush(uring, disk) < 0)
+                goto cleanup;
+#endif
+            // Everything else is written right here. For directories, that means they exist before their children, and they get their times restored when we close disk.
+            if(kt_copy_entry_to_disk(a, disk, entry) < 0)
+            {
+                kt_set_error(KT_ERR_ARCHIVE);
+                goto cleanup;
+            }
+            if(archive_entry_filetype(entry) == AE_IFDIR)
+            {
+                size_t len = strlen(archive_entry_pathname(entry));
+                while(len > 1 && archive_entry_pathname(entry)[len - 1] == '/')
+                    len--;
+                if(kt_dir_cache_add(&dir_cache, archive_entry_pathname(entry), len) < 0)
+                    goto cleanup;
+            }
+        }
+    }
+
+#ifdef KT_WITH_IO_URING
+    if(uring != NULL && kt_uring_batch_flush(uring, disk) < 0)
+        goto cleanup;
+#endif
+    // Wait for our writers to be done with the queue...
+    if(num_writers > 0)
+    {
+        kt_extract_pool_join(&pool, writers, num_writers, 0);
+        num_writers = 0;
+        if(pool.failed)
+            goto cleanup;
+    }
+    // ...before creating the hardlinks
+    for(h = 0; h < num_hardlinks; h++)
+    {
+        if(kt_write_disk_entry(disk, hardlinks[h], NULL, 0) < 0)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+    }
+    ret = 0;
+    // Complain about the patterns that didn't match anything, like tar
+    for(i = 0; i < filter.num_patterns; i++)
+    {
+        if(!filter.matched[i])
+        {
+            fprintf(kt_stderr, "'%s' not found in package.\n", filter.patterns[i]);
+            kt_set_error(KT_ERR_INVALID);
+            ret = 1;
+        }
+    }
+
+    // How fast we went, to compare the various write paths (cf. tools/extract-bench.sh)
+    if(opts != NULL && opts->stats)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+        fprintf(kt_stderr, "Extracted %u entries (%u files, %.1f MiB) in %.2fs (%.0f files/s, %s).\n", num_entries, num_files, (double) total_bytes / (1024.0 * 1024.0), elapsed, elapsed > 0 ? (double) num_files / elapsed : 0.0, backend);
+    }
+    if(source->digests != NULL)
+        fprintf(kt_stderr, "Left %u unchanged files alone, rewrote %u, and patched %u in place (%.1f MiB written).\n", incremental.unchanged, incremental.rewritten, incremental.patched, (double) incremental.patched_bytes / (1024.0 * 1024.0));
+
+cleanup:
+    if(num_writers > 0)
+        kt_extract_pool_join(&pool, writers, num_writers, 1);
+    if(pool_started)
+    {
+        // Free whatever was left over in the queue
+        while(pool.head != NULL)
+        {
+            struct kt_extract_job *job = pool.head;
+            pool.head = job->next;
+            kt_extract_job_free(job);
+        }
+        pthread_cond_destroy(&pool.not_full);
+        pthread_cond_destroy(&pool.not_empty);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    free(writers);
+#ifdef KT_WITH_IO_URING
+    kt_uring_batch_free(uring);
+#endif
+    for(h = 0; h < num_hardlinks; h++)
+        archive_entry_free(hardlinks[h]);
+    free(hardlinks);
+    kt_store_close(store);
+    if(disk != NULL)
+    {
+        // This is where the directories get their times restored
+        archive_write_close(disk);
+        archive_write_free(disk);
+    }
+    kt_dir_cache_free(&dir_cache);
+    kt_extract_filter_free(&filter);
+    free(path_buf);
+    free(rel_buf);
+
+    return ret;
+}
+
+// Hand a plain gzipped tarball over to the parallel inflater (cf. inflate.c). Returns 1 if it isn't worth it, with nothing left open.
+static int kt_extract_inflate_open(struct archive *a, const char *filename, const KTInflateOptions *inflate, FILE **src)
+{
+    char magic_number[MAGIC_NUMBER_LENGTH];
+    FILE *input;
+    int r;
+
+    if((input = fopen(filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    // Only a GZIP magic number without any flags looks like a userdata package to the probe, let libarchive deal with everything else
+    if(fread(magic_number, sizeof(char), MAGIC_NUMBER_LENGTH, input) < MAGIC_NUMBER_LENGTH || get_bundle_version(magic_number) != UserDataPackage)
+    {
+        fclose(input);
+        return 1;
+    }
+    rewind(input);
+    if((r = kt_inflate_read_open(a, input, 0, inflate)) != 0)
+    {
+        fclose(input);
+        return r;
+    }
+    *src = input;
+
+    return 0;
+}
+
+// Extract a tarball. If idx isn't NULL, we do the inflating ourselves, and fill it as we go.
+int libarchive_extract(const char *filename, const char *prefix, const ExtractOptions *opts, KTIndex *idx, KTDigestCache *digests)
+{
+    struct kt_extract_source source;
+    FILE *src = NULL;
+    int r = 1;
+    int ret;
+
+    memset(&source, 0, sizeof(source));
+    source.digests = digests;
+    if((source.a = kt_extract_read_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return 1;
+    }
+
+    if(filename != NULL && strcmp(filename, "-") == 0)
+        filename = NULL;
+    if(idx != NULL)
     {
-        switch(opt)
+        if((src = (filename != NULL ? fopen(filename, "rb") : stdin)) == NULL)
         {
-            case 'u':
-                fake_sign = 1;
-                break;
-            case ':':
-                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
-                return -1;
-                break;
-            case '?':
-                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
-                return -1;
-                break;
-            default:
-                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
-                return -1;
-                break;
+            fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", filename, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            archive_read_free(source.a);
+            return 1;
+        }
+        if(kt_index_read_open(source.a, idx, src, 0) < 0)
+        {
+            if(src != stdin)
+                fclose(src);
+            archive_read_free(source.a);
+            return 1;
         }
     }
-
-    // We need exactly 2 non-switch options (I/O)!
-    if(optind < argc && (optind + 2) == argc)
+    else if(filename != NULL && opts->inflate.jobs > 1 && (r = kt_extract_inflate_open(source.a, filename, &opts->inflate, &src)) <= 0)
     {
-        // We know exactly what we need, and in what order
-        bin_filename = argv[optind];
-        output_dir = argv[optind + 1];
+        if(r < 0)
+        {
+            archive_read_free(source.a);
+            return 1;
+        }
     }
-    else
+    else if(archive_read_open_filename(source.a, filename, 10240) != ARCHIVE_OK)
     {
-        fprintf(stderr, "Invalid number of arguments (need input & output).\n");
+        fprintf(kt_stderr, "archive_read_open_file() failure: %s.\n", archive_error_string(source.a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        archive_read_free(source.a);
+        return 1;
+    }
+
+    ret = kt_extract_entries(&source, prefix, opts, idx);
+
+    archive_read_close(source.a);
+    archive_read_free(source.a);
+    if(src != NULL && src != stdin)
+        fclose(src);
+
+    return ret;
+}
+
+// What update-filelist.dat told us so far
+struct kt_extract_expect
+{
+    KTDigestCache *digests;
+    unsigned int num_expected;
+};
+
+// Remember the MD5 a record of the index file lists
+static int kt_extract_expect_record(void *arg, const KTFilelistRecord *record)
+{
+    struct kt_extract_expect *expect = arg;
+    const char *rel;
+    size_t len;
+
+    rel = kt_normalize_entry_path(record->path, &len);
+    if(kt_digest_cache_expect(expect->digests, rel, record->md5) < 0)
         return -1;
+    expect->num_expected++;
+
+    return 0;
+}
+
+// The sidecar index, if it's usable, or the one create --seekable embedded in the package
+static KTIndex *kt_extract_index_load(FILE *bin, const ExtractOptions *opts, unsigned int *embedded)
+{
+    KTIndex *idx = NULL;
+
+    *embedded = 0;
+    if(opts->index_file != NULL)
+        idx = kt_index_load(opts->index_file, bin, opts->fake_sign);
+    if(idx == NULL && (idx = kt_index_load_embedded(bin, opts->fake_sign)) != NULL)
+        *embedded = 1;
+
+    return idx;
+}
+
+// extract --incremental: update-filelist.dat comes last, but with an index, its MD5s are only a seek away.
+// Without one, we'll just have to look at the data.
+static int kt_extract_expect_filelist(KTDigestCache *digests, FILE *bin, const ExtractOptions *opts)
+{
+    KTIndex *idx;
+    struct archive *a = NULL;
+    struct archive_entry *entry;
+    struct kt_extract_expect expect = { digests, 0 };
+    KTFilelistReader reader;
+    const char *buff;
+    size_t size;
+    int64_t offset;
+    off_t pos;
+    long e;
+    unsigned int embedded;
+    int r;
+    int ret = -1;
+
+    if((pos = ftello(bin)) < 0)
+        return 0;
+    if((idx = kt_extract_index_load(bin, opts, &embedded)) == NULL)
+    {
+        fseeko(bin, pos, SEEK_SET);
+        return 0;
     }
-    // Double validation, and make GCC happy
-    if(bin_filename == NULL)
+    if((e = kt_index_find(idx, INDEX_FILE_NAME)) < 0)
+        e = kt_index_find(idx, "./" INDEX_FILE_NAME);
+    if(e < 0)
     {
-        fprintf(stderr, "Input filename isn't set!\n");
-        return -1;
+        ret = 0;
+        goto cleanup;
     }
-    if(output_dir == NULL)
+    if((a = kt_extract_read_new()) == NULL || kt_index_read_open_at(a, idx, bin, idx->entries[e].offset) < 0 || archive_read_next_header(a, &entry) != ARCHIVE_OK)
     {
-        fprintf(stderr, "Output directory isn't set!\n");
-        return -1;
+        // We'll just do without
+        fprintf(kt_stderr, "Cannot read " INDEX_FILE_NAME " through the index, comparing the data instead.\n");
+        ret = 0;
+        goto cleanup;
+    }
+    kt_filelist_reader_init(&reader, kt_extract_expect_record, &expect);
+    while((r = archive_read_data_block(a, (const void **) &buff, &size, &offset)) == ARCHIVE_OK)
+    {
+        if(kt_filelist_reader_feed(&reader, buff, size) < 0)
+            goto cleanup;
+    }
+    if(r != ARCHIVE_EOF)
+    {
+        fprintf(kt_stderr, "Cannot read " INDEX_FILE_NAME " through the index (%s), comparing the data instead.\n", archive_error_string(a));
+        ret = 0;
+        goto cleanup;
     }
+    if(kt_filelist_reader_end(&reader) < 0)
+        goto cleanup;
+    fprintf(kt_stderr, "Picked up %u MD5s from " INDEX_FILE_NAME ", thanks to the index.\n", expect.num_expected);
+    ret = 0;
 
-    // Check that input properly ends in .bin or .stgz
-    if(!IS_BIN(bin_filename) && !IS_STGZ(bin_filename) && !IS_TARBALL(bin_filename) && !IS_TGZ(bin_filename))
+cleanup:
+    if(a != NULL)
+        archive_read_free(a);
+    kt_index_free(idx);
+    fseeko(bin, pos, SEEK_SET);
+
+    return ret;
+}
+
+// Load the digest cache that lives next to output_dir, and whatever the package tells us about its files
+static KTDigestCache *kt_extract_digests_open(FILE *bin, const char *output_dir, const ExtractOptions *opts)
+{
+    KTDigestCache *digests;
+    char *name;
+
+    if((name = kt_digest_cache_default_name(output_dir)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate digest cache filename: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return NULL;
+    }
+    digests = kt_digest_cache_open(name);
+    free(name);
+    if(digests == NULL)
+        return NULL;
+    fprintf(kt_stderr, "Incremental extraction, using the digest cache '%s' (%u records).\n", kt_digest_cache_name(digests), kt_digest_cache_size(digests));
+    if(kt_extract_expect_filelist(digests, bin, opts) < 0)
+    {
+        kt_digest_cache_free(digests);
+        return NULL;
+    }
+
+    return digests;
+}
+
+// Whatever happened, the records we've got describe what's on disk, so keep them
+static void kt_extract_digests_close(KTDigestCache *digests)
+{
+    if(digests == NULL)
+        return;
+    kt_digest_cache_save(digests);
+    kt_digest_cache_free(digests);
+}
+
+// Extract some entries straight from a package, without going through a temp tarball, so that we can stop early, or seek right to them if there's an index
+static int kt_extract_partial(FILE *bin_input, const char *output_dir, const ExtractOptions *opts)
+{
+    struct kt_extract_source source;
+    struct kt_extract_filter filter;
+    KTIndex *probe;
+    KTIndex *idx = NULL;
+    unsigned int embedded;
+    uint32_t i;
+    int ret = -1;
+
+    memset(&source, 0, sizeof(source));
+    if(opts->incremental && (source.digests = kt_extract_digests_open(bin_input, output_dir, opts)) == NULL)
+        return -1;
+    if((probe = kt_index_probe(bin_input, opts->fake_sign)) == NULL)
     {
-        fprintf(stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' or '.tar.gz'/'.tgz' userdata package.\n", bin_filename);
+        kt_extract_digests_close(source.digests);
         return -1;
     }
-    // NOTE: Do some sanity checks for output directory handling?
-    // The 'rewrite pathname entry' cheap method we currently use is pretty 'dumb' (it assumes the path is correct, creating it if need be),
-    // but the other (more correct?) way to handle this (chdir) would need some babysitting (cf. bsdtar's *_chdir() in tar/util.c)...
-    if((bin_input = fopen(bin_filename, "rb")) == NULL)
+    idx = kt_extract_index_load(bin_input, opts, &embedded);
+
+    if(idx != NULL)
+    {
+        // Pick what we want from the index
+        if(kt_extract_filter_init(&filter, opts) < 0)
+            goto cleanup;
+        if(idx->num_entries > 0 && (source.wanted = malloc(idx->num_entries * sizeof(*source.wanted))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate entry list: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            kt_extract_filter_free(&filter);
+            goto cleanup;
+        }
+        for(i = 0; i < idx->num_entries; i++)
+        {
+            if(kt_extract_filter_match(&filter, idx->entries[i].pathname, S_ISDIR(idx->entries[i].mode)) && strcmp(idx->entries[i].pathname, KT_INDEX_SEEK_NAME) != 0)
+                source.wanted[source.num_wanted++] = i;
+        }
+        kt_extract_filter_free(&filter);
+        source.idx = idx;
+        source.bin = bin_input;
+        fprintf(kt_stderr, "Using %s%s%s to extract %u out of %u entries.\n", (embedded ? "the package's embedded index" : "index '"), (embedded ? "" : opts->index_file), (embedded ? "" : "'"), source.num_wanted, idx->num_entries);
+    }
+    else
+    {
+        // We'll only go through it once, so don't bother with checkpoints
+        probe->span = UINT64_MAX;
+        if(fseeko(bin_input, (off_t) probe->payload_offset, SEEK_SET) != 0)
+        {
+            fprintf(kt_stderr, "Cannot seek in package: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            goto cleanup;
+        }
+        if((source.a = kt_extract_read_new()) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate a read archive.\n");
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        if(kt_index_read_open(source.a, probe, bin_input, probe->munged) < 0)
+            goto cleanup;
+    }
+    // We don't go through the whole payload, so we can't check it against the header's MD5
+    fprintf(kt_stderr, "Partial extraction, skipping the package's integrity check.\n");
+
+    if(kt_extract_entries(&source, output_dir, opts, NULL) == 0)
+        ret = 0;
+
+cleanup:
+    if(source.a != NULL)
+        archive_read_free(source.a);
+    free(source.wanted);
+    kt_index_free(idx);
+    kt_index_free(probe);
+    kt_extract_digests_close(source.digests);
+
+    return ret;
+}
+
+// Convert a package to a temporary tarball, check its integrity, and extract it to output_dir (doesn't close input)
+int kindle_extract(FILE *bin_input, const char *output_dir, const ExtractOptions *opts)
+{
+    char tgz_filename[] = KT_TMPDIR "/kindletool_extract_tgz_XXXXXX";
+    int tgz_fd;
+    FILE *tgz_output;
+    char header_md5[MD5_HASH_LENGTH + 1] = {'\0'};
+    char actual_md5[MD5_HASH_LENGTH + 1] = {'\0'};
+    KTIndex *idx = NULL;
+    KTDigestCache *digests = NULL;
+    struct stat st;
+
+    // If we only want a few entries out of a package that's a real file, read them straight from it
+    if(opts->num_patterns > 0 && fstat(fileno(bin_input), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if(opts->build_index)
+            fprintf(kt_stderr, "Not building an index for a partial extraction.\n");
+        return kt_extract_partial(bin_input, output_dir, opts);
+    }
+
+    // The index is only a cache, so failing to build it isn't fatal
+    if(opts->build_index && opts->num_patterns == 0 && opts->index_file != NULL && (idx = kt_index_probe(bin_input, opts->fake_sign)) == NULL)
+        fprintf(kt_stderr, "Cannot index this package, extracting it anyway.\n");
+    if(opts->incremental && (digests = kt_extract_digests_open(bin_input, output_dir, opts)) == NULL)
     {
-        fprintf(stderr, "Cannot open input %s package '%s': %s.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, strerror(errno));
+        kt_index_free(idx);
         return -1;
     }
+
     // Use a non-racy tempfile, hopefully... (Heavily inspired from http://www.tldp.org/HOWTO/Secure-Programs-HOWTO/avoid-race.html)
     // We always create them in P_tmpdir (usually /tmp or /var/tmp), and rely on the OS implementation to handle the umask,
     // it'll cost us less LOC that way since I don't really want to introduce a dedicated utility function for tempfile handling...
@@ -1038,8 +2789,10 @@ int kindle_extract_main(int argc, char *argv[])
     // Inspired from fontconfig's compatibility helpers (http://cgit.freedesktop.org/fontconfig/tree/src/fccompat.c)
     if(_mktemp(tgz_filename) == NULL)
     {
-        fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
-        fclose(bin_input);
+        fprintf(kt_stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        kt_index_free(idx);
+        kt_extract_digests_close(digests);
         return -1;
     }
     tgz_fd = open(tgz_filename, O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0600);
@@ -1048,58 +2801,320 @@ int kindle_extract_main(int argc, char *argv[])
 #endif
     if(tgz_fd == -1)
     {
-        fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
-        fclose(bin_input);
+        fprintf(kt_stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        kt_index_free(idx);
+        kt_extract_digests_close(digests);
         return -1;
     }
     if((tgz_output = fdopen(tgz_fd, "w+b")) == NULL)
     {
-        fprintf(stderr, "Cannot open temp output '%s' for writing: %s.\n", tgz_filename, strerror(errno));
-        fclose(bin_input);
+        fprintf(kt_stderr, "Cannot open temp output '%s' for writing: %s.\n", tgz_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
         close(tgz_fd);
         unlink(tgz_filename);
+        kt_index_free(idx);
+        kt_extract_digests_close(digests);
         return -1;
     }
-    // Print a recap of what we're about to do
-    fprintf(stderr, "Extracting %s package '%s' to '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, output_dir);
-    if(kindle_convert(bin_input, tgz_output, NULL, fake_sign, 0, NULL, header_md5) < 0)
+    if(kindle_convert(bin_input, tgz_output, NULL, opts->fake_sign, 0, NULL, header_md5) < 0)
     {
-        fprintf(stderr, "Error converting %s package '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename);
-        fclose(bin_input);
+        fprintf(kt_stderr, "Error converting package.\n");
         fclose(tgz_output);
+        unlink(tgz_filename);
+        kt_index_free(idx);
+        kt_extract_digests_close(digests);
         return -1;
     }
-    fclose(bin_input);
     // When appropriate, check the integrity of the tarball, thanks to the md5 hash stored in the package's header...
-    if(!fake_sign && strlen(header_md5) != 0)
+    if(!opts->fake_sign && strlen(header_md5) != 0)
     {
         // First, calculate the hash of what we've just extracted...
         rewind(tgz_output);
         if(md5_sum(tgz_output, actual_md5) < 0)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
+            fprintf(kt_stderr, "Error calculating MD5 of package.\n");
             fclose(tgz_output);
             unlink(tgz_filename);
+            kt_index_free(idx);
+            kt_extract_digests_close(digests);
             return -1;
         }
         // ...And compare it against the one stored in the package's header.
         if(strcmp(header_md5, actual_md5) != 0)
         {
-            fprintf(stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
+            fprintf(kt_stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
+            kt_set_error(KT_ERR_INTEGRITY);
             fclose(tgz_output);
             unlink(tgz_filename);
+            kt_index_free(idx);
+            kt_extract_digests_close(digests);
             return -1;
         }
     }
     fclose(tgz_output);
-    if(libarchive_extract(tgz_filename, output_dir) < 0)
+    // The temp tarball is the demunged payload, byte for byte, so the offsets we record while extracting it are valid in the package, too
+    if(libarchive_extract(tgz_filename, output_dir, opts, idx, digests) != 0)
     {
-        fprintf(stderr, "Error extracting temp tarball '%s' to '%s'.\n", tgz_filename, output_dir);
+        fprintf(kt_stderr, "Error extracting temp tarball '%s' to '%s'.\n", tgz_filename, output_dir);
         unlink(tgz_filename);
+        kt_index_free(idx);
+        kt_extract_digests_close(digests);
         return -1;
     }
     unlink(tgz_filename);
+    if(idx != NULL)
+    {
+        if(kt_index_save(idx, opts->index_file) == 0)
+            fprintf(kt_stderr, "Indexed %u entries (%u checkpoints) to '%s'.\n", idx->num_entries, idx->num_points, opts->index_file);
+        kt_index_free(idx);
+    }
+    kt_extract_digests_close(digests);
+    return 0;
+}
+
+static int kt_add_pattern(char ***patterns, unsigned int *num_patterns, char *pattern)
+{
+    char **list;
+
+    if((list = realloc(*patterns, (*num_patterns + 1) * sizeof(*list))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate pattern list: %s.\n", strerror(errno));
+        return -1;
+    }
+    list[(*num_patterns)++] = pattern;
+    *patterns = list;
+
+    return 0;
+}
+
+// Read a list of paths (or patterns), one per line, like tar's -T. The patterns point into *buf, which the caller has to free.
+static int kt_read_file_list(const char *filename, char **buf, char ***patterns, unsigned int *num_patterns)
+{
+    FILE *list;
+    char *data = NULL;
+    char *tmp;
+    size_t size = 0;
+    size_t len = 0;
+    size_t count;
+    char *line;
+    char *eol;
+
+    if(strcmp(filename, "-") == 0)
+        list = stdin;
+    else if((list = fopen(filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open file list '%s': %s.\n", filename, strerror(errno));
+        return -1;
+    }
+    do
+    {
+        if(len + BUFFER_SIZE + 1 > size)
+        {
+            size = (size == 0 ? BUFFER_SIZE * 4 : size * 2);
+            if((tmp = realloc(data, size)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate file list: %s.\n", strerror(errno));
+                goto failure;
+            }
+            data = tmp;
+        }
+        count = fread(data + len, sizeof(char), BUFFER_SIZE, list);
+        len += count;
+    } while(count > 0);
+    if(ferror(list))
+    {
+        fprintf(kt_stderr, "Cannot read file list '%s': %s.\n", filename, strerror(errno));
+        goto failure;
+    }
+    data[len] = '\0';
+
+    // Split it in place, skipping empty lines
+    for(line = data; line < data + len; line = eol + 1)
+    {
+        if((eol = strchr(line, '\n')) == NULL)
+            eol = data + len;
+        *eol = '\0';
+        if(eol > line && *(eol - 1) == '\r')
+            *(eol - 1) = '\0';
+        if(*line != '\0' && kt_add_pattern(patterns, num_patterns, line) < 0)
+            goto failure;
+    }
+
+    if(list != stdin)
+        fclose(list);
+    *buf = data;
     return 0;
+
+failure:
+    if(list != stdin)
+        fclose(list);
+    free(data);
+    return -1;
+}
+
+int kindle_extract_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "unsigned", no_argument, NULL, 'u' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "io-uring", no_argument, NULL, 'U' },
+        { "index", no_argument, NULL, 'I' },
+        { "files-from", required_argument, NULL, 'T' },
+        { "store", required_argument, NULL, 'S' },
+        { "incremental", no_argument, NULL, 'i' },
+        { "inflate-jobs", required_argument, NULL, 'z' },
+        { "speculative", no_argument, NULL, 'Z' },
+        { "stats", no_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    ExtractOptions extract_opts;
+    char *index_file = NULL;
+    const char *list_filename = NULL;
+    char *list_buf = NULL;
+    int i;
+    int ret;
+
+    char *bin_filename;
+    char *output_dir;
+    FILE *bin_input;
+
+    memset(&extract_opts, 0, sizeof(extract_opts));
+    bin_filename = NULL;
+    output_dir = NULL;
+    while((opt = getopt_long(argc, argv, "uj:UIT:S:iz:Zs", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'u':
+                extract_opts.fake_sign = 1;
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &extract_opts.jobs) < 0)
+                    return -1;
+                break;
+            case 'U':
+                extract_opts.io_uring = 1;
+                break;
+            case 'I':
+                extract_opts.build_index = 1;
+                break;
+            case 'T':
+                list_filename = optarg;
+                break;
+            case 'S':
+                extract_opts.store = optarg;
+                break;
+            case 'i':
+                extract_opts.incremental = 1;
+                break;
+            case 'z':
+                if(parse_jobs(optarg, &extract_opts.inflate.jobs) < 0)
+                    return -1;
+                break;
+            case 'Z':
+                extract_opts.inflate.speculative = 1;
+                break;
+            case 's':
+                extract_opts.stats = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    // Guessing is pointless without anyone to guess
+    if(extract_opts.inflate.speculative && extract_opts.inflate.jobs == 0 && parse_jobs("0", &extract_opts.inflate.jobs) < 0)
+        return -1;
+
+    // We need at least 2 non-switch options (I/O), anything after that is what we want to extract
+    if(optind < argc && (optind + 2) <= argc)
+    {
+        // We know exactly what we need, and in what order
+        bin_filename = argv[optind];
+        output_dir = argv[optind + 1];
+    }
+    else
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need input & output).\n");
+        return -1;
+    }
+    // Double validation, and make GCC happy
+    if(bin_filename == NULL)
+    {
+        fprintf(kt_stderr, "Input filename isn't set!\n");
+        return -1;
+    }
+    if(output_dir == NULL)
+    {
+        fprintf(kt_stderr, "Output directory isn't set!\n");
+        return -1;
+    }
+
+    // Check that input properly ends in .bin or .stgz
+    if(!IS_BIN(bin_filename) && !IS_STGZ(bin_filename) && !IS_TARBALL(bin_filename) && !IS_TGZ(bin_filename))
+    {
+        fprintf(kt_stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' or '.tar.gz'/'.tgz' userdata package.\n", bin_filename);
+        return -1;
+    }
+    // NOTE: Do some sanity checks for output directory handling?
+    // The 'rewrite pathname entry' cheap method we currently use is pretty 'dumb' (it assumes the path is correct, creating it if need be),
+    // but the other (more correct?) way to handle this (chdir) would need some babysitting (cf. bsdtar's *_chdir() in tar/util.c)...
+    if((bin_input = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input %s package '%s': %s.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, strerror(errno));
+        return -1;
+    }
+    // The index lives right next to the package
+    if((index_file = kt_index_default_name(bin_filename)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index filename: %s.\n", strerror(errno));
+        fclose(bin_input);
+        return -1;
+    }
+    extract_opts.index_file = index_file;
+    // Gather the patterns, from the command line, and from the file list
+    if(list_filename != NULL && kt_read_file_list(list_filename, &list_buf, &extract_opts.patterns, &extract_opts.num_patterns) < 0)
+    {
+        fclose(bin_input);
+        free(index_file);
+        free(extract_opts.patterns);
+        return -1;
+    }
+    for(i = optind + 2; i < argc; i++)
+    {
+        if(kt_add_pattern(&extract_opts.patterns, &extract_opts.num_patterns, argv[i]) < 0)
+        {
+            fclose(bin_input);
+            free(index_file);
+            free(extract_opts.patterns);
+            free(list_buf);
+            return -1;
+        }
+    }
+    // Print a recap of what we're about to do
+    fprintf(kt_stderr, "Extracting %s package '%s' to '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, output_dir);
+    ret = kindle_extract(bin_input, output_dir, &extract_opts);
+    if(ret < 0)
+        fprintf(kt_stderr, "Error extracting %s package '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename);
+    fclose(bin_input);
+    free(index_file);
+    free(extract_opts.patterns);
+    free(list_buf);
+    return ret;
 }
 
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
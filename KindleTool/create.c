@@ -26,23 +26,50 @@ static int write_entry(struct kttar *, struct archive *, struct archive *, struc
 static int copy_file_data_block(struct kttar *, struct archive *, struct archive *, struct archive_entry *);
 static int create_from_archive_read_disk(struct kttar *, struct archive *, char *, int, char *, const unsigned int);
 
-int sign_file(FILE *in_file, struct rsa_private_key *rsa_pkey, FILE *sigout_file)
+// Sign whatever has been fed to hash (which is reset in the process), raw_sig needs to hold rsa_pkey->size bytes
+static int sign_hash(struct sha256_ctx *hash, struct rsa_private_key *rsa_pkey, unsigned char *raw_sig)
 {
-    unsigned char buffer[BUFFER_SIZE];
-    size_t len;
-    struct sha256_ctx hash;
     mpz_t sig;
-    // NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
-    unsigned char raw_sig[CERTIFICATE_2K_SIZE];
     size_t siglen;
 
-    // Like we just said, handle 2K keys at most!
+    // We can't use keys > 2K anyway...
     if(rsa_pkey->size > CERTIFICATE_2K_SIZE)
     {
-        fprintf(stderr, "RSA key is too large (2K at most)!\n");
+        fprintf(kt_stderr, "RSA key is too large (2K at most)!\n");
+        kt_set_error(KT_ERR_CRYPTO);
+        return -1;
+    }
+    mpz_init(sig);
+    if(!rsa_sha256_sign(rsa_pkey, hash, sig))
+    {
+        fprintf(kt_stderr, "RSA key is too small!\n");
+        kt_set_error(KT_ERR_CRYPTO);
+        mpz_clear(sig);
+        return -1;
+    }
+
+    // NOTE: mpz_out_raw outputs a format that doesn't quite fit our needs (it prepends 4 bytes of size info)... Do it ourselves with mpz_export!
+    mpz_export(raw_sig, &siglen, 1, sizeof(unsigned char *), 1, 0, sig);   // Words of the proper amount of bytes for the host, most significant word & byte first (BE), full words.
+    mpz_clear(sig);
+    // Check that the sig looks sane...
+    if(siglen * sizeof(unsigned char *) != rsa_pkey->size)
+    {
+        fprintf(kt_stderr, "Signature is too short (or too large?) for our key!\n");
+        kt_set_error(KT_ERR_CRYPTO);
         return -1;
     }
 
+    return 0;
+}
+
+int sign_file(FILE *in_file, struct rsa_private_key *rsa_pkey, FILE *sigout_file)
+{
+    unsigned char buffer[BUFFER_SIZE];
+    size_t len;
+    struct sha256_ctx hash;
+    // NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
+    unsigned char raw_sig[CERTIFICATE_2K_SIZE];
+
     sha256_init(&hash);
     while((len = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, in_file)) > 0)
     {
@@ -50,37 +77,156 @@ int sign_file(FILE *in_file, struct rsa_private_key *rsa_pkey, FILE *sigout_file
     }
     if(ferror(in_file) != 0)
     {
-        fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error reading input file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
-    mpz_init(sig);
-    if(!rsa_sha256_sign(rsa_pkey, &hash, sig))
+    if(sign_hash(&hash, rsa_pkey, raw_sig) < 0)
+        return -1;
+
+    // And finally, write our sig!
+    if(fwrite(raw_sig, sizeof(unsigned char), rsa_pkey->size, sigout_file) < rsa_pkey->size)
     {
-        fprintf(stderr, "RSA key is too small!\n");
-        mpz_clear(sig);
+        fprintf(kt_stderr, "Error writing signature file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
 
-    // NOTE: mpz_out_raw outputs a format that doesn't quite fit our needs (it prepends 4 bytes of size info)... Do it ourselves with mpz_export!
-    mpz_export(raw_sig, &siglen, 1, sizeof(unsigned char *), 1, 0, sig);   // Words of the proper amount of bytes for the host, most significant word & byte first (BE), full words.
-    mpz_clear(sig);
-    // Check that the sig looks sane...
-    if(siglen * sizeof(unsigned char *) != rsa_pkey->size)
+    return 0;
+}
+
+// Hash a file we're about to archive (MD5 for the bundlefile, SHA-256 for its signature, and to spot duplicates)
+static int hash_content(int start_fd, const char *path, unsigned char *buff, size_t buff_size, KTTarContent *content)
+{
+    struct md5_ctx md5;
+    uint8_t md5_digest_buf[MD5_DIGEST_SIZE];
+    struct sha256_ctx sha256;
+    FILE *file;
+    size_t len;
+    int fd;
+
+    // We might not be able to open it while libarchive has it open (on non POSIX systems), we'll just do it the usual way later, then
+    if((fd = kt_walk_open(start_fd, path, O_RDONLY)) < 0)
+        return -1;
+    if((file = fdopen(fd, "rb")) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    md5_init(&md5);
+    sha256_init(&content->hash);
+    while((len = fread(buff, sizeof(unsigned char), buff_size, file)) > 0)
+    {
+        md5_update(&md5, len, buff);
+        sha256_update(&content->hash, len, buff);
+    }
+    if(ferror(file) != 0)
     {
-        fprintf(stderr, "Signature is too short (or too large?) for our key!\n");
+        fclose(file);
         return -1;
     }
+    fclose(file);
+    md5_digest(&md5, MD5_DIGEST_SIZE, md5_digest_buf);
+    base16_encode_update(content->md5, MD5_DIGEST_SIZE, md5_digest_buf);
+    content->md5[MD5_HASH_LENGTH] = '\0';
+    // Keep the context intact for the signature
+    sha256 = content->hash;
+    sha256_digest(&sha256, SHA256_DIGEST_SIZE, content->sha256);
 
-    // And finally, write our sig!
-    if(fwrite(raw_sig, sizeof(unsigned char), rsa_pkey->size, sigout_file) < rsa_pkey->size)
+    return 0;
+}
+
+// Sign a file we hashed during the walk, the copies of the same content share the signature of the first one
+static int sign_content(struct kttar *kttar, const KTTarContent *content, struct rsa_private_key *rsa_pkey, FILE *sigout_file)
+{
+    KTTarContent *first = &kttar->contents[content->first];
+    struct sha256_ctx hash;
+
+    if(first->sig == NULL)
+    {
+        if((first->sig = malloc(CERTIFICATE_2K_SIZE)) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate memory for a signature.\n");
+            kt_set_error(KT_ERR_NOMEM);
+            return -1;
+        }
+        hash = first->hash;
+        if(sign_hash(&hash, rsa_pkey, first->sig) < 0)
+        {
+            free(first->sig);
+            first->sig = NULL;
+            return -1;
+        }
+    }
+    if(fwrite(first->sig, sizeof(unsigned char), rsa_pkey->size, sigout_file) < rsa_pkey->size)
     {
-        fprintf(stderr, "Error writing signature file: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error writing signature file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
 
     return 0;
 }
 
+static void free_contents(struct kttar *kttar)
+{
+    unsigned int i;
+
+    if(kttar->contents == NULL)
+        return;
+    for(i = 0; i < kttar->num_contents; i++)
+        free(kttar->contents[i].sig);
+    free(kttar->contents);
+    kt_hash_table_free(&kttar->content_table);
+}
+
+// A SHA-256 is about as good a hash as it gets, its first bytes will do
+static size_t content_slot(const uint8_t *sha256)
+{
+    size_t slot;
+
+    memcpy(&slot, sha256, sizeof(slot));
+    return slot;
+}
+
+static size_t content_hash(void *arg, size_t index)
+{
+    const struct kttar *kttar = arg;
+
+    return content_slot(kttar->contents[index].sha256);
+}
+
+static int content_match(void *arg, size_t index, const void *sha256, size_t len)
+{
+    const struct kttar *kttar = arg;
+
+    return memcmp(kttar->contents[index].sha256, sha256, len) == 0;
+}
+
+// Look for a first copy of the same content, returns its index in to_sign_and_bundle_list, or -1
+static int find_content(const struct kttar *kttar, const KTTarContent *content)
+{
+    size_t index;
+
+    if((index = kt_hash_table_find(&kttar->content_table, content_slot(content->sha256), content->sha256, SHA256_DIGEST_SIZE)) == KT_HASH_NONE)
+        return -1;
+    return (int) index;
+}
+
+// Remember the content of contents[index] as a first copy
+static int add_content(struct kttar *kttar, size_t index)
+{
+    if(kt_hash_table_insert(&kttar->content_table, index) < 0)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory for the duplicate lookup table.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    kttar->num_unique++;
+
+    return 0;
+}
+
 // As usual, largely based on libarchive's doc, examples, and source ;)
 static int metadata_filter(struct archive *a, void *_data __attribute__((unused)), struct archive_entry *entry)
 {
@@ -99,29 +245,29 @@ static int metadata_filter(struct archive *a, void *_data __attribute__((unused)
         // Exclude *.sig files in a case insensitive way, to avoid duplicates
         matching = archive_match_new();
         if(archive_match_exclude_pattern(matching, "./*\\.[Ss][Ii][Gg]$") != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+            fprintf(kt_stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
         // Exclude *.dat too, to avoid ending up with multiple bundlefiles!
         if(archive_match_exclude_pattern(matching, "./*\\.[Dd][Aa][Tt]$") != ARCHIVE_OK)    // NOTE: If we wanted to be more lenient, we could exclude "./update*\\.[Dd][Aa][Tt]$" instead
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+            fprintf(kt_stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
         // Exclude *nix hidden files, too?
         // NOTE: The ARCHIVE_READDISK_MAC_COPYFILE flag for read_disk is disabled by default, so we should already be creating 'sane' archives on OS X, without the crazy ._* acl/xattr files ;)
         // On the other hand, if the user passed us a self-built tarball, we can't do anything about it. OS X users: export COPYFILE_DISABLE=1 is your friend!
         /*
         if(archive_match_exclude_pattern(matching, "./\\.*$") != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+            fprintf(kt_stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
         */
 
         r = archive_match_path_excluded(matching, entry);
         if(r < 0)
         {
-            fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
+            fprintf(kt_stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
             archive_match_free(matching);
             return 0;
         }
         if(r)
         {
             // Skip original bundle/sig files to avoid duplicates
-            fprintf(stderr, "! %s\n", archive_entry_pathname(entry));
+            fprintf(kt_stderr, "! %s\n", archive_entry_pathname(entry));
             archive_match_free(matching);
             return 0;
         }
@@ -150,7 +296,8 @@ static int write_entry(struct kttar *kttar, struct archive *a, struct archive *i
     e = archive_write_header(a, entry);
     if(e != ARCHIVE_OK)
     {
-        fprintf(stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
+        fprintf(kt_stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
     }
 
     if(e == ARCHIVE_FATAL)
@@ -199,13 +346,13 @@ static int copy_file_data_block(struct kttar *kttar, struct archive *a, struct a
                 if(bytes_written < 0)
                 {
                     // Write failed; this is bad
-                    fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+                    fprintf(kt_stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
                     return -1;
                 }
                 if((size_t)bytes_written < ns)
                 {
                     // Write was truncated; warn but continue.
-                    fprintf(stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
+                    fprintf(kt_stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
                     return 0;
                 }
                 progress += bytes_written;
@@ -217,20 +364,20 @@ static int copy_file_data_block(struct kttar *kttar, struct archive *a, struct a
         if(bytes_written < 0)
         {
             // Write failed; this is bad
-            fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+            fprintf(kt_stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
             return -1;
         }
         if((size_t)bytes_written < bytes_read)
         {
             // Write was truncated; warn but continue.
-            fprintf(stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
+            fprintf(kt_stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
             return 0;
         }
         progress += bytes_written;
     }
     if(r < ARCHIVE_WARN)
     {
-        fprintf(stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
+        fprintf(kt_stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
         return -1;
     }
     return 0;
@@ -244,6 +391,9 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
     unsigned int is_kernel = 0;
     char *original_path = NULL;
     char *tweaked_path = NULL;
+    KTTarContent content;
+    int dup;
+    int start_fd = -1;
 
     struct archive *disk;
     struct archive_entry *entry;
@@ -259,12 +409,18 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
     }
     archive_read_disk_set_standard_lookup(disk);
 
+    // We hash files as we go to spot duplicates, and the walk moves the working directory around
+    if(first_pass && kttar->dedup)
+        start_fd = kt_walk_start();
+
     r = archive_read_disk_open(disk, input_filename);
     if(r != ARCHIVE_OK)
     {
-        fprintf(stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+        fprintf(kt_stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+        kt_set_error(KT_ERR_ARCHIVE);
         archive_read_free(disk);
         archive_entry_free(entry);
+        kt_walk_end(start_fd);
         return 1;
     }
 
@@ -276,15 +432,15 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
             break;
         else if(r != ARCHIVE_OK)
         {
-            fprintf(stderr, "archive_read_next_header2() failed: %s", archive_error_string(disk));
+            fprintf(kt_stderr, "archive_read_next_header2() failed: %s", archive_error_string(disk));
             if(r == ARCHIVE_FATAL)
             {
-                fprintf(stderr, " (FATAL).\n");
+                fprintf(kt_stderr, " (FATAL).\n");
                 goto cleanup;
             }
             else if(r < ARCHIVE_WARN)
             {
-                fprintf(stderr, " (FAILED).\n");
+                fprintf(kt_stderr, " (FAILED).\n");
                 // NOTE: We don't want to end up with an incomplete archive, abort.
                 goto cleanup;
             }
@@ -305,7 +461,7 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
                 if(archive_entry_filetype(entry) == AE_IFDIR && strlen(archive_entry_pathname(entry)) <= kttar->tweak_pointer_index)
                 {
                     // Print what we're stripping, ala GNU tar...
-                    fprintf(stderr, "kindletool: Removing leading '%s/' from member names.\n", archive_entry_pathname(entry));
+                    fprintf(kt_stderr, "kindletool: Removing leading '%s/' from member names.\n", archive_entry_pathname(entry));
                     // Just skip it, we don't need a redundant and explicit root directory entry in our tarball...
                     archive_read_disk_descend(disk);
                     continue;
@@ -377,8 +533,34 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
         }
 
         archive_read_disk_descend(disk);
+
+        // If we've already archived the same content, just point to it
+        dup = -1;
+        if(first_pass && kttar->dedup && archive_entry_filetype(entry) == AE_IFREG)
+        {
+            memset(&content, 0, sizeof(content));
+            content.first = -1;
+            if(hash_content(start_fd, archive_entry_sourcepath(entry), kttar->buff, kttar->buff_size, &content) == 0)
+            {
+                if((dup = find_content(kttar, &content)) >= 0)
+                {
+                    archive_entry_set_hardlink(entry, kttar->tweaked_to_sign_and_bundle_list[dup]);
+                    archive_entry_set_size(entry, 0);
+                    content.first = dup;
+                }
+                else
+                {
+                    // We'll be the first copy
+                    content.first = (int) kttar->sign_and_bundle_index;
+                }
+            }
+        }
+
         // Print what we're adding, ala bsdtar
-        fprintf(stderr, "a %s%s\n", archive_entry_pathname(entry), (is_kernel ? "\t\t|<" : (is_exec ? "\t\t<-" : "")));
+        if(dup >= 0)
+            fprintf(kt_stderr, "a %s link to %s\n", archive_entry_pathname(entry), kttar->tweaked_to_sign_and_bundle_list[dup]);
+        else
+            fprintf(kt_stderr, "a %s%s\n", archive_entry_pathname(entry), (is_kernel ? "\t\t|<" : (is_exec ? "\t\t<-" : "")));
 
         // Write our entry to the archive, completely through libarchive, to avoid having to open our entry file again, which would fail on non POSIX systems...
         if(write_file(kttar, a, disk, entry) != 0)
@@ -407,6 +589,15 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
                     kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(archive_entry_pathname(entry));
                     kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(archive_entry_pathname(entry));
                 }
+                if(kttar->dedup)
+                {
+                    kttar->contents = realloc(kttar->contents, ++kttar->num_contents * sizeof(*kttar->contents));
+                    kttar->contents[kttar->num_contents - 1] = content;
+                    if(dup >= 0)
+                        kttar->num_linked++;
+                    else if(content.first >= 0 && add_content(kttar, kttar->num_contents - 1) < 0)
+                        goto cleanup;
+                }
             }
         }
         else
@@ -421,6 +612,7 @@ static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a,
     archive_read_close(disk);
     archive_read_free(disk);
     archive_entry_free(entry);
+    kt_walk_end(start_fd);
 
     return 0;
 
@@ -430,17 +622,19 @@ cleanup:
     archive_read_close(disk);
     archive_read_free(disk);
     archive_entry_free(entry);
+    kt_walk_end(start_fd);
 
     return 1;
 }
 
 // Archiving code inspired from libarchive tar/write.c ;).
-int kindle_create_package_archive(const int outfd, char **filename, const unsigned int total_files, struct rsa_private_key *rsa_pkey_file, const unsigned int legacy, const unsigned int real_blocksize)
+int kindle_create_package_archive(const int outfd, char **filename, const unsigned int total_files, struct rsa_private_key *rsa_pkey_file, const unsigned int legacy, const unsigned int real_blocksize, const unsigned int dedup)
 {
     struct archive *a;
     struct kttar *kttar, kttar_storage;
     unsigned int i;
-    FILE *file;
+    FILE *file = NULL;
+    KTTarContent *content;
     FILE *sigfile;
     char md5[MD5_HASH_LENGTH + 1];
     uint8_t bundlefile_status = 0;
@@ -448,7 +642,7 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
     char *signame = NULL;
     char sigabsolutepath[] = KT_TMPDIR "/kindletool_create_sig_XXXXXX";
     int sigfd;
-    char *pathnamecpy = NULL;
+    char displayname[PATH_MAX];
     char bundle_filename[] = KT_TMPDIR "/kindletool_create_idx_XXXXXX";
     int bundle_fd = -1;
     FILE *bundlefile = NULL;
@@ -457,6 +651,8 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
     // Use a pointer for consistency, but stack-allocated storage for ease of cleanup.
     kttar = &kttar_storage;
     memset(kttar, 0, sizeof(*kttar));
+    kttar->dedup = dedup;
+    kt_hash_table_init(&kttar->content_table, content_hash, content_match, kttar);
     // Choose a suitable copy buffer size
     kttar->buff_size = 64 * 1024;
     while(kttar->buff_size < (size_t) DEFAULT_BYTES_PER_BLOCK)
@@ -467,7 +663,8 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
     // Allocate a buffer for file data.
     if((kttar->buff = malloc(kttar->buff_size)) == NULL)
     {
-        fprintf(stderr, "Cannot allocate memory for archive copy buffer.\n");
+        fprintf(kt_stderr, "Cannot allocate memory for archive copy buffer.\n");
+        kt_set_error(KT_ERR_NOMEM);
         return 1;
     }
 
@@ -506,7 +703,7 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
 #if defined(_WIN32) && !defined(__CYGWIN__)
     if(_mktemp(bundle_filename) == NULL)
     {
-        fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
         goto cleanup;
     }
     bundle_fd = open(bundle_filename, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
@@ -515,12 +712,14 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
 #endif
     if(bundle_fd == -1)
     {
-        fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         goto cleanup;
     }
     if((bundlefile = fdopen(bundle_fd, "wb+")) == NULL)
     {
-        fprintf(stderr, "Cannot open temp bundlefile '%s' for writing: %s.\n", bundle_filename, strerror(errno));
+        fprintf(kt_stderr, "Cannot open temp bundlefile '%s' for writing: %s.\n", bundle_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
         close(bundle_fd);
         unlink(bundle_filename);
         goto cleanup;
@@ -563,20 +762,31 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
                 stat(kttar->to_sign_and_bundle_list[i], &st);
             }
 
+            // If we hashed it during the walk, we don't even need to read it again
+            content = NULL;
+            file = NULL;
+            if(i < kttar->num_contents && kttar->contents[i].first >= 0)
+                content = &kttar->contents[i];
+
             // Go on as usual, hash, sign & bundle :)
-            if((file = fopen(kttar->to_sign_and_bundle_list[i], "rb")) == NULL)
+            if(content == NULL && (file = fopen(kttar->to_sign_and_bundle_list[i], "rb")) == NULL)
             {
-                fprintf(stderr, "Cannot open '%s' for reading: %s!\n", kttar->to_sign_and_bundle_list[i], strerror(errno));
+                fprintf(kt_stderr, "Cannot open '%s' for reading: %s!\n", kttar->to_sign_and_bundle_list[i], strerror(errno));
+                kt_set_error(KT_ERR_IO);
                 // Avoid a double free (beginning from the second iteration, since we freed signame at the end of the first iteration, but it's not allocated yet, and cleanup will try to free...)
                 signame = NULL;
                 goto cleanup;
             }
             // Don't hash our bundlefile
-            if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
+            if(content != NULL)
+            {
+                memcpy(md5, content->md5, sizeof(md5));
+            }
+            else if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
             {
                 if(md5_sum(file, md5) != 0)
                 {
-                    fprintf(stderr, "Cannot calculate hash sum for '%s'.\n", kttar->to_sign_and_bundle_list[i]);
+                    fprintf(kt_stderr, "Cannot calculate hash sum for '%s'.\n", kttar->to_sign_and_bundle_list[i]);
                     fclose(file);
                     // Avoid a double free, bis.
                     signame = NULL;
@@ -608,8 +818,9 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
 #if defined(_WIN32) && !defined(__CYGWIN__)
             if(_mktemp(sigabsolutepath) == NULL)
             {
-                fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
-                fclose(file);
+                fprintf(kt_stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+                if(file != NULL)
+                    fclose(file);
                 goto cleanup;
             }
             sigfd = open(sigabsolutepath, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
@@ -618,22 +829,25 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
 #endif
             if(sigfd == -1)
             {
-                fprintf(stderr, "Couldn't open temporary signature file: %s.\n", strerror(errno));
-                fclose(file);
+                fprintf(kt_stderr, "Couldn't open temporary signature file: %s.\n", strerror(errno));
+                if(file != NULL)
+                    fclose(file);
                 goto cleanup;
             }
             if((sigfile = fdopen(sigfd, "wb")) == NULL)
             {
-                fprintf(stderr, "Cannot open temp signature file '%s' for writing: %s.\n", signame, strerror(errno));
-                fclose(file);
+                fprintf(kt_stderr, "Cannot open temp signature file '%s' for writing: %s.\n", signame, strerror(errno));
+                if(file != NULL)
+                    fclose(file);
                 close(sigfd);
                 unlink(sigabsolutepath);
                 goto cleanup;
             }
-            if(sign_file(file, rsa_pkey_file, sigfile) < 0)
+            if((content != NULL ? sign_content(kttar, content, rsa_pkey_file, sigfile) : sign_file(file, rsa_pkey_file, sigfile)) < 0)
             {
-                fprintf(stderr, "Cannot sign '%s'.\n", kttar->to_sign_and_bundle_list[i]);
-                fclose(file);
+                fprintf(kt_stderr, "Cannot sign '%s'.\n", kttar->to_sign_and_bundle_list[i]);
+                if(file != NULL)
+                    fclose(file);
                 fclose(sigfile);
                 unlink(sigabsolutepath);   // Delete empty/broken sigfile
                 goto cleanup;
@@ -643,27 +857,26 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
             if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
             {
                 // The last field is a display name, take a hint from the Python tool, and use the file's basename with a simple suffix
-                // Use a copy of to_sign_and_bundle_list[i] to get our basename, since the POSIX implementation may alter its arg, and that would be very bad...
-                // And we're using the tweaked pathname in case we're in legacy mode ;)
-                pathnamecpy = strdup(kttar->to_sign_and_bundle_list[i]);
+                // Use our reentrant basename, since the POSIX implementation may alter its arg and/or use a static buffer, and that would be very bad...
+                kt_basename(kttar->to_sign_and_bundle_list[i], displayname, sizeof(displayname));
                 // Only flag kernels in recovery update...
                 // FWIW, the format is as follows: file_type_id md5sum file_name blocksize file_display_name
                 // where the id is 1 for kernel images (in recovery updates only), 129 for install scripts, and 128 for assets, and the blocksize is based on the file size relative to the update type blocksize.
-                if(fprintf(bundlefile, "%d %s %s %lld %s_ktool_file\n", ((real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(kttar->to_sign_and_bundle_list[i]) ? 1 : (IS_SCRIPT(kttar->to_sign_and_bundle_list[i]) || IS_SHELL(kttar->to_sign_and_bundle_list[i])) ? 129 : 128)), md5, kttar->tweaked_to_sign_and_bundle_list[i], (long long) st.st_size / real_blocksize, basename(pathnamecpy)) < 0)
+                if(fprintf(bundlefile, "%d %s %s %lld %s_ktool_file\n", ((real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(kttar->to_sign_and_bundle_list[i]) ? 1 : (IS_SCRIPT(kttar->to_sign_and_bundle_list[i]) || IS_SHELL(kttar->to_sign_and_bundle_list[i])) ? 129 : 128)), md5, kttar->tweaked_to_sign_and_bundle_list[i], (long long) st.st_size / real_blocksize, displayname) < 0)
                 {
-                    fprintf(stderr, "Cannot write to index file.\n");
+                    fprintf(kt_stderr, "Cannot write to index file.\n");
                     // Cleanup a bit before crapping out
-                    fclose(file);
+                    if(file != NULL)
+                        fclose(file);
                     fclose(sigfile);
                     unlink(sigabsolutepath);
-                    free(pathnamecpy);
                     goto cleanup;
                 }
-                free(pathnamecpy);
             }
 
             // Cleanup
-            fclose(file);
+            if(file != NULL)
+                fclose(file);
             fclose(sigfile);
         }
 
@@ -680,6 +893,7 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
     }
 
     free(kttar->buff);
+    free_contents(kttar);
     for(i = 0; i < kttar->sign_and_bundle_index; i++)
         free(kttar->to_sign_and_bundle_list[i]);
     free(kttar->to_sign_and_bundle_list);
@@ -689,19 +903,22 @@ int kindle_create_package_archive(const int outfd, char **filename, const unsign
     archive_write_close(a);
     archive_write_free(a);
 
+    if(kttar->dedup)
+        fprintf(kt_stderr, "Archived %u duplicate files as hardlinks to %u unique files.\n", kttar->num_linked, kttar->num_unique);
+
     // Print a warning if no script was detected (in an OTA update)...
     if(!kttar->has_script && real_blocksize == BLOCK_SIZE)
     {
-        fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-        fprintf(stderr, "@ No script was detected in your input, this update package won't do a thing! @\n");
-        fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+        fprintf(kt_stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+        fprintf(kt_stderr, "@ No script was detected in your input, this update package won't do a thing! @\n");
+        fprintf(kt_stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
     }
     // If we're building a recovery update, warn that this possibly isn't the brightest idea, given the very specific requirements...
     if(real_blocksize == RECOVERY_BLOCK_SIZE)
     {
-        fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
-        fprintf(stderr, "@ You're building a recovery update from scratch! Make sure you know what you're doing... @\n");
-        fprintf(stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+        fprintf(kt_stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
+        fprintf(kt_stderr, "@ You're building a recovery update from scratch! Make sure you know what you're doing... @\n");
+        fprintf(kt_stderr, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@\n");
     }
 
     return 0;
@@ -725,6 +942,7 @@ cleanup:
     free(signame);
     // The big stuff, too...
     free(kttar->buff);
+    free_contents(kttar);
     if(kttar->sign_and_bundle_index > 0)
     {
         for(i = 0; i < kttar->sign_and_bundle_index; i++)
@@ -750,12 +968,12 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
         case OTAUpdateV2:
             if((temp = tmpfile()) == NULL)
             {
-                fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
+                fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
                 return -1;
             }
             if(kindle_create_ota_update_v2(info, input_tgz, temp, fake_sign) < 0) // Create the update
             {
-                fprintf(stderr, "Error creating update package.\n");
+                fprintf(kt_stderr, "Error creating update package.\n");
                 fclose(temp);
                 return -1;
             }
@@ -764,7 +982,7 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             {
                 if(kindle_create_signature(info, temp, output) < 0) // Write the signature (unless we asked for an unsigned package)
                 {
-                    fprintf(stderr, "Error signing update package.\n");
+                    fprintf(kt_stderr, "Error signing update package.\n");
                     fclose(temp);
                     return -1;
                 }
@@ -775,14 +993,14 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             {
                 if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
                 {
-                    fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
+                    fprintf(kt_stderr, "Error writing update to output: %s.\n", strerror(errno));
                     fclose(temp);
                     return -1;
                 }
             }
             if(ferror(temp) != 0)
             {
-                fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
+                fprintf(kt_stderr, "Error reading generated update: %s.\n", strerror(errno));
                 fclose(temp);
                 return -1;
             }
@@ -799,12 +1017,12 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
         case RecoveryUpdateV2:
             if((temp = tmpfile()) == NULL)
             {
-                fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
+                fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
                 return -1;
             }
             if(kindle_create_recovery_v2(info, input_tgz, temp, fake_sign) < 0)
             {
-                fprintf(stderr, "Error creating update package.\n");
+                fprintf(kt_stderr, "Error creating update package.\n");
                 fclose(temp);
                 return -1;
             }
@@ -813,7 +1031,7 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             {
                 if(kindle_create_signature(info, temp, output) < 0)
                 {
-                    fprintf(stderr, "Error signing update package.\n");
+                    fprintf(kt_stderr, "Error signing update package.\n");
                     fclose(temp);
                     return -1;
                 }
@@ -823,14 +1041,14 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             {
                 if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
                 {
-                    fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
+                    fprintf(kt_stderr, "Error writing update to output: %s.\n", strerror(errno));
                     fclose(temp);
                     return -1;
                 }
             }
             if(ferror(temp) != 0)
             {
-                fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
+                fprintf(kt_stderr, "Error reading generated update: %s.\n", strerror(errno));
                 fclose(temp);
                 return -1;
             }
@@ -842,7 +1060,7 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             // We only need to sign the input tarball...
             if(kindle_create_signature(info, input_tgz, output) < 0)
             {
-                fprintf(stderr, "Error signing userdata package.\n");
+                fprintf(kt_stderr, "Error signing userdata package.\n");
                 return -1;
             }
             rewind(input_tgz);
@@ -851,65 +1069,29 @@ int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const
             {
                 if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
                 {
-                    fprintf(stderr, "Error appending userdata tarball to output: %s.\n", strerror(errno));
+                    fprintf(kt_stderr, "Error appending userdata tarball to output: %s.\n", strerror(errno));
                     return -1;
                 }
             }
             if(ferror(input_tgz) != 0)
             {
-                fprintf(stderr, "Error reading original userdata tarball update: %s.\n", strerror(errno));
+                fprintf(kt_stderr, "Error reading original userdata tarball update: %s.\n", strerror(errno));
                 return -1;
             }
             return 0;
             break;
         case UnknownUpdate:
         default:
-            fprintf(stderr, "Unknown update type.\n");
+            fprintf(kt_stderr, "Unknown update type.\n");
             break;
     }
     return -1;
 }
 
-int kindle_create_ota_update_v2(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
+// Hash the payload, write the header, and the (munged) payload. This is the part every kind of bundle has in common.
+int kindle_create_bundle(KTHeader *header, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
 {
-    size_t header_size;
-    unsigned char *header;
-    size_t hindex;
-    int i;
     FILE *demunged_tgz;
-    size_t str_len;
-
-    demunged_tgz = NULL;
-
-    // First part of the set sized data
-    header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_V2_BLOCK_SIZE;
-    header = malloc(header_size);
-    hindex = 0;
-    strncpy((char *)header, info->magic_number, MAGIC_NUMBER_LENGTH);
-    hindex += MAGIC_NUMBER_LENGTH;
-    memcpy(&header[hindex], &info->source_revision, sizeof(uint64_t)); // Source
-    hindex += sizeof(uint64_t);
-    memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t)); // Target
-    hindex += sizeof(uint64_t);
-    memcpy(&header[hindex], &info->num_devices, sizeof(uint16_t)); // Device count
-    hindex += sizeof(uint16_t);
-
-    // Next, we write the devices
-    header_size += info->num_devices * sizeof(uint16_t);
-    header = realloc(header, header_size);
-    for(i = 0; i < info->num_devices; i++)
-    {
-        memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t)); // Device
-        hindex += sizeof(uint16_t);
-    }
-
-    // Part two of the set sized data
-    header_size += OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
-    header = realloc(header, header_size);
-    memcpy(&header[hindex], &info->critical, sizeof(uint8_t)); // Critical
-    hindex += sizeof(uint8_t);
-    memset(&header[hindex], 0, sizeof(uint8_t)); // 1 byte padding
-    hindex += sizeof(uint8_t);
 
     // Even if we asked for a fake package, the Kindle still expects a proper package...
     // Sum a temp deobfuscated tarball to fake it ;)
@@ -917,306 +1099,298 @@ int kindle_create_ota_update_v2(UpdateInformation *info, FILE *input_tgz, FILE *
     {
         if((demunged_tgz = tmpfile()) == NULL)
         {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            free(header);
+            fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
             return -1;
         }
         demunger(input_tgz, demunged_tgz, 0, 0);
         rewind(input_tgz);
         rewind(demunged_tgz);
-        if(md5_sum(demunged_tgz, (char *)&header[hindex]) < 0)
+        if(md5_sum(demunged_tgz, header->md5_sum) < 0)
         {
-            fprintf(stderr, "Error calculating MD5 of fake package.\n");
-            free(header);
+            fprintf(kt_stderr, "Error calculating MD5 of fake package.\n");
+            fclose(demunged_tgz);
             return -1;
         }
         fclose(demunged_tgz);
     }
     else
     {
-        if(md5_sum(input_tgz, (char *)&header[hindex]) < 0) // md5 hash
+        if(md5_sum(input_tgz, header->md5_sum) < 0) // md5 hash
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            free(header);
+            fprintf(kt_stderr, "Error calculating MD5 of package.\n");
             return -1;
         }
         rewind(input_tgz); // Reset input for later reading
     }
 
-    md(&header[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
-    hindex += MD5_HASH_LENGTH;
-    memcpy(&header[hindex], &info->num_meta, sizeof(uint16_t)); // num_meta, cannot be casted
-    hindex += sizeof(uint16_t);
-
-    // Next, we write the meta strings
-    for(i = 0; i < info->num_meta; i++)
-    {
-        str_len = strlen(info->metastrings[i]);
-        header_size += str_len + sizeof(uint16_t);
-        header = realloc(header, header_size);
-        // String length: little endian -> big endian
-        // FIXME: While otaup expects this endianness switch, it would seem that otacheck doesn't, and chokes with an headerTooShortInMetadataField error as soon as we pass more than one metastring...
-        //        If we don't switch the endianness, otacheck passes, but otaup chokes... >_<"
-        memcpy(&header[hindex], &((uint8_t *)&str_len)[1], sizeof(uint8_t));
-        hindex += sizeof(uint8_t);
-        memcpy(&header[hindex], &((uint8_t *)&str_len)[0], sizeof(uint8_t));
-        hindex += sizeof(uint8_t);
-        md((unsigned char *)info->metastrings[i], str_len); // Obfuscate meta string
-        // FIXME: Should this really be munged? Following otaup would point to yes, but I've never seen an update with meta strings in the wild, and the aforementionned issue with the string length doesn't help...
-        strncpy((char *)&header[hindex], info->metastrings[i], str_len);
-        hindex += str_len;
-    }
-
-    // Now, we write the header to the file
-    if(fwrite(header, sizeof(unsigned char), header_size, output) < header_size)
-    {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-        free(header);
+    // Now, we write the header to the file (the codec takes care of the obfuscation)
+    if(kt_header_write(header, output) < 0)
         return -1;
-    }
 
     // Write the actual update
-    free(header);
     return munger(input_tgz, output, 0, fake_sign);
 }
 
-int kindle_create_signature(UpdateInformation *info, FILE *input_bin, FILE *output)
+int kindle_create_ota_update_v2(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
 {
-    UpdateHeader header; // Header to write
+    KTHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);
+    header.version = OTAUpdateV2;
+    header.source_revision = info->source_revision;
+    header.target_revision = info->target_revision;
+    header.num_devices = info->num_devices;
+    header.device_list = info->devices;
+    header.critical = info->critical;
+    header.num_meta = info->num_meta;
+    header.metastrings = info->metastrings;
+
+    return kindle_create_bundle(&header, input_tgz, output, fake_sign);
+}
 
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
-    strncpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH); // Write magic number
-    header.data.signature.certificate_number = (uint32_t)info->certificate_number; // 4 byte certificate number
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE)
-    {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+// Wrap input_bin in an SP01 envelope: its header, then the signature of the whole of input_bin (which the caller appends)
+int kindle_create_envelope(uint32_t certificate_number, struct rsa_private_key *rsa_pkey, FILE *input_bin, FILE *output)
+{
+    KTHeader header; // Header to write
+
+    memset(&header, 0, sizeof(header)); // Zero init
+    memcpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH); // Write magic number
+    header.version = UpdateSignature;
+    header.certificate_number = certificate_number; // 4 byte certificate number
+    if(kt_header_write(&header, output) < 0)
         return -1;
-    }
     // Write signature to output
-    if(sign_file(input_bin, &info->sign_pkey, output) < 0)
+    if(sign_file(input_bin, rsa_pkey, output) < 0)
     {
-        fprintf(stderr, "Error signing update package payload.\n");
+        fprintf(kt_stderr, "Error signing update package payload.\n");
         return -1;
     }
     return 0;
 }
 
-int kindle_create_ota_update(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
+// A bundle in an SP01 envelope, for when the header & the tarball are already set: build it in a tempfile, sign it, and append it
+int kindle_create_signed_bundle(KTHeader *header, FILE *input_tgz, FILE *output, uint32_t certificate_number, struct rsa_private_key *rsa_pkey)
 {
-    UpdateHeader header;
-    FILE *obfuscated_tgz;
-
-    obfuscated_tgz = NULL;
-
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
-    strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
-    header.data.ota_update.source_revision = (uint32_t)info->source_revision; // Source
-    header.data.ota_update.target_revision = (uint32_t)info->target_revision; // Target
-    header.data.ota_update.device = (uint16_t)info->devices[0]; // Device
-    header.data.ota_update.optional = (unsigned char)info->optional; // Optional
+    unsigned char buffer[BUFFER_SIZE];
+    size_t count;
+    FILE *temp;
 
-    if(fake_sign)
+    if((temp = tmpfile()) == NULL)
     {
-        if((obfuscated_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            return -1;
-        }
-        demunger(input_tgz, obfuscated_tgz, 0, 0);
-        rewind(input_tgz);
-        rewind(obfuscated_tgz);
-        if(md5_sum(obfuscated_tgz, header.data.ota_update.md5_sum) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            return -1;
-        }
-        fclose(obfuscated_tgz);
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
     }
-    else
+    if(kindle_create_bundle(header, input_tgz, temp, 0) < 0)
+    {
+        fclose(temp);
+        return -1;
+    }
+    rewind(temp);
+    if(kindle_create_envelope(certificate_number, rsa_pkey, temp, output) < 0)
+    {
+        fclose(temp);
+        return -1;
+    }
+    rewind(temp);
+    while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0)
     {
-        if(md5_sum(input_tgz, header.data.ota_update.md5_sum) < 0)
+        if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
         {
-            fprintf(stderr, "Error calculating MD5 of input tgz.\n");
+            fprintf(kt_stderr, "Error writing update to output: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            fclose(temp);
             return -1;
         }
-        rewind(input_tgz); // Rewind input
     }
-    md((unsigned char *)header.data.ota_update.md5_sum, MD5_HASH_LENGTH); // Obfuscate md5 hash
-
-    // Write header to output
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE)
+    if(ferror(temp) != 0)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error reading generated update: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(temp);
         return -1;
     }
+    fclose(temp);
+    return 0;
+}
 
-    // Write package to output
-    return munger(input_tgz, output, 0, fake_sign);
+int kindle_create_signature(UpdateInformation *info, FILE *input_bin, FILE *output)
+{
+    return kindle_create_envelope((uint32_t)info->certificate_number, &info->sign_pkey, input_bin, output);
 }
 
-int kindle_create_recovery(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
+int kindle_create_ota_update(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
 {
-    UpdateHeader header;
-    FILE *obfuscated_tgz;
+    KTHeader header;
+
+    memset(&header, 0, sizeof(header)); // Zero init
+    memcpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
+    header.version = OTAUpdate;
+    header.source_revision = (uint32_t)info->source_revision; // Source
+    header.target_revision = (uint32_t)info->target_revision; // Target
+    header.device = (uint16_t)info->devices[0]; // Device
+    header.optional = (unsigned char)info->optional; // Optional
 
-    obfuscated_tgz = NULL;
+    return kindle_create_bundle(&header, input_tgz, output, fake_sign);
+}
+
+int kindle_create_recovery(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
+{
+    KTHeader header;
 
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
+    memset(&header, 0, sizeof(header)); // Zero init
 
-    strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
-    header.data.recovery_update.magic_1 = (uint32_t)info->magic_1; // Magic 1
-    header.data.recovery_update.magic_2 = (uint32_t)info->magic_2; // Magic 2
-    header.data.recovery_update.minor = (uint32_t)info->minor; // Minor
+    memcpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
+    header.version = RecoveryUpdate;
+    header.magic_1 = (uint32_t)info->magic_1; // Magic 1
+    header.magic_2 = (uint32_t)info->magic_2; // Magic 2
+    header.minor = (uint32_t)info->minor; // Minor
 
     // Handle FB02 with a V2 Header Rev. Different length, but still fixed...
     if(info->header_rev == 2)
     {
         // NOTE: It expects some new stuff that I'm not too sure about... Here be dragons.
-        header.data.recovery_h2_update.platform = (uint32_t)info->platform;
-        header.data.recovery_h2_update.header_rev = (uint32_t)info->header_rev;
-        header.data.recovery_h2_update.board = (uint32_t)info->board;
+        header.platform = (uint32_t)info->platform;
+        header.header_rev = (uint32_t)info->header_rev;
+        header.board = (uint32_t)info->board;
     }
     else
     {
         // Assume what we did before was okay, and put a device id in there...
-        header.data.recovery_update.device = (uint32_t)info->devices[0]; // Device
+        header.device = (uint32_t)info->devices[0]; // Device
     }
 
-    if(fake_sign)
-    {
-        if((obfuscated_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            return -1;
-        }
-        demunger(input_tgz, obfuscated_tgz, 0, 0);
-        rewind(input_tgz);
-        rewind(obfuscated_tgz);
-        if(md5_sum(obfuscated_tgz, header.data.recovery_update.md5_sum) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            return -1;
-        }
-        fclose(obfuscated_tgz);
-    }
-    else
-    {
-        if(md5_sum(input_tgz, header.data.recovery_update.md5_sum) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of input tgz.\n");
-            return -1;
-        }
-        rewind(input_tgz); // Rewind input
-    }
-    md((unsigned char *)header.data.recovery_update.md5_sum, MD5_HASH_LENGTH); // Obfuscate md5 hash
-
-    // Write header to output
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE)
-    {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-        return -1;
-    }
-
-    // Write package to output
-    return munger(input_tgz, output, 0, fake_sign);
+    return kindle_create_bundle(&header, input_tgz, output, fake_sign);
 }
 
 int kindle_create_recovery_v2(UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
 {
-    size_t header_size;
-    unsigned char *header;
-    size_t hindex;
-    int i;
-    FILE *demunged_tgz;
-    unsigned char recovery_num_devices;
-
-    demunged_tgz = NULL;
+    KTHeader header;
 
     // Its total size is fixed, but some stuff inside are variable/padded...
-    header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
-    header = malloc(header_size);
-    hindex = 0;
-    // Zero init everything first...
-    memset(header, 0, header_size);
-
-    strncpy((char *)header, info->magic_number, MAGIC_NUMBER_LENGTH);
-    hindex += MAGIC_NUMBER_LENGTH;
-    hindex += sizeof(uint32_t); // Padding
-    memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t)); // Target
-    hindex += sizeof(uint64_t);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);
+    header.version = RecoveryUpdateV2;
+    header.target_revision = info->target_revision;
+    header.magic_1 = info->magic_1;
+    header.magic_2 = info->magic_2;
+    header.minor = info->minor;
+    header.platform = (uint32_t)info->platform;
+    header.header_rev = info->header_rev;
+    header.board = (uint32_t)info->board;
+    header.num_devices = info->num_devices;     // Stored as an u8...
+    header.device_list = info->devices;
+
+    return kindle_create_bundle(&header, input_tgz, output, fake_sign);
+}
 
-    // Even if we asked for a fake package, the Kindle still expects a proper package...
-    // Sum a temp deobfuscated tarball to fake it ;)
-    if(fake_sign)
+// Add a device to info, and guess a matching magic number.
+// Device names & aliases (see tools/kindle_registry.py), the aliases allocate their whole family in one shot.
+int kindle_create_add_device(UpdateInformation *info, const char *name)
+{
+    const KTRegistryName *reg_name;
+
+    if((reg_name = kt_registry_lookup(name)) != NULL && reg_name->num_devices > 0)
     {
-        if((demunged_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            free(header);
-            return -1;
-        }
-        demunger(input_tgz, demunged_tgz, 0, 0);
-        rewind(input_tgz);
-        rewind(demunged_tgz);
-        if(md5_sum(demunged_tgz, (char *)&header[hindex]) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of fake package.\n");
-            free(header);
+        if(kt_registry_devices(reg_name, &info->devices, &info->num_devices) < 0)
             return -1;
-        }
-        fclose(demunged_tgz);
+        if(reg_name->magic_number != NULL)
+            memcpy(info->magic_number, reg_name->magic_number, MAGIC_NUMBER_LENGTH);
     }
     else
     {
-        if(md5_sum(input_tgz, (char *)&header[hindex]) < 0) // md5 hash
+        info->devices = realloc(info->devices, ++info->num_devices * sizeof(Device));
+        if(strcmp(name, "none") == 0)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            free(header);
-            return -1;
+            info->devices[info->num_devices - 1] = KindleUnknown;
+            // We *really* mean no devices, so reset num_devices ;).
+            info->num_devices = 0;
+        }
+        else if(strcmp(name, "auto") == 0 || strcmp(name, "current") == 0)
+        {
+            // Detect the current Kindle model
+            FILE *kindle_usid;
+            if((kindle_usid = fopen("/proc/usid", "rb")) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot open /proc/usid (not running on a Kindle?): %s.\n", strerror(errno));
+                return -1;
+            }
+            unsigned char serial_no[SERIAL_NO_LENGTH];
+            if(fread(serial_no, sizeof(unsigned char), SERIAL_NO_LENGTH, kindle_usid) < SERIAL_NO_LENGTH || ferror(kindle_usid) != 0)
+            {
+                fprintf(kt_stderr, "Error reading /proc/usid: %s.\n", strerror(errno));
+                fclose(kindle_usid);
+                return -1;
+            }
+            fclose(kindle_usid);
+            // Get the device code...
+            char device_code[3];
+            snprintf(device_code, 3, "%.*s", 2, &serial_no[2]);
+            Device dev_code = (Device)strtoul(device_code, NULL, 16);
+            // Unless we're feeling adventurous, check if it's a valid device...
+            if(!kt_with_unknown_devcodes && kt_device_name(dev_code) == NULL)
+            {
+                fprintf(kt_stderr, "Unknown device %s (0x%02X).\n", name, dev_code);
+                return -1;
+            }
+            else
+            {
+                // Yay, known valid device code :)
+                info->devices[info->num_devices - 1] = dev_code;
+                // Roughly guess a decent magic number...
+                if(dev_code < Kindle4NonTouch)
+                {
+                    memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+                }
+                else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
+                {
+                    memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                }
+                else
+                {
+                    memcpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                }
+            }
+        }
+        else
+        {
+            // Check if we passed an hex device code...
+            char *endptr;
+            Device dev_code = (Device)strtoul(name, &endptr, 16);
+            // Check that it even remotely looks like a device code first...
+            if(*endptr != '\0' || dev_code <= 0x00 || dev_code > 0xFF)
+            {
+                fprintf(kt_stderr, "Unknown or invalid device %s.\n", name);
+                return -1;
+            }
+            // Unless we're feeling adventurous, check if it's a valid device...
+            if(!kt_with_unknown_devcodes && kt_device_name(dev_code) == NULL)
+            {
+                fprintf(kt_stderr, "Unknown device %s (0x%02X).\n", name, dev_code);
+                return -1;
+            }
+            else
+            {
+                // Yay, known valid device code :)
+                info->devices[info->num_devices - 1] = dev_code;
+                // Roughly guess a decent magic number...
+                if(dev_code < Kindle4NonTouch)
+                {
+                    memcpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+                }
+                else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
+                {
+                    memcpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                }
+                else
+                {
+                    memcpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                }
+            }
         }
-        rewind(input_tgz); // Reset input for later reading
-    }
-
-    md(&header[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
-    hindex += MD5_HASH_LENGTH;
-
-    memcpy(&header[hindex], &info->magic_1, sizeof(uint32_t));          // Magic 1
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->magic_2, sizeof(uint32_t));          // Magic 2
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->minor, sizeof(uint32_t));            // Minor
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->platform, sizeof(uint32_t));         // Platform
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->header_rev, sizeof(uint32_t));       // Header rev
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->board, sizeof(uint32_t));            // Board
-    hindex += sizeof(uint32_t);
-
-    hindex += sizeof(uint32_t); // Padding
-    hindex += sizeof(uint16_t); // ... Padding
-    hindex += sizeof(uint8_t);  // And more weird padding
-    recovery_num_devices = (uint8_t)info->num_devices;  // u16 to u8...
-    memcpy(&header[hindex], &recovery_num_devices, sizeof(uint8_t));    // Device count
-    hindex += sizeof(uint8_t);
-
-    for(i = 0; i < info->num_devices; i++)
-    {
-        memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));   // Device
-        hindex += sizeof(uint16_t);
-    }
-
-    // Now, we write the header to the file
-    if(fwrite(header, sizeof(unsigned char), header_size, output) < header_size)
-    {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-        free(header);
-        return -1;
     }
-
-    // Write the actual update
-    free(header);
-    return munger(input_tgz, output, 0, fake_sign);
+    return 0;
 }
 
 int kindle_create_main(int argc, char *argv[])
@@ -1244,6 +1418,12 @@ int kindle_create_main(int argc, char *argv[])
         { "unsigned", no_argument, NULL, 'u' },
         { "userdata", no_argument, NULL, 'U' },
         { "legacy", no_argument, NULL, 'C' },
+        { "delta-from", required_argument, NULL, 'D' },
+        { "delta-base", required_argument, NULL, 'E' },
+        { "diff", required_argument, NULL, 'F' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "dedup", no_argument, NULL, 'L' },
+        { "seekable", optional_argument, NULL, 'S' },
         { NULL, 0, NULL, 0 }
     };
     UpdateInformation info = {"\0\0\0\0", UnknownUpdate, get_default_key(), 0, UINT64_MAX, 0, 0, 0, 0, NULL, 0, 0, 0, CertificateDeveloper, 0, 0, 0, NULL };
@@ -1262,9 +1442,18 @@ int kindle_create_main(int argc, char *argv[])
     unsigned int fake_sign;
     unsigned int userdata_only;
     unsigned int legacy;
+    unsigned int dedup;
     unsigned int real_blocksize;
     struct archive_entry *entry;
     struct archive *match;
+    const KTRegistryName *reg_name;
+    char *delta_from = NULL;
+    const char *delta_base = KT_DELTA_DEFAULT_BASE;
+    char *diff_from = NULL;
+    unsigned int jobs;
+    uint64_t seek_span;
+    FILE *seekable;
+    KTDeltaStage delta_stage;
     int r;
 
     // Defaults
@@ -1275,6 +1464,10 @@ int kindle_create_main(int argc, char *argv[])
     fake_sign = 0;
     userdata_only = 0;
     legacy = 0;
+    dedup = 0;
+    seek_span = 0;
+    if(parse_jobs("0", &jobs) < 0)
+        return -1;
 
     // Skip command
     argv++;
@@ -1283,7 +1476,7 @@ int kindle_create_main(int argc, char *argv[])
     // Update type
     if(argc < 1)
     {
-        fprintf(stderr, "Not enough arguments.\n");
+        fprintf(kt_stderr, "Not enough arguments.\n");
         return -1;
     }
     if(strncmp(argv[0], "ota2", 4) == 0)
@@ -1322,503 +1515,34 @@ int kindle_create_main(int argc, char *argv[])
     }
     else
     {
-        fprintf(stderr, "'%s' is not a valid update type.\n", argv[0]);
+        fprintf(kt_stderr, "'%s' is not a valid update type.\n", argv[0]);
         goto do_error;
     }
 
     // Arguments
-    while((opt = getopt_long(argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:auUC", opts, &opt_index)) != -1)
+    while((opt = getopt_long(argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:auUCD:E:F:j:LS::", opts, &opt_index)) != -1)
     {
         switch(opt)
         {
             case 'd':
-                // The aliases handle their memory allocation on their own, in one shot.
-                if(strcmp(optarg, "kindle4") == 0)
-                {
-                    strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 2;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle4NonTouch;
-                    info.devices[info.num_devices++] = Kindle4NonTouchBlack;
-                }
-                else if(strcmp(optarg, "touch") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 3 + kt_with_unknown_devcodes;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle5TouchWifi;
-                    info.devices[info.num_devices++] = Kindle5TouchWifi3G;
-                    info.devices[info.num_devices++] = Kindle5TouchWifi3GEurope;
-                    if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = Kindle5TouchUnknown;
-                }
-                else if(strcmp(optarg, "paperwhite") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 6;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GBrazil;
-                }
-                else if(strcmp(optarg, "paperwhite2") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 11 + (kt_with_unknown_devcodes * 3);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WifiJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GRussia;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi4GBInternational;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GBEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GB;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GBCanada;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0x61;
-                    }
-                }
-                else if(strcmp(optarg, "basic") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 1 + kt_with_unknown_devcodes;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleBasic;
-                    if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = KindleBasicUnknown_0xDD;
-                }
-                else if(strcmp(optarg, "voyage") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 3 + (kt_with_unknown_devcodes * 3);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleVoyageWifi;
-                    info.devices[info.num_devices++] = KindleVoyageWifi3G;
-                    info.devices[info.num_devices++] = KindleVoyageWifi3GEurope;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x2A;
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x52;
-                    }
-                }
-                else if(strcmp(optarg, "paperwhite3") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 1 + (kt_with_unknown_devcodes * 5);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhite3Wifi;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G2;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G4;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G5;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G6;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G7;
-                    }
-                }
-                else if(strcmp(optarg, "kindle5") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 25 + kt_with_unknown_devcodes + (kt_with_unknown_devcodes * 3) + kt_with_unknown_devcodes + (kt_with_unknown_devcodes * 3) + (kt_with_unknown_devcodes * 5);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle5TouchWifi;
-                    info.devices[info.num_devices++] = Kindle5TouchWifi3G;
-                    info.devices[info.num_devices++] = Kindle5TouchWifi3GEurope;
-                    if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = Kindle5TouchUnknown;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWifi3GBrazil;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WifiJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GRussia;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi4GBInternational;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GBEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GB;
-                    info.devices[info.num_devices++] = KindlePaperWhite2Wifi3G4GBCanada;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0x61;
-                    }
-                    info.devices[info.num_devices++] = KindleBasic;
-                    if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = KindleBasicUnknown_0xDD;
-                    info.devices[info.num_devices++] = KindleVoyageWifi;
-                    info.devices[info.num_devices++] = KindleVoyageWifi3G;
-                    info.devices[info.num_devices++] = KindleVoyageWifi3GEurope;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x2A;
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x52;
-                    }
-                    info.devices[info.num_devices++] = KindlePaperWhite3Wifi;
-                    if(kt_with_unknown_devcodes)
-                    {
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G2;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G4;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G5;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G6;
-                        info.devices[info.num_devices++] = KindlePaperWhite3Unknown_0G7;
-                    }
-                }
-                else if(kt_with_unknown_devcodes && (strcmp(optarg, "unknown") == 0 || strcmp(optarg, "datamined") == 0))
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);      // Meh?
-                    unsigned int num_aliased_devices = 7;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x16;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x21;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x07;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0B;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0C;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0D;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x99;
-                }
-                else if(strcmp(optarg, "kindle2") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 2;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle2US;
-                    info.devices[info.num_devices++] = Kindle2International;
-                }
-                else if(strcmp(optarg, "kindledx") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 3;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleDXUS;
-                    info.devices[info.num_devices++] = KindleDXInternational;
-                    info.devices[info.num_devices++] = KindleDXGraphite;
-                }
-                else if(strcmp(optarg, "kindle3") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 3;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle3Wifi;
-                    info.devices[info.num_devices++] = Kindle3Wifi3G;
-                    info.devices[info.num_devices++] = Kindle3Wifi3GEurope;
-                }
-                else if(strcmp(optarg, "legacy") == 0)
-                {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    unsigned int num_aliased_devices = 8;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle2US;
-                    info.devices[info.num_devices++] = Kindle2International;
-                    info.devices[info.num_devices++] = KindleDXUS;
-                    info.devices[info.num_devices++] = KindleDXInternational;
-                    info.devices[info.num_devices++] = KindleDXGraphite;
-                    info.devices[info.num_devices++] = Kindle3Wifi;
-                    info.devices[info.num_devices++] = Kindle3Wifi3G;
-                    info.devices[info.num_devices++] = Kindle3Wifi3GEurope;
-                }
-                else
-                {
-                    info.devices = realloc(info.devices, ++info.num_devices * sizeof(Device));
-                    if(strcmp(optarg, "k1") == 0)
-                        info.devices[info.num_devices - 1] = Kindle1;
-                    else if(strcmp(optarg, "k2") == 0)
-                        info.devices[info.num_devices - 1] = Kindle2US;
-                    else if(strcmp(optarg, "k2i") == 0)
-                        info.devices[info.num_devices - 1] = Kindle2International;
-                    else if(strcmp(optarg, "dx") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXUS;
-                    else if(strcmp(optarg, "dxi") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXInternational;
-                    else if(strcmp(optarg, "dxg") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXGraphite;
-                    else if(strcmp(optarg, "k3w") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3Wifi;
-                    else if(strcmp(optarg, "k3g") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3Wifi3G;
-                    else if(strcmp(optarg, "k3gb") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3Wifi3GEurope;
-                    else if(strcmp(optarg, "k4") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle4NonTouch;
-                        strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "k4b") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle4NonTouchBlack;
-                        strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-                    }
-                    // NOTE: Magic number switch to 'versionless' update types here... FW >= 5.6.1 apparently dropped support for these...
-                    else if(strcmp(optarg, "k5w") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWifi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "k5g") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWifi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "k5gb") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWifi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "k5u") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = Kindle5TouchUnknown;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw") == 0 || strcmp(optarg, "kpw") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pwg") == 0 || strcmp(optarg, "kpwg") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pwgc") == 0 || strcmp(optarg, "kpwgc") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi3GCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pwgb") == 0 || strcmp(optarg, "kpwgb") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pwgj") == 0 || strcmp(optarg, "kpwgj") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pwgbr") == 0 || strcmp(optarg, "kpwgbr") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWifi3GBrazil;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2") == 0 || strcmp(optarg, "kpw2") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2j") == 0 || strcmp(optarg, "kpw2j") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WifiJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2g") == 0 || strcmp(optarg, "kpw2g") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gc") == 0 || strcmp(optarg, "kpw2gc") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3GCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gb") == 0 || strcmp(optarg, "kpw2gb") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gr") == 0 || strcmp(optarg, "kpw2gr") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3GRussia;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gj") == 0 || strcmp(optarg, "kpw2gj") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2il") == 0 || strcmp(optarg, "kpw2il") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi4GBInternational;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gbl") == 0 || strcmp(optarg, "kpw2gbl") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3G4GBEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gl") == 0 || strcmp(optarg, "kpw2gl") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3G4GB;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw2gcl") == 0 || strcmp(optarg, "kpw2gcl") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2Wifi3G4GBCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "kt2") == 0 || strcmp(optarg, "bk") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindleBasic;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "kv") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindleVoyageWifi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "kvg") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindleVoyageWifi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "kvgb") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindleVoyageWifi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "pw3") == 0 || strcmp(optarg, "kpw3") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3Wifi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                    }
-                    else if(strcmp(optarg, "none") == 0)
-                    {
-                        info.devices[info.num_devices - 1] = KindleUnknown;
-                        // We *really* mean no devices, so reset num_devices ;).
-                        info.num_devices = 0;
-                    }
-                    else if(strcmp(optarg, "auto") == 0 || strcmp(optarg, "current") == 0)
-                    {
-                        // Detect the current Kindle model
-                        FILE *kindle_usid;
-                        if((kindle_usid = fopen("/proc/usid", "rb")) == NULL)
-                        {
-                            fprintf(stderr, "Cannot open /proc/usid (not running on a Kindle?): %s.\n", strerror(errno));
-                            goto do_error;
-                        }
-                        unsigned char serial_no[SERIAL_NO_LENGTH];
-                        if(fread(serial_no, sizeof(unsigned char), SERIAL_NO_LENGTH, kindle_usid) < SERIAL_NO_LENGTH || ferror(kindle_usid) != 0)
-                        {
-                            fprintf(stderr, "Error reading /proc/usid: %s.\n", strerror(errno));
-                            fclose(kindle_usid);
-                            goto do_error;
-                        }
-                        fclose(kindle_usid);
-                        // Get the device code...
-                        char device_code[3];
-                        snprintf(device_code, 3, "%.*s", 2, &serial_no[2]);
-                        Device dev_code = (Device)strtoul(device_code, NULL, 16);
-                        // Unless we're feeling adventurous, check if it's a valid device...
-                        if(!kt_with_unknown_devcodes && strcmp(convert_device_id(dev_code), "Unknown") == 0)
-                        {
-                            fprintf(stderr, "Unknown device %s (0x%02X).\n", optarg, dev_code);
-                            goto do_error;
-                        }
-                        else
-                        {
-                            // Yay, known valid device code :)
-                            info.devices[info.num_devices - 1] = dev_code;
-                            // Roughly guess a decent magic number...
-                            if(dev_code < Kindle4NonTouch)
-                            {
-                                strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-                            }
-                            else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
-                            {
-                                strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-                            }
-                            else
-                            {
-                                strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        // Check if we passed an hex device code...
-                        char *endptr;
-                        Device dev_code = (Device)strtoul(optarg, &endptr, 16);
-                        // Check that it even remotely looks like a device code first...
-                        if(*endptr != '\0' || dev_code <= 0x00 || dev_code > 0xFF)
-                        {
-                            fprintf(stderr, "Unknown or invalid device %s.\n", optarg);
-                            goto do_error;
-                        }
-                        // Unless we're feeling adventurous, check if it's a valid device...
-                        if(!kt_with_unknown_devcodes && strcmp(convert_device_id(dev_code), "Unknown") == 0)
-                        {
-                            fprintf(stderr, "Unknown device %s (0x%02X).\n", optarg, dev_code);
-                            goto do_error;
-                        }
-                        else
-                        {
-                            // Yay, known valid device code :)
-                            info.devices[info.num_devices - 1] = dev_code;
-                            // Roughly guess a decent magic number...
-                            if(dev_code < Kindle4NonTouch)
-                            {
-                                strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-                            }
-                            else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
-                            {
-                                strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-                            }
-                            else
-                            {
-                                strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
-                            }
-                        }
-                    }
-                }
+                if(kindle_create_add_device(&info, optarg) < 0)
+                    goto do_error;
                 break;
             case 'p':
-                if(strcmp(optarg, "unspecified") == 0)
-                    info.platform = Plat_Unspecified;
-                else if(strcmp(optarg, "mario") == 0)
-                    info.platform = MarioDeprecated;
-                else if(strcmp(optarg, "luigi") == 0)
-                    info.platform = Luigi;
-                else if(strcmp(optarg, "banjo") == 0)
-                    info.platform = Banjo;
-                else if(strcmp(optarg, "yoshi") == 0)
-                    info.platform = Yoshi;
-                else if(strcmp(optarg, "yoshime-proto") == 0 || strcmp(optarg, "yoshime-p") == 0)
-                    info.platform = YoshimeProto;
-                else if(strcmp(optarg, "yoshime") == 0)
-                    info.platform = Yoshime;
-                else if(strcmp(optarg, "wario") == 0)
-                    info.platform = Wario;
+                if((reg_name = kt_registry_lookup(optarg)) != NULL && reg_name->platform >= 0)
+                    info.platform = (Platform) reg_name->platform;
                 else
                 {
-                    fprintf(stderr, "Unknown platform %s.\n", optarg);
+                    fprintf(kt_stderr, "Unknown platform %s.\n", optarg);
                     goto do_error;
                 }
                 break;
             case 'B':
-                if(strcmp(optarg, "unspecified") == 0)
-                    info.board = Board_Unspecified;
-                else if(strcmp(optarg, "tequila") == 0)
-                    info.board = Tequila;
-                else if(strcmp(optarg, "whitney") == 0)
-                    info.board = Whitney;
+                if((reg_name = kt_registry_lookup(optarg)) != NULL && reg_name->board >= 0)
+                    info.board = (Board) reg_name->board;
                 else
                 {
-                    fprintf(stderr, "Unknown board %s.\n", optarg);
+                    fprintf(kt_stderr, "Unknown board %s.\n", optarg);
                     goto do_error;
                 }
                 break;
@@ -1828,7 +1552,7 @@ int kindle_create_main(int argc, char *argv[])
             case 'k':
                 if(nettle_rsa_privkey_from_pem(optarg, &info.sign_pkey) != 0)
                 {
-                    fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
+                    fprintf(kt_stderr, "Key '%s' cannot be loaded.\n", optarg);
                     goto do_error;
                 }
                 break;
@@ -1836,7 +1560,7 @@ int kindle_create_main(int argc, char *argv[])
                 strncpy(info.magic_number, optarg, MAGIC_NUMBER_LENGTH);
                 if((info.version = get_bundle_version(optarg)) == UnknownUpdate)
                 {
-                    fprintf(stderr, "Invalid bundle version %s.\n", optarg);
+                    fprintf(kt_stderr, "Invalid bundle version %s.\n", optarg);
                     goto do_error;
                 }
                 break;
@@ -1867,12 +1591,12 @@ int kindle_create_main(int argc, char *argv[])
             case 'x':
                 if(strchr(optarg, '=') == NULL) // A metastring must contain an '=' character (remember, it's a key=value pair ;))
                 {
-                    fprintf(stderr, "Invalid metastring. Format: key=value, input: %s\n", optarg);
+                    fprintf(kt_stderr, "Invalid metastring. Format: key=value, input: %s\n", optarg);
                     goto do_error;
                 }
                 if(strlen(optarg) > 0xFFFF)
                 {
-                    fprintf(stderr, "Metastring too long. Max length: %d, input: %s\n", 0xFFFF, optarg);
+                    fprintf(kt_stderr, "Metastring too long. Max length: %d, input: %s\n", 0xFFFF, optarg);
                     goto do_error;
                 }
                 info.metastrings = realloc(info.metastrings, ++info.num_meta * sizeof(char *));
@@ -1890,16 +1614,45 @@ int kindle_create_main(int argc, char *argv[])
             case 'C':
                 legacy = 1;
                 break;
+            case 'D':
+                free(delta_from);
+                delta_from = strdup(optarg);
+                break;
+            case 'E':
+                delta_base = optarg;
+                break;
+            case 'F':
+                free(diff_from);
+                diff_from = strdup(optarg);
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &jobs) < 0)
+                    goto do_error;
+                break;
+            case 'L':
+                dedup = 1;
+                break;
+            case 'S':
+                if(optarg == NULL)
+                    seek_span = KT_INDEX_SPAN;
+                else if(parse_size(optarg, &seek_span) < 0)
+                    goto do_error;
+                if(seek_span < KT_INDEX_WINDOW_SIZE || seek_span > (UINT64_C(1) << 40))
+                {
+                    fprintf(kt_stderr, "Invalid checkpoint interval '%s' (must be between 32K and 1024G).\n", optarg);
+                    goto do_error;
+                }
+                break;
             case ':':
-                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
                 goto do_error;
                 break;
             case '?':
-                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
                 goto do_error;
                 break;
             default:
-                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
                 goto do_error;
                 break;
         }
@@ -1911,7 +1664,7 @@ int kindle_create_main(int argc, char *argv[])
         // Needs to be a signed package
         if(info.version != UpdateSignature)
         {
-            fprintf(stderr, "Invalid update type (%s) for an userdata package.\n", convert_bundle_version(info.version));
+            fprintf(kt_stderr, "Invalid update type (%s) for an userdata package.\n", convert_bundle_version(info.version));
             goto do_error;
         }
     }
@@ -1920,18 +1673,18 @@ int kindle_create_main(int argc, char *argv[])
         // Musn't be *only* a sig envelope...
         if(info.version == UpdateSignature)
         {
-            fprintf(stderr, "Invalid update type (%s) for an update package.\n", convert_bundle_version(info.version));
+            fprintf(kt_stderr, "Invalid update type (%s) for an update package.\n", convert_bundle_version(info.version));
             goto do_error;
         }
         // Validation (Allow 0 devices in Recovery V2 & FB02 h2, allow multiple devices in OTA V2 & Recovery V2)
         if((info.num_devices < 1 && (info.version != RecoveryUpdateV2 && (info.version != RecoveryUpdate || info.header_rev != 2))) || ((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2) && info.num_devices > 1))
         {
-            fprintf(stderr, "Invalid number of supported devices (%d) for this update type (%s).\n", info.num_devices, convert_bundle_version(info.version));
+            fprintf(kt_stderr, "Invalid number of supported devices (%d) for this update type (%s).\n", info.num_devices, convert_bundle_version(info.version));
             goto do_error;
         }
         if((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2) && (info.source_revision > UINT32_MAX || info.target_revision > UINT32_MAX))
         {
-            fprintf(stderr, "Source/target revision for this update type (%s) cannot exceed %u.\n", convert_bundle_version(info.version), UINT32_MAX);
+            fprintf(kt_stderr, "Source/target revision for this update type (%s) cannot exceed %u.\n", convert_bundle_version(info.version), UINT32_MAX);
             goto do_error;
         }
         // When building an ota update with ota2 only devices, don't try to use non ota v1 bundle versions, reset it @ FC02, or shit happens.
@@ -1966,14 +1719,14 @@ int kindle_create_main(int argc, char *argv[])
         // We need a platform id, board id (& header rev?) for recovery2
         if(info.version == RecoveryUpdateV2)
         {
-            if(strcmp(convert_platform_id(info.platform), "Unknown") == 0)
+            if(kt_platform_name(info.platform) == NULL)
             {
-                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
+                fprintf(kt_stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
                 goto do_error;
             }
-            if(strcmp(convert_board_id(info.board), "Unknown") == 0)
+            if(kt_board_name(info.board) == NULL)
             {
-                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
+                fprintf(kt_stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
                 goto do_error;
             }
             // Don't bother for header rev? We don't for other potentially optional flags in recovery, so...
@@ -1981,14 +1734,14 @@ int kindle_create_main(int argc, char *argv[])
         // We need a platform id & board id for recovery FB02 V2
         if(info.version == RecoveryUpdate)
         {
-            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && strcmp(convert_platform_id(info.platform), "Unknown") == 0)
+            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && kt_platform_name(info.platform) == NULL)
             {
-                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
+                fprintf(kt_stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
                 goto do_error;
             }
-            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && strcmp(convert_board_id(info.board), "Unknown") == 0)
+            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && kt_board_name(info.board) == NULL)
             {
-                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
+                fprintf(kt_stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
                 goto do_error;
             }
         }
@@ -2004,7 +1757,7 @@ int kindle_create_main(int argc, char *argv[])
         // We of course need a full magic number... As magic_number is not NULL terminated, we cannot use strlen, so let one of our helper functions do the job...
         if(get_bundle_version(info.magic_number) == UnknownUpdate)
         {
-            fprintf(stderr, "You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n", convert_bundle_version(info.version), info.magic_number);
+            fprintf(kt_stderr, "You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n", convert_bundle_version(info.version), info.magic_number);
             goto do_error;
         }
     }
@@ -2041,7 +1794,7 @@ int kindle_create_main(int argc, char *argv[])
     }
     else
     {
-        fprintf(stderr, "No input/output specified.\n");
+        fprintf(kt_stderr, "No input/output specified.\n");
         goto do_error;
     }
 
@@ -2070,7 +1823,7 @@ int kindle_create_main(int argc, char *argv[])
             }
         }
         if(archive_match_exclude_pattern(match, valid_update_file_pattern) != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
+            fprintf(kt_stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
         free(valid_update_file_pattern);
 
         archive_entry_copy_pathname(entry, output_filename);
@@ -2080,9 +1833,9 @@ int kindle_create_main(int argc, char *argv[])
         {
             if(r < 0)
             {
-                fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
+                fprintf(kt_stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
             }
-            fprintf(stderr, "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n", output_filename, (fake_sign || userdata_only) ? "data.stgz" : "update*.bin");
+            fprintf(kt_stderr, "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n", output_filename, (fake_sign || userdata_only) ? "data.stgz" : "update*.bin");
             archive_entry_free(entry);
             archive_match_free(match);
             goto do_error;
@@ -2095,7 +1848,7 @@ int kindle_create_main(int argc, char *argv[])
         // Check to see if we can write to our output file (do it now instead of earlier, this way the pattern matching has been done, and we potentially avoid fopen squishing a file we meant as input, not output)
         if((output = fopen(output_filename, "wb")) == NULL)
         {
-            fprintf(stderr, "Cannot create output package file '%s': %s.\n", output_filename, strerror(errno));
+            fprintf(kt_stderr, "Cannot create output package file '%s': %s.\n", output_filename, strerror(errno));
             goto do_error;
         }
     }
@@ -2120,17 +1873,52 @@ int kindle_create_main(int argc, char *argv[])
     // Don't try to build an unsigned package if we didn't feed a single proper tarball
     if(fake_sign && !skip_archive)
     {
-        fprintf(stderr, "You need to feed me a single tarball to build an unsigned package.\n");
+        fprintf(kt_stderr, "You need to feed me a single tarball to build an unsigned package.\n");
         goto do_error;
     }
 
     // Same thing when building a signed userdata package
     if(userdata_only && !skip_archive)
     {
-        fprintf(stderr, "You need to feed me a single tarball to build a signed userdata package.\n");
+        fprintf(kt_stderr, "You need to feed me a single tarball to build a signed userdata package.\n");
         goto do_error;
     }
 
+    // A delta package is built from scratch, and relies on an apply script
+    if(delta_from != NULL)
+    {
+        if(skip_archive)
+        {
+            fprintf(kt_stderr, "You need to feed me files and/or directories to build a delta package.\n");
+            goto do_error;
+        }
+        if(info.version != OTAUpdateV2)
+        {
+            fprintf(kt_stderr, "Invalid update type (%s) for a delta package, it has to be an OTA V2 update.\n", convert_bundle_version(info.version));
+            goto do_error;
+        }
+    }
+
+    // Same idea for a diff package, except that we diff two directory trees, and that it only updates the base
+    if(diff_from != NULL)
+    {
+        if(delta_from != NULL)
+        {
+            fprintf(kt_stderr, "You can't build a delta package and a diff package at the same time.\n");
+            goto do_error;
+        }
+        if(skip_archive || input_index != 1)
+        {
+            fprintf(kt_stderr, "You need to feed me a single directory to build a diff package.\n");
+            goto do_error;
+        }
+        if(info.version != OTAUpdate && info.version != OTAUpdateV2)
+        {
+            fprintf(kt_stderr, "Invalid update type (%s) for a diff package, it has to be an OTA update.\n", convert_bundle_version(info.version));
+            goto do_error;
+        }
+    }
+
     // If we need to build a tarball, do it in a tempfile
     if(!skip_archive)
     {
@@ -2139,7 +1927,7 @@ int kindle_create_main(int argc, char *argv[])
 #if defined(_WIN32) && !defined(__CYGWIN__)
         if(_mktemp(tarball_filename) == NULL)
         {
-            fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
             goto do_error;
         }
         tarball_fd = open(tarball_filename, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
@@ -2148,7 +1936,7 @@ int kindle_create_main(int argc, char *argv[])
 #endif
         if(tarball_fd == -1)
         {
-            fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
             goto do_error;
         }
     }
@@ -2157,69 +1945,69 @@ int kindle_create_main(int argc, char *argv[])
     // Again, a signed userdata package is the ugly duckling...
     if(userdata_only)
     {
-        fprintf(stderr, "Building userdata package '%s' directly from '%s' (signed with cert %d).\n", output_filename, tarball_filename, info.certificate_number);
+        fprintf(kt_stderr, "Building userdata package '%s' directly from '%s' (signed with cert %d).\n", output_filename, tarball_filename, info.certificate_number);
     }
     else
     {
-        fprintf(stderr, "Building %s%s%s (%.*s) update package '%s'%s%s%s%s for", (legacy ? "(in legacy mode) " : ""), (fake_sign ? "fake " : ""), (convert_bundle_version(info.version)), MAGIC_NUMBER_LENGTH, info.magic_number, output_filename, (skip_archive ? " directly from " : ""), (skip_archive ? "'" : ""), (skip_archive ? tarball_filename : ""), (skip_archive ? "'" : ""));
+        fprintf(kt_stderr, "Building %s%s%s (%.*s) update package '%s'%s%s%s%s for", (legacy ? "(in legacy mode) " : ""), (fake_sign ? "fake " : ""), (convert_bundle_version(info.version)), MAGIC_NUMBER_LENGTH, info.magic_number, output_filename, (skip_archive ? " directly from " : ""), (skip_archive ? "'" : ""), (skip_archive ? tarball_filename : ""), (skip_archive ? "'" : ""));
         // If we have specific device IDs, list them
         if(info.num_devices > 0)
         {
-            fprintf(stderr, " %hd device%s (",  info.num_devices, (info.num_devices > 1 ? "s" : ""));
+            fprintf(kt_stderr, " %hd device%s (",  info.num_devices, (info.num_devices > 1 ? "s" : ""));
             // Loop over devices
             for(i = 0; i < info.num_devices; i++)
             {
-                fprintf(stderr, "%s", convert_device_id(info.devices[i]));
+                fprintf(kt_stderr, "%s", convert_device_id(info.devices[i]));
                 if(i != info.num_devices - 1)
-                    fprintf(stderr, ", ");
+                    fprintf(kt_stderr, ", ");
             }
-            fprintf(stderr, "),");
+            fprintf(kt_stderr, "),");
         }
         else
         {
-            fprintf(stderr, " no specific device,");
+            fprintf(kt_stderr, " no specific device,");
         }
         // Don't print settings not applicable to our update type...
         switch(info.version)
         {
             case OTAUpdateV2:
                 if(info.target_revision == UINT64_MAX)
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
+                    fprintf(kt_stderr, " Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
                 else
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, (long long) info.target_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
+                    fprintf(kt_stderr, " Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, (long long) info.target_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
                 // Loop over meta
                 for(i = 0; i < info.num_meta; i++)
                 {
-                    fprintf(stderr, "%s", info.metastrings[i]);
+                    fprintf(kt_stderr, "%s", info.metastrings[i]);
                     if(i != info.num_meta - 1)
-                        fprintf(stderr, "; ");
+                        fprintf(kt_stderr, "; ");
                     else
-                        fprintf(stderr, ").\n");
+                        fprintf(kt_stderr, ").\n");
                 }
                 break;
             case OTAUpdate:
                 if(info.target_revision == UINT32_MAX)
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n", (long long) info.source_revision, info.optional);
+                    fprintf(kt_stderr, " Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n", (long long) info.source_revision, info.optional);
                 else
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n", (long long) info.source_revision, (long long) info.target_revision, info.optional);
+                    fprintf(kt_stderr, " Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n", (long long) info.source_revision, (long long) info.target_revision, info.optional);
                 break;
             case RecoveryUpdate:
-                fprintf(stderr, " Minor: %d, Magic 1: %d, Magic 2: %d", info.minor, info.magic_1, info.magic_2);
+                fprintf(kt_stderr, " Minor: %d, Magic 1: %d, Magic 2: %d", info.minor, info.magic_1, info.magic_2);
                 if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev > 0)
-                    fprintf(stderr, ", Header Rev: %llu, Platform: %s, Board: %s.\n", (long long) info.header_rev, convert_platform_id(info.platform), convert_board_id(info.board));
+                    fprintf(kt_stderr, ", Header Rev: %llu, Platform: %s, Board: %s.\n", (long long) info.header_rev, convert_platform_id(info.platform), convert_board_id(info.board));
                 else
-                    fprintf(stderr, ".\n");
+                    fprintf(kt_stderr, ".\n");
                 break;
             case RecoveryUpdateV2:
                 if(info.target_revision == UINT64_MAX)
-                    fprintf(stderr, " Target OTA: MAX");
+                    fprintf(kt_stderr, " Target OTA: MAX");
                 else
-                    fprintf(stderr, " Target OTA: %llu", (long long) info.target_revision);
-                fprintf(stderr, ", Minor: %d, Magic 1: %d, Magic 2: %d, Header Rev: %llu, Cert: %d, Platform: %s, Board: %s.\n", info.minor, info.magic_1, info.magic_2, (long long) info.header_rev, info.certificate_number, convert_platform_id(info.platform), convert_board_id(info.board));
+                    fprintf(kt_stderr, " Target OTA: %llu", (long long) info.target_revision);
+                fprintf(kt_stderr, ", Minor: %d, Magic 1: %d, Magic 2: %d, Header Rev: %llu, Cert: %d, Platform: %s, Board: %s.\n", info.minor, info.magic_1, info.magic_2, (long long) info.header_rev, info.certificate_number, convert_platform_id(info.platform), convert_board_id(info.board));
                 break;
             case UnknownUpdate:
             default:
-                fprintf(stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
+                fprintf(kt_stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
                 break;
         }
     }
@@ -2227,9 +2015,40 @@ int kindle_create_main(int argc, char *argv[])
     // Create our package archive, sigfile & bundlefile included
     if(!skip_archive)
     {
-        if(kindle_create_package_archive(tarball_fd, input_list, input_index, &info.sign_pkey, legacy, real_blocksize) != 0)
+        // For a delta package, archive what changed instead (in legacy mode, because the paths in the staging tree are already the final ones)
+        if(delta_from != NULL)
+        {
+            fprintf(kt_stderr, "Shipping what changed since '%s' (base on the device: %s).\n", delta_from, delta_base);
+            if(kt_delta_stage(&delta_stage, delta_from, input_list, input_index, legacy, delta_base) < 0)
+            {
+                fprintf(kt_stderr, "Failed to diff against '%s'.\n", delta_from);
+                close(tarball_fd);
+                unlink(tarball_filename);
+                goto do_error;
+            }
+            r = kindle_create_package_archive(tarball_fd, delta_stage.inputs, 2, &info.sign_pkey, 1, real_blocksize, dedup);
+            kt_delta_stage_free(&delta_stage);
+        }
+        else if(diff_from != NULL)
         {
-            fprintf(stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
+            fprintf(kt_stderr, "Shipping what changed from '%s' to '%s' (base on the device: %s).\n", diff_from, input_list[0], delta_base);
+            if(kt_delta_stage_trees(&delta_stage, diff_from, input_list[0], jobs, delta_base) < 0)
+            {
+                fprintf(kt_stderr, "Failed to diff '%s' against '%s'.\n", input_list[0], diff_from);
+                close(tarball_fd);
+                unlink(tarball_filename);
+                goto do_error;
+            }
+            r = kindle_create_package_archive(tarball_fd, delta_stage.inputs, 2, &info.sign_pkey, 1, real_blocksize, dedup);
+            kt_delta_stage_free(&delta_stage);
+        }
+        else
+        {
+            r = kindle_create_package_archive(tarball_fd, input_list, input_index, &info.sign_pkey, legacy, real_blocksize, dedup);
+        }
+        if(r != 0)
+        {
+            fprintf(kt_stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
             // Delete the borked files
             close(tarball_fd);
             unlink(tarball_filename);
@@ -2242,12 +2061,30 @@ int kindle_create_main(int argc, char *argv[])
     // And finally, build our package :)
     if((input = fopen(tarball_filename, "rb")) == NULL)
     {
-        fprintf(stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
+        fprintf(kt_stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
         goto do_error;
     }
+    // Deflate it again, with checkpoints & an index the device won't notice
+    if(seek_span > 0)
+    {
+        if((seekable = tmpfile()) == NULL)
+        {
+            fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+            goto do_error;
+        }
+        if(kt_index_make_seekable(input, seekable, seek_span) < 0)
+        {
+            fprintf(kt_stderr, "Cannot make the payload seekable.\n");
+            fclose(seekable);
+            goto do_error;
+        }
+        fclose(input);
+        input = seekable;
+        rewind(input);
+    }
     if(kindle_create(&info, input, output, fake_sign) < 0)
     {
-        fprintf(stderr, "Cannot write update to output.\n");
+        fprintf(kt_stderr, "Cannot write update to output.\n");
         goto do_error;
     }
 
@@ -2264,6 +2101,8 @@ int kindle_create_main(int argc, char *argv[])
     if(output != stdout)
         fclose(output);
     free(output_filename);
+    free(delta_from);
+    free(diff_from);
     // Remove tarball, unless we asked to keep it, or we used an existent tarball as sole input
     if(!keep_archive && !skip_archive)
         unlink(tarball_filename);
@@ -2279,6 +2118,8 @@ do_error:
         free(input_list);
     }
     free(output_filename);
+    free(delta_from);
+    free(diff_from);
     free(info.devices);
     for(i = 0; i < info.num_meta; i++)
         free(info.metastrings[i]);
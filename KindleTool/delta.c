@@ -0,0 +1,1766 @@
+//
+//  delta.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Delta packages: instead of the full payload, we only ship what changed since an older package, plus a script that rebuilds the full payload on the device.
+// The old payload has to be available there (in the 'base' directory), and the script brings it up to date once it's done, so that deltas can be chained.
+// Unchanged files are copied from the base, small or brand new files are shipped as-is, and large files that changed are diffed rsync-style:
+// we hash the old file's blocks, look for them at every offset of the new file with a rolling checksum, and only ship the bytes that didn't match.
+// Everything is rebuilt with dd, since that's about the only tool we can count on finding on the device.
+// Diff packages (create --diff) are the simpler variant, for a directory tree that's kept as-is on the device: we diff two trees by content (hashed in parallel),
+// only ship added & changed files, and the script checks the base, then moves, replaces & removes files in it.
+// Symlinks & directories are never shipped: the script recreates them (in the payload or in the base, respectively), and compares symlinks by their target.
+
+// Name of the apply script, at the root of the payload
+#define KT_DELTA_SCRIPT_NAME "kt_delta_apply.sh"
+// Extension of the literal data of a file shipped as a binary delta
+#define KT_DELTA_SUFFIX ".ktdelta"
+// Granularity of the block matching (which is also the dd block size used on the device)
+#define KT_DELTA_BLOCK 4096
+// Smaller files are shipped whole when they changed
+#define KT_DELTA_MIN_SIZE (64 * 1024)
+// Read buffer, when we hash files on disk
+#define KT_DELTA_READ_SIZE (256 * 1024)
+
+enum kt_delta_op_type
+{
+    KT_DELTA_COPY = 0,          // A run of blocks from the old file
+    KT_DELTA_LITERAL            // A run of bytes from the new file
+};
+
+typedef struct
+{
+    uint32_t weak;
+    uint8_t strong[MD5_DIGEST_SIZE];
+} KTDeltaBlock;
+
+// A regular file, symlink or directory of the old (or new) payload
+typedef struct kt_delta_file
+{
+    char *path;                 // Normalized (cf. kt_delta_path)
+    unsigned int type;          // AE_IFREG, AE_IFLNK or AE_IFDIR
+    char *target;               // Symlinks only
+    uint64_t size;
+    uint8_t md5[MD5_DIGEST_SIZE];
+    uint32_t num_blocks;        // Only for files we might diff
+    KTDeltaBlock *blocks;
+    unsigned int seen;          // Old file: still there in the new payload. New file: was there in the old one
+    unsigned int moved;         // New file: moved from other
+    const struct kt_delta_file *other;  // New file: the old one it replaces (or was moved from)
+} KTDeltaFile;
+
+typedef struct
+{
+    uint8_t type;
+    uint64_t start;             // Old block (copy), or offset in the new file (literal)
+    uint64_t count;             // Blocks (copy), or bytes (literal)
+} KTDeltaOp;
+
+struct kt_delta
+{
+    KTDeltaStage *stage;
+    KTDeltaFile *files;
+    unsigned int num_files;
+    FILE *script;
+    char **to_sync;             // Added & changed files, the base gets a copy of them once everything went fine
+    unsigned int num_to_sync;
+    char **to_link;             // Added & retargeted symlinks, as target, path pairs
+    unsigned int num_to_link;
+    char **to_mkdir;            // Added directories
+    unsigned int num_to_mkdir;
+    KTDeltaOp *ops;
+    size_t num_ops;
+    size_t ops_size;
+    unsigned int num_unchanged;
+    unsigned int num_added;
+    unsigned int num_changed;
+    unsigned int num_patched;
+    unsigned int num_removed;
+    uint64_t payload_bytes;     // Size of the full new payload
+    uint64_t shipped_bytes;     // What we actually ship of it
+};
+
+// Match paths the same way, however they were passed to create (./foo and foo are the same file)
+static const char *kt_delta_path(const char *path)
+{
+    for(;;)
+    {
+        if(path[0] == '/')
+            path++;
+        else if(path[0] == '.' && path[1] == '/')
+            path += 2;
+        else
+            return path;
+    }
+}
+
+// Same thing, for a path we keep: directories may come with a trailing slash
+static char *kt_delta_path_dup(const char *path)
+{
+    char *dup;
+    size_t len;
+
+    path = kt_delta_path(path);
+    len = strlen(path);
+    while(len > 0 && path[len - 1] == '/')
+        len--;
+    if((dup = malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(dup, path, len);
+    dup[len] = '\0';
+    return dup;
+}
+
+// Don't let a path escape the staging directory
+static int kt_delta_path_is_sane(const char *path)
+{
+    const char *p = path;
+
+    while((p = strstr(p, "..")) != NULL)
+    {
+        if((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+        p += 2;
+    }
+    return 1;
+}
+
+static int kt_delta_file_cmp(const void *a, const void *b)
+{
+    return strcmp(((const KTDeltaFile *) a)->path, ((const KTDeltaFile *) b)->path);
+}
+
+static int kt_delta_file_find_cmp(const void *key, const void *file)
+{
+    return strcmp((const char *) key, ((const KTDeltaFile *) file)->path);
+}
+
+static KTDeltaFile *kt_delta_find(struct kt_delta *delta, const char *path)
+{
+    if(delta->num_files == 0)
+        return NULL;
+    return bsearch(path, delta->files, delta->num_files, sizeof(*delta->files), kt_delta_file_find_cmp);
+}
+
+// rsync's weak checksum: the two halves can be rolled along the file one byte at a time
+static uint32_t kt_delta_weak(const unsigned char *data, size_t len, uint32_t *a_out, uint32_t *b_out)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    *a_out = a & 0xFFFF;
+    *b_out = b & 0xFFFF;
+    return *a_out | (*b_out << 16);
+}
+
+static void kt_delta_strong(const unsigned char *data, size_t len, uint8_t *digest)
+{
+    struct md5_ctx md5;
+
+    md5_init(&md5);
+    md5_update(&md5, len, data);
+    md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+}
+
+static void kt_delta_hex(const uint8_t *digest, char hex[MD5_HASH_LENGTH + 1])
+{
+    base16_encode_update(hex, MD5_DIGEST_SIZE, digest);
+    hex[MD5_HASH_LENGTH] = '\0';
+}
+
+// Single-quote a path for the apply script
+static void kt_delta_quote(FILE *out, const char *path)
+{
+    fputc('\'', out);
+    for(; *path != '\0'; path++)
+    {
+        if(*path == '\'')
+            fputs("'\\''", out);
+        else
+            fputc(*path, out);
+    }
+    fputc('\'', out);
+}
+
+static void kt_delta_script_call(FILE *script, const char *function, const char *path)
+{
+    fprintf(script, "%s ", function);
+    kt_delta_quote(script, path);
+    fprintf(script, "\n");
+}
+
+// Same thing, for a symlink
+static void kt_delta_script_link(FILE *script, const char *function, const char *target, const char *path)
+{
+    fprintf(script, "%s ", function);
+    kt_delta_quote(script, target);
+    fputc(' ', script);
+    kt_delta_quote(script, path);
+    fprintf(script, "\n");
+}
+
+// Remember what we created in the staging directory, to clean up after ourselves
+static int kt_delta_track(char ***list, unsigned int *count, const char *path)
+{
+    char **new_list;
+
+    if((new_list = realloc(*list, (*count + 1) * sizeof(char *))) == NULL)
+        return -1;
+    *list = new_list;
+    if((new_list[*count] = strdup(path)) == NULL)
+        return -1;
+    (*count)++;
+    return 0;
+}
+
+static int kt_delta_mkdir(KTDeltaStage *stage, const char *path)
+{
+    int r;
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    r = mkdir(path);
+#else
+    r = mkdir(path, 0700);
+#endif
+    if(r != 0)
+    {
+        if(errno == EEXIST)
+            return 0;
+        fprintf(kt_stderr, "Cannot create directory '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    if(kt_delta_track(&stage->dirs, &stage->num_dirs, path) < 0)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    return 0;
+}
+
+// Create the parent directories of path (which is modified, but always restored)
+static int kt_delta_mkdirs(KTDeltaStage *stage, char *path, size_t root_len)
+{
+    char *p;
+
+    for(p = path + root_len + 1; (p = strchr(p, '/')) != NULL; p++)
+    {
+        if(p[-1] == '/')
+            continue;
+        *p = '\0';
+        if(kt_delta_mkdir(stage, path) < 0)
+        {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+// Write a file of the payload tree, in the staging directory
+static int kt_delta_stage_file(KTDeltaStage *stage, const char *path, const char *suffix, const unsigned char *data, size_t len)
+{
+    char *staged;
+    size_t root_len;
+    FILE *out;
+
+    root_len = strlen(stage->inputs[1]);
+    if((staged = malloc(root_len + 1 + strlen(path) + strlen(suffix) + 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory for a staged path.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    sprintf(staged, "%s/%s%s", stage->inputs[1], path, suffix);
+    if(kt_delta_mkdirs(stage, staged, root_len) < 0)
+    {
+        free(staged);
+        return -1;
+    }
+    if((out = fopen(staged, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open staged file '%s' for writing: %s.\n", staged, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(staged);
+        return -1;
+    }
+    if(kt_delta_track(&stage->files, &stage->num_files, staged) < 0)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        fclose(out);
+        unlink(staged);
+        free(staged);
+        return -1;
+    }
+    free(staged);
+    if(len > 0 && fwrite(data, sizeof(unsigned char), len, out) < len)
+    {
+        fprintf(kt_stderr, "Error writing staged file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(out);
+        return -1;
+    }
+    if(fclose(out) != 0)
+    {
+        fprintf(kt_stderr, "Error writing staged file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    return 0;
+}
+
+// Hash every file of the old payload (and the blocks of the ones we might want to diff), and remember its symlinks & directories
+static int kt_delta_load(struct kt_delta *delta, const char *old_name)
+{
+    KTIndex stream;
+    struct archive *a;
+    struct archive_entry *entry;
+    KTDeltaFile *file;
+    KTDeltaFile *new_files;
+    struct md5_ctx md5;
+    unsigned char *block = NULL;
+    char name[PATH_MAX];
+    const char *path;
+    size_t fill;
+    ssize_t r;
+    uint32_t weak_a, weak_b;
+    unsigned int type;
+    unsigned int i;
+    FILE *input;
+    int ret = -1;
+
+    if((input = fopen(old_name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open old package '%s' for reading: %s.\n", old_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    memset(&stream, 0, sizeof(stream));
+    if((a = archive_read_new()) == NULL || (block = malloc(KT_DELTA_BLOCK)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory to read the old package.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    if(kt_payload_read_open(a, &stream, input, 0, NULL) < 0)
+        goto cleanup;
+
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        // Signatures & the index file are rebuilt anyway (and so is the root directory, if it's there)
+        path = kt_delta_path(archive_entry_pathname(entry));
+        kt_basename(path, name, sizeof(name));
+        type = (archive_entry_hardlink(entry) != NULL ? AE_IFREG : archive_entry_filetype(entry));
+        if((type != AE_IFREG && type != AE_IFLNK && type != AE_IFDIR) || IS_SIG(path) || strcmp(name, INDEX_FILE_NAME) == 0 || *path == '\0' || strcmp(path, ".") == 0)
+            continue;
+        if(strcmp(path, KT_DELTA_SCRIPT_NAME) == 0)
+        {
+            fprintf(kt_stderr, "'%s' is a delta package itself, we need a full package to diff against.\n", old_name);
+            kt_set_error(KT_ERR_INVALID);
+            goto cleanup;
+        }
+
+        if((new_files = realloc(delta->files, (delta->num_files + 1) * sizeof(*delta->files))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate memory for the old payload's file list.\n");
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        delta->files = new_files;
+        file = &delta->files[delta->num_files];
+        memset(file, 0, sizeof(*file));
+        if((file->path = kt_delta_path_dup(path)) == NULL)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        delta->num_files++;
+        file->type = type;
+        if(type == AE_IFLNK && (file->target = strdup(archive_entry_symlink(entry) != NULL ? archive_entry_symlink(entry) : "")) == NULL)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        if(type != AE_IFREG)
+            continue;
+
+        // A duplicate archived as a hardlink (create --dedup) has the content of its target, which came first
+        if(archive_entry_hardlink(entry) != NULL)
+        {
+            const char *target = kt_delta_path(archive_entry_hardlink(entry));
+
+            for(i = delta->num_files - 1; i-- > 0;)
+            {
+                if(strcmp(delta->files[i].path, target) == 0)
+                    break;
+            }
+            if(i == (unsigned int) -1)
+            {
+                fprintf(kt_stderr, "'%s' is a hardlink to '%s', which isn't in the package.\n", path, target);
+                kt_set_error(KT_ERR_FORMAT);
+                goto cleanup;
+            }
+            file->size = delta->files[i].size;
+            memcpy(file->md5, delta->files[i].md5, sizeof(file->md5));
+            if(delta->files[i].blocks != NULL)
+            {
+                if((file->blocks = malloc(delta->files[i].num_blocks * sizeof(*file->blocks))) == NULL)
+                {
+                    fprintf(kt_stderr, "Cannot allocate memory for the block hashes of '%s'.\n", path);
+                    kt_set_error(KT_ERR_NOMEM);
+                    goto cleanup;
+                }
+                memcpy(file->blocks, delta->files[i].blocks, delta->files[i].num_blocks * sizeof(*file->blocks));
+                file->num_blocks = delta->files[i].num_blocks;
+            }
+            continue;
+        }
+
+        file->size = (uint64_t) archive_entry_size(entry);
+        if(file->size >= KT_DELTA_MIN_SIZE)
+        {
+            if((file->blocks = malloc((size_t)(file->size / KT_DELTA_BLOCK) * sizeof(*file->blocks))) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate memory for the block hashes of '%s'.\n", path);
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+        }
+
+        // Only whole blocks are worth remembering, the tail of the file never matches anything
+        md5_init(&md5);
+        fill = 0;
+        while((r = archive_read_data(a, block + fill, KT_DELTA_BLOCK - fill)) > 0)
+        {
+            md5_update(&md5, (size_t) r, block + fill);
+            fill += (size_t) r;
+            if(fill == KT_DELTA_BLOCK)
+            {
+                if(file->blocks != NULL)
+                {
+                    file->blocks[file->num_blocks].weak = kt_delta_weak(block, KT_DELTA_BLOCK, &weak_a, &weak_b);
+                    kt_delta_strong(block, KT_DELTA_BLOCK, file->blocks[file->num_blocks].strong);
+                    file->num_blocks++;
+                }
+                fill = 0;
+            }
+        }
+        if(r < 0)
+        {
+            fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        md5_digest(&md5, MD5_DIGEST_SIZE, file->md5);
+    }
+
+    qsort(delta->files, delta->num_files, sizeof(*delta->files), kt_delta_file_cmp);
+    for(i = 1; i < delta->num_files; i++)
+    {
+        if(strcmp(delta->files[i - 1].path, delta->files[i].path) == 0)
+        {
+            fprintf(kt_stderr, "'%s' is stored twice in '%s', can't tell which one is on the device.\n", delta->files[i].path, old_name);
+            kt_set_error(KT_ERR_FORMAT);
+            goto cleanup;
+        }
+    }
+    fprintf(kt_stderr, "Diffing against the %u files, symlinks & directories of '%s'.\n", delta->num_files, old_name);
+    ret = 0;
+
+cleanup:
+    if(a != NULL)
+        archive_read_free(a);
+    free(stream.points);
+    free(block);
+    fclose(input);
+
+    return ret;
+}
+
+static int kt_delta_push_op(struct kt_delta *delta, uint8_t type, uint64_t start, uint64_t count)
+{
+    KTDeltaOp *last = (delta->num_ops > 0 ? &delta->ops[delta->num_ops - 1] : NULL);
+    KTDeltaOp *new_ops;
+
+    // Merge runs of consecutive blocks
+    if(last != NULL && type == KT_DELTA_COPY && last->type == KT_DELTA_COPY && last->start + last->count == start)
+    {
+        last->count += count;
+        return 0;
+    }
+    if(delta->num_ops == delta->ops_size)
+    {
+        delta->ops_size = (delta->ops_size > 0 ? delta->ops_size * 2 : 256);
+        if((new_ops = realloc(delta->ops, delta->ops_size * sizeof(*delta->ops))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate memory for a delta.\n");
+            kt_set_error(KT_ERR_NOMEM);
+            return -1;
+        }
+        delta->ops = new_ops;
+    }
+    delta->ops[delta->num_ops].type = type;
+    delta->ops[delta->num_ops].start = start;
+    delta->ops[delta->num_ops].count = count;
+    delta->num_ops++;
+    return 0;
+}
+
+// Look for the old file's blocks at every offset of the new one. Returns the number of literal bytes we'd have to ship (once padded), or -1 on error.
+static int64_t kt_delta_diff(struct kt_delta *delta, const KTDeltaFile *old, const unsigned char *data, size_t len)
+{
+    int32_t *head = NULL;
+    int32_t *next = NULL;
+    uint32_t table_size;
+    uint32_t weak, a, b;
+    uint32_t i;
+    uint8_t strong[MD5_DIGEST_SIZE];
+    unsigned int have_strong;
+    int64_t match;
+    int64_t expected = -1;
+    size_t pos = 0;
+    size_t literal = 0;
+    uint64_t literal_bytes = 0;
+
+    delta->num_ops = 0;
+    if(old->num_blocks == 0 || len < KT_DELTA_BLOCK)
+        return (int64_t) len;
+
+    // Chain the old blocks by weak checksum
+    for(table_size = 1; table_size < old->num_blocks * 2; table_size <<= 1)
+        ;
+    if((head = malloc(table_size * sizeof(*head))) == NULL || (next = malloc(old->num_blocks * sizeof(*next))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory for a delta.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(head);
+        return -1;
+    }
+    memset(head, 0xFF, table_size * sizeof(*head));
+    // Walk backwards, so that chains list the earliest blocks first
+    for(i = old->num_blocks; i-- > 0;)
+    {
+        next[i] = head[old->blocks[i].weak & (table_size - 1)];
+        head[old->blocks[i].weak & (table_size - 1)] = (int32_t) i;
+    }
+
+    weak = kt_delta_weak(data, KT_DELTA_BLOCK, &a, &b);
+    while(pos + KT_DELTA_BLOCK <= len)
+    {
+        match = -1;
+        have_strong = 0;
+        // Prefer the block that follows the last match, that makes for longer copies
+        if(expected >= 0 && expected < old->num_blocks && old->blocks[expected].weak == weak)
+        {
+            kt_delta_strong(data + pos, KT_DELTA_BLOCK, strong);
+            have_strong = 1;
+            if(memcmp(strong, old->blocks[expected].strong, MD5_DIGEST_SIZE) == 0)
+                match = expected;
+        }
+        if(match < 0)
+        {
+            int32_t j;
+
+            for(j = head[weak & (table_size - 1)]; j >= 0; j = next[j])
+            {
+                if(old->blocks[j].weak != weak)
+                    continue;
+                if(!have_strong)
+                {
+                    kt_delta_strong(data + pos, KT_DELTA_BLOCK, strong);
+                    have_strong = 1;
+                }
+                if(memcmp(strong, old->blocks[j].strong, MD5_DIGEST_SIZE) == 0)
+                {
+                    match = j;
+                    break;
+                }
+            }
+        }
+
+        if(match >= 0)
+        {
+            if(pos > literal)
+            {
+                if(kt_delta_push_op(delta, KT_DELTA_LITERAL, literal, pos - literal) < 0)
+                    goto error;
+                literal_bytes += (pos - literal + KT_DELTA_BLOCK - 1) / KT_DELTA_BLOCK * KT_DELTA_BLOCK;
+            }
+            if(kt_delta_push_op(delta, KT_DELTA_COPY, (uint64_t) match, 1) < 0)
+                goto error;
+            expected = match + 1;
+            pos += KT_DELTA_BLOCK;
+            literal = pos;
+            if(pos + KT_DELTA_BLOCK <= len)
+                weak = kt_delta_weak(data + pos, KT_DELTA_BLOCK, &a, &b);
+        }
+        else
+        {
+            // Roll the window one byte further
+            if(pos + KT_DELTA_BLOCK < len)
+            {
+                a = (a - data[pos] + data[pos + KT_DELTA_BLOCK]) & 0xFFFF;
+                b = (b - KT_DELTA_BLOCK * (uint32_t) data[pos] + a) & 0xFFFF;
+                weak = a | (b << 16);
+            }
+            pos++;
+        }
+    }
+    if(len > literal)
+    {
+        if(kt_delta_push_op(delta, KT_DELTA_LITERAL, literal, len - literal) < 0)
+            goto error;
+        literal_bytes += (len - literal + KT_DELTA_BLOCK - 1) / KT_DELTA_BLOCK * KT_DELTA_BLOCK;
+    }
+
+    free(head);
+    free(next);
+    return (int64_t) literal_bytes;
+
+error:
+    free(head);
+    free(next);
+    return -1;
+}
+
+// Ship the literal runs of the last diff (each of them padded to a whole block), and tell the apply script how to put the file back together
+static int kt_delta_write_patch(struct kt_delta *delta, const char *path, const KTDeltaFile *old, const unsigned char *data, const uint8_t *md5)
+{
+    unsigned char *literals;
+    size_t literal_size = 0;
+    size_t padded;
+    size_t i;
+    char hex[MD5_HASH_LENGTH + 1];
+    int ret;
+
+    for(i = 0; i < delta->num_ops; i++)
+    {
+        if(delta->ops[i].type == KT_DELTA_LITERAL)
+            literal_size += (size_t)(delta->ops[i].count + KT_DELTA_BLOCK - 1) / KT_DELTA_BLOCK * KT_DELTA_BLOCK;
+    }
+    if((literals = calloc(literal_size > 0 ? literal_size : 1, 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory for the delta of '%s'.\n", path);
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+
+    kt_delta_hex(old->md5, hex);
+    fprintf(delta->script, "\nKT_FILE=");
+    kt_delta_quote(delta->script, path);
+    fprintf(delta->script, "\nkt_check \"$KT_DELTA_BASE/$KT_FILE\" %s\n{\n", hex);
+    literal_size = 0;
+    for(i = 0; i < delta->num_ops; i++)
+    {
+        if(delta->ops[i].type == KT_DELTA_COPY)
+        {
+            fprintf(delta->script, "kt_copy %llu %llu\n", (unsigned long long) delta->ops[i].start, (unsigned long long) delta->ops[i].count);
+        }
+        else
+        {
+            fprintf(delta->script, "kt_lit %llu %llu\n", (unsigned long long)(literal_size / KT_DELTA_BLOCK), (unsigned long long) delta->ops[i].count);
+            memcpy(literals + literal_size, data + delta->ops[i].start, (size_t) delta->ops[i].count);
+            padded = (size_t)(delta->ops[i].count + KT_DELTA_BLOCK - 1) / KT_DELTA_BLOCK * KT_DELTA_BLOCK;
+            literal_size += padded;
+        }
+    }
+    kt_delta_hex(md5, hex);
+    fprintf(delta->script, "} > \"$KT_FILE.new\" || kt_fail \"$KT_FILE: cannot rebuild\"\n");
+    fprintf(delta->script, "kt_check \"$KT_FILE.new\" %s\n", hex);
+    fprintf(delta->script, "mv -f \"$KT_FILE.new\" \"$KT_FILE\" && rm -f \"$KT_FILE" KT_DELTA_SUFFIX "\" || kt_fail \"$KT_FILE: cannot rebuild\"\n");
+
+    ret = kt_delta_stage_file(delta->stage, path, KT_DELTA_SUFFIX, literals, literal_size);
+    delta->shipped_bytes += literal_size;
+    free(literals);
+    return ret;
+}
+
+// Sort out a regular file of the new payload
+static int kt_delta_add_file(struct kt_delta *delta, const char *path, const unsigned char *data, size_t len)
+{
+    KTDeltaFile *old;
+    struct md5_ctx md5;
+    uint8_t digest[MD5_DIGEST_SIZE];
+    char hex[MD5_HASH_LENGTH + 1];
+    int64_t literal_bytes;
+
+    md5_init(&md5);
+    md5_update(&md5, len, data);
+    md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+    delta->payload_bytes += len;
+
+    // If it used to be a symlink or a directory, that one goes, and this is a new file
+    if((old = kt_delta_find(delta, path)) != NULL && old->type == AE_IFREG)
+    {
+        if(old->seen)
+        {
+            fprintf(kt_stderr, "'%s' was passed twice.\n", path);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        old->seen = 1;
+        if(old->size == len && memcmp(old->md5, digest, MD5_DIGEST_SIZE) == 0)
+        {
+            // Unchanged, the device already has it
+            fprintf(kt_stderr, "= %s\n", path);
+            kt_delta_hex(digest, hex);
+            fprintf(delta->script, "kt_keep ");
+            kt_delta_quote(delta->script, path);
+            fprintf(delta->script, " %s\n", hex);
+            delta->num_unchanged++;
+            return 0;
+        }
+        delta->num_changed++;
+        // Only bother with a binary delta if it saves at least half of the file
+        if(len >= KT_DELTA_MIN_SIZE && old->num_blocks > 0)
+        {
+            if((literal_bytes = kt_delta_diff(delta, old, data, len)) < 0)
+                return -1;
+            if((uint64_t) literal_bytes + delta->num_ops * 32 < len / 2)
+            {
+                fprintf(kt_stderr, "~ %s\t\t(%lld of %lld bytes)\n", path, (long long) literal_bytes, (long long) len);
+                delta->num_patched++;
+                if(kt_delta_write_patch(delta, path, old, data, digest) < 0)
+                    return -1;
+                if(kt_delta_track(&delta->to_sync, &delta->num_to_sync, path) < 0)
+                {
+                    kt_set_error(KT_ERR_NOMEM);
+                    return -1;
+                }
+                return 0;
+            }
+        }
+        fprintf(kt_stderr, "M %s\n", path);
+    }
+    else
+    {
+        fprintf(kt_stderr, "+ %s\n", path);
+        delta->num_added++;
+    }
+
+    // Ship it whole
+    delta->shipped_bytes += len;
+    if(kt_delta_stage_file(delta->stage, path, "", data, len) < 0)
+        return -1;
+    if(kt_delta_track(&delta->to_sync, &delta->num_to_sync, path) < 0)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    return 0;
+}
+
+// The base gets the added & retargeted symlinks and the added directories once everything went fine
+static int kt_delta_sync_node(struct kt_delta *delta, const char *path, unsigned int type, const char *target)
+{
+    if(type == AE_IFLNK)
+    {
+        if(kt_delta_track(&delta->to_link, &delta->num_to_link, target) < 0 || kt_delta_track(&delta->to_link, &delta->num_to_link, path) < 0)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            return -1;
+        }
+    }
+    else if(kt_delta_track(&delta->to_mkdir, &delta->num_to_mkdir, path) < 0)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    return 0;
+}
+
+// Sort out a symlink or a directory of the new payload: nothing to ship, the apply script recreates it
+static int kt_delta_add_node(struct kt_delta *delta, const char *path, unsigned int type, const char *target)
+{
+    KTDeltaFile *old;
+
+    if(type == AE_IFLNK)
+        kt_delta_script_link(delta->script, "kt_link", target, path);
+    else
+        kt_delta_script_call(delta->script, "kt_mkdir", path);
+
+    // If it used to be something else, that one goes, and this is a new one
+    if((old = kt_delta_find(delta, path)) != NULL && old->type == type)
+    {
+        if(old->seen)
+        {
+            fprintf(kt_stderr, "'%s' was passed twice.\n", path);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        old->seen = 1;
+        if(type == AE_IFDIR || strcmp(old->target, target) == 0)
+        {
+            fprintf(kt_stderr, "= %s\n", path);
+            delta->num_unchanged++;
+            return 0;
+        }
+        fprintf(kt_stderr, "M %s\n", path);
+        delta->num_changed++;
+    }
+    else
+    {
+        fprintf(kt_stderr, "+ %s\n", path);
+        delta->num_added++;
+    }
+    return kt_delta_sync_node(delta, path, type, target);
+}
+
+// Walk one of create's inputs, naming entries the way create would
+static int kt_delta_walk(struct kt_delta *delta, const char *input, const unsigned int legacy)
+{
+    struct archive *disk;
+    struct archive_entry *entry;
+    struct stat st;
+    size_t tweak_index = 0;
+    unsigned char *data = NULL;
+    size_t data_size = 0;
+    size_t len;
+    ssize_t r;
+    const char *path;
+    unsigned int type;
+    int ret = -1;
+
+    if(legacy && stat(input, &st) == 0 && S_ISDIR(st.st_mode))
+        tweak_index = strlen(input);
+
+    disk = archive_read_disk_new();
+    archive_read_disk_set_standard_lookup(disk);
+    if(archive_read_disk_open(disk, input) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+        kt_set_error(KT_ERR_ARCHIVE);
+        archive_read_free(disk);
+        return -1;
+    }
+    entry = archive_entry_new();
+
+    for(;;)
+    {
+        archive_entry_clear(entry);
+        r = archive_read_next_header2(disk, entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header2() failed: %s.\n", archive_error_string(disk));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        archive_read_disk_descend(disk);
+        type = archive_entry_filetype(entry);
+        if(type != AE_IFREG && type != AE_IFLNK && type != AE_IFDIR)
+            continue;
+
+        path = archive_entry_pathname(entry);
+        if(tweak_index != 0)
+        {
+            // Create skips the root directory itself in legacy mode
+            if(type == AE_IFDIR && strlen(path) <= tweak_index)
+                continue;
+            path += (path[tweak_index] == '/' ? tweak_index + 1 : tweak_index);
+        }
+        // Same exclude list as create
+        if(IS_SIG(path) || IS_DAT(path))
+        {
+            fprintf(kt_stderr, "! %s\n", path);
+            continue;
+        }
+        path = kt_delta_path(path);
+        if(type == AE_IFDIR && strcmp(path, ".") == 0)
+            continue;
+        if(!kt_delta_path_is_sane(path) || strcmp(path, KT_DELTA_SCRIPT_NAME) == 0 || *path == '\0')
+        {
+            fprintf(kt_stderr, "Cannot build a delta package with '%s' in it.\n", archive_entry_pathname(entry));
+            kt_set_error(KT_ERR_INVALID);
+            goto cleanup;
+        }
+        if(type != AE_IFREG)
+        {
+            if(kt_delta_add_node(delta, path, type, (archive_entry_symlink(entry) != NULL ? archive_entry_symlink(entry) : "")) < 0)
+                goto cleanup;
+            continue;
+        }
+
+        // Slurp it, we'll need random access to diff it anyway
+        len = (size_t) archive_entry_size(entry);
+        if(len + 1 > data_size)
+        {
+            free(data);
+            data_size = len + 1;
+            if((data = malloc(data_size)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate memory to read '%s'.\n", path);
+                kt_set_error(KT_ERR_NOMEM);
+                data_size = 0;
+                goto cleanup;
+            }
+        }
+        if(len > 0 && (r = archive_read_data(disk, data, len)) < 0)
+        {
+            fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(disk));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        if(len > 0 && (size_t) r < len)
+        {
+            fprintf(kt_stderr, "%s: Truncated read; file may have shrunk while being diffed.\n", path);
+            kt_set_error(KT_ERR_IO);
+            goto cleanup;
+        }
+        if(kt_delta_add_file(delta, path, data, len) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    free(data);
+    archive_read_close(disk);
+    archive_read_free(disk);
+    archive_entry_free(entry);
+
+    return ret;
+}
+
+// The shell helpers of the apply script: a delta package rebuilds its full payload, a diff package only updates the base
+static void kt_delta_script_header(FILE *script, const char *from, const char *base, const unsigned int diff)
+{
+    char name[PATH_MAX];
+
+    kt_basename(from, name, sizeof(name));
+    if(diff)
+        fprintf(script,
+                "#!/bin/sh\n"
+                "#\n"
+                "# Generated by KindleTool: applies the changes shipped in this package to a copy of %s,\n"
+                "# which has to be found in $KT_DELTA_BASE (files are moved, replaced & removed in place).\n"
+                "#\n\n", name);
+    else
+        fprintf(script,
+                "#!/bin/sh\n"
+                "#\n"
+                "# Generated by KindleTool: rebuilds the full payload of this delta package,\n"
+                "# from the payload of %s, which has to be found in $KT_DELTA_BASE.\n"
+                "# Once it's done, the base is brought up to date, so that the next delta applies on top of it.\n"
+                "#\n\n", name);
+    // Not quoted, so that it can be a variable
+    fprintf(script, "KT_DELTA_BASE=\"${KT_DELTA_BASE:-%s}\"\n\n", base);
+    fprintf(script,
+            "kt_fail()\n"
+            "{\n"
+            "\techo \"kt_delta_apply: $*\" >&2\n"
+            "\texit 1\n"
+            "}\n\n"
+            "kt_check()\n"
+            "{\n"
+            "\t[ \"$(md5sum \"$1\" 2>/dev/null | cut -d ' ' -f 1)\" = \"$2\" ] || kt_fail \"$1: checksum mismatch\"\n"
+            "}\n\n");
+    if(diff)
+        fprintf(script,
+                "# Moves go through a temporary name, in case a new path goes through a removed one\n"
+                "kt_stash()\n"
+                "{\n"
+                "\tmv -f \"$KT_DELTA_BASE/$1\" \"$KT_DELTA_BASE/$1.ktmove\" || kt_fail \"$1: cannot move it\"\n"
+                "}\n\n"
+                "kt_unstash()\n"
+                "{\n"
+                "\tmkdir -p \"$(dirname \"$KT_DELTA_BASE/$2\")\" && mv -f \"$KT_DELTA_BASE/$1.ktmove\" \"$KT_DELTA_BASE/$2\" || kt_fail \"$1: cannot move it to $2\"\n"
+                "}\n\n"
+                "kt_check_link()\n"
+                "{\n"
+                "\t[ -L \"$1\" ] && [ \"$(readlink \"$1\")\" = \"$2\" ] || kt_fail \"$1: not a symlink to $2\"\n"
+                "}\n\n");
+    else
+        fprintf(script,
+                "# An unchanged file, straight from the base\n"
+                "kt_keep()\n"
+                "{\n"
+                "\tmkdir -p \"$(dirname \"$1\")\" && cp \"$KT_DELTA_BASE/$1\" \"$1\" || kt_fail \"$1: cannot copy it from the base\"\n"
+                "\tkt_check \"$1\" \"$2\"\n"
+                "}\n\n"
+                "# A symlink ($2, to $1) or a directory of the payload\n"
+                "kt_link()\n"
+                "{\n"
+                "\tmkdir -p \"$(dirname \"$2\")\" && rm -f \"$2\" && ln -s \"$1\" \"$2\" || kt_fail \"$2: cannot link it to $1\"\n"
+                "}\n\n"
+                "kt_mkdir()\n"
+                "{\n"
+                "\tmkdir -p \"$1\" || kt_fail \"$1: cannot create it\"\n"
+                "}\n\n"
+                "# $2 blocks of the base version of $KT_FILE, starting at block $1\n"
+                "kt_copy()\n"
+                "{\n"
+                "\tdd if=\"$KT_DELTA_BASE/$KT_FILE\" bs=%d skip=\"$1\" count=\"$2\" 2>/dev/null\n"
+                "}\n\n"
+                "# $2 bytes of the literal data of $KT_FILE, starting at block $1\n"
+                "kt_lit()\n"
+                "{\n"
+                "\tdd if=\"$KT_FILE" KT_DELTA_SUFFIX "\" bs=%d skip=\"$1\" count=\"$(($2 / %d))\" 2>/dev/null\n"
+                "\t[ \"$(($2 %% %d))\" -eq 0 ] || dd if=\"$KT_FILE" KT_DELTA_SUFFIX "\" bs=1 skip=\"$((($1 + $2 / %d) * %d))\" count=\"$(($2 %% %d))\" 2>/dev/null\n"
+                "}\n\n",
+                KT_DELTA_BLOCK, KT_DELTA_BLOCK, KT_DELTA_BLOCK, KT_DELTA_BLOCK, KT_DELTA_BLOCK, KT_DELTA_BLOCK, KT_DELTA_BLOCK);
+    fprintf(script,
+            "kt_sync()\n"
+            "{\n"
+            "\tmkdir -p \"$(dirname \"$KT_DELTA_BASE/$1\")\" && cp \"$1\" \"$KT_DELTA_BASE/$1\" || kt_fail \"$1: cannot update the base\"\n"
+            "}\n\n"
+            "kt_sync_link()\n"
+            "{\n"
+            "\tmkdir -p \"$(dirname \"$KT_DELTA_BASE/$2\")\" && rm -f \"$KT_DELTA_BASE/$2\" && ln -s \"$1\" \"$KT_DELTA_BASE/$2\" || kt_fail \"$2: cannot update the base\"\n"
+            "}\n\n"
+            "kt_sync_dir()\n"
+            "{\n"
+            "\tmkdir -p \"$KT_DELTA_BASE/$1\" || kt_fail \"$1: cannot update the base\"\n"
+            "}\n\n"
+            "kt_drop()\n"
+            "{\n"
+            "\trm -f \"$KT_DELTA_BASE/$1\"\n"
+            "}\n\n"
+            "# Removed directories only go if nothing else was left in them\n"
+            "kt_drop_dir()\n"
+            "{\n"
+            "\trmdir \"$KT_DELTA_BASE/$1\" 2>/dev/null\n"
+            "}\n\n"
+            "cd \"$(dirname \"$0\")\" || kt_fail \"cannot find the payload\"\n\n");
+}
+
+// Our own little corner of the temp directory: the apply script goes in a directory of its own, so that create archives it first (and it runs before the update's own scripts)
+static int kt_delta_stage_init(struct kt_delta *delta, KTDeltaStage *stage, const char *from, const char *base, const unsigned int diff)
+{
+    char *script_name;
+
+    memset(stage, 0, sizeof(*stage));
+    memset(delta, 0, sizeof(*delta));
+    delta->stage = stage;
+
+    if((stage->dir = strdup(KT_TMPDIR "/kindletool_create_delta_XXXXXX")) == NULL)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    if(_mktemp(stage->dir) == NULL || mkdir(stage->dir) != 0)
+#else
+    if(mkdtemp(stage->dir) == NULL)
+#endif
+    {
+        fprintf(kt_stderr, "Couldn't create temporary directory: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(stage->dir);
+        stage->dir = NULL;
+        return -1;
+    }
+    if((stage->inputs[0] = malloc(strlen(stage->dir) + sizeof("/script"))) == NULL || (stage->inputs[1] = malloc(strlen(stage->dir) + sizeof("/payload"))) == NULL)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    sprintf(stage->inputs[0], "%s/script", stage->dir);
+    sprintf(stage->inputs[1], "%s/payload", stage->dir);
+    if(kt_delta_mkdir(stage, stage->inputs[0]) < 0 || kt_delta_mkdir(stage, stage->inputs[1]) < 0)
+        return -1;
+
+    if((script_name = malloc(strlen(stage->inputs[0]) + 1 + sizeof(KT_DELTA_SCRIPT_NAME))) == NULL)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    sprintf(script_name, "%s/" KT_DELTA_SCRIPT_NAME, stage->inputs[0]);
+    if((delta->script = fopen(script_name, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open apply script '%s' for writing: %s.\n", script_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(script_name);
+        return -1;
+    }
+    if(kt_delta_track(&stage->files, &stage->num_files, script_name) < 0)
+    {
+        kt_set_error(KT_ERR_NOMEM);
+        free(script_name);
+        return -1;
+    }
+    free(script_name);
+    kt_delta_script_header(delta->script, from, base, diff);
+
+    return 0;
+}
+
+// Close the apply script, free everything, and throw the staging tree away if something went wrong
+static int kt_delta_stage_done(struct kt_delta *delta, int ret)
+{
+    unsigned int i;
+
+    if(delta->script != NULL && fclose(delta->script) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Error writing apply script: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        ret = -1;
+    }
+    for(i = 0; i < delta->num_files; i++)
+    {
+        free(delta->files[i].path);
+        free(delta->files[i].target);
+        free(delta->files[i].blocks);
+    }
+    free(delta->files);
+    for(i = 0; i < delta->num_to_sync; i++)
+        free(delta->to_sync[i]);
+    free(delta->to_sync);
+    for(i = 0; i < delta->num_to_link; i++)
+        free(delta->to_link[i]);
+    free(delta->to_link);
+    for(i = 0; i < delta->num_to_mkdir; i++)
+        free(delta->to_mkdir[i]);
+    free(delta->to_mkdir);
+    free(delta->ops);
+    if(ret < 0)
+        kt_delta_stage_free(delta->stage);
+
+    return ret;
+}
+
+// Removed files go before anything is copied to the base, in case a new path goes through one of them, and removed directories go once they've been emptied (deepest first)
+static void kt_delta_script_sync(struct kt_delta *delta)
+{
+    unsigned int i;
+
+    for(i = 0; i < delta->num_files; i++)
+    {
+        if(delta->files[i].seen || delta->files[i].type == AE_IFDIR)
+            continue;
+        fprintf(kt_stderr, "- %s\n", delta->files[i].path);
+        fprintf(delta->script, "kt_drop ");
+        kt_delta_quote(delta->script, delta->files[i].path);
+        fprintf(delta->script, "\n");
+        delta->num_removed++;
+    }
+    for(i = delta->num_files; i-- > 0;)
+    {
+        if(delta->files[i].seen || delta->files[i].type != AE_IFDIR)
+            continue;
+        fprintf(kt_stderr, "- %s\n", delta->files[i].path);
+        kt_delta_script_call(delta->script, "kt_drop_dir", delta->files[i].path);
+        delta->num_removed++;
+    }
+    for(i = 0; i < delta->num_to_mkdir; i++)
+        kt_delta_script_call(delta->script, "kt_sync_dir", delta->to_mkdir[i]);
+    for(i = 0; i < delta->num_to_sync; i++)
+    {
+        fprintf(delta->script, "kt_sync ");
+        kt_delta_quote(delta->script, delta->to_sync[i]);
+        fprintf(delta->script, "\n");
+    }
+    for(i = 0; i + 1 < delta->num_to_link; i += 2)
+        kt_delta_script_link(delta->script, "kt_sync_link", delta->to_link[i], delta->to_link[i + 1]);
+}
+
+static int kt_delta_script_end(struct kt_delta *delta)
+{
+    fprintf(delta->script, "\nexit 0\n");
+    if(ferror(delta->script) != 0)
+    {
+        fprintf(kt_stderr, "Error writing apply script: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    return 0;
+}
+
+// Build the staging tree of a delta package: create archives stage->inputs (in legacy mode) instead of its own inputs
+int kt_delta_stage(KTDeltaStage *stage, const char *old_name, char **input_list, const unsigned int input_count, const unsigned int legacy, const char *base)
+{
+    struct kt_delta delta;
+    unsigned int i;
+
+    if(kt_delta_stage_init(&delta, stage, old_name, base, 0) < 0)
+        return kt_delta_stage_done(&delta, -1);
+    if(kt_delta_load(&delta, old_name) < 0)
+        return kt_delta_stage_done(&delta, -1);
+    for(i = 0; i < input_count; i++)
+    {
+        if(kt_delta_walk(&delta, input_list[i], legacy) < 0)
+            return kt_delta_stage_done(&delta, -1);
+    }
+
+    // Bring the base up to date
+    fprintf(delta.script, "\n# The base now matches this payload\n");
+    kt_delta_script_sync(&delta);
+    if(kt_delta_script_end(&delta) < 0)
+        return kt_delta_stage_done(&delta, -1);
+
+    fprintf(kt_stderr, "Delta: %u unchanged, %u added, %u changed (%u as binary deltas), %u removed. Shipping %llu of %llu bytes.\n", delta.num_unchanged, delta.num_added, delta.num_changed, delta.num_patched, delta.num_removed, (unsigned long long) delta.shipped_bytes, (unsigned long long) delta.payload_bytes);
+    return kt_delta_stage_done(&delta, 0);
+}
+
+// List the regular files, symlinks & directories of a directory tree, relative to its root
+static int kt_delta_list_tree(const char *root, KTDeltaFile **files, unsigned int *num_files)
+{
+    struct archive *disk;
+    struct archive_entry *entry;
+    struct stat st;
+    KTDeltaFile *new_files;
+    size_t root_len;
+    const char *path;
+    unsigned int type;
+    int r;
+    int ret = -1;
+
+    if(stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(kt_stderr, "'%s' is not a directory.\n", root);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    root_len = strlen(root);
+
+    disk = archive_read_disk_new();
+    archive_read_disk_set_standard_lookup(disk);
+    if(archive_read_disk_open(disk, root) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+        kt_set_error(KT_ERR_ARCHIVE);
+        archive_read_free(disk);
+        return -1;
+    }
+    entry = archive_entry_new();
+
+    for(;;)
+    {
+        archive_entry_clear(entry);
+        r = archive_read_next_header2(disk, entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header2() failed: %s.\n", archive_error_string(disk));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        archive_read_disk_descend(disk);
+        type = archive_entry_filetype(entry);
+        if(type != AE_IFREG && type != AE_IFLNK && type != AE_IFDIR)
+            continue;
+
+        // Same naming & exclude list as create in legacy mode (which skips the root directory itself)
+        path = archive_entry_pathname(entry);
+        if(type == AE_IFDIR && strlen(path) <= root_len)
+            continue;
+        if(strlen(path) > root_len)
+            path += (path[root_len] == '/' ? root_len + 1 : root_len);
+        if(IS_SIG(path) || IS_DAT(path))
+        {
+            fprintf(kt_stderr, "! %s\n", path);
+            continue;
+        }
+        path = kt_delta_path(path);
+        if(!kt_delta_path_is_sane(path) || strcmp(path, KT_DELTA_SCRIPT_NAME) == 0 || *path == '\0')
+        {
+            fprintf(kt_stderr, "Cannot build a diff package with '%s' in it.\n", archive_entry_pathname(entry));
+            kt_set_error(KT_ERR_INVALID);
+            goto cleanup;
+        }
+
+        if((new_files = realloc(*files, (*num_files + 1) * sizeof(**files))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate memory for the file list of '%s'.\n", root);
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        *files = new_files;
+        memset(&new_files[*num_files], 0, sizeof(**files));
+        if((new_files[*num_files].path = strdup(path)) == NULL)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        (*num_files)++;
+        new_files[*num_files - 1].type = type;
+        if(type == AE_IFREG)
+            new_files[*num_files - 1].size = (uint64_t) archive_entry_size(entry);
+        else if(type == AE_IFLNK && (new_files[*num_files - 1].target = strdup(archive_entry_symlink(entry) != NULL ? archive_entry_symlink(entry) : "")) == NULL)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+    }
+    qsort(*files, *num_files, sizeof(**files), kt_delta_file_cmp);
+    ret = 0;
+
+cleanup:
+    archive_read_close(disk);
+    archive_read_free(disk);
+    archive_entry_free(entry);
+
+    return ret;
+}
+
+static char *kt_delta_join(const char *root, const char *path)
+{
+    char *joined;
+
+    if((joined = malloc(strlen(root) + 1 + strlen(path) + 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate memory for a path.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return NULL;
+    }
+    sprintf(joined, "%s/%s", root, path);
+    return joined;
+}
+
+struct kt_delta_hash_pool
+{
+    KTContext *ctx;
+    pthread_mutex_t lock;
+    const char *root;
+    KTDeltaFile *files;
+    unsigned int num_files;
+    unsigned int next;
+    unsigned int failed;
+};
+
+static int kt_delta_hash_file(const char *root, KTDeltaFile *file, unsigned char *buf)
+{
+    struct md5_ctx md5;
+    char *name;
+    FILE *in;
+    size_t len;
+    uint64_t size = 0;
+
+    // Symlinks are compared by their target, and directories not at all
+    if(file->type != AE_IFREG)
+        return 0;
+    if((name = kt_delta_join(root, file->path)) == NULL)
+        return -1;
+    if((in = fopen(name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(name);
+        return -1;
+    }
+    md5_init(&md5);
+    while((len = fread(buf, sizeof(unsigned char), KT_DELTA_READ_SIZE, in)) > 0)
+    {
+        md5_update(&md5, len, buf);
+        size += len;
+    }
+    if(ferror(in) != 0)
+    {
+        fprintf(kt_stderr, "Error reading '%s': %s.\n", name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(in);
+        free(name);
+        return -1;
+    }
+    md5_digest(&md5, MD5_DIGEST_SIZE, file->md5);
+    // What we hashed is what counts
+    file->size = size;
+    fclose(in);
+    free(name);
+    return 0;
+}
+
+static void kt_delta_hash_loop(struct kt_delta_hash_pool *pool)
+{
+    unsigned char *buf;
+    unsigned int i;
+
+    if((buf = malloc(KT_DELTA_READ_SIZE)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read buffer.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        pthread_mutex_lock(&pool->lock);
+        pool->failed = 1;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if(pool->failed || pool->next >= pool->num_files)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(kt_delta_hash_file(pool->root, &pool->files[i], buf) < 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    free(buf);
+}
+
+static void *kt_delta_hash_worker(void *arg)
+{
+    struct kt_delta_hash_pool *pool = arg;
+
+    kt_context_attach(pool->ctx);
+    kt_delta_hash_loop(pool);
+    kt_context_attach(NULL);
+
+    return NULL;
+}
+
+// Hash a whole tree, with a pool of threads
+static int kt_delta_hash_tree(const char *root, KTDeltaFile *files, unsigned int num_files, unsigned int jobs)
+{
+    struct kt_delta_hash_pool pool;
+    pthread_t *workers = NULL;
+    unsigned int num_workers = 0;
+    unsigned int i;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.ctx = kt_context_current();
+    pool.root = root;
+    pool.files = files;
+    pool.num_files = num_files;
+
+    if(jobs > num_files)
+        jobs = num_files;
+    if(jobs > 1 && (workers = malloc(jobs * sizeof(*workers))) != NULL)
+    {
+        for(num_workers = 0; num_workers < jobs; num_workers++)
+        {
+            if(pthread_create(&workers[num_workers], NULL, kt_delta_hash_worker, &pool) != 0)
+                break;
+        }
+    }
+    // Do it ourselves if we couldn't spawn anything
+    if(num_workers == 0)
+        kt_delta_hash_loop(&pool);
+    for(i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+
+    return (pool.failed ? -1 : 0);
+}
+
+// Copy a file of the new tree to the staging tree
+static int kt_delta_stage_copy(KTDeltaStage *stage, const char *root, const char *path)
+{
+    unsigned char *buf;
+    char *name;
+    FILE *in;
+    size_t len;
+    size_t total = 0;
+    size_t size = 0;
+    int ret = -1;
+
+    if((name = kt_delta_join(root, path)) == NULL)
+        return -1;
+    if((in = fopen(name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(name);
+        return -1;
+    }
+    // Changed files are usually small enough, keep it simple
+    buf = NULL;
+    for(;;)
+    {
+        unsigned char *new_buf;
+
+        if(total == size)
+        {
+            size = (size > 0 ? size * 2 : KT_DELTA_READ_SIZE);
+            if((new_buf = realloc(buf, size)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate memory to read '%s'.\n", name);
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            buf = new_buf;
+        }
+        if((len = fread(buf + total, sizeof(unsigned char), size - total, in)) == 0)
+            break;
+        total += len;
+    }
+    if(ferror(in) != 0)
+    {
+        fprintf(kt_stderr, "Error reading '%s': %s.\n", name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    ret = kt_delta_stage_file(stage, path, "", buf, total);
+
+cleanup:
+    free(buf);
+    fclose(in);
+    free(name);
+    return ret;
+}
+
+static int kt_delta_content_cmp(const void *a, const void *b)
+{
+    const KTDeltaFile *fa = *(const KTDeltaFile * const *) a;
+    const KTDeltaFile *fb = *(const KTDeltaFile * const *) b;
+
+    if(fa->size != fb->size)
+        return (fa->size < fb->size ? -1 : 1);
+    return memcmp(fa->md5, fb->md5, MD5_DIGEST_SIZE);
+}
+
+static void kt_delta_script_check(FILE *script, const KTDeltaFile *file)
+{
+    char hex[MD5_HASH_LENGTH + 1];
+
+    if(file->type == AE_IFDIR)
+        return;
+    if(file->type == AE_IFLNK)
+    {
+        fprintf(script, "kt_check_link \"$KT_DELTA_BASE\"/");
+        kt_delta_quote(script, file->path);
+        fputc(' ', script);
+        kt_delta_quote(script, file->target);
+        fprintf(script, "\n");
+        return;
+    }
+    kt_delta_hex(file->md5, hex);
+    fprintf(script, "kt_check \"$KT_DELTA_BASE\"/");
+    kt_delta_quote(script, file->path);
+    fprintf(script, " %s\n", hex);
+}
+
+// Build the staging tree of a package that turns a copy of old_root into new_root: only added & changed files are shipped, moves, removals, symlinks & directories are left to the apply script
+int kt_delta_stage_trees(KTDeltaStage *stage, const char *old_root, const char *new_root, unsigned int jobs, const char *base)
+{
+    struct kt_delta delta;
+    KTDeltaFile *new_files = NULL;
+    unsigned int num_new = 0;
+    KTDeltaFile **removed = NULL;
+    unsigned int num_removed = 0;
+    unsigned int num_moved = 0;
+    KTDeltaFile *old;
+    KTDeltaFile **found;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    unsigned int i, j;
+    int ret = -1;
+
+    if(kt_delta_stage_init(&delta, stage, old_root, base, 1) < 0)
+        return kt_delta_stage_done(&delta, -1);
+
+    // Hash both trees
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if(kt_delta_list_tree(old_root, &delta.files, &delta.num_files) < 0 || kt_delta_list_tree(new_root, &new_files, &num_new) < 0)
+        goto cleanup;
+    if(kt_delta_hash_tree(old_root, delta.files, delta.num_files, jobs) < 0 || kt_delta_hash_tree(new_root, new_files, num_new, jobs) < 0)
+        goto cleanup;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    fprintf(kt_stderr, "Hashed %u + %u files, symlinks & directories in %.2fs (%u job%s).\n", delta.num_files, num_new, elapsed, jobs, (jobs > 1 ? "s" : ""));
+
+    // Same path (and same kind: if that changed, the old one goes, and the new one is added)
+    for(i = 0; i < num_new; i++)
+    {
+        delta.payload_bytes += new_files[i].size;
+        if((old = kt_delta_find(&delta, new_files[i].path)) == NULL || old->type != new_files[i].type)
+            continue;
+        old->seen = 1;
+        new_files[i].seen = 1;
+        if(old->type == AE_IFDIR)
+            delta.num_unchanged++;
+        else if(old->type == AE_IFLNK ? strcmp(old->target, new_files[i].target) == 0 : (old->size == new_files[i].size && memcmp(old->md5, new_files[i].md5, MD5_DIGEST_SIZE) == 0))
+            delta.num_unchanged++;
+        else
+            new_files[i].other = old;
+    }
+
+    // Whatever is left of the old tree's files might just have moved: match it by content
+    for(i = 0; i < delta.num_files; i++)
+    {
+        if(delta.files[i].seen || delta.files[i].type != AE_IFREG)
+            continue;
+        if((found = realloc(removed, (num_removed + 1) * sizeof(*removed))) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate memory for the list of removed files.\n");
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+        removed = found;
+        removed[num_removed++] = &delta.files[i];
+    }
+    qsort(removed, num_removed, sizeof(*removed), kt_delta_content_cmp);
+    for(i = 0; i < num_new && num_removed > 0; i++)
+    {
+        KTDeltaFile *key = &new_files[i];
+
+        if(new_files[i].seen || new_files[i].type != AE_IFREG || (found = bsearch(&key, removed, num_removed, sizeof(*removed), kt_delta_content_cmp)) == NULL)
+            continue;
+        // Take the first one of the same content that hasn't been claimed yet
+        j = (unsigned int) (found - removed);
+        while(j > 0 && kt_delta_content_cmp(&removed[j - 1], &key) == 0)
+            j--;
+        for(; j < num_removed && kt_delta_content_cmp(&removed[j], &key) == 0; j++)
+        {
+            if(!removed[j]->seen)
+            {
+                removed[j]->seen = 1;
+                new_files[i].seen = 1;
+                new_files[i].moved = 1;
+                new_files[i].other = removed[j];
+                num_moved++;
+                break;
+            }
+        }
+    }
+
+    // Make sure the device has what we diffed against before touching anything
+    fprintf(delta.script, "# The base has to be what this package was built against\n");
+    for(i = 0; i < num_new; i++)
+    {
+        if(new_files[i].other != NULL)
+            kt_delta_script_check(delta.script, new_files[i].other);
+    }
+    for(i = 0; i < delta.num_files; i++)
+    {
+        if(!delta.files[i].seen)
+            kt_delta_script_check(delta.script, &delta.files[i]);
+    }
+
+    fprintf(delta.script, "\n# Moved files\n");
+    for(i = 0; i < num_new; i++)
+    {
+        if(!new_files[i].moved)
+            continue;
+        fprintf(delta.script, "kt_stash ");
+        kt_delta_quote(delta.script, new_files[i].other->path);
+        fprintf(delta.script, "\n");
+    }
+    for(i = 0; i < num_new; i++)
+    {
+        if(!new_files[i].moved)
+            continue;
+        fprintf(kt_stderr, "R %s -> %s\n", new_files[i].other->path, new_files[i].path);
+        fprintf(delta.script, "kt_unstash ");
+        kt_delta_quote(delta.script, new_files[i].other->path);
+        fprintf(delta.script, " ");
+        kt_delta_quote(delta.script, new_files[i].path);
+        fprintf(delta.script, "\n");
+    }
+
+    // Ship the rest
+    for(i = 0; i < num_new; i++)
+    {
+        if(new_files[i].moved || (new_files[i].seen && new_files[i].other == NULL))
+            continue;
+        if(new_files[i].other != NULL)
+        {
+            fprintf(kt_stderr, "M %s\n", new_files[i].path);
+            delta.num_changed++;
+        }
+        else
+        {
+            fprintf(kt_stderr, "+ %s\n", new_files[i].path);
+            delta.num_added++;
+        }
+        if(new_files[i].type != AE_IFREG)
+        {
+            if(kt_delta_sync_node(&delta, new_files[i].path, new_files[i].type, new_files[i].target) < 0)
+                goto cleanup;
+            continue;
+        }
+        delta.shipped_bytes += new_files[i].size;
+        if(kt_delta_stage_copy(stage, new_root, new_files[i].path) < 0)
+            goto cleanup;
+        if(kt_delta_track(&delta.to_sync, &delta.num_to_sync, new_files[i].path) < 0)
+        {
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+    }
+    // Directories that are gone from the new tree are removed as well, once their files moved away or were removed
+    fprintf(delta.script, "\n# Removed, replaced & added files, symlinks & directories\n");
+    kt_delta_script_sync(&delta);
+    if(kt_delta_script_end(&delta) < 0)
+        goto cleanup;
+
+    fprintf(kt_stderr, "Diff: %u unchanged, %u added, %u changed, %u moved, %u removed. Shipping %llu of %llu bytes.\n", delta.num_unchanged, delta.num_added, delta.num_changed, num_moved, delta.num_removed, (unsigned long long) delta.shipped_bytes, (unsigned long long) delta.payload_bytes);
+    ret = 0;
+
+cleanup:
+    for(i = 0; i < num_new; i++)
+    {
+        free(new_files[i].path);
+        free(new_files[i].target);
+    }
+    free(new_files);
+    free(removed);
+
+    return kt_delta_stage_done(&delta, ret);
+}
+
+// Remove the staging tree, and forget about it
+void kt_delta_stage_free(KTDeltaStage *stage)
+{
+    unsigned int i;
+
+    for(i = 0; i < stage->num_files; i++)
+    {
+        unlink(stage->files[i]);
+        free(stage->files[i]);
+    }
+    free(stage->files);
+    // Deepest first
+    for(i = stage->num_dirs; i-- > 0;)
+    {
+        rmdir(stage->dirs[i]);
+        free(stage->dirs[i]);
+    }
+    free(stage->dirs);
+    if(stage->dir != NULL)
+        rmdir(stage->dir);
+    free(stage->dir);
+    free(stage->inputs[0]);
+    free(stage->inputs[1]);
+    memset(stage, 0, sizeof(*stage));
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
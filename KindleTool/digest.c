@@ -0,0 +1,385 @@
+//
+//  digest.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// A persistent digest cache for extract --incremental: the MD5 of every file we've extracted (or found identical),
+// keyed by its path in the package, and by what stat() said about it at the time (size, inode, mtime & ctime).
+// As long as nothing touched a file since, we know its digest without reading it back.
+// It's a plain text file living next to the output directory, one record per line:
+//     <md5> <size> <inode> <mtime>.<nsec> <ctime>.<nsec> <path>
+// It also holds what the package we're extracting expects (the MD5s of its update-filelist.dat), but that part isn't saved.
+
+#define KT_DIGEST_HEADER "# KindleTool digest cache v1\n"
+
+#if defined(__APPLE__)
+#define KT_DIGEST_MTIME_NSEC(st) ((long) (st)->st_mtimespec.tv_nsec)
+#define KT_DIGEST_CTIME_NSEC(st) ((long) (st)->st_ctimespec.tv_nsec)
+#elif defined(_WIN32) && !defined(__CYGWIN__)
+#define KT_DIGEST_MTIME_NSEC(st) 0L
+#define KT_DIGEST_CTIME_NSEC(st) 0L
+#else
+#define KT_DIGEST_MTIME_NSEC(st) ((long) (st)->st_mtim.tv_nsec)
+#define KT_DIGEST_CTIME_NSEC(st) ((long) (st)->st_ctim.tv_nsec)
+#endif
+
+struct kt_digest_record
+{
+    char *path;
+    int has_digest;
+    char md5[MD5_HASH_LENGTH + 1];
+    uint64_t size;
+    uint64_t ino;
+    int64_t mtime;
+    long mtime_nsec;
+    int64_t ctime;
+    long ctime_nsec;
+    int has_expected;
+    char expected[MD5_HASH_LENGTH + 1];     // From the package's update-filelist.dat
+};
+
+struct kt_digest_cache
+{
+    char *filename;
+    struct kt_digest_record **records;
+    size_t count;
+    size_t size;
+    KTHashTable index;          // Of records, by path
+    unsigned int num_loaded;
+    int dirty;
+};
+
+char *kt_digest_cache_default_name(const char *output_dir)
+{
+    char *name;
+    size_t len = strlen(output_dir);
+
+    // Right next to the output directory, not in it, or we'd end up repackaging it
+    while(len > 1 && output_dir[len - 1] == '/')
+        len--;
+    if((name = malloc(len + sizeof(KT_DIGEST_SUFFIX))) == NULL)
+        return NULL;
+    memcpy(name, output_dir, len);
+    memcpy(name + len, KT_DIGEST_SUFFIX, sizeof(KT_DIGEST_SUFFIX));
+
+    return name;
+}
+
+static size_t kt_digest_cache_hash(void *arg, size_t index)
+{
+    const KTDigestCache *cache = arg;
+
+    return kt_hash_path(cache->records[index]->path, strlen(cache->records[index]->path));
+}
+
+static int kt_digest_cache_match(void *arg, size_t index, const void *path, size_t len)
+{
+    const KTDigestCache *cache = arg;
+
+    return strncmp(cache->records[index]->path, path, len) == 0 && cache->records[index]->path[len] == '\0';
+}
+
+static struct kt_digest_record *kt_digest_cache_find(KTDigestCache *cache, const char *path)
+{
+    size_t len = strlen(path);
+    size_t i;
+
+    if((i = kt_hash_table_find(&cache->index, kt_hash_path(path, len), path, len)) == KT_HASH_NONE)
+        return NULL;
+    return cache->records[i];
+}
+
+// Find the record of path, creating it if need be
+static struct kt_digest_record *kt_digest_cache_get(KTDigestCache *cache, const char *path)
+{
+    struct kt_digest_record **records;
+    struct kt_digest_record *record;
+
+    if((record = kt_digest_cache_find(cache, path)) != NULL)
+        return record;
+
+    if(cache->count == cache->size)
+    {
+        if((records = realloc(cache->records, (cache->size ? cache->size * 2 : 256) * sizeof(*records))) == NULL)
+            return NULL;
+        cache->records = records;
+        cache->size = (cache->size ? cache->size * 2 : 256);
+    }
+    if((record = calloc(1, sizeof(*record))) == NULL)
+        return NULL;
+    if((record->path = strdup(path)) == NULL)
+    {
+        free(record);
+        return NULL;
+    }
+    cache->records[cache->count] = record;
+    if(kt_hash_table_insert(&cache->index, cache->count) < 0)
+    {
+        free(record->path);
+        free(record);
+        return NULL;
+    }
+    cache->count++;
+
+    return record;
+}
+
+static void kt_digest_record_stat(struct kt_digest_record *record, const struct stat *st)
+{
+    record->size = (uint64_t) st->st_size;
+    record->ino = (uint64_t) st->st_ino;
+    record->mtime = (int64_t) st->st_mtime;
+    record->mtime_nsec = KT_DIGEST_MTIME_NSEC(st);
+    record->ctime = (int64_t) st->st_ctime;
+    record->ctime_nsec = KT_DIGEST_CTIME_NSEC(st);
+}
+
+// A missing cache is an empty one, and so is a corrupted one (we only ever lose a few reads)
+KTDigestCache *kt_digest_cache_open(const char *filename)
+{
+    KTDigestCache *cache;
+    struct kt_digest_record *record;
+    FILE *in;
+    char line[PATH_MAX + 128];
+    char md5[MD5_HASH_LENGTH + 1];
+    unsigned long long size;
+    unsigned long long ino;
+    long long mtime;
+    long mtime_nsec;
+    long long ctime;
+    long ctime_nsec;
+    int path_start;
+    size_t len;
+
+    if((cache = calloc(1, sizeof(*cache))) == NULL || (cache->filename = strdup(filename)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate digest cache: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        free(cache);
+        return NULL;
+    }
+    kt_hash_table_init(&cache->index, kt_digest_cache_hash, kt_digest_cache_match, cache);
+    if((in = fopen(filename, "rb")) == NULL)
+        return cache;
+
+    if(fgets(line, sizeof(line), in) == NULL || strcmp(line, KT_DIGEST_HEADER) != 0)
+    {
+        fprintf(kt_stderr, "Digest cache '%s' isn't one of ours, starting from scratch.\n", filename);
+        fclose(in);
+        return cache;
+    }
+    while(fgets(line, sizeof(line), in) != NULL)
+    {
+        len = strlen(line);
+        if(len == 0 || line[len - 1] != '\n')
+            break;
+        line[--len] = '\0';
+        path_start = 0;
+        if(sscanf(line, "%32s %llu %llu %lld.%ld %lld.%ld %n", md5, &size, &ino, &mtime, &mtime_nsec, &ctime, &ctime_nsec, &path_start) != 7 || path_start == 0 || line[path_start] == '\0' || strlen(md5) != MD5_HASH_LENGTH)
+            continue;
+        if((record = kt_digest_cache_get(cache, line + path_start)) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate digest cache record: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            fclose(in);
+            kt_digest_cache_free(cache);
+            return NULL;
+        }
+        record->has_digest = 1;
+        memcpy(record->md5, md5, sizeof(record->md5));
+        record->size = (uint64_t) size;
+        record->ino = (uint64_t) ino;
+        record->mtime = (int64_t) mtime;
+        record->mtime_nsec = mtime_nsec;
+        record->ctime = (int64_t) ctime;
+        record->ctime_nsec = ctime_nsec;
+        cache->num_loaded++;
+    }
+    fclose(in);
+
+    return cache;
+}
+
+unsigned int kt_digest_cache_size(const KTDigestCache *cache)
+{
+    return cache->num_loaded;
+}
+
+const char *kt_digest_cache_name(const KTDigestCache *cache)
+{
+    return cache->filename;
+}
+
+// What the package says path should hash to
+int kt_digest_cache_expect(KTDigestCache *cache, const char *path, const char *md5)
+{
+    struct kt_digest_record *record;
+
+    if(strlen(md5) != MD5_HASH_LENGTH)
+        return 0;
+    if((record = kt_digest_cache_get(cache, path)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate digest cache record: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    record->has_expected = 1;
+    memcpy(record->expected, md5, sizeof(record->expected));
+
+    return 0;
+}
+
+const char *kt_digest_cache_expected(KTDigestCache *cache, const char *path)
+{
+    struct kt_digest_record *record;
+
+    if((record = kt_digest_cache_find(cache, path)) == NULL || !record->has_expected)
+        return NULL;
+    return record->expected;
+}
+
+// The digest of path, if it's still the file we hashed
+const char *kt_digest_cache_lookup(KTDigestCache *cache, const char *path, const struct stat *st)
+{
+    struct kt_digest_record *record;
+
+    if((record = kt_digest_cache_find(cache, path)) == NULL || !record->has_digest)
+        return NULL;
+    if(record->size != (uint64_t) st->st_size || record->ino != (uint64_t) st->st_ino
+       || record->mtime != (int64_t) st->st_mtime || record->mtime_nsec != KT_DIGEST_MTIME_NSEC(st)
+       || record->ctime != (int64_t) st->st_ctime || record->ctime_nsec != KT_DIGEST_CTIME_NSEC(st))
+        return NULL;
+    return record->md5;
+}
+
+int kt_digest_cache_update(KTDigestCache *cache, const char *path, const struct stat *st, const char *md5)
+{
+    struct kt_digest_record *record;
+
+    // We couldn't read such a record back
+    if(strchr(path, '\n') != NULL)
+        return 0;
+    if((record = kt_digest_cache_get(cache, path)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate digest cache record: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    record->has_digest = 1;
+    snprintf(record->md5, sizeof(record->md5), "%s", md5);
+    kt_digest_record_stat(record, st);
+    cache->dirty = 1;
+
+    return 0;
+}
+
+// Forget about path, because we're rewriting it behind the cache's back
+void kt_digest_cache_forget(KTDigestCache *cache, const char *path)
+{
+    struct kt_digest_record *record;
+
+    if((record = kt_digest_cache_find(cache, path)) != NULL && record->has_digest)
+    {
+        record->has_digest = 0;
+        cache->dirty = 1;
+    }
+}
+
+// Write it to a temp file, and rename it over the old one, so that an interrupted save doesn't lose everything
+int kt_digest_cache_save(KTDigestCache *cache)
+{
+    struct kt_digest_record *record;
+    char *temp_name;
+    FILE *out;
+    size_t i;
+    int ret = -1;
+
+    if(!cache->dirty)
+        return 0;
+    if((temp_name = malloc(strlen(cache->filename) + sizeof(".tmp"))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate digest cache filename: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    sprintf(temp_name, "%s.tmp", cache->filename);
+    if((out = fopen(temp_name, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open digest cache '%s' for writing: %s.\n", temp_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(temp_name);
+        return -1;
+    }
+    fputs(KT_DIGEST_HEADER, out);
+    for(i = 0; i < cache->count; i++)
+    {
+        record = cache->records[i];
+        if(!record->has_digest)
+            continue;
+        fprintf(out, "%s %llu %llu %lld.%09ld %lld.%09ld %s\n", record->md5, (unsigned long long) record->size, (unsigned long long) record->ino, (long long) record->mtime, record->mtime_nsec, (long long) record->ctime, record->ctime_nsec, record->path);
+    }
+    if(ferror(out))
+    {
+        fprintf(kt_stderr, "Cannot write digest cache '%s': %s.\n", temp_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(out);
+        goto cleanup;
+    }
+    if(fclose(out) != 0)
+    {
+        fprintf(kt_stderr, "Cannot write digest cache '%s': %s.\n", temp_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if(kt_rename_replace(temp_name, cache->filename) != 0)
+    {
+        fprintf(kt_stderr, "Cannot rename digest cache '%s' to '%s': %s.\n", temp_name, cache->filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    cache->dirty = 0;
+    ret = 0;
+
+cleanup:
+    if(ret < 0)
+        unlink(temp_name);
+    free(temp_name);
+
+    return ret;
+}
+
+void kt_digest_cache_free(KTDigestCache *cache)
+{
+    size_t i;
+
+    if(cache == NULL)
+        return;
+    for(i = 0; i < cache->count; i++)
+    {
+        free(cache->records[i]->path);
+        free(cache->records[i]);
+    }
+    free(cache->records);
+    kt_hash_table_free(&cache->index);
+    free(cache->filename);
+    free(cache);
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,591 @@
+//
+//  header.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Every bundle header is described once, as a list of fields, and both the parser & the serializer walk that list.
+// Integers are little-endian on the wire, whatever the host is, and are (de)coded byte by byte, so alignment is never an issue.
+
+typedef enum
+{
+    KTFieldInteger,             // Stored in a KTHeader member
+    KTFieldPadding,             // Zeroes when we write it, ignored when we read it
+    KTFieldMD5,                 // Munged hex MD5 hash of the payload
+    KTFieldDevices,             // Device count (of 'width' bytes), followed by that many uint16_t device ids
+    KTFieldMetastrings          // uint16_t count, followed by that many (big-endian uint16_t length, munged string) records
+} KTHeaderFieldType;
+
+typedef struct
+{
+    KTHeaderFieldType type;
+    size_t width;               // On the wire
+    size_t offset;              // Of the KTHeader member (integers only)
+    size_t size;                // Of the KTHeader member (integers only)
+} KTHeaderField;
+
+typedef struct
+{
+    size_t block_size;          // Fixed size of what follows the magic number (the remainder is padding), 0 if it's variable
+    const KTHeaderField *fields;
+    size_t num_fields;
+} KTHeaderFormat;
+
+#define KT_FIELD_INT(width, member) { KTFieldInteger, width, offsetof(KTHeader, member), sizeof(((KTHeader *) 0)->member) }
+#define KT_FIELD_PAD(width) { KTFieldPadding, width, 0, 0 }
+#define KT_FIELD_MD5 { KTFieldMD5, MD5_HASH_LENGTH, 0, 0 }
+#define KT_FIELD_DEVICES(width) { KTFieldDevices, width, 0, 0 }
+#define KT_FIELD_METASTRINGS { KTFieldMetastrings, sizeof(uint16_t), 0, 0 }
+#define KT_FORMAT(block_size, fields) { block_size, fields, sizeof(fields) / sizeof(*fields) }
+
+// SP01
+static const KTHeaderField kt_signature_fields[] =
+{
+    KT_FIELD_INT(4, certificate_number)
+};
+
+// FC02 & FD03
+static const KTHeaderField kt_ota_update_fields[] =
+{
+    KT_FIELD_INT(4, source_revision),
+    KT_FIELD_INT(4, target_revision),
+    KT_FIELD_INT(2, device),
+    KT_FIELD_INT(1, optional),
+    KT_FIELD_INT(1, padding),
+    KT_FIELD_MD5
+};
+
+// FC04, FD04 & FL01
+static const KTHeaderField kt_ota_update_v2_fields[] =
+{
+    KT_FIELD_INT(8, source_revision),
+    KT_FIELD_INT(8, target_revision),
+    KT_FIELD_DEVICES(2),
+    KT_FIELD_INT(1, critical),
+    KT_FIELD_INT(1, padding),
+    KT_FIELD_MD5,
+    KT_FIELD_METASTRINGS
+};
+
+// FB01 & FB02
+static const KTHeaderField kt_recovery_fields[] =
+{
+    KT_FIELD_PAD(12),
+    KT_FIELD_MD5,
+    KT_FIELD_INT(4, magic_1),
+    KT_FIELD_INT(4, magic_2),
+    KT_FIELD_INT(4, minor),
+    KT_FIELD_INT(4, device)
+};
+
+// FB02 with a V2 header rev: the device is replaced by a platform, a header rev & a board
+static const KTHeaderField kt_recovery_h2_fields[] =
+{
+    KT_FIELD_PAD(12),
+    KT_FIELD_MD5,
+    KT_FIELD_INT(4, magic_1),
+    KT_FIELD_INT(4, magic_2),
+    KT_FIELD_INT(4, minor),
+    KT_FIELD_INT(4, platform),
+    KT_FIELD_INT(4, header_rev),
+    KT_FIELD_INT(4, board)
+};
+
+// FB03
+static const KTHeaderField kt_recovery_v2_fields[] =
+{
+    KT_FIELD_PAD(4),
+    KT_FIELD_INT(8, target_revision),
+    KT_FIELD_MD5,
+    KT_FIELD_INT(4, magic_1),
+    KT_FIELD_INT(4, magic_2),
+    KT_FIELD_INT(4, minor),
+    KT_FIELD_INT(4, platform),
+    KT_FIELD_INT(4, header_rev),
+    KT_FIELD_INT(4, board),
+    KT_FIELD_PAD(7),            // Some weird padding (u32, u16, u8)
+    KT_FIELD_DEVICES(1)
+};
+
+static const KTHeaderFormat kt_signature_format = KT_FORMAT(UPDATE_SIGNATURE_BLOCK_SIZE, kt_signature_fields);
+static const KTHeaderFormat kt_ota_update_format = KT_FORMAT(OTA_UPDATE_BLOCK_SIZE, kt_ota_update_fields);
+static const KTHeaderFormat kt_ota_update_v2_format = KT_FORMAT(0, kt_ota_update_v2_fields);
+static const KTHeaderFormat kt_recovery_format = KT_FORMAT(RECOVERY_UPDATE_BLOCK_SIZE, kt_recovery_fields);
+static const KTHeaderFormat kt_recovery_h2_format = KT_FORMAT(RECOVERY_UPDATE_BLOCK_SIZE, kt_recovery_h2_fields);
+static const KTHeaderFormat kt_recovery_v2_format = KT_FORMAT(RECOVERY_UPDATE_BLOCK_SIZE, kt_recovery_v2_fields);
+
+// Offset of the header rev of an FB02 header, magic number included
+#define KT_RECOVERY_HEADER_REV_OFFSET (MAGIC_NUMBER_LENGTH + 12 + MD5_HASH_LENGTH + 4 * sizeof(uint32_t))
+
+static uint64_t kt_get_le(const unsigned char *bytes, size_t width)
+{
+    uint64_t value = 0;
+
+    while(width-- > 0)
+        value = (value << 8) | bytes[width];
+    return value;
+}
+
+static void kt_put_le(unsigned char *bytes, uint64_t value, size_t width)
+{
+    size_t i;
+
+    for(i = 0; i < width; i++)
+    {
+        bytes[i] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static void kt_header_store(KTHeader *header, const KTHeaderField *field, uint64_t value)
+{
+    void *member = (unsigned char *) header + field->offset;
+
+    switch(field->size)
+    {
+        case sizeof(uint8_t):
+            *(uint8_t *) member = (uint8_t) value;
+            break;
+        case sizeof(uint16_t):
+            *(uint16_t *) member = (uint16_t) value;
+            break;
+        case sizeof(uint32_t):
+            *(uint32_t *) member = (uint32_t) value;
+            break;
+        default:
+            *(uint64_t *) member = value;
+            break;
+    }
+}
+
+static uint64_t kt_header_load(const KTHeader *header, const KTHeaderField *field)
+{
+    const void *member = (const unsigned char *) header + field->offset;
+
+    switch(field->size)
+    {
+        case sizeof(uint8_t):
+            return *(const uint8_t *) member;
+        case sizeof(uint16_t):
+            return *(const uint16_t *) member;
+        case sizeof(uint32_t):
+            return *(const uint32_t *) member;
+        default:
+            return *(const uint64_t *) member;
+    }
+}
+
+// Pick the field table of a bundle version. buf is only used to tell both kinds of FB02 headers apart when we're parsing.
+static const KTHeaderFormat *kt_header_format(const KTHeader *header, const unsigned char *buf, size_t len)
+{
+    switch(header->version)
+    {
+        case UpdateSignature:
+            return &kt_signature_format;
+        case OTAUpdate:
+            return &kt_ota_update_format;
+        case OTAUpdateV2:
+            return &kt_ota_update_v2_format;
+        case RecoveryUpdate:
+            if(buf == NULL)
+                return (header->header_rev == 2 ? &kt_recovery_h2_format : &kt_recovery_format);
+            if(len >= KT_RECOVERY_HEADER_REV_OFFSET + sizeof(uint32_t) && kt_get_le(buf + KT_RECOVERY_HEADER_REV_OFFSET, sizeof(uint32_t)) == 2)
+                return &kt_recovery_h2_format;
+            return &kt_recovery_format;
+        case RecoveryUpdateV2:
+            return &kt_recovery_v2_format;
+        case UserDataPackage:
+        case UnknownUpdate:
+        default:
+            return NULL;
+    }
+}
+
+// Returns 1 if we need at least that many bytes to go on, -1 if that's more than the header can hold, 0 if we already have them
+static int kt_header_need(KTHeader *header, size_t needed, size_t len, size_t limit)
+{
+    if(needed > limit)
+        return -1;
+    if(needed <= len)
+        return 0;
+    header->header_size = needed;
+    return 1;
+}
+
+// Parse a header from the len bytes at buf, without copying the device list & the metastrings out of it.
+// Returns 0 when it's complete (header_size is then its actual size, which may be more than len for fixed size headers, since we don't need their padding),
+// 1 if we need at least header_size bytes to say more, and -1 if it's malformed.
+// Userdata packages & unknown bundles are complete after their magic number, it's up to the caller to check the version.
+int kt_header_parse(KTHeader *header, const unsigned char *buf, size_t len)
+{
+    const KTHeaderFormat *format;
+    const KTHeaderField *field;
+    size_t limit;
+    size_t pos;
+    size_t i;
+    unsigned int n;
+    int r;
+
+    memset(header, 0, sizeof(*header));
+    header->version = UnknownUpdate;
+    if((r = kt_header_need(header, MAGIC_NUMBER_LENGTH, len, KT_HEADER_MAX_SIZE)) != 0)
+        return r;
+    memcpy(header->magic_number, buf, MAGIC_NUMBER_LENGTH);
+    header->version = get_bundle_version(header->magic_number);
+    header->header_size = MAGIC_NUMBER_LENGTH;
+    // Both kinds of FB02 headers only differ by their header rev, we need it to pick the right one
+    if(header->version == RecoveryUpdate && (r = kt_header_need(header, KT_RECOVERY_HEADER_REV_OFFSET + sizeof(uint32_t), len, KT_HEADER_MAX_SIZE)) != 0)
+        return r;
+    if((format = kt_header_format(header, buf, len)) == NULL)
+        return 0;
+    // We only need the bytes of the actual fields, not the padding of fixed size headers, but their variable parts have to fit in them
+    limit = (format->block_size ? MAGIC_NUMBER_LENGTH + format->block_size : KT_HEADER_MAX_SIZE);
+
+    pos = MAGIC_NUMBER_LENGTH;
+    for(i = 0; i < format->num_fields; i++)
+    {
+        field = &format->fields[i];
+        if((r = kt_header_need(header, pos + field->width, len, limit)) != 0)
+            return r;
+        switch(field->type)
+        {
+            case KTFieldInteger:
+                kt_header_store(header, field, kt_get_le(buf + pos, field->width));
+                pos += field->width;
+                break;
+            case KTFieldPadding:
+                pos += field->width;
+                break;
+            case KTFieldMD5:
+                memcpy(header->md5_sum, buf + pos, MD5_HASH_LENGTH);
+                dm((unsigned char *) header->md5_sum, MD5_HASH_LENGTH);
+                header->md5_sum[MD5_HASH_LENGTH] = '\0';
+                pos += MD5_HASH_LENGTH;
+                break;
+            case KTFieldDevices:
+                header->num_devices = (uint16_t) kt_get_le(buf + pos, field->width);
+                pos += field->width;
+                if((r = kt_header_need(header, pos + header->num_devices * sizeof(uint16_t), len, limit)) != 0)
+                    return r;
+                header->devices = buf + pos;
+                pos += header->num_devices * sizeof(uint16_t);
+                break;
+            case KTFieldMetastrings:
+                header->num_meta = (uint16_t) kt_get_le(buf + pos, sizeof(uint16_t));
+                pos += sizeof(uint16_t);
+                header->meta = buf + pos;
+                for(n = 0; n < header->num_meta; n++)
+                {
+                    if((r = kt_header_need(header, pos + sizeof(uint16_t), len, limit)) != 0)
+                        return r;
+                    pos += sizeof(uint16_t) + (size_t)((buf[pos] << 8) | buf[pos + 1]);
+                    if((r = kt_header_need(header, pos, len, limit)) != 0)
+                        return r;
+                }
+                header->meta_size = (size_t)(buf + pos - header->meta);
+                break;
+        }
+    }
+
+    header->header_size = (format->block_size ? limit : pos);
+    return 0;
+}
+
+// i-th device of a parsed header
+uint16_t kt_header_device(const KTHeader *header, unsigned int i)
+{
+    if(header->device_list != NULL)
+        return (uint16_t) header->device_list[i];
+    return (uint16_t) kt_get_le(header->devices + i * sizeof(uint16_t), sizeof(uint16_t));
+}
+
+// Walk the metastrings of a parsed header: returns the (still munged) string at *cursor, and moves the cursor to the next one.
+// Start with *cursor set to header->meta, and stop after num_meta strings.
+const unsigned char *kt_header_next_meta(const unsigned char **cursor, uint16_t *length)
+{
+    const unsigned char *string;
+
+    *length = (uint16_t)(((*cursor)[0] << 8) | (*cursor)[1]);
+    string = *cursor + sizeof(uint16_t);
+    *cursor = string + *length;
+    return string;
+}
+
+// How many bytes serializing this header takes, 0 if it isn't something we can serialize
+size_t kt_header_size(const KTHeader *header)
+{
+    const KTHeaderFormat *format;
+    size_t size;
+    size_t i;
+    unsigned int n;
+
+    if((format = kt_header_format(header, NULL, 0)) == NULL)
+        return 0;
+    if(format->block_size)
+        return MAGIC_NUMBER_LENGTH + format->block_size;
+
+    size = MAGIC_NUMBER_LENGTH;
+    for(i = 0; i < format->num_fields; i++)
+    {
+        size += format->fields[i].width;
+        if(format->fields[i].type == KTFieldDevices)
+            size += header->num_devices * sizeof(uint16_t);
+        else if(format->fields[i].type == KTFieldMetastrings)
+        {
+            if(header->metastrings == NULL)
+                size += header->meta_size;
+            else
+                for(n = 0; n < header->num_meta; n++)
+                    size += sizeof(uint16_t) + strlen(header->metastrings[n]);
+        }
+    }
+    return size;
+}
+
+// Serialize a header into buf, which has to hold at least kt_header_size() bytes
+int kt_header_serialize(const KTHeader *header, unsigned char *buf, size_t size)
+{
+    const KTHeaderFormat *format;
+    const KTHeaderField *field;
+    size_t header_size;
+    size_t str_len;
+    size_t pos;
+    size_t i;
+    unsigned int n;
+
+    if((format = kt_header_format(header, NULL, 0)) == NULL || (header_size = kt_header_size(header)) == 0)
+    {
+        fprintf(kt_stderr, "Cannot build a header for this kind of bundle.\n");
+        kt_set_error(KT_ERR_FORMAT);
+        return -1;
+    }
+    if(size < header_size)
+    {
+        fprintf(kt_stderr, "Header buffer too small (%zu bytes, need %zu).\n", size, header_size);
+        kt_set_error(KT_ERR_GENERIC);
+        return -1;
+    }
+
+    memset(buf, 0, header_size);
+    memcpy(buf, header->magic_number, MAGIC_NUMBER_LENGTH);
+    pos = MAGIC_NUMBER_LENGTH;
+    for(i = 0; i < format->num_fields; i++)
+    {
+        field = &format->fields[i];
+        switch(field->type)
+        {
+            case KTFieldInteger:
+                kt_put_le(buf + pos, kt_header_load(header, field), field->width);
+                pos += field->width;
+                break;
+            case KTFieldPadding:
+                pos += field->width;
+                break;
+            case KTFieldMD5:
+                memcpy(buf + pos, header->md5_sum, MD5_HASH_LENGTH);
+                md(buf + pos, MD5_HASH_LENGTH); // Obfuscate md5 hash
+                pos += MD5_HASH_LENGTH;
+                break;
+            case KTFieldDevices:
+                if(header->num_devices >= (1U << (8 * field->width)))
+                {
+                    fprintf(kt_stderr, "Too many devices for this kind of bundle (%hu).\n", header->num_devices);
+                    kt_set_error(KT_ERR_INVALID);
+                    return -1;
+                }
+                kt_put_le(buf + pos, header->num_devices, field->width);
+                pos += field->width;
+                for(n = 0; n < header->num_devices; n++)
+                {
+                    kt_put_le(buf + pos, kt_header_device(header, n), sizeof(uint16_t));
+                    pos += sizeof(uint16_t);
+                }
+                break;
+            case KTFieldMetastrings:
+                kt_put_le(buf + pos, header->num_meta, sizeof(uint16_t));
+                pos += sizeof(uint16_t);
+                if(header->metastrings == NULL)
+                {
+                    // No metadata at all is the common case, and meta is NULL then
+                    if(header->meta_size > 0)
+                        memcpy(buf + pos, header->meta, header->meta_size);
+                    pos += header->meta_size;
+                    break;
+                }
+                for(n = 0; n < header->num_meta; n++)
+                {
+                    str_len = strlen(header->metastrings[n]);
+                    if(str_len > UINT16_MAX)
+                    {
+                        fprintf(kt_stderr, "Metastring too long (%zu bytes).\n", str_len);
+                        kt_set_error(KT_ERR_INVALID);
+                        return -1;
+                    }
+                    // String length: big endian
+                    // FIXME: While otaup expects this endianness switch, it would seem that otacheck doesn't, and chokes with an headerTooShortInMetadataField error as soon as we pass more than one metastring...
+                    //        If we don't switch the endianness, otacheck passes, but otaup chokes... >_<"
+                    buf[pos++] = (unsigned char)(str_len >> 8);
+                    buf[pos++] = (unsigned char)(str_len & 0xFF);
+                    memcpy(buf + pos, header->metastrings[n], str_len);
+                    // FIXME: Should this really be munged? Following otaup would point to yes, but I've never seen an update with meta strings in the wild, and the aforementionned issue with the string length doesn't help...
+                    md(buf + pos, str_len);     // Obfuscate meta string
+                    pos += str_len;
+                }
+                break;
+        }
+    }
+
+    return 0;
+}
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+// Parse the header straight from a mapping of the input, if it's a regular file. Returns 1 if that's not possible, so we can fall back to reading it.
+static int kt_header_map(KTHeader *header, KTHeaderBuffer *hbuf, FILE *input)
+{
+    struct stat st;
+    off_t pos;
+    off_t base;
+    long page_size;
+    size_t len;
+    unsigned char *map;
+    int fd;
+
+    if((fd = fileno(input)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return 1;
+    if((pos = ftello(input)) < 0 || pos >= st.st_size || (page_size = sysconf(_SC_PAGESIZE)) <= 0)
+        return 1;
+    base = pos - (pos % page_size);
+    len = (size_t)(st.st_size - pos);
+    if(len > KT_HEADER_MAX_SIZE)
+        len = KT_HEADER_MAX_SIZE;
+    if((map = mmap(NULL, (size_t)(pos - base) + len, PROT_READ, MAP_PRIVATE, fd, base)) == MAP_FAILED)
+        return 1;
+    // Leave anything out of the ordinary (truncated or malformed headers) to the stream reader, it knows how to complain about it
+    if(kt_header_parse(header, map + (pos - base), len) != 0 || header->header_size > len || fseeko(input, pos + (off_t) header->header_size, SEEK_SET) != 0)
+    {
+        munmap(map, (size_t)(pos - base) + len);
+        return 1;
+    }
+    hbuf->map = map;
+    hbuf->map_len = (size_t)(pos - base) + len;
+    return 0;
+}
+#endif
+
+// Read a whole header from the input, and leave it at the start of what follows. What the header points to lives in hbuf, until the next read or kt_header_buffer_free.
+int kt_header_read(KTHeader *header, KTHeaderBuffer *hbuf, FILE *input)
+{
+    unsigned char *data;
+    size_t len;
+    size_t needed;
+    int r;
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if(hbuf->map != NULL)
+    {
+        munmap(hbuf->map, hbuf->map_len);
+        hbuf->map = NULL;
+        hbuf->map_len = 0;
+    }
+    if(kt_header_map(header, hbuf, input) == 0)
+        return 0;
+#endif
+
+    // Read as much as the parser asks for, which is one read per variable part at worst
+    len = 0;
+    needed = MAGIC_NUMBER_LENGTH;
+    for(;;)
+    {
+        if(needed > hbuf->size)
+        {
+            if((data = realloc(hbuf->data, needed)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate %zu bytes for the header.\n", needed);
+                kt_set_error(KT_ERR_NOMEM);
+                return -1;
+            }
+            hbuf->data = data;
+            hbuf->size = needed;
+        }
+        if(fread(hbuf->data + len, sizeof(unsigned char), needed - len, input) < needed - len)
+        {
+            fprintf(kt_stderr, "Cannot read update header: %s.\n", (ferror(input) ? strerror(errno) : "unexpected end of file"));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        len = needed;
+        r = kt_header_parse(header, hbuf->data, len);
+        if(r < 0)
+        {
+            fprintf(kt_stderr, "Malformed update header.\n");
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+        // We're done once we've read the padding of fixed size headers, too
+        if(r == 0 && len >= header->header_size)
+            return 0;
+        needed = header->header_size;
+    }
+}
+
+// Serialize a header, and write it in one go
+int kt_header_write(const KTHeader *header, FILE *output)
+{
+    unsigned char *buf;
+    size_t size;
+
+    if((size = kt_header_size(header)) == 0)
+    {
+        fprintf(kt_stderr, "Cannot build a header for this kind of bundle.\n");
+        kt_set_error(KT_ERR_FORMAT);
+        return -1;
+    }
+    if((buf = malloc(size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate %zu bytes for the header.\n", size);
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if(kt_header_serialize(header, buf, size) < 0)
+    {
+        free(buf);
+        return -1;
+    }
+    if(fwrite(buf, sizeof(unsigned char), size, output) < size)
+    {
+        fprintf(kt_stderr, "Error writing update header: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return 0;
+}
+
+void kt_header_buffer_free(KTHeaderBuffer *hbuf)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if(hbuf->map != NULL)
+        munmap(hbuf->map, hbuf->map_len);
+#endif
+    free(hbuf->data);
+    memset(hbuf, 0, sizeof(*hbuf));
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,1411 @@
+//
+//  index.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// A random access index for package payloads, heavily inspired from Mark Adler's zran.c (in zlib's examples).
+// While we inflate the payload once, we snapshot the inflater's state (position & last 32K of output) every KT_INDEX_SPAN bytes,
+// and we remember where every tar entry starts. Since the munging is a simple byte substitution, we can then demunge & inflate
+// from the closest checkpoint, instead of from the start of a potentially huge package.
+
+#define KT_INDEX_MAGIC "KTIX"
+#define KT_INDEX_VERSION 1
+// Magic, version, package size & mtime, payload offset, munged flag, header digest, span, and the number of points & entries
+#define KT_INDEX_HEADER_SIZE 65
+#define KT_INDEX_CHUNK 16384
+// The embedded flavor (create --seekable), and where to find it: the gzip header's MTIME holds the compressed offset of its tar entry.
+// (An extra field would have been cleaner, but it'd set a flag in the fourth byte, and that one is part of the userdata packages' magic number).
+#define KT_INDEX_SEEK_MAGIC "KTSX"
+#define KT_INDEX_SEEK_VERSION 1
+#define KT_INDEX_SEEK_MTIME_OFFSET 4
+
+// State of the inflater while we're building an index
+struct kt_index_builder
+{
+    KTIndex *idx;
+    FILE *src;
+    unsigned int demunge;
+    z_stream strm;
+    uint64_t totin;             // Compressed bytes consumed so far
+    uint64_t totout;            // Uncompressed bytes produced so far
+    uint64_t last;              // Where the last checkpoint was
+    int member_start;           // We're at the start of a gzip member
+    int eof;
+    unsigned char in[KT_INDEX_CHUNK];
+    unsigned char window[KT_INDEX_WINDOW_SIZE];
+};
+
+// State of the deflater while we're making a payload seekable
+struct kt_index_seeker
+{
+    KTIndex *idx;
+    FILE *out;
+    z_stream strm;
+    uint64_t totin;             // Compressed bytes written so far
+    uint64_t totout;            // Uncompressed bytes deflated so far
+    uint64_t last;              // Where the last checkpoint was
+    uint64_t end;               // Where the original end of archive is
+    uint32_t next;              // The next entry we'll reach
+    unsigned char out_buf[KT_INDEX_CHUNK];
+};
+
+// State of the inflater while we're reading from an index
+struct kt_index_reader
+{
+    const KTIndex *idx;
+    FILE *bin;
+    z_stream strm;
+    int raw;                    // Raw deflate (we started from a window) or gzip
+    unsigned int trailer;       // Bytes of gzip trailer left to skip after a raw deflate stream
+    int member_start;
+    int eof;
+    uint64_t skip;              // Uncompressed bytes to throw away before we reach the requested offset
+    unsigned char in[KT_INDEX_CHUNK];
+    unsigned char out[KT_INDEX_CHUNK * 4];
+};
+
+static void kt_put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char) (v & 0xFF);
+    p[1] = (unsigned char) (v >> 8);
+}
+
+static void kt_put_le32(unsigned char *p, uint32_t v)
+{
+    unsigned int i;
+
+    for(i = 0; i < 4; i++)
+        p[i] = (unsigned char) ((v >> (8 * i)) & 0xFF);
+}
+
+static void kt_put_le64(unsigned char *p, uint64_t v)
+{
+    unsigned int i;
+
+    for(i = 0; i < 8; i++)
+        p[i] = (unsigned char) ((v >> (8 * i)) & 0xFF);
+}
+
+static uint16_t kt_get_le16(const unsigned char *p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t kt_get_le32(const unsigned char *p)
+{
+    uint32_t v = 0;
+    unsigned int i;
+
+    for(i = 0; i < 4; i++)
+        v |= (uint32_t) p[i] << (8 * i);
+    return v;
+}
+
+static uint64_t kt_get_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    unsigned int i;
+
+    for(i = 0; i < 8; i++)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+// Parse the package's header without spamming the log (unless it fails), and leave input at the start of the payload
+static int kt_index_skip_header(FILE *input, const unsigned int fake_sign)
+{
+    KTContext *ctx = kt_context_current();
+    FILE *orig_log = ctx->log;
+    FILE *log;
+    char *log_buf = NULL;
+    size_t log_size = 0;
+    char header_md5[MD5_HASH_LENGTH + 1];
+    int ret;
+
+    if((log = kt_open_memstream(&log_buf, &log_size)) != NULL)
+        ctx->log = log;
+    ret = kindle_convert(input, NULL, NULL, fake_sign, 0, NULL, header_md5);
+    ctx->log = orig_log;
+    if(log != NULL)
+    {
+        fclose(log);
+        if(ret < 0 && log_buf != NULL)
+            fwrite(log_buf, sizeof(char), log_size, kt_stderr);
+        free(log_buf);
+    }
+
+    return ret;
+}
+
+// Check that the payload starts with a GZIP magic number
+static int kt_index_is_gzip(FILE *input, uint64_t offset, const unsigned int munged)
+{
+    unsigned char magic[2];
+
+    if(fseeko(input, (off_t) offset, SEEK_SET) != 0 || fread(magic, sizeof(unsigned char), sizeof(magic), input) < sizeof(magic))
+        return 0;
+    if(munged)
+        dm(magic, sizeof(magic));
+    return magic[0] == 0x1F && magic[1] == 0x8B;
+}
+
+// Identify a package, and find its payload. Returns an empty index for it (input's position is restored).
+KTIndex *kt_index_probe(FILE *input, const unsigned int fake_sign)
+{
+    KTIndex *idx;
+    struct stat st;
+    struct md5_ctx md5;
+    unsigned char buffer[BUFFER_SIZE];
+    char magic_number[MAGIC_NUMBER_LENGTH];
+    off_t start;
+    off_t offset;
+    uint64_t left;
+    size_t count;
+
+    if((start = ftello(input)) < 0 || fstat(fileno(input), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(kt_stderr, "Cannot index this package, it isn't a regular file.\n");
+        kt_set_error(KT_ERR_INVALID);
+        return NULL;
+    }
+    if((idx = calloc(1, sizeof(*idx))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return NULL;
+    }
+    idx->bin_size = (uint64_t) st.st_size;
+    idx->bin_mtime = (int64_t) st.st_mtime;
+    idx->span = KT_INDEX_SPAN;
+
+    if(fread(magic_number, sizeof(char), MAGIC_NUMBER_LENGTH, input) < MAGIC_NUMBER_LENGTH)
+    {
+        fprintf(kt_stderr, "Cannot read input file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto failure;
+    }
+    if(get_bundle_version(magic_number) == UserDataPackage)
+    {
+        // A straight tarball, it's all payload
+        idx->payload_offset = (uint64_t) start;
+        idx->munged = 0;
+    }
+    else
+    {
+        fseeko(input, start, SEEK_SET);
+        if(kt_index_skip_header(input, fake_sign) < 0 || (offset = ftello(input)) < 0)
+        {
+            fprintf(kt_stderr, "Cannot parse the package's header.\n");
+            kt_set_error(KT_ERR_FORMAT);
+            goto failure;
+        }
+        idx->payload_offset = (uint64_t) offset;
+        idx->munged = (fake_sign ? 0 : 1);
+        // A signed userdata package: we ate its GZIP magic number
+        if(!kt_index_is_gzip(input, idx->payload_offset, idx->munged) && offset >= MAGIC_NUMBER_LENGTH && kt_index_is_gzip(input, idx->payload_offset - MAGIC_NUMBER_LENGTH, 0))
+        {
+            idx->payload_offset -= MAGIC_NUMBER_LENGTH;
+            idx->munged = 0;
+        }
+    }
+    if(!kt_index_is_gzip(input, idx->payload_offset, idx->munged))
+    {
+        fprintf(kt_stderr, "The package's payload isn't a gzipped tarball.\n");
+        kt_set_error(KT_ERR_FORMAT);
+        goto failure;
+    }
+
+    // Key the index to the header, too, so that a re-signed or retargeted package doesn't reuse a stale one
+    md5_init(&md5);
+    fseeko(input, start, SEEK_SET);
+    left = idx->payload_offset - (uint64_t) start;
+    while(left > 0 && (count = fread(buffer, sizeof(unsigned char), (left < BUFFER_SIZE ? (size_t) left : BUFFER_SIZE), input)) > 0)
+    {
+        md5_update(&md5, count, buffer);
+        left -= count;
+    }
+    md5_digest(&md5, MD5_DIGEST_SIZE, idx->header_digest);
+
+    fseeko(input, start, SEEK_SET);
+    return idx;
+
+failure:
+    fseeko(input, start, SEEK_SET);
+    kt_index_free(idx);
+    return NULL;
+}
+
+void kt_index_free(KTIndex *idx)
+{
+    uint32_t i;
+
+    if(idx == NULL)
+        return;
+    for(i = 0; i < idx->num_points; i++)
+        free(idx->points[i].window);
+    free(idx->points);
+    for(i = 0; i < idx->num_entries; i++)
+        free(idx->entries[i].pathname);
+    free(idx->entries);
+    free(idx);
+}
+
+// The default sidecar for a package (caller frees)
+char *kt_index_default_name(const char *bin_filename)
+{
+    char *name;
+    size_t len = strlen(bin_filename);
+
+    if((name = malloc(len + sizeof(KT_INDEX_SUFFIX))) == NULL)
+        return NULL;
+    memcpy(name, bin_filename, len);
+    memcpy(name + len, KT_INDEX_SUFFIX, sizeof(KT_INDEX_SUFFIX));
+
+    return name;
+}
+
+// Remember where we are in the compressed stream. For windowed checkpoints, left is what's left of the circular window buffer.
+static int kt_index_add_point(struct kt_index_builder *b, KTIndexPointType type, unsigned int left)
+{
+    KTIndex *idx = b->idx;
+    KTIndexPoint *points;
+    KTIndexPoint *point;
+    unsigned char window[KT_INDEX_WINDOW_SIZE];
+    uLongf window_size;
+
+    if((points = realloc(idx->points, (idx->num_points + 1) * sizeof(*points))) == NULL)
+        return -1;
+    idx->points = points;
+    point = &idx->points[idx->num_points];
+    memset(point, 0, sizeof(*point));
+    point->out = b->totout;
+    point->in = b->totin;
+    point->type = (uint8_t) type;
+    if(type == KTIndexPointWindow)
+    {
+        point->bits = (uint8_t) (b->strm.data_type & 7);
+        // Unroll the circular buffer
+        if(left)
+            memcpy(window, b->window + KT_INDEX_WINDOW_SIZE - left, left);
+        if(left < KT_INDEX_WINDOW_SIZE)
+            memcpy(window + left, b->window, KT_INDEX_WINDOW_SIZE - left);
+        // Tarballs compress well, so don't store 32K of mostly redundant data per checkpoint
+        window_size = compressBound(KT_INDEX_WINDOW_SIZE);
+        if((point->window = malloc(window_size)) == NULL)
+            return -1;
+        if(compress2(point->window, &window_size, window, KT_INDEX_WINDOW_SIZE, Z_BEST_SPEED) != Z_OK)
+        {
+            free(point->window);
+            return -1;
+        }
+        point->window_size = (uint32_t) window_size;
+    }
+    idx->num_points++;
+    b->last = b->totout;
+
+    return 0;
+}
+
+static ssize_t kt_index_builder_read(struct archive *a, void *client_data, const void **buff)
+{
+    struct kt_index_builder *b = client_data;
+    unsigned int before_in;
+    unsigned int before_out;
+    unsigned int produced;
+    size_t count;
+    int ret;
+
+    for(;;)
+    {
+        if(b->strm.avail_in == 0 && !b->eof)
+        {
+            count = fread(b->in, sizeof(unsigned char), KT_INDEX_CHUNK, b->src);
+            if(ferror(b->src))
+            {
+                archive_set_error(a, errno, "Cannot read payload");
+                kt_set_error(KT_ERR_IO);
+                return -1;
+            }
+            if(count == 0)
+                b->eof = 1;
+            if(b->demunge)
+                dm(b->in, count);
+            b->strm.next_in = b->in;
+            b->strm.avail_in = (uInt) count;
+        }
+        if(b->strm.avail_in == 0)
+            return 0;
+        if(b->member_start)
+        {
+            // Anything that isn't another gzip member is trailing garbage
+            if(b->strm.next_in[0] != 0x1F)
+            {
+                b->eof = 1;
+                b->strm.avail_in = 0;
+                return 0;
+            }
+            if(kt_index_add_point(b, KTIndexPointMember, 0) < 0)
+            {
+                archive_set_error(a, ENOMEM, "Cannot allocate index checkpoint");
+                kt_set_error(KT_ERR_NOMEM);
+                return -1;
+            }
+            b->member_start = 0;
+        }
+        if(b->strm.avail_out == 0)
+        {
+            b->strm.next_out = b->window;
+            b->strm.avail_out = KT_INDEX_WINDOW_SIZE;
+        }
+
+        // Stop at the end of every deflate block, so we get a chance to set a checkpoint there
+        before_in = b->strm.avail_in;
+        before_out = b->strm.avail_out;
+        ret = inflate(&b->strm, Z_BLOCK);
+        b->totin += before_in - b->strm.avail_in;
+        produced = before_out - b->strm.avail_out;
+        b->totout += produced;
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || (ret == Z_BUF_ERROR && b->eof))
+        {
+            archive_set_error(a, ARCHIVE_ERRNO_MISC, "Cannot inflate payload: %s", (b->strm.msg != NULL ? b->strm.msg : "truncated stream"));
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+        if(ret == Z_STREAM_END)
+        {
+            // There might be another gzip member after this one
+            inflateReset(&b->strm);
+            b->member_start = 1;
+        }
+        else if((b->strm.data_type & 128) && !(b->strm.data_type & 64) && b->totout - b->last > b->idx->span)
+        {
+            // End of a block that isn't the last one, and we've come far enough since the last checkpoint
+            if(kt_index_add_point(b, KTIndexPointWindow, b->strm.avail_out) < 0)
+            {
+                archive_set_error(a, ENOMEM, "Cannot allocate index checkpoint");
+                kt_set_error(KT_ERR_NOMEM);
+                return -1;
+            }
+        }
+        if(produced > 0)
+        {
+            *buff = b->strm.next_out - produced;
+            return (ssize_t) produced;
+        }
+    }
+}
+
+static int kt_index_builder_close(struct archive *a, void *client_data)
+{
+    struct kt_index_builder *b = client_data;
+
+    (void) a;
+    inflateEnd(&b->strm);
+    free(b);
+
+    return ARCHIVE_OK;
+}
+
+// Open a, reading from a (possibly munged) gzipped tarball, filling idx's checkpoints as we go. Add the entries with kt_index_add_entry.
+// If we already had to consume the first few bytes of the payload (e.g., when sniffing a pipe), pass them (demunged) as prefix.
+int kt_index_read_open_prefixed(struct archive *a, KTIndex *idx, FILE *src, const unsigned int demunge, const unsigned char *prefix, size_t prefix_len)
+{
+    struct kt_index_builder *b;
+
+    if(prefix_len > KT_INDEX_CHUNK)
+    {
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((b = calloc(1, sizeof(*b))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index builder: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    b->idx = idx;
+    b->src = src;
+    b->demunge = demunge;
+    b->member_start = 1;
+    // Only handle gzip, we want to know where the members start
+    if(inflateInit2(&b->strm, 15 + 16) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize inflater.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(b);
+        return -1;
+    }
+    if(prefix_len > 0)
+    {
+        memcpy(b->in, prefix, prefix_len);
+        b->strm.next_in = b->in;
+        b->strm.avail_in = (uInt) prefix_len;
+    }
+    if(archive_read_open(a, b, NULL, kt_index_builder_read, kt_index_builder_close) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_open() failure: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+
+    return 0;
+}
+
+int kt_index_read_open(struct archive *a, KTIndex *idx, FILE *src, const unsigned int demunge)
+{
+    return kt_index_read_open_prefixed(a, idx, src, demunge, NULL, 0);
+}
+
+int kt_index_add_entry(KTIndex *idx, int64_t offset, struct archive_entry *entry)
+{
+    KTIndexEntry *entries;
+    KTIndexEntry *e;
+
+    if((entries = realloc(idx->entries, (idx->num_entries + 1) * sizeof(*entries))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index entry: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    idx->entries = entries;
+    e = &idx->entries[idx->num_entries];
+    e->offset = (uint64_t) offset;
+    e->size = (uint64_t) archive_entry_size(entry);
+    e->mode = (uint32_t) archive_entry_mode(entry);
+    e->mtime = (int64_t) archive_entry_mtime(entry);
+    if((e->pathname = strdup(archive_entry_pathname(entry))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index entry: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    idx->num_entries++;
+
+    return 0;
+}
+
+// The checkpoints, then the entries (shared by the sidecar & the embedded flavors)
+static int kt_index_write_tables(const KTIndex *idx, FILE *out)
+{
+    unsigned char buf[32];
+    size_t len;
+    uint32_t i;
+
+    for(i = 0; i < idx->num_points; i++)
+    {
+        kt_put_le64(buf, idx->points[i].out);
+        kt_put_le64(buf + 8, idx->points[i].in);
+        buf[16] = idx->points[i].bits;
+        buf[17] = idx->points[i].type;
+        kt_put_le32(buf + 18, idx->points[i].window_size);
+        if(fwrite(buf, sizeof(unsigned char), 22, out) < 22)
+            return -1;
+        if(idx->points[i].window_size > 0 && fwrite(idx->points[i].window, sizeof(unsigned char), idx->points[i].window_size, out) < idx->points[i].window_size)
+            return -1;
+    }
+    for(i = 0; i < idx->num_entries; i++)
+    {
+        len = strlen(idx->entries[i].pathname);
+        if(len > UINT16_MAX)
+            len = UINT16_MAX;
+        kt_put_le64(buf, idx->entries[i].offset);
+        kt_put_le64(buf + 8, idx->entries[i].size);
+        kt_put_le32(buf + 16, idx->entries[i].mode);
+        kt_put_le64(buf + 20, (uint64_t) idx->entries[i].mtime);
+        kt_put_le16(buf + 28, (uint16_t) len);
+        if(fwrite(buf, sizeof(unsigned char), 30, out) < 30 || fwrite(idx->entries[i].pathname, sizeof(char), len, out) < len)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Returns -1 on allocation failure, -2 if it's truncated or invalid
+static int kt_index_read_tables(KTIndex *idx, FILE *in, uint32_t num_points, uint32_t num_entries)
+{
+    unsigned char buf[32];
+    uint32_t i;
+    uint16_t len;
+
+    if((num_points > 0 && (idx->points = calloc(num_points, sizeof(*idx->points))) == NULL) || (num_entries > 0 && (idx->entries = calloc(num_entries, sizeof(*idx->entries))) == NULL))
+        return -1;
+    for(i = 0; i < num_points; i++)
+    {
+        if(fread(buf, sizeof(unsigned char), 22, in) < 22)
+            return -2;
+        idx->points[i].out = kt_get_le64(buf);
+        idx->points[i].in = kt_get_le64(buf + 8);
+        idx->points[i].bits = buf[16];
+        idx->points[i].type = buf[17];
+        idx->points[i].window_size = kt_get_le32(buf + 18);
+        idx->num_points++;
+        if(idx->points[i].window_size > compressBound(KT_INDEX_WINDOW_SIZE))
+            return -2;
+        if(idx->points[i].window_size > 0)
+        {
+            if((idx->points[i].window = malloc(idx->points[i].window_size)) == NULL)
+                return -1;
+            if(fread(idx->points[i].window, sizeof(unsigned char), idx->points[i].window_size, in) < idx->points[i].window_size)
+                return -2;
+        }
+    }
+    for(i = 0; i < num_entries; i++)
+    {
+        if(fread(buf, sizeof(unsigned char), 30, in) < 30)
+            return -2;
+        idx->entries[i].offset = kt_get_le64(buf);
+        idx->entries[i].size = kt_get_le64(buf + 8);
+        idx->entries[i].mode = kt_get_le32(buf + 16);
+        idx->entries[i].mtime = (int64_t) kt_get_le64(buf + 20);
+        len = kt_get_le16(buf + 28);
+        if((idx->entries[i].pathname = malloc((size_t) len + 1)) == NULL)
+            return -1;
+        idx->num_entries++;
+        if(fread(idx->entries[i].pathname, sizeof(char), len, in) < len)
+            return -2;
+        idx->entries[i].pathname[len] = '\0';
+    }
+
+    return 0;
+}
+
+// Everything is stored little-endian, with fixed-size fields
+int kt_index_save(const KTIndex *idx, const char *index_filename)
+{
+    FILE *out;
+    unsigned char buf[KT_INDEX_HEADER_SIZE];
+    int ret = -1;
+
+    if((out = fopen(index_filename, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open index '%s' for writing: %s.\n", index_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+
+    memcpy(buf, KT_INDEX_MAGIC, 4);
+    kt_put_le32(buf + 4, KT_INDEX_VERSION);
+    kt_put_le64(buf + 8, idx->bin_size);
+    kt_put_le64(buf + 16, (uint64_t) idx->bin_mtime);
+    kt_put_le64(buf + 24, idx->payload_offset);
+    buf[32] = idx->munged;
+    memcpy(buf + 33, idx->header_digest, MD5_DIGEST_SIZE);
+    kt_put_le64(buf + 49, idx->span);
+    kt_put_le32(buf + 57, idx->num_points);
+    kt_put_le32(buf + 61, idx->num_entries);
+    if(fwrite(buf, sizeof(unsigned char), KT_INDEX_HEADER_SIZE, out) < KT_INDEX_HEADER_SIZE)
+        goto cleanup;
+
+    if(kt_index_write_tables(idx, out) < 0)
+        goto cleanup;
+    ret = 0;
+
+cleanup:
+    if(ret < 0)
+    {
+        fprintf(kt_stderr, "Cannot write index '%s': %s.\n", index_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+    }
+    if(fclose(out) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Cannot write index '%s': %s.\n", index_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        ret = -1;
+    }
+    if(ret < 0)
+        unlink(index_filename);
+
+    return ret;
+}
+
+// Load an index, and check that it still matches the package it's supposed to belong to. Returns NULL if it doesn't exist, is stale, or is unusable.
+KTIndex *kt_index_load(const char *index_filename, FILE *bin, const unsigned int fake_sign)
+{
+    FILE *in;
+    KTIndex *idx = NULL;
+    KTIndex *cur = NULL;
+    unsigned char buf[KT_INDEX_HEADER_SIZE];
+    uint32_t num_points;
+    uint32_t num_entries;
+    int r;
+
+    if((in = fopen(index_filename, "rb")) == NULL)
+        return NULL;
+    if(fread(buf, sizeof(unsigned char), KT_INDEX_HEADER_SIZE, in) < KT_INDEX_HEADER_SIZE || memcmp(buf, KT_INDEX_MAGIC, 4) != 0 || kt_get_le32(buf + 4) != KT_INDEX_VERSION)
+    {
+        fprintf(kt_stderr, "Index '%s' is invalid, ignoring it.\n", index_filename);
+        goto failure;
+    }
+    if((idx = calloc(1, sizeof(*idx))) == NULL)
+        goto failure;
+    idx->bin_size = kt_get_le64(buf + 8);
+    idx->bin_mtime = (int64_t) kt_get_le64(buf + 16);
+    idx->payload_offset = kt_get_le64(buf + 24);
+    idx->munged = buf[32];
+    memcpy(idx->header_digest, buf + 33, MD5_DIGEST_SIZE);
+    idx->span = kt_get_le64(buf + 49);
+    num_points = kt_get_le32(buf + 57);
+    num_entries = kt_get_le32(buf + 61);
+
+    // Check that it was built from this very package
+    if((cur = kt_index_probe(bin, fake_sign)) == NULL)
+        goto failure;
+    if(cur->bin_size != idx->bin_size || cur->bin_mtime != idx->bin_mtime || cur->payload_offset != idx->payload_offset || cur->munged != idx->munged || memcmp(cur->header_digest, idx->header_digest, MD5_DIGEST_SIZE) != 0)
+    {
+        fprintf(kt_stderr, "Index '%s' is stale, ignoring it.\n", index_filename);
+        goto failure;
+    }
+
+    if(num_points == 0)
+        goto failure;
+    if((r = kt_index_read_tables(idx, in, num_points, num_entries)) == -2)
+        goto truncated;
+    else if(r < 0)
+        goto failure;
+
+    kt_index_free(cur);
+    fclose(in);
+    return idx;
+
+truncated:
+    fprintf(kt_stderr, "Index '%s' is truncated, ignoring it.\n", index_filename);
+failure:
+    kt_index_free(cur);
+    kt_index_free(idx);
+    fclose(in);
+    return NULL;
+}
+
+// Returns the entry number of pathname, or -1
+long kt_index_find(const KTIndex *idx, const char *pathname)
+{
+    uint32_t i;
+
+    for(i = 0; i < idx->num_entries; i++)
+    {
+        if(strcmp(idx->entries[i].pathname, pathname) == 0)
+            return (long) i;
+    }
+
+    return -1;
+}
+
+static int kt_index_reader_fill(struct kt_index_reader *r)
+{
+    size_t count;
+
+    if(r->strm.avail_in > 0 || r->eof)
+        return 0;
+    count = fread(r->in, sizeof(unsigned char), KT_INDEX_CHUNK, r->bin);
+    if(ferror(r->bin))
+        return -1;
+    if(count == 0)
+        r->eof = 1;
+    if(r->idx->munged)
+        dm(r->in, count);
+    r->strm.next_in = r->in;
+    r->strm.avail_in = (uInt) count;
+
+    return 0;
+}
+
+static ssize_t kt_index_reader_read(struct archive *a, void *client_data, const void **buff)
+{
+    struct kt_index_reader *r = client_data;
+    unsigned int produced;
+    int ret;
+
+    for(;;)
+    {
+        if(kt_index_reader_fill(r) < 0)
+        {
+            archive_set_error(a, errno, "Cannot read payload");
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        if(r->strm.avail_in == 0)
+            return 0;
+        // Skip the gzip trailer of the member we started in the middle of
+        if(r->trailer > 0)
+        {
+            produced = (r->strm.avail_in < r->trailer ? r->strm.avail_in : r->trailer);
+            r->strm.next_in += produced;
+            r->strm.avail_in -= produced;
+            r->trailer -= produced;
+            continue;
+        }
+        if(r->member_start)
+        {
+            if(r->strm.next_in[0] != 0x1F)
+            {
+                r->eof = 1;
+                r->strm.avail_in = 0;
+                return 0;
+            }
+            r->member_start = 0;
+        }
+
+        r->strm.next_out = r->out;
+        r->strm.avail_out = sizeof(r->out);
+        ret = inflate(&r->strm, Z_NO_FLUSH);
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || (ret == Z_BUF_ERROR && r->eof))
+        {
+            archive_set_error(a, ARCHIVE_ERRNO_MISC, "Cannot inflate payload: %s", (r->strm.msg != NULL ? r->strm.msg : "truncated stream"));
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+        if(ret == Z_STREAM_END)
+        {
+            if(r->raw)
+            {
+                // We've got to handle the trailer & the next member's header ourselves
+                inflateEnd(&r->strm);
+                if(inflateInit2(&r->strm, 15 + 16) != Z_OK)
+                {
+                    archive_set_error(a, ENOMEM, "Cannot initialize inflater");
+                    kt_set_error(KT_ERR_NOMEM);
+                    return -1;
+                }
+                r->raw = 0;
+                r->trailer = 8;
+            }
+            else
+            {
+                inflateReset(&r->strm);
+            }
+            r->member_start = 1;
+        }
+        produced = (unsigned int) (sizeof(r->out) - r->strm.avail_out);
+        if(produced <= r->skip)
+        {
+            r->skip -= produced;
+            continue;
+        }
+        *buff = r->out + r->skip;
+        produced -= (unsigned int) r->skip;
+        r->skip = 0;
+        return (ssize_t) produced;
+    }
+}
+
+static int kt_index_reader_close(struct archive *a, void *client_data)
+{
+    struct kt_index_reader *r = client_data;
+
+    (void) a;
+    inflateEnd(&r->strm);
+    free(r);
+
+    return ARCHIVE_OK;
+}
+
+// Open a, reading the package's tarball from offset (usually an entry's offset), inflating from the closest checkpoint
+int kt_index_read_open_at(struct archive *a, const KTIndex *idx, FILE *bin, uint64_t offset)
+{
+    struct kt_index_reader *r;
+    const KTIndexPoint *point;
+    unsigned char window[KT_INDEX_WINDOW_SIZE];
+    uLongf window_size = KT_INDEX_WINDOW_SIZE;
+    uint32_t lo = 0;
+    uint32_t hi = idx->num_points;
+    uint32_t mid;
+    int c;
+
+    // Find the last checkpoint before offset
+    while(hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if(idx->points[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    point = &idx->points[lo];
+
+    if((r = calloc(1, sizeof(*r))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index reader: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    r->idx = idx;
+    r->bin = bin;
+    r->skip = offset - point->out;
+    r->raw = (point->type != KTIndexPointMember);
+    r->member_start = !r->raw;
+    if(inflateInit2(&r->strm, (r->raw ? -15 : 15 + 16)) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize inflater.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(r);
+        return -1;
+    }
+    if(fseeko(bin, (off_t) (idx->payload_offset + point->in - (point->bits ? 1 : 0)), SEEK_SET) != 0)
+    {
+        fprintf(kt_stderr, "Cannot seek in package: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto failure;
+    }
+    if(point->type == KTIndexPointWindow)
+    {
+        // Restore the bits of the byte that started the next block, and the window
+        if(point->bits)
+        {
+            if((c = fgetc(bin)) == EOF)
+            {
+                fprintf(kt_stderr, "Cannot read package: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_IO);
+                goto failure;
+            }
+            if(idx->munged)
+            {
+                unsigned char byte = (unsigned char) c;
+                dm(&byte, 1);
+                c = byte;
+            }
+            inflatePrime(&r->strm, point->bits, c >> (8 - point->bits));
+        }
+        if(uncompress(window, &window_size, point->window, point->window_size) != Z_OK || window_size != KT_INDEX_WINDOW_SIZE)
+        {
+            fprintf(kt_stderr, "Index checkpoint is corrupted.\n");
+            kt_set_error(KT_ERR_FORMAT);
+            goto failure;
+        }
+        inflateSetDictionary(&r->strm, window, KT_INDEX_WINDOW_SIZE);
+    }
+
+    if(archive_read_open(a, r, NULL, kt_index_reader_read, kt_index_reader_close) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_open() failure: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+
+    return 0;
+
+failure:
+    inflateEnd(&r->strm);
+    free(r);
+    return -1;
+}
+
+// Build the index of a package in one pass, without extracting anything
+int kt_index_build(const char *bin_filename, const char *index_filename, const unsigned int fake_sign)
+{
+    FILE *bin;
+    KTIndex *idx = NULL;
+    struct archive *a = NULL;
+    struct archive_entry *entry;
+    int r;
+    int ret = -1;
+
+    if((bin = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input '%s' for reading: %s.\n", bin_filename, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    if((idx = kt_index_probe(bin, fake_sign)) == NULL)
+        goto cleanup;
+    if(fseeko(bin, (off_t) idx->payload_offset, SEEK_SET) != 0)
+    {
+        fprintf(kt_stderr, "Cannot seek in package: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+
+    a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(kt_index_read_open(a, idx, bin, idx->munged) < 0)
+        goto cleanup;
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        if(kt_index_add_entry(idx, archive_read_header_position(a), entry) < 0)
+            goto cleanup;
+        if(archive_read_data_skip(a) < ARCHIVE_WARN)
+        {
+            fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+    }
+    if(kt_index_save(idx, index_filename) < 0)
+        goto cleanup;
+    fprintf(kt_stderr, "Indexed %u entries (%u checkpoints) to '%s'.\n", idx->num_entries, idx->num_points, index_filename);
+    ret = 0;
+
+cleanup:
+    if(a != NULL)
+        archive_read_free(a);
+    kt_index_free(idx);
+    fclose(bin);
+
+    return ret;
+}
+
+static int kt_index_seeker_deflate(struct kt_index_seeker *w, unsigned char *data, size_t len, int flush)
+{
+    size_t have;
+
+    w->strm.next_in = data;
+    w->strm.avail_in = (uInt) len;
+    do
+    {
+        w->strm.next_out = w->out_buf;
+        w->strm.avail_out = sizeof(w->out_buf);
+        if(deflate(&w->strm, flush) == Z_STREAM_ERROR)
+        {
+            fprintf(kt_stderr, "Cannot deflate payload.\n");
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+        have = sizeof(w->out_buf) - w->strm.avail_out;
+        if(fwrite(w->out_buf, sizeof(unsigned char), have, w->out) < have)
+        {
+            fprintf(kt_stderr, "Cannot write payload: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        w->totin += have;
+    }
+    while(w->strm.avail_out == 0);
+    w->totout += len;
+
+    return 0;
+}
+
+// Flush everything, so that inflate can start from here without a window
+static int kt_index_seeker_checkpoint(struct kt_index_seeker *w)
+{
+    KTIndexPoint *points;
+
+    if(kt_index_seeker_deflate(w, NULL, 0, Z_FULL_FLUSH) < 0)
+        return -1;
+    if((points = realloc(w->idx->points, (w->idx->num_points + 1) * sizeof(*points))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index checkpoint: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    w->idx->points = points;
+    memset(&points[w->idx->num_points], 0, sizeof(*points));
+    points[w->idx->num_points].out = w->totout;
+    points[w->idx->num_points].in = w->totin;
+    points[w->idx->num_points].type = KTIndexPointFlush;
+    w->idx->num_points++;
+    w->last = w->totout;
+
+    return 0;
+}
+
+// Checkpoints go at the first entry boundary at least a span away from the last one, or in the middle of an entry if it runs for another span
+static int kt_index_seeker_feed(struct kt_index_seeker *w, unsigned char *data, size_t len)
+{
+    const KTIndex *idx = w->idx;
+    uint64_t limit;
+
+    while(len > 0 && w->totout < w->end)
+    {
+        for(; w->next < idx->num_entries && idx->entries[w->next].offset <= w->totout; w->next++)
+        {
+            if(idx->entries[w->next].offset == w->totout && w->totout - w->last >= idx->span && kt_index_seeker_checkpoint(w) < 0)
+                return -1;
+        }
+        if(w->totout - w->last >= 2 * idx->span && kt_index_seeker_checkpoint(w) < 0)
+            return -1;
+        // Don't go past the next place we might want to stop at
+        limit = w->end - w->totout;
+        if(w->next < idx->num_entries && idx->entries[w->next].offset - w->totout < limit)
+            limit = idx->entries[w->next].offset - w->totout;
+        if(w->last + 2 * idx->span - w->totout < limit)
+            limit = w->last + 2 * idx->span - w->totout;
+        if(limit > len)
+            limit = len;
+        if(kt_index_seeker_deflate(w, data, (size_t) limit, Z_NO_FLUSH) < 0)
+            return -1;
+        data += limit;
+        len -= (size_t) limit;
+    }
+
+    return 0;
+}
+
+// Serialize the embedded flavor: no package to key it to, it's part of the package
+static int kt_index_seek_serialize(const KTIndex *idx, char **buf, size_t *size)
+{
+    FILE *out;
+    unsigned char hdr[24];
+    int ret = -1;
+
+    if((out = kt_open_memstream(buf, size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate embedded index: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    memcpy(hdr, KT_INDEX_SEEK_MAGIC, 4);
+    kt_put_le32(hdr + 4, KT_INDEX_SEEK_VERSION);
+    kt_put_le64(hdr + 8, idx->span);
+    kt_put_le32(hdr + 16, idx->num_points);
+    kt_put_le32(hdr + 20, idx->num_entries);
+    if(fwrite(hdr, sizeof(unsigned char), sizeof(hdr), out) == sizeof(hdr) && kt_index_write_tables(idx, out) == 0)
+        ret = 0;
+    if(fclose(out) != 0 || ret < 0)
+    {
+        fprintf(kt_stderr, "Cannot write embedded index.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Turn a plain gzipped tarball into a seekable one: still a single gzip member, but fully flushed at entry boundaries every span bytes,
+// with its own index appended as a tar entry, and a pointer to it in the gzip header. Device side, it's just an extra file nobody asked about.
+int kt_index_make_seekable(FILE *input, FILE *output, uint64_t span)
+{
+    KTIndex *idx;
+    struct kt_index_seeker *w = NULL;
+    struct archive *a = NULL;
+    struct archive *tar = NULL;
+    struct archive_entry *entry;
+    struct archive_entry *self = NULL;
+    gz_header gzhead;
+    z_stream strm;
+    unsigned char mtime[4];
+    unsigned char in_buf[KT_INDEX_CHUNK];
+    unsigned char out_buf[KT_INDEX_CHUNK * 4];
+    char *data = NULL;
+    size_t data_size = 0;
+    unsigned char *tail = NULL;
+    size_t tail_size;
+    size_t tail_used;
+    size_t count;
+    int64_t newest = 0;
+    uint32_t i;
+    int end_of_member = 0;
+    int r;
+    int ret = -1;
+
+    if((idx = calloc(1, sizeof(*idx))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    memset(&strm, 0, sizeof(strm));
+
+    // First, find the entries, and where the end of archive is (or a stale index of ours, which we'll replace)
+    idx->span = UINT64_MAX;
+    rewind(input);
+    a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(kt_index_read_open(a, idx, input, 0) < 0)
+        goto cleanup;
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF || (r == ARCHIVE_OK && strcmp(archive_entry_pathname(entry), KT_INDEX_SEEK_NAME) == 0))
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        if(kt_index_add_entry(idx, archive_read_header_position(a), entry) < 0)
+            goto cleanup;
+        if(archive_read_data_skip(a) < ARCHIVE_WARN)
+        {
+            fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+    }
+    if((w = calloc(1, sizeof(*w))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate deflater: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    w->end = (uint64_t) archive_read_header_position(a);
+    archive_read_free(a);
+    a = NULL;
+    // We only want our own checkpoints
+    free(idx->points);
+    idx->points = NULL;
+    idx->num_points = 0;
+    idx->span = span;
+
+    // Then deflate it again (we'll fill in the gzip header's MTIME later)
+    w->idx = idx;
+    w->out = output;
+    memset(&gzhead, 0, sizeof(gzhead));
+    gzhead.os = 3;
+    if(deflateInit2(&w->strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize deflater.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(w);
+        w = NULL;
+        goto cleanup;
+    }
+    deflateSetHeader(&w->strm, &gzhead);
+    if(inflateInit2(&strm, 15 + 16) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize inflater.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    idx->points = calloc(1, sizeof(*idx->points));
+    if(idx->points == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate index checkpoint: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    idx->points[0].type = KTIndexPointMember;
+    idx->num_points = 1;
+
+    rewind(input);
+    while(w->totout < w->end)
+    {
+        if(strm.avail_in == 0)
+        {
+            count = fread(in_buf, sizeof(unsigned char), sizeof(in_buf), input);
+            if(ferror(input))
+            {
+                fprintf(kt_stderr, "Cannot read tarball: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_IO);
+                goto cleanup;
+            }
+            if(count == 0)
+                break;
+            strm.next_in = in_buf;
+            strm.avail_in = (uInt) count;
+        }
+        // Another member
+        if(end_of_member)
+        {
+            inflateReset(&strm);
+            end_of_member = 0;
+        }
+        strm.next_out = out_buf;
+        strm.avail_out = sizeof(out_buf);
+        r = inflate(&strm, Z_NO_FLUSH);
+        if(r == Z_NEED_DICT || r == Z_DATA_ERROR || r == Z_MEM_ERROR)
+        {
+            fprintf(kt_stderr, "Cannot inflate tarball: %s.\n", (strm.msg != NULL ? strm.msg : "corrupted stream"));
+            kt_set_error(KT_ERR_FORMAT);
+            goto cleanup;
+        }
+        if(r == Z_STREAM_END)
+            end_of_member = 1;
+        if(kt_index_seeker_feed(w, out_buf, sizeof(out_buf) - strm.avail_out) < 0)
+            goto cleanup;
+    }
+    if(w->totout < w->end)
+    {
+        fprintf(kt_stderr, "Tarball is truncated.\n");
+        kt_set_error(KT_ERR_FORMAT);
+        goto cleanup;
+    }
+
+    // Our index starts on a checkpoint of its own, and describes itself, too
+    if(kt_index_seeker_checkpoint(w) < 0)
+        goto cleanup;
+    if((self = archive_entry_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate archive entry.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    archive_entry_set_pathname(self, KT_INDEX_SEEK_NAME);
+    archive_entry_set_filetype(self, AE_IFREG);
+    archive_entry_set_perm(self, 0644);
+    // Dated like the newest entry of the payload, so that the same tarball always gives the same package
+    for(i = 0; i < idx->num_entries; i++)
+    {
+        if(idx->entries[i].mtime > newest)
+            newest = idx->entries[i].mtime;
+    }
+    archive_entry_set_mtime(self, (time_t) newest, 0);
+    archive_entry_set_size(self, 0);
+    if(kt_index_add_entry(idx, (int64_t) w->end, self) < 0 || kt_index_seek_serialize(idx, &data, &data_size) < 0)
+        goto cleanup;
+    // Fixed-size fields, so its size doesn't change when we fill it in
+    free(data);
+    idx->entries[idx->num_entries - 1].size = (uint64_t) data_size;
+    archive_entry_set_size(self, (int64_t) data_size);
+    if(kt_index_seek_serialize(idx, &data, &data_size) < 0)
+        goto cleanup;
+
+    // A header, the data, and a new end of archive
+    tail_size = 3 * 512 + data_size + 2 * 512;
+    if((tail = malloc(tail_size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate archive buffer: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    tar = archive_write_new();
+    archive_write_set_format_gnutar(tar);
+    archive_write_add_filter_none(tar);
+    archive_write_set_bytes_per_block(tar, 0);
+    if(archive_write_open_memory(tar, tail, tail_size, &tail_used) != ARCHIVE_OK || archive_write_header(tar, self) != ARCHIVE_OK || archive_write_data(tar, data, data_size) != (ssize_t) data_size || archive_write_close(tar) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "Cannot archive the index: %s.\n", archive_error_string(tar));
+        kt_set_error(KT_ERR_ARCHIVE);
+        goto cleanup;
+    }
+    if(kt_index_seeker_deflate(w, tail, tail_used, Z_FINISH) < 0)
+        goto cleanup;
+
+    // And tell readers where to find it
+    if(idx->points[idx->num_points - 1].in > UINT32_MAX)
+    {
+        fprintf(kt_stderr, "The payload is too large (over 4GB) for its embedded index to be found.\n");
+        kt_put_le32(mtime, 0);
+    }
+    else
+    {
+        kt_put_le32(mtime, (uint32_t) idx->points[idx->num_points - 1].in);
+    }
+    if(fflush(output) != 0 || fseeko(output, KT_INDEX_SEEK_MTIME_OFFSET, SEEK_SET) != 0 || fwrite(mtime, sizeof(unsigned char), sizeof(mtime), output) < sizeof(mtime) || fflush(output) != 0)
+    {
+        fprintf(kt_stderr, "Cannot write payload: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    fprintf(kt_stderr, "Made the payload seekable: %u entries, %u checkpoints.\n", idx->num_entries, idx->num_points);
+    ret = 0;
+
+cleanup:
+    if(a != NULL)
+        archive_read_free(a);
+    if(tar != NULL)
+        archive_write_free(tar);
+    if(self != NULL)
+        archive_entry_free(self);
+    if(w != NULL)
+    {
+        deflateEnd(&w->strm);
+        free(w);
+    }
+    inflateEnd(&strm);
+    free(tail);
+    free(data);
+    kt_index_free(idx);
+
+    return ret;
+}
+
+// Load the index create --seekable embedded in a package. Returns NULL if there's none, or if it's unusable.
+KTIndex *kt_index_load_embedded(FILE *bin, const unsigned int fake_sign)
+{
+    KTContext *ctx = kt_context_current();
+    KTError last_error = ctx->last_error;
+    KTIndex *idx;
+    struct archive *a = NULL;
+    struct archive_entry *entry;
+    unsigned char hdr[24];
+    unsigned char *data = NULL;
+    size_t size;
+    FILE *in = NULL;
+    uint32_t num_points;
+    uint32_t num_entries;
+    off_t pos;
+
+    if((pos = ftello(bin)) < 0 || (idx = kt_index_probe(bin, fake_sign)) == NULL)
+        return NULL;
+    // Plain gzip files usually have a timestamp there, so this is only a hint...
+    if(fseeko(bin, (off_t) idx->payload_offset, SEEK_SET) != 0 || fread(hdr, sizeof(unsigned char), 8, bin) < 8)
+        goto none;
+    if(idx->munged)
+        dm(hdr, 8);
+    if(hdr[0] != 0x1F || hdr[1] != 0x8B || hdr[2] != 0x08 || kt_get_le32(hdr + KT_INDEX_SEEK_MTIME_OFFSET) == 0 || kt_get_le32(hdr + KT_INDEX_SEEK_MTIME_OFFSET) >= idx->bin_size - idx->payload_offset)
+        goto none;
+
+    // ...that we'll only trust if we find our entry there, on the checkpoint it starts on
+    if((idx->points = calloc(1, sizeof(*idx->points))) == NULL)
+        goto none;
+    idx->points[0].in = kt_get_le32(hdr + KT_INDEX_SEEK_MTIME_OFFSET);
+    idx->points[0].type = KTIndexPointFlush;
+    idx->num_points = 1;
+    a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(kt_index_read_open_at(a, idx, bin, 0) < 0 || archive_read_next_header(a, &entry) != ARCHIVE_OK || strcmp(archive_entry_pathname(entry), KT_INDEX_SEEK_NAME) != 0)
+        goto none;
+    if(archive_entry_size(entry) < 24 || archive_entry_size(entry) > INT32_MAX)
+        goto failure;
+    size = (size_t) archive_entry_size(entry);
+    if((data = malloc(size)) == NULL || archive_read_data(a, data, size) != (ssize_t) size)
+        goto failure;
+    archive_read_free(a);
+    a = NULL;
+    free(idx->points);
+    idx->points = NULL;
+    idx->num_points = 0;
+
+    if((in = kt_fmemopen(data, size, "rb")) == NULL || fread(hdr, sizeof(unsigned char), 24, in) < 24 || memcmp(hdr, KT_INDEX_SEEK_MAGIC, 4) != 0 || kt_get_le32(hdr + 4) != KT_INDEX_SEEK_VERSION)
+        goto failure;
+    idx->span = kt_get_le64(hdr + 8);
+    num_points = kt_get_le32(hdr + 16);
+    num_entries = kt_get_le32(hdr + 20);
+    if(num_points == 0 || kt_index_read_tables(idx, in, num_points, num_entries) < 0)
+        goto failure;
+
+    fclose(in);
+    free(data);
+    fseeko(bin, pos, SEEK_SET);
+    return idx;
+
+failure:
+    fprintf(kt_stderr, "The package's embedded index is unusable, ignoring it.\n");
+none:
+    if(a != NULL)
+        archive_read_free(a);
+    if(in != NULL)
+        fclose(in);
+    free(data);
+    kt_index_free(idx);
+    fseeko(bin, pos, SEEK_SET);
+    // We were just looking
+    ctx->last_error = last_error;
+    return NULL;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,958 @@
+//
+//  inflate.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// We feed zlib straight from a read-only mapping
+#define ZLIB_CONST
+#include "kindle_tool.h"
+
+// Parallel inflation of a payload that's a regular file: it's cut in segments that are inflated by a pool of threads,
+// and handed to libarchive in order, so that the tar parsing doesn't change a bit.
+// When the payload was made seekable (cf. create --seekable), its index tells us exactly where the segments start.
+// Otherwise, each thread looks for a place to start in its own chunk of the payload: the header of a gzip member,
+// or, with --speculative, the header of a stored or dynamic deflate block, like pugz does. Since we don't know the 32K of output
+// that come before such a guess, we inflate it with a made-up window, then a second time with its complement:
+// whatever came out the same didn't come from the window. Once the real window is known, only what did needs to be inflated again,
+// and the last 32K of a segment never depend on the window for long.
+// Every guess is checked against the end of the previous segment before we use it, so a bad guess only costs time:
+// that segment is then inflated from where the previous one left off, like it would have been without us.
+
+#define KT_INFLATE_WINDOW 32768
+#define KT_INFLATE_IN_SIZE 32768
+#define KT_INFLATE_OUT_STEP (256 * 1024)
+#define KT_INFLATE_CHUNK_MIN (1024 * 1024)      // Compressed bytes per guessed segment, at least...
+#define KT_INFLATE_CHUNK_MAX (8 * 1024 * 1024)  // ...and at most
+#define KT_INFLATE_COMPARE (256 * 1024)         // How much output we compare to find what depends on the window, at first
+#define KT_INFLATE_MARKS 64                     // Boundaries we remember past a guess
+#define KT_INFLATE_HEADER_SIZE 320              // Enough for the biggest dynamic block header
+
+enum
+{
+    KT_INFLATE_FREE,
+    KT_INFLATE_QUEUED,
+    KT_INFLATE_BUSY,
+    KT_INFLATE_DONE
+};
+
+// The payload, as mapped
+struct kt_inflate_src
+{
+    const unsigned char *data;
+    uint64_t size;
+    unsigned int munged;
+};
+
+// A boundary, and how much came out before it
+struct kt_inflate_mark
+{
+    uint64_t pos;
+    size_t out;
+    int header;
+};
+
+// Inflate from a boundary (the start of a deflate block, or of a gzip member), until the first boundary at or past stop, or until max_out bytes came out
+struct kt_inflate_run
+{
+    uint64_t pos;               // Bit position of the boundary we start from
+    int header;                 // pos is the start of a gzip member
+    const unsigned char *dict;  // The window before pos (unused at the start of a member)
+    size_t dict_len;
+    uint64_t stop;
+    size_t max_out;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_size;
+    uint64_t end;               // The boundary we stopped at (unless we stopped because of max_out)
+    int end_header;
+    int eof;                    // We reached the end of the payload (or whatever trails it)
+    struct kt_inflate_mark *marks;  // The first boundaries we went through (if not NULL)
+    unsigned int max_marks;
+    unsigned int num_marks;
+};
+
+struct kt_inflate_job
+{
+    uint64_t segment;
+    int guess;                  // Look for a place to start in [from, to), instead of starting at run.pos
+    uint64_t from;
+    uint64_t to;
+    const KTIndexPoint *point;  // Exact start from an index checkpoint (NULL otherwise)
+    struct kt_inflate_mark marks[KT_INFLATE_MARKS];  // Where we could pick up a guess, past its start
+    unsigned int num_marks;
+    unsigned char dict[KT_INFLATE_WINDOW];
+    struct kt_inflate_run run;
+    size_t dep_end;             // What came out before that might depend on the window we didn't have
+    int status;
+    int state;
+};
+
+struct kt_inflate_pool
+{
+    KTContext *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // A segment is waiting for a worker
+    pthread_cond_t done;        // A segment was inflated
+    pthread_t *workers;
+    unsigned int num_workers;
+    struct kt_inflate_job *jobs;
+    unsigned int num_slots;
+    uint64_t num_segments;
+    uint64_t next_queue;        // Next segment we queue...
+    uint64_t next_inflate;      // ...a worker inflates...
+    uint64_t next_read;         // ...and we hand to libarchive
+    int quit;
+    struct kt_inflate_src src;
+    void *map;
+    size_t map_len;
+    KTIndex *seek;              // Exact segments, from the embedded index (NULL if we guess)
+    uint64_t chunk;             // Compressed size of a guessed segment
+    unsigned int speculative;
+    unsigned char fakes[2][KT_INFLATE_WINDOW];  // The made-up windows, and their complement
+    // Where the output we've handed out so far ends (guesses only)
+    z_stream strm;
+    uint64_t pos;
+    int header;
+    int eof;
+    unsigned char window[KT_INFLATE_WINDOW];
+    size_t window_len;
+    unsigned char *handed;      // What libarchive is looking at
+    uint64_t num_guessed;
+};
+
+static unsigned char kt_inflate_byte(const struct kt_inflate_src *src, uint64_t off)
+{
+    unsigned char c = src->data[off];
+
+    if(src->munged)
+        dm(&c, 1);
+    return c;
+}
+
+// Length of the gzip header at off, or 0 if there isn't one
+static uint64_t kt_inflate_gzip_header(const struct kt_inflate_src *src, uint64_t off)
+{
+    uint64_t p;
+    unsigned char flags;
+
+    if(src->size < 10 || off > src->size - 10)
+        return 0;
+    if(kt_inflate_byte(src, off) != 0x1F || kt_inflate_byte(src, off + 1) != 0x8B || kt_inflate_byte(src, off + 2) != 0x08)
+        return 0;
+    flags = kt_inflate_byte(src, off + 3);
+    if(flags & 0xE0)
+        return 0;
+    p = off + 10;
+    if(flags & 0x04)
+    {
+        if(p + 2 > src->size)
+            return 0;
+        p += 2 + (uint64_t) (kt_inflate_byte(src, p) | (kt_inflate_byte(src, p + 1) << 8));
+    }
+    if(flags & 0x08)
+    {
+        while(p < src->size && kt_inflate_byte(src, p) != 0)
+            p++;
+        p++;
+    }
+    if(flags & 0x10)
+    {
+        while(p < src->size && kt_inflate_byte(src, p) != 0)
+            p++;
+        p++;
+    }
+    if(flags & 0x02)
+        p += 2;
+    if(p > src->size)
+        return 0;
+
+    return p - off;
+}
+
+static int kt_inflate_reserve(struct kt_inflate_run *run)
+{
+    unsigned char *out;
+    size_t size;
+
+    if(run->out_size - run->out_len >= KT_INFLATE_OUT_STEP / 4 || run->out_size >= run->max_out)
+        return 0;
+    size = run->out_size + KT_INFLATE_OUT_STEP + run->out_size / 2;
+    if(size > run->max_out)
+        size = run->max_out;
+    if((out = realloc(run->out, size)) == NULL)
+        return -1;
+    run->out = out;
+    run->out_size = size;
+
+    return 0;
+}
+
+static void kt_inflate_mark(struct kt_inflate_run *run, uint64_t pos, int header)
+{
+    if(run->marks == NULL || run->num_marks >= run->max_marks || (run->num_marks > 0 && run->marks[run->num_marks - 1].pos == pos))
+        return;
+    run->marks[run->num_marks].pos = pos;
+    run->marks[run->num_marks].out = run->out_len;
+    run->marks[run->num_marks].header = header;
+    run->num_marks++;
+}
+
+static int kt_inflate_run(const struct kt_inflate_src *src, z_stream *strm, struct kt_inflate_run *run)
+{
+    unsigned char in[KT_INFLATE_IN_SIZE];
+    uint64_t byte = run->pos >> 3;
+    unsigned int bit = (unsigned int) (run->pos & 7);
+    int header = run->header;
+    uint64_t len;
+    uint64_t bitpos;
+    size_t room;
+    int ret;
+
+    run->out_len = 0;
+    run->eof = 0;
+    run->end = UINT64_MAX;
+    run->end_header = 0;
+    run->num_marks = 0;
+    strm->avail_in = 0;
+    // Once per member
+    for(;;)
+    {
+        if(header)
+        {
+            if((len = kt_inflate_gzip_header(src, byte)) == 0)
+            {
+                // That's the end of the payload, or whatever trails it
+                run->eof = 1;
+                run->end = byte * 8;
+                run->end_header = 1;
+                return 0;
+            }
+            byte += len;
+            bit = 0;
+        }
+        if(inflateReset(strm) != Z_OK)
+            return -1;
+        if(bit)
+        {
+            if(byte >= src->size)
+                return -1;
+            inflatePrime(strm, (int) (8 - bit), kt_inflate_byte(src, byte) >> bit);
+            byte++;
+        }
+        if(!header && run->dict != NULL && run->dict_len > 0 && inflateSetDictionary(strm, run->dict, (uInt) run->dict_len) != Z_OK)
+            return -1;
+        header = 0;
+
+        for(;;)
+        {
+            if(run->out_len >= run->max_out)
+                return 0;
+            if(strm->avail_in == 0)
+            {
+                // Truncated
+                if(byte >= src->size)
+                    return -1;
+                len = (src->size - byte < KT_INFLATE_IN_SIZE ? src->size - byte : KT_INFLATE_IN_SIZE);
+                if(src->munged)
+                {
+                    memcpy(in, src->data + byte, (size_t) len);
+                    dm(in, (size_t) len);
+                    strm->next_in = in;
+                }
+                else
+                {
+                    strm->next_in = src->data + byte;
+                }
+                strm->avail_in = (uInt) len;
+                byte += len;
+            }
+            if(kt_inflate_reserve(run) < 0)
+                return -1;
+            room = run->out_size - run->out_len;
+            if(room > run->max_out - run->out_len)
+                room = run->max_out - run->out_len;
+            if(room > UINT_MAX)
+                room = UINT_MAX;
+            strm->next_out = run->out + run->out_len;
+            strm->avail_out = (uInt) room;
+            ret = inflate(strm, Z_BLOCK);
+            run->out_len += room - strm->avail_out;
+            if(ret == Z_STREAM_END)
+            {
+                // Skip the trailer, another member might follow
+                byte = byte - strm->avail_in + 8;
+                strm->avail_in = 0;
+                if(byte > src->size)
+                    return -1;
+                header = 1;
+                kt_inflate_mark(run, byte * 8, 1);
+                if(byte * 8 >= run->stop)
+                {
+                    run->end = byte * 8;
+                    run->end_header = 1;
+                    run->eof = (kt_inflate_gzip_header(src, byte) == 0);
+                    return 0;
+                }
+                break;
+            }
+            if(ret != Z_OK && ret != Z_BUF_ERROR)
+                return -1;
+            // At the end of a block that isn't the last one: that's a boundary
+            if((strm->data_type & 128) && !(strm->data_type & 64))
+            {
+                bitpos = (byte - strm->avail_in) * 8 - (uint64_t) (strm->data_type & 7);
+                kt_inflate_mark(run, bitpos, 0);
+                if(bitpos >= run->stop)
+                {
+                    run->end = bitpos;
+                    run->end_header = 0;
+                    strm->avail_in = 0;
+                    return 0;
+                }
+            }
+        }
+    }
+}
+
+// Find the output of a guessed segment that came from the made-up window: it's whatever comes out different with its complement
+static int kt_inflate_dependencies(struct kt_inflate_pool *pool, z_stream *strm, struct kt_inflate_job *job)
+{
+    struct kt_inflate_run cmp;
+    size_t len = KT_INFLATE_COMPARE;
+    size_t i;
+    size_t dep_end;
+    int ret = -1;
+
+    memset(&cmp, 0, sizeof(cmp));
+    cmp.pos = job->run.pos;
+    cmp.dict = pool->fakes[1];
+    cmp.dict_len = KT_INFLATE_WINDOW;
+    cmp.stop = UINT64_MAX;
+    for(;;)
+    {
+        if(len > job->run.out_len)
+            len = job->run.out_len;
+        cmp.max_out = len;
+        if(kt_inflate_run(&pool->src, strm, &cmp) < 0 || cmp.out_len != len)
+            break;
+        dep_end = 0;
+        for(i = len; i > 0; i--)
+        {
+            if(cmp.out[i - 1] != job->run.out[i - 1])
+            {
+                dep_end = i;
+                break;
+            }
+        }
+        // Once the last 32K are clean, so is whatever follows
+        if(len == job->run.out_len || len - dep_end >= KT_INFLATE_WINDOW)
+        {
+            job->dep_end = dep_end;
+            ret = 0;
+            break;
+        }
+        len *= 4;
+    }
+    free(cmp.out);
+
+    return ret;
+}
+
+// Whether a dynamic block header at pos makes sense: most random bits don't get past that, and we don't need a window to tell
+static int kt_inflate_header_ok(const struct kt_inflate_src *src, z_stream *strm, uint64_t pos)
+{
+    unsigned char in[KT_INFLATE_HEADER_SIZE];
+    unsigned char out[1];
+    uint64_t byte = (pos >> 3) + 1;
+    size_t len;
+    int ret;
+
+    if(byte >= src->size || inflateReset(strm) != Z_OK)
+        return 0;
+    inflatePrime(strm, (int) (8 - (pos & 7)), kt_inflate_byte(src, pos >> 3) >> (pos & 7));
+    len = (src->size - byte < sizeof(in) ? (size_t) (src->size - byte) : sizeof(in));
+    memcpy(in, src->data + byte, len);
+    if(src->munged)
+        dm(in, len);
+    strm->next_in = in;
+    strm->avail_in = (uInt) len;
+    strm->next_out = out;
+    strm->avail_out = sizeof(out);
+    ret = inflate(strm, Z_TREES);
+
+    return (ret == Z_OK || ret == Z_BUF_ERROR);
+}
+
+// Try to start a guessed segment at pos: a deflate block has to go all the way to the next one before we go any further
+static int kt_inflate_try(struct kt_inflate_pool *pool, z_stream *strm, struct kt_inflate_job *job, struct kt_inflate_run *probe, uint64_t pos)
+{
+    probe->pos = pos;
+    probe->header = 0;
+    probe->dict = pool->fakes[0];
+    probe->dict_len = KT_INFLATE_WINDOW;
+    probe->stop = pos + 1;
+    probe->max_out = SIZE_MAX;
+    if(kt_inflate_run(&pool->src, strm, probe) < 0 || probe->eof)
+        return -1;
+    job->run.pos = pos;
+    job->run.header = 0;
+    job->run.dict = pool->fakes[0];
+    job->run.dict_len = KT_INFLATE_WINDOW;
+    if(kt_inflate_run(&pool->src, strm, &job->run) < 0 || kt_inflate_dependencies(pool, strm, job) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Look for a place to start in [from, to): a gzip member first, or, if we're allowed to guess, a deflate block
+static int kt_inflate_guess(struct kt_inflate_pool *pool, z_stream *strm, struct kt_inflate_job *job)
+{
+    const struct kt_inflate_src *src = &pool->src;
+    struct kt_inflate_run probe;
+    uint64_t b;
+    unsigned int bit;
+    unsigned int bits;
+    int found = 0;
+
+    memset(&probe, 0, sizeof(probe));
+    job->run.marks = job->marks;
+    job->run.max_marks = KT_INFLATE_MARKS;
+    for(b = job->from; b < job->to && !found; b++)
+    {
+        if(kt_inflate_byte(src, b) == 0x1F && kt_inflate_gzip_header(src, b) > 0)
+        {
+            job->run.pos = b * 8;
+            job->run.header = 1;
+            job->run.dict = NULL;
+            job->run.dict_len = 0;
+            if(kt_inflate_run(src, strm, &job->run) == 0)
+            {
+                job->dep_end = 0;
+                found = 1;
+                break;
+            }
+        }
+        if(!pool->speculative || b < 1 || b + 4 > src->size)
+            continue;
+        // A stored block: its length, then its complement, after a header & zero padding.
+        // We can't tell where the header starts in the padding, but every possibility ends in the same place.
+        bits = (unsigned int) kt_inflate_byte(src, b) | ((unsigned int) kt_inflate_byte(src, b + 1) << 8);
+        if(!(kt_inflate_byte(src, b - 1) & 0xC0) && (bits ^ 0xFFFF) == ((unsigned int) kt_inflate_byte(src, b + 2) | ((unsigned int) kt_inflate_byte(src, b + 3) << 8)) && kt_inflate_try(pool, strm, job, &probe, (b - 1) * 8 + 5) == 0)
+        {
+            found = 1;
+            break;
+        }
+        // A dynamic block: fixed ones are too easy to mistake for random bits, these have a header that has to make sense
+        for(bit = 0; bit < 8; bit++)
+        {
+            if(((bits >> (bit + 1)) & 3) == 2 && kt_inflate_header_ok(src, strm, b * 8 + bit) && kt_inflate_try(pool, strm, job, &probe, b * 8 + bit) == 0)
+            {
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(probe.out);
+    job->num_marks = (found ? job->run.num_marks : 0);
+    job->run.marks = NULL;
+
+    return (found ? 0 : -1);
+}
+
+static int kt_inflate_job_run(struct kt_inflate_pool *pool, z_stream *strm, struct kt_inflate_job *job)
+{
+    uLongf dict_len = KT_INFLATE_WINDOW;
+
+    if(job->guess)
+        return kt_inflate_guess(pool, strm, job);
+    if(job->point != NULL && job->point->type == KTIndexPointWindow)
+    {
+        if(uncompress(job->dict, &dict_len, job->point->window, job->point->window_size) != Z_OK || dict_len != KT_INFLATE_WINDOW)
+            return -1;
+        job->run.dict = job->dict;
+        job->run.dict_len = KT_INFLATE_WINDOW;
+    }
+    return kt_inflate_run(&pool->src, strm, &job->run);
+}
+
+static void *kt_inflate_worker(void *arg)
+{
+    struct kt_inflate_pool *pool = arg;
+    struct kt_inflate_job *job;
+    z_stream strm;
+    int ok;
+
+    kt_context_attach(pool->ctx);
+    memset(&strm, 0, sizeof(strm));
+    ok = (inflateInit2(&strm, -15) == Z_OK);
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->quit && pool->next_inflate >= pool->next_queue)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if(pool->quit)
+            break;
+        job = &pool->jobs[pool->next_inflate++ % pool->num_slots];
+        job->state = KT_INFLATE_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->status = (ok ? kt_inflate_job_run(pool, &strm, job) : -1);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = KT_INFLATE_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if(ok)
+        inflateEnd(&strm);
+    kt_context_attach(NULL);
+
+    return NULL;
+}
+
+// Queue whatever fits. Called with the lock held.
+static void kt_inflate_queue(struct kt_inflate_pool *pool)
+{
+    struct kt_inflate_job *job;
+    uint64_t s;
+
+    while(pool->next_queue < pool->num_segments && pool->next_queue < pool->next_read + pool->num_slots)
+    {
+        s = pool->next_queue;
+        job = &pool->jobs[s % pool->num_slots];
+        if(job->state != KT_INFLATE_FREE)
+            break;
+        job->segment = s;
+        job->guess = 0;
+        job->point = NULL;
+        job->dep_end = 0;
+        job->num_marks = 0;
+        job->status = 0;
+        job->run.header = 0;
+        job->run.dict = NULL;
+        job->run.dict_len = 0;
+        job->run.stop = UINT64_MAX;
+        job->run.max_out = SIZE_MAX;
+        if(pool->seek != NULL)
+        {
+            // Straight from the index: we know where it starts, and how much comes out
+            job->point = &pool->seek->points[s];
+            job->run.pos = job->point->in * 8 - job->point->bits;
+            job->run.header = (job->point->type == KTIndexPointMember);
+            if(s + 1 < pool->num_segments)
+                job->run.max_out = (size_t) (pool->seek->points[s + 1].out - job->point->out);
+        }
+        else
+        {
+            job->from = s * pool->chunk;
+            job->to = (s + 1 < pool->num_segments ? (s + 1) * pool->chunk : pool->src.size);
+            if(s + 1 < pool->num_segments)
+                job->run.stop = (s + 1) * pool->chunk * 8;
+            // The first one starts with the payload, obviously
+            job->guess = (s > 0);
+            job->run.pos = 0;
+            job->run.header = 1;
+        }
+        job->state = KT_INFLATE_QUEUED;
+        pool->next_queue++;
+    }
+    pthread_cond_broadcast(&pool->queued);
+}
+
+// Remember the last 32K we handed out
+static void kt_inflate_slide(struct kt_inflate_pool *pool, const unsigned char *buf, size_t len)
+{
+    // Nothing handed out (buf may be NULL then)
+    if(len == 0)
+        return;
+    if(len >= KT_INFLATE_WINDOW)
+    {
+        memcpy(pool->window, buf + len - KT_INFLATE_WINDOW, KT_INFLATE_WINDOW);
+        pool->window_len = KT_INFLATE_WINDOW;
+        return;
+    }
+    memmove(pool->window, pool->window + len, KT_INFLATE_WINDOW - len);
+    memcpy(pool->window + KT_INFLATE_WINDOW - len, buf, len);
+    pool->window_len = (pool->window_len + len > KT_INFLATE_WINDOW ? KT_INFLATE_WINDOW : pool->window_len + len);
+}
+
+// Inflate from where the output we've handed out ends, on this thread
+static int kt_inflate_here(struct kt_inflate_pool *pool, struct kt_inflate_run *run, uint64_t stop, size_t max_out)
+{
+    memset(run, 0, sizeof(*run));
+    run->pos = pool->pos;
+    run->header = pool->header;
+    run->dict = pool->window + KT_INFLATE_WINDOW - pool->window_len;
+    run->dict_len = pool->window_len;
+    run->stop = stop;
+    run->max_out = max_out;
+    if(kt_inflate_run(&pool->src, &pool->strm, run) < 0)
+    {
+        free(run->out);
+        run->out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Check a guessed segment against where we are, fix what depended on the window, and take its output (or do it ourselves)
+static int kt_inflate_take_guess(struct kt_inflate_pool *pool, struct kt_inflate_job *job, unsigned char **out, size_t *out_len)
+{
+    struct kt_inflate_run gap;
+    struct kt_inflate_run fix;
+    unsigned char *buf;
+    uint64_t sync = pool->pos;
+    int sync_header = pool->header;
+    size_t skip = 0;
+    size_t len;
+    unsigned int i;
+    int ok = (job->status == 0);
+
+    memset(&gap, 0, sizeof(gap));
+    memset(&fix, 0, sizeof(fix));
+    // Go to the first boundary at or past where it started...
+    if(ok && job->run.pos > pool->pos)
+    {
+        if(kt_inflate_here(pool, &gap, job->run.pos, SIZE_MAX) < 0)
+            return -1;
+        sync = gap.end;
+        sync_header = gap.end_header;
+        ok = !gap.eof;
+    }
+    // ...it has to be one it went through, too
+    if(ok && (sync != job->run.pos || sync_header != job->run.header))
+    {
+        ok = 0;
+        for(i = 0; i < job->num_marks; i++)
+        {
+            if(job->marks[i].pos == sync && job->marks[i].header == sync_header)
+            {
+                skip = job->marks[i].out;
+                ok = 1;
+                break;
+            }
+        }
+    }
+    if(ok)
+    {
+        kt_inflate_slide(pool, gap.out, gap.out_len);
+        pool->pos = sync;
+        pool->header = sync_header;
+        if(job->dep_end > skip)
+        {
+            if(kt_inflate_here(pool, &fix, UINT64_MAX, job->dep_end - skip) < 0 || fix.out_len != job->dep_end - skip)
+            {
+                free(gap.out);
+                free(fix.out);
+                return -1;
+            }
+            memcpy(job->run.out + skip, fix.out, fix.out_len);
+            free(fix.out);
+        }
+        len = job->run.out_len - skip;
+        if(gap.out_len > 0 || skip > 0)
+        {
+            // (+ 1 so that it's never 0)
+            if((buf = realloc(gap.out, gap.out_len + len + 1)) == NULL)
+            {
+                free(gap.out);
+                return -1;
+            }
+            memcpy(buf + gap.out_len, job->run.out + skip, len);
+            *out = buf;
+            *out_len = gap.out_len + len;
+        }
+        else
+        {
+            *out = job->run.out;
+            *out_len = len;
+            job->run.out = NULL;
+            job->run.out_size = 0;
+        }
+        pool->pos = job->run.end;
+        pool->header = job->run.end_header;
+        pool->eof = job->run.eof;
+        if(job->segment > 0)
+            pool->num_guessed++;
+    }
+    else
+    {
+        // No luck, the old way
+        free(gap.out);
+        if(kt_inflate_here(pool, &gap, job->run.stop, SIZE_MAX) < 0)
+            return -1;
+        *out = gap.out;
+        *out_len = gap.out_len;
+        pool->pos = gap.end;
+        pool->header = gap.end_header;
+        pool->eof = gap.eof;
+    }
+    kt_inflate_slide(pool, *out, *out_len);
+
+    return 0;
+}
+
+static ssize_t kt_inflate_read(struct archive *a, void *client_data, const void **buff)
+{
+    struct kt_inflate_pool *pool = client_data;
+    struct kt_inflate_job *job;
+    unsigned char *out = NULL;
+    size_t out_len = 0;
+    int r;
+
+    free(pool->handed);
+    pool->handed = NULL;
+    while(!pool->eof && pool->next_read < pool->num_segments)
+    {
+        pthread_mutex_lock(&pool->lock);
+        kt_inflate_queue(pool);
+        job = &pool->jobs[pool->next_read % pool->num_slots];
+        while(job->state != KT_INFLATE_DONE)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        if(pool->seek != NULL)
+        {
+            r = job->status;
+            // The index told us how much to expect
+            if(r == 0 && job->run.max_out != SIZE_MAX && job->run.out_len != job->run.max_out)
+                r = -1;
+            if(r == 0)
+            {
+                out = job->run.out;
+                out_len = job->run.out_len;
+                job->run.out = NULL;
+                job->run.out_size = 0;
+                pool->eof = job->run.eof;
+            }
+        }
+        else
+        {
+            r = kt_inflate_take_guess(pool, job, &out, &out_len);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = KT_INFLATE_FREE;
+        pool->next_read++;
+        pthread_mutex_unlock(&pool->lock);
+        if(r < 0)
+        {
+            archive_set_error(a, ARCHIVE_ERRNO_MISC, "Cannot inflate payload");
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+        if(out_len == 0)
+        {
+            free(out);
+            continue;
+        }
+        pool->handed = out;
+        *buff = out;
+        return (ssize_t) out_len;
+    }
+
+    return 0;
+}
+
+static void kt_inflate_pool_free(struct kt_inflate_pool *pool)
+{
+    unsigned int i;
+
+    if(pool->workers != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = 1;
+        pthread_cond_broadcast(&pool->queued);
+        pthread_mutex_unlock(&pool->lock);
+        for(i = 0; i < pool->num_workers; i++)
+            pthread_join(pool->workers[i], NULL);
+        free(pool->workers);
+    }
+    if(pool->jobs != NULL)
+    {
+        for(i = 0; i < pool->num_slots; i++)
+            free(pool->jobs[i].run.out);
+        free(pool->jobs);
+    }
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    inflateEnd(&pool->strm);
+    free(pool->handed);
+    kt_index_free(pool->seek);
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    if(pool->map != NULL)
+        munmap(pool->map, pool->map_len);
+#endif
+    free(pool);
+}
+
+static int kt_inflate_close(struct archive *a, void *client_data)
+{
+    struct kt_inflate_pool *pool = client_data;
+
+    (void) a;
+    if(pool->seek == NULL && pool->num_segments > 1)
+        fprintf(kt_stderr, "Inflated %llu out of %llu segments in parallel.\n", (unsigned long long) pool->num_guessed + 1, (unsigned long long) pool->num_segments);
+    kt_inflate_pool_free(pool);
+
+    return ARCHIVE_OK;
+}
+
+// Open a, reading the tarball inside input (a package, or a plain gzipped tarball) with a pool of inflaters.
+// Returns 1 if it isn't worth it (or possible), so that the caller can fall back to its serial reader.
+int kt_inflate_read_open(struct archive *a, FILE *input, const unsigned int fake_sign, const KTInflateOptions *opts)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) a;
+    (void) input;
+    (void) fake_sign;
+    (void) opts;
+    return 1;
+#else
+    struct kt_inflate_pool *pool;
+    struct stat st;
+    KTIndex *probe;
+    KTIndex *seek;
+    long page_size;
+    off_t base;
+    unsigned char magic;
+    const unsigned char *p;
+    unsigned int i;
+    unsigned int k;
+
+    if(opts == NULL || opts->jobs < 2 || fstat(fileno(input), &st) != 0 || !S_ISREG(st.st_mode))
+        return 1;
+    if((probe = kt_index_probe(input, fake_sign)) == NULL)
+        return -1;
+    seek = kt_index_load_embedded(input, fake_sign);
+    if((pool = calloc(1, sizeof(*pool))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate inflater pool: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        kt_index_free(probe);
+        kt_index_free(seek);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->ctx = kt_context_current();
+    pool->seek = seek;
+    pool->speculative = opts->speculative;
+    pool->src.size = probe->bin_size - probe->payload_offset;
+    pool->src.munged = probe->munged;
+    pool->header = 1;
+    if(inflateInit2(&pool->strm, -15) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize inflater.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        kt_index_free(probe);
+        kt_inflate_pool_free(pool);
+        return -1;
+    }
+
+    // Map the payload
+    if((page_size = sysconf(_SC_PAGESIZE)) <= 0)
+        page_size = 4096;
+    base = (off_t) probe->payload_offset - (off_t) (probe->payload_offset % (uint64_t) page_size);
+    pool->map_len = (size_t) (probe->bin_size - (uint64_t) base);
+    if(pool->src.size == 0 || (pool->map = mmap(NULL, pool->map_len, PROT_READ, MAP_PRIVATE, fileno(input), base)) == MAP_FAILED)
+    {
+        pool->map = NULL;
+        kt_index_free(probe);
+        kt_inflate_pool_free(pool);
+        return 1;
+    }
+    pool->src.data = (const unsigned char *) pool->map + (probe->payload_offset - (uint64_t) base);
+    kt_index_free(probe);
+
+    if(seek != NULL && seek->num_points > 1)
+    {
+        pool->num_segments = seek->num_points;
+    }
+    else
+    {
+        kt_index_free(pool->seek);
+        pool->seek = NULL;
+        pool->chunk = pool->src.size / ((uint64_t) opts->jobs * 4);
+        if(pool->chunk < KT_INFLATE_CHUNK_MIN)
+            pool->chunk = KT_INFLATE_CHUNK_MIN;
+        if(pool->chunk > KT_INFLATE_CHUNK_MAX)
+            pool->chunk = KT_INFLATE_CHUNK_MAX;
+        pool->num_segments = (pool->src.size + pool->chunk - 1) / pool->chunk;
+        if(!pool->speculative)
+        {
+            // Without another gzip member to start from, there's nothing to split
+            magic = 0x1F;
+            if(pool->src.munged)
+                md(&magic, 1);
+            p = memchr(pool->src.data + 1, magic, (size_t) pool->src.size - 1);
+            while(p != NULL && kt_inflate_gzip_header(&pool->src, (uint64_t) (p - pool->src.data)) == 0)
+                p = memchr(p + 1, magic, (size_t) (pool->src.size - (uint64_t) (p + 1 - pool->src.data)));
+            if(p == NULL)
+                pool->num_segments = 1;
+        }
+        if(pool->num_segments < 2)
+        {
+            kt_inflate_pool_free(pool);
+            return 1;
+        }
+        for(k = 0; k < KT_INFLATE_WINDOW; k++)
+        {
+            pool->fakes[0][k] = (unsigned char) (k & 0xFF);
+            pool->fakes[1][k] = (unsigned char) ~(k & 0xFF);
+        }
+    }
+
+    pool->num_slots = opts->jobs * 2;
+    if((pool->jobs = calloc(pool->num_slots, sizeof(*pool->jobs))) == NULL || (pool->workers = malloc(opts->jobs * sizeof(*pool->workers))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate inflater pool: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        kt_inflate_pool_free(pool);
+        return -1;
+    }
+    for(i = 0; i < opts->jobs; i++)
+    {
+        if(pthread_create(&pool->workers[i], NULL, kt_inflate_worker, pool) != 0)
+            break;
+        pool->num_workers++;
+    }
+    if(pool->num_workers == 0)
+    {
+        fprintf(kt_stderr, "Cannot spawn inflater threads, inflating serially.\n");
+        free(pool->workers);
+        pool->workers = NULL;
+        kt_inflate_pool_free(pool);
+        return 1;
+    }
+    fprintf(kt_stderr, "Inflating with %u threads (%llu segments, %s).\n", pool->num_workers, (unsigned long long) pool->num_segments, (pool->seek != NULL ? "from the embedded index" : (pool->speculative ? "speculative" : "gzip members")));
+
+    if(archive_read_open(a, pool, NULL, kt_inflate_read, kt_inflate_close) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_open() failure: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
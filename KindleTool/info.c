@@ -0,0 +1,553 @@
+//
+//  info.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Default passwords: they're a few hex digits of the MD5 of the serial number (with a trailing LF).
+// That's always a 17 bytes message, so a single MD5 block, in which only the first 16 bytes ever change.
+// We hash KT_INFO_LANES serials at once: every round is a loop over plain arrays of lanes, which compilers
+// turn into SIMD code wherever the target has some (and it's still plain C everywhere else).
+
+#define KT_INFO_LANES 8
+// How many serials we read, hash & format per round trip
+#define KT_INFO_BATCH 4096
+// Longest input line we care about (anything longer is reported as invalid)
+#define KT_INFO_LINE 256
+
+enum kt_serial_status
+{
+    KT_SERIAL_OK = 0,
+    KT_SERIAL_UNKNOWN,          // Well formed, but not a device we know about
+    KT_SERIAL_INVALID,          // Not 16 characters long
+    KT_SERIAL_STATUS_COUNT
+};
+
+static const char *kt_serial_status_names[KT_SERIAL_STATUS_COUNT] = { "ok", "unknown", "invalid" };
+
+typedef struct
+{
+    char serial[KT_INFO_LINE];
+    size_t len;
+    enum kt_serial_status status;
+    Device device;
+    unsigned int new_scheme;    // Device ID in chars 4 to 6, base32 (since the PW3)
+    unsigned int wario;         // Platform is Wario or newer
+    char md5[MD5_HASH_LENGTH];
+} KTSerialInfo;
+
+struct kt_info_buffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static const uint32_t kt_md5_k[64] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned int kt_md5_s[64] =
+{
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+#define KT_ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// One MD5 step over every lane
+#define KT_MD5_ROUND(i, F, g) \
+    for(l = 0; l < KT_INFO_LANES; l++) \
+    { \
+        uint32_t t = a[l] + (F) + kt_md5_k[i] + w[g][l]; \
+        a[l] = d[l]; \
+        d[l] = c[l]; \
+        c[l] = b[l]; \
+        b[l] += KT_ROTL32(t, kt_md5_s[i]); \
+    }
+
+// MD5 of "<serial>\n" for up to KT_INFO_LANES serials, as lowercase hex (like md5_sum)
+static void kt_md5_serials(KTSerialInfo *infos, unsigned int n)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint32_t w[16][KT_INFO_LANES];
+    uint32_t a[KT_INFO_LANES], b[KT_INFO_LANES], c[KT_INFO_LANES], d[KT_INFO_LANES];
+    unsigned int i;
+    unsigned int j;
+    unsigned int l;
+    uint32_t v;
+
+    memset(w, 0, sizeof(w));
+    for(l = 0; l < n; l++)
+    {
+        for(j = 0; j < SERIAL_NO_LENGTH / 4; j++)
+            w[j][l] = (uint32_t) (unsigned char) infos[l].serial[j * 4] | (uint32_t) (unsigned char) infos[l].serial[j * 4 + 1] << 8 | (uint32_t) (unsigned char) infos[l].serial[j * 4 + 2] << 16 | (uint32_t) (unsigned char) infos[l].serial[j * 4 + 3] << 24;
+    }
+    for(l = 0; l < KT_INFO_LANES; l++)
+    {
+        w[4][l] = 0x0000800A;                           // '\n', then the padding bit
+        w[14][l] = (SERIAL_NO_LENGTH + 1) * 8;          // Message length, in bits
+        a[l] = 0x67452301;
+        b[l] = 0xefcdab89;
+        c[l] = 0x98badcfe;
+        d[l] = 0x10325476;
+    }
+
+    for(i = 0; i < 16; i++)
+        KT_MD5_ROUND(i, (d[l] ^ (b[l] & (c[l] ^ d[l]))), i)
+    for(i = 16; i < 32; i++)
+        KT_MD5_ROUND(i, (c[l] ^ (d[l] & (b[l] ^ c[l]))), (5 * i + 1) & 15)
+    for(i = 32; i < 48; i++)
+        KT_MD5_ROUND(i, (b[l] ^ c[l] ^ d[l]), (3 * i + 5) & 15)
+    for(i = 48; i < 64; i++)
+        KT_MD5_ROUND(i, (c[l] ^ (b[l] | ~d[l])), (7 * i) & 15)
+
+    for(l = 0; l < n; l++)
+    {
+        const uint32_t state[4] = { a[l] + 0x67452301, b[l] + 0xefcdab89, c[l] + 0x98badcfe, d[l] + 0x10325476 };
+        for(i = 0; i < 4; i++)
+        {
+            v = state[i];
+            for(j = 0; j < 4; j++)
+            {
+                infos[l].md5[i * 8 + j * 2] = hex[(v >> (j * 8 + 4)) & 0x0F];
+                infos[l].md5[i * 8 + j * 2 + 1] = hex[(v >> (j * 8)) & 0x0F];
+            }
+        }
+    }
+}
+
+// Figure out the device (and its platform) from a well formed serial
+static void kt_serial_device(KTSerialInfo *info)
+{
+    char device_code[4] = {'\0'};
+
+    snprintf(device_code, 3, "%.*s", 2, &info->serial[2]);
+    info->device = (Device)strtoul(device_code, NULL, 16);
+    info->new_scheme = 0;
+    // Handle the new device ID position, since the PW3
+    if(kt_device_name(info->device) == NULL)
+    {
+        snprintf(device_code, 4, "%.*s", 3, &info->serial[3]);
+        info->device = (Device)strtoul(device_code, NULL, 32);
+        info->new_scheme = 1;
+    }
+    info->status = (kt_device_name(info->device) == NULL ? KT_SERIAL_UNKNOWN : KT_SERIAL_OK);
+    // Handle the Wario (>= PW2) passwords while we're at it... Thanks to npoland for this one ;).
+    // NOTE: Remember to check if this is still sane w/ kindle_model_sort.py when new stuff comes out!
+    info->wario = (info->device == KindleVoyageWifi || info->device == KindlePaperWhite2Wifi4GBInternational || info->device >= KindleVoyageUnknown_0x2A);
+}
+
+// Normalize a serial, and check that it at least looks like one
+static void kt_serial_prepare(KTSerialInfo *info)
+{
+    size_t i;
+
+    if(info->len != SERIAL_NO_LENGTH)
+    {
+        info->status = KT_SERIAL_INVALID;
+        return;
+    }
+    for(i = 0; i < SERIAL_NO_LENGTH; i++)
+    {
+        if(islower((int)(unsigned char)info->serial[i]))
+            info->serial[i] = (char)toupper((int)(unsigned char)info->serial[i]);
+    }
+    kt_serial_device(info);
+}
+
+// Hash a batch of serials, KT_INFO_LANES at a time (the invalid ones just ride along)
+static void kt_serial_hash(KTSerialInfo *infos, unsigned int count)
+{
+    unsigned int i;
+
+    for(i = 0; i < count; i += KT_INFO_LANES)
+        kt_md5_serials(&infos[i], (count - i < KT_INFO_LANES ? count - i : KT_INFO_LANES));
+}
+
+static int kt_info_reserve(struct kt_info_buffer *buf, size_t len)
+{
+    char *data;
+    size_t size;
+
+    if(buf->len + len <= buf->size)
+        return 0;
+    size = (buf->size > 0 ? buf->size : BUFFER_SIZE);
+    while(size < buf->len + len)
+        size *= 2;
+    if((data = realloc(buf->data, size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate the output buffer.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    buf->data = data;
+    buf->size = size;
+
+    return 0;
+}
+
+// The buffer always has room for KT_INFO_LINE bytes past len, see kt_info_format
+static void kt_info_put(struct kt_info_buffer *buf, const char *str, size_t len)
+{
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+#define kt_info_puts(buf, str) kt_info_put(buf, str, sizeof(str) - 1)
+
+// Something that came from the input: escaped for JSON, or stripped of anything that would break a TSV row
+static void kt_info_put_raw(struct kt_info_buffer *buf, const char *str, size_t len, unsigned int json)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char ch;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        ch = (unsigned char) str[i];
+        if(json && (ch == '"' || ch == '\\'))
+        {
+            buf->data[buf->len++] = '\\';
+            buf->data[buf->len++] = (char) ch;
+        }
+        else if(ch < 0x20 || ch == 0x7F)
+        {
+            if(json)
+            {
+                kt_info_puts(buf, "\\u00");
+                buf->data[buf->len++] = hex[ch >> 4];
+                buf->data[buf->len++] = hex[ch & 0x0F];
+            }
+            else
+                buf->data[buf->len++] = ' ';
+        }
+        else
+            buf->data[buf->len++] = (char) ch;
+    }
+}
+
+static void kt_info_put_uint(struct kt_info_buffer *buf, unsigned int n)
+{
+    char digits[16];
+    size_t len = 0;
+
+    do
+    {
+        digits[len++] = (char) ('0' + n % 10);
+        n /= 10;
+    } while(n > 0);
+    while(len > 0)
+        buf->data[buf->len++] = digits[--len];
+}
+
+// One record per serial: serial, status, device, device name, platform, root password, recovery password
+static int kt_info_format(struct kt_info_buffer *buf, const KTSerialInfo *info, unsigned int json)
+{
+    const char *name;
+    const char *status = kt_serial_status_names[info->status];
+    const char *md5_part = &info->md5[info->wario ? 13 : 7];
+
+    // Escaping can blow up each input byte to 6 output bytes, everything else is bounded by the device name
+    if(kt_info_reserve(buf, info->len * 6 + KT_INFO_LINE) < 0)
+        return -1;
+    if(json)
+    {
+        kt_info_puts(buf, "{\"serial\":\"");
+        kt_info_put_raw(buf, info->serial, info->len, json);
+        kt_info_puts(buf, "\",\"status\":\"");
+        kt_info_put(buf, status, strlen(status));
+        kt_info_puts(buf, "\"");
+        if(info->status == KT_SERIAL_OK)
+        {
+            name = kt_device_name(info->device);
+            kt_info_puts(buf, ",\"device\":");
+            kt_info_put_uint(buf, (unsigned int) info->device);
+            kt_info_puts(buf, ",\"device_name\":\"");
+            kt_info_put(buf, name, strlen(name));
+            kt_info_puts(buf, "\",\"platform\":\"");
+            if(info->wario)
+                kt_info_puts(buf, "wario");
+            else
+                kt_info_puts(buf, "pre-wario");
+            kt_info_puts(buf, "\",\"root_password\":\"fiona");
+            kt_info_put(buf, md5_part, 3);
+            kt_info_puts(buf, "\",\"recovery_password\":\"fiona");
+            kt_info_put(buf, md5_part, 4);
+            kt_info_puts(buf, "\"");
+        }
+        kt_info_puts(buf, "}\n");
+    }
+    else
+    {
+        kt_info_put_raw(buf, info->serial, info->len, json);
+        kt_info_puts(buf, "\t");
+        kt_info_put(buf, status, strlen(status));
+        if(info->status == KT_SERIAL_OK)
+        {
+            name = kt_device_name(info->device);
+            kt_info_puts(buf, "\t");
+            kt_info_put_uint(buf, (unsigned int) info->device);
+            kt_info_puts(buf, "\t");
+            kt_info_put(buf, name, strlen(name));
+            if(info->wario)
+                kt_info_puts(buf, "\twario\tfiona");
+            else
+                kt_info_puts(buf, "\tpre-wario\tfiona");
+            kt_info_put(buf, md5_part, 3);
+            kt_info_puts(buf, "\tfiona");
+            kt_info_put(buf, md5_part, 4);
+        }
+        else
+            kt_info_puts(buf, "\t\t\t\t\t");
+        kt_info_puts(buf, "\n");
+    }
+
+    return 0;
+}
+
+// Read the next serial (one per line, blank lines are skipped). Returns 1 on success, 0 at EOF, -1 on error.
+static int kt_info_read(FILE *input, KTSerialInfo *info)
+{
+    size_t len;
+    int ch;
+
+    while(fgets(info->serial, sizeof(info->serial), input) != NULL)
+    {
+        len = strlen(info->serial);
+        // Swallow the rest of an overlong line, what we kept of it will be reported as invalid
+        if(len == sizeof(info->serial) - 1 && info->serial[len - 1] != '\n')
+        {
+            while((ch = fgetc(input)) != EOF && ch != '\n')
+                ;
+        }
+        while(len > 0 && isspace((int)(unsigned char)info->serial[len - 1]))
+            len--;
+        if(len == 0)
+            continue;
+        info->serial[len] = '\0';
+        info->len = len;
+        return 1;
+    }
+    if(ferror(input) != 0)
+    {
+        fprintf(kt_stderr, "Cannot read serial numbers: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Default passwords for a whole list of serial numbers (one per line), as TSV or JSON Lines. Tallies ok, unknown & invalid serials in counts.
+int kindle_info_batch(FILE *input, FILE *out, unsigned int json, unsigned int *counts)
+{
+    KTSerialInfo *infos;
+    struct kt_info_buffer buf;
+    unsigned int count;
+    unsigned int i;
+    int r = 1;
+    int ret = 0;
+
+    if((infos = malloc(KT_INFO_BATCH * sizeof(*infos))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate the serial number batch.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    memset(&buf, 0, sizeof(buf));
+
+    while(r > 0 && ret == 0)
+    {
+        for(count = 0; count < KT_INFO_BATCH; count++)
+        {
+            if((r = kt_info_read(input, &infos[count])) <= 0)
+                break;
+            kt_serial_prepare(&infos[count]);
+        }
+        if(r < 0)
+            ret = -1;
+        kt_serial_hash(infos, count);
+        buf.len = 0;
+        for(i = 0; i < count && ret == 0; i++)
+        {
+            counts[infos[i].status]++;
+            if(kt_info_format(&buf, &infos[i], json) < 0)
+                ret = -1;
+        }
+        if(buf.len > 0 && fwrite(buf.data, 1, buf.len, out) != buf.len)
+        {
+            fprintf(kt_stderr, "Cannot write the results: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            ret = -1;
+        }
+    }
+    free(buf.data);
+    free(infos);
+
+    return ret;
+}
+
+int kindle_info_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "batch", no_argument, NULL, 'b' },
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+    KTSerialInfo info;
+    unsigned int batch = 0;
+    unsigned int json = 0;
+    const char *out_name = NULL;
+    FILE *input;
+    FILE *out;
+    unsigned int counts[KT_SERIAL_STATUS_COUNT] = { 0 };
+    unsigned int total;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    int i;
+    int ret = 0;
+
+    while((opt = getopt_long(argc, argv, "bf:o:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'b':
+                batch = 1;
+                break;
+            case 'f':
+                if(strcmp(optarg, "tsv") == 0)
+                    json = 0;
+                else if(strcmp(optarg, "jsonl") == 0 || strcmp(optarg, "json") == 0)
+                    json = 1;
+                else
+                {
+                    fprintf(kt_stderr, "Unknown output format '%s' (tsv or jsonl).\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'o':
+                out_name = optarg;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    if(!batch)
+    {
+        if(optind >= argc)
+        {
+            fprintf(kt_stderr, "Missing argument. You must pass a serial number.\n");
+            return -1;
+        }
+        memset(&info, 0, sizeof(info));
+        info.len = strlen(argv[optind]);
+        if(info.len != SERIAL_NO_LENGTH)
+        {
+            fprintf(kt_stderr, "Serial number must be 16 digits long (no spaces). Example: %s\n", "B0NNXXXXXXXXXXXX");
+            return -1;
+        }
+        memcpy(info.serial, argv[optind], SERIAL_NO_LENGTH);
+        kt_serial_prepare(&info);
+        if(info.status == KT_SERIAL_UNKNOWN)
+        {
+            fprintf(kt_stderr, "Unknown device!\n");
+            return -1;
+        }
+        if(info.new_scheme)
+            fprintf(kt_stderr, "Device uses the new device ID scheme\n");
+        kt_md5_serials(&info, 1);
+        fprintf(kt_stderr, "Platform is %s\n", (info.wario ? "Wario or newer" : "pre Wario"));
+        // Default root passwords are DES hashed, so we only care about the first 8 chars. On the other hand,
+        // the recovery MMC export option expects a 9 chars password, so, provide both...
+        fprintf(kt_stderr, "Root PW            %s%.*s\nRecovery PW        %s%.*s\n", "fiona", 3, &info.md5[info.wario ? 13 : 7], "fiona", 4, &info.md5[info.wario ? 13 : 7]);
+        return 0;
+    }
+
+    if(out_name == NULL || strcmp(out_name, "-") == 0)
+        out = stdout;
+    else if((out = fopen(out_name, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open output '%s' for writing: %s.\n", out_name, strerror(errno));
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if(!json)
+        fputs("serial\tstatus\tdevice\tdevice_name\tplatform\troot_password\trecovery_password\n", out);
+    // Serials from stdin, unless we were given some files
+    for(i = optind; (i < argc || i == optind) && ret == 0; i++)
+    {
+        if(i >= argc || strcmp(argv[i], "-") == 0)
+            input = stdin;
+        else if((input = fopen(argv[i], "rb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open input '%s' for reading: %s.\n", argv[i], strerror(errno));
+            ret = -1;
+            break;
+        }
+        ret = kindle_info_batch(input, out, json, counts);
+        if(input != stdin)
+            fclose(input);
+    }
+    if(fflush(out) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Cannot write the results: %s.\n", strerror(errno));
+        ret = -1;
+    }
+    if(out != stdout && fclose(out) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Cannot write output '%s': %s.\n", out_name, strerror(errno));
+        ret = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    total = counts[KT_SERIAL_OK] + counts[KT_SERIAL_UNKNOWN] + counts[KT_SERIAL_INVALID];
+    fprintf(kt_stderr, "Processed %u serial numbers in %.2fs (%.0f/s, %u lanes): %u ok, %u unknown devices, %u invalid.\n", total, elapsed, elapsed > 0 ? (double) total / elapsed : 0.0, KT_INFO_LANES, counts[KT_SERIAL_OK], counts[KT_SERIAL_UNKNOWN], counts[KT_SERIAL_INVALID]);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
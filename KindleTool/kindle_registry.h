@@ -0,0 +1,336 @@
+/*
+   Device, platform & board registry: dense ID -> record look-up tables, and a perfect hash of the names create accepts.
+   Generated by: tools/kindle_registry.py (edit that instead, and regenerate)
+*/
+
+#ifndef KINDLEREGISTRY
+#define KINDLEREGISTRY
+
+/*  the enums in kindle_tool.h have to agree with us */
+typedef char kt_registry_enum_check[(
+    Kindle1 == 0x01 &&
+    Kindle2US == 0x02 &&
+    Kindle2International == 0x03 &&
+    KindleDXUS == 0x04 &&
+    KindleDXInternational == 0x05 &&
+    KindleDXGraphite == 0x09 &&
+    Kindle3Wifi == 0x08 &&
+    Kindle3Wifi3G == 0x06 &&
+    Kindle3Wifi3GEurope == 0x0A &&
+    Kindle4NonTouch == 0x0E &&
+    Kindle5TouchWifi == 0x11 &&
+    Kindle5TouchWifi3G == 0x0F &&
+    Kindle5TouchWifi3GEurope == 0x10 &&
+    Kindle5TouchUnknown == 0x12 &&
+    Kindle4NonTouchBlack == 0x23 &&
+    KindlePaperWhiteWifi == 0x24 &&
+    KindlePaperWhiteWifi3G == 0x1B &&
+    KindlePaperWhiteWifi3GCanada == 0x1C &&
+    KindlePaperWhiteWifi3GEurope == 0x1D &&
+    KindlePaperWhiteWifi3GJapan == 0x1F &&
+    KindlePaperWhiteWifi3GBrazil == 0x20 &&
+    KindlePaperWhite2Wifi == 0xD4 &&
+    KindlePaperWhite2WifiJapan == 0x5A &&
+    KindlePaperWhite2Wifi3G == 0xD5 &&
+    KindlePaperWhite2Wifi3GCanada == 0xD6 &&
+    KindlePaperWhite2Wifi3GEurope == 0xD7 &&
+    KindlePaperWhite2Wifi3GRussia == 0xD8 &&
+    KindlePaperWhite2Wifi3GJapan == 0xF2 &&
+    KindlePaperWhite2Wifi4GBInternational == 0x17 &&
+    KindlePaperWhite2Wifi3G4GBEurope == 0x60 &&
+    KindlePaperWhite2Unknown_0xF4 == 0xF4 &&
+    KindlePaperWhite2Unknown_0xF9 == 0xF9 &&
+    KindlePaperWhite2Wifi3G4GB == 0x62 &&
+    KindlePaperWhite2Unknown_0x61 == 0x61 &&
+    KindlePaperWhite2Wifi3G4GBCanada == 0x5F &&
+    KindleBasic == 0xC6 &&
+    KindleVoyageWifi == 0x13 &&
+    ValidKindleUnknown_0x16 == 0x16 &&
+    ValidKindleUnknown_0x21 == 0x21 &&
+    KindleVoyageWifi3G == 0x54 &&
+    KindleVoyageUnknown_0x2A == 0x2A &&
+    KindleVoyageUnknown_0x4F == 0x4F &&
+    KindleVoyageUnknown_0x52 == 0x52 &&
+    KindleVoyageWifi3GEurope == 0x53 &&
+    ValidKindleUnknown_0x07 == 0x07 &&
+    ValidKindleUnknown_0x0B == 0x0B &&
+    ValidKindleUnknown_0x0C == 0x0C &&
+    ValidKindleUnknown_0x0D == 0x0D &&
+    ValidKindleUnknown_0x99 == 0x99 &&
+    KindleBasicUnknown_0xDD == 0xDD &&
+    KindlePaperWhite3Wifi == 0x201 &&
+    KindlePaperWhite3Unknown_0G2 == 0x202 &&
+    KindlePaperWhite3Unknown_0G4 == 0x204 &&
+    KindlePaperWhite3Unknown_0G5 == 0x205 &&
+    KindlePaperWhite3Unknown_0G6 == 0x206 &&
+    KindlePaperWhite3Unknown_0G7 == 0x207 &&
+    Plat_Unspecified == 0x00 &&
+    MarioDeprecated == 0x01 &&
+    Luigi == 0x02 &&
+    Banjo == 0x03 &&
+    Yoshi == 0x04 &&
+    YoshimeProto == 0x05 &&
+    Yoshime == 0x06 &&
+    Wario == 0x07 &&
+    Board_Unspecified == 0x00 &&
+    Tequila == 0x03 &&
+    Whitney == 0x05
+) ? 1 : -1];
+
+/*  device records, kt_device_index points into this (0 is the unknown device) */
+static const KTDeviceRecord kt_device_records[] = {
+    { NULL, 0 },
+    { "Kindle 1", 0 },                                                       // Kindle1
+    { "Kindle 2 US", 0 },                                                    // Kindle2US
+    { "Kindle 2 International", 0 },                                         // Kindle2International
+    { "Kindle DX US", 0 },                                                   // KindleDXUS
+    { "Kindle DX International", 0 },                                        // KindleDXInternational
+    { "Kindle DX Graphite", 0 },                                             // KindleDXGraphite
+    { "Kindle 3 Wifi", 0 },                                                  // Kindle3Wifi
+    { "Kindle 3 Wifi+3G", 0 },                                               // Kindle3Wifi3G
+    { "Kindle 3 Wifi+3G Europe", 0 },                                        // Kindle3Wifi3GEurope
+    { "Kindle 4 Non-Touch Silver (2011)", 0 },                               // Kindle4NonTouch
+    { "Kindle 5 Touch Wifi", 0 },                                            // Kindle5TouchWifi
+    { "Kindle 5 Touch Wifi+3G", 0 },                                         // Kindle5TouchWifi3G
+    { "Kindle 5 Touch Wifi+3G Europe", 0 },                                  // Kindle5TouchWifi3GEurope
+    { "Kindle 5 Touch (Unknown Variant)", KT_DEVICE_UNCONFIRMED },           // Kindle5TouchUnknown
+    { "Kindle 4 Non-Touch Black (2012)", 0 },                                // Kindle4NonTouchBlack
+    { "Kindle PaperWhite Wifi", 0 },                                         // KindlePaperWhiteWifi
+    { "Kindle PaperWhite Wifi+3G", 0 },                                      // KindlePaperWhiteWifi3G
+    { "Kindle PaperWhite Wifi+3G Canada", 0 },                               // KindlePaperWhiteWifi3GCanada
+    { "Kindle PaperWhite Wifi+3G Europe", 0 },                               // KindlePaperWhiteWifi3GEurope
+    { "Kindle PaperWhite Wifi+3G Japan", 0 },                                // KindlePaperWhiteWifi3GJapan
+    { "Kindle PaperWhite Wifi+3G Brazil", 0 },                               // KindlePaperWhiteWifi3GBrazil
+    { "Kindle PaperWhite 2 (2013) Wifi", 0 },                                // KindlePaperWhite2Wifi
+    { "Kindle PaperWhite 2 (2013) Wifi Japan", 0 },                          // KindlePaperWhite2WifiJapan
+    { "Kindle PaperWhite 2 (2013) Wifi+3G", 0 },                             // KindlePaperWhite2Wifi3G
+    { "Kindle PaperWhite 2 (2013) Wifi+3G Canada", 0 },                      // KindlePaperWhite2Wifi3GCanada
+    { "Kindle PaperWhite 2 (2013) Wifi+3G Europe", 0 },                      // KindlePaperWhite2Wifi3GEurope
+    { "Kindle PaperWhite 2 (2013) Wifi+3G Russia", 0 },                      // KindlePaperWhite2Wifi3GRussia
+    { "Kindle PaperWhite 2 (2013) Wifi+3G Japan", 0 },                       // KindlePaperWhite2Wifi3GJapan
+    { "Kindle PaperWhite 2 (2013) Wifi (4GB) International", 0 },            // KindlePaperWhite2Wifi4GBInternational
+    { "Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Europe", 0 },                // KindlePaperWhite2Wifi3G4GBEurope
+    { "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite2Unknown_0xF4
+    { "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite2Unknown_0xF9
+    { "Kindle PaperWhite 2 (2013) Wifi+3G (4GB)", 0 },                       // KindlePaperWhite2Wifi3G4GB
+    { "Kindle PaperWhite 2 (2013) (Unknown Variant 0x61)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite2Unknown_0x61
+    { "Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Canada", 0 },                // KindlePaperWhite2Wifi3G4GBCanada
+    { "Kindle Basic (2014)", 0 },                                            // KindleBasic
+    { "Kindle Voyage WiFi", 0 },                                             // KindleVoyageWifi
+    { "Unknown Kindle (0x16)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x16
+    { "Unknown Kindle (0x21)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x21
+    { "Kindle Voyage WiFi+3G", 0 },                                          // KindleVoyageWifi3G
+    { "Kindle Voyage (Unknown Variant 0x2A)", KT_DEVICE_UNCONFIRMED },       // KindleVoyageUnknown_0x2A
+    { "Kindle Voyage (Unknown Variant 0x4F)", KT_DEVICE_UNCONFIRMED },       // KindleVoyageUnknown_0x4F
+    { "Kindle Voyage (Unknown Variant 0x52)", KT_DEVICE_UNCONFIRMED },       // KindleVoyageUnknown_0x52
+    { "Kindle Voyage WiFi+3G Europe", 0 },                                   // KindleVoyageWifi3GEurope
+    { "Unknown Kindle (0x07)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x07
+    { "Unknown Kindle (0x0B)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x0B
+    { "Unknown Kindle (0x0C)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x0C
+    { "Unknown Kindle (0x0D)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x0D
+    { "Unknown Kindle (0x99)", KT_DEVICE_UNCONFIRMED },                      // ValidKindleUnknown_0x99
+    { "Kindle Basic (2014) (Unknown Variant 0xDD)", KT_DEVICE_UNCONFIRMED }, // KindleBasicUnknown_0xDD
+    { "Kindle PaperWhite 3 (2015) WiFi", 0 },                                // KindlePaperWhite3Wifi
+    { "Kindle PaperWhite 3 (2015) (Unknown Variant 0G2)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite3Unknown_0G2
+    { "Kindle PaperWhite 3 (2015) (Unknown Variant 0G4)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite3Unknown_0G4
+    { "Kindle PaperWhite 3 (2015) (Unknown Variant 0G5)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite3Unknown_0G5
+    { "Kindle PaperWhite 3 (2015) (Unknown Variant 0G6)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite3Unknown_0G6
+    { "Kindle PaperWhite 3 (2015) (Unknown Variant 0G7)", KT_DEVICE_UNCONFIRMED }, // KindlePaperWhite3Unknown_0G7
+};
+
+#define KT_DEVICE_ID_MAX 0x207
+
+/*  index by device ID, result in kt_device_records */
+static const uint8_t kt_device_index[KT_DEVICE_ID_MAX + 1] = {
+    0, 1, 2, 3, 4, 5, 8, 45, 7, 6, 9, 46, 47, 48, 10, 12,
+    13, 11, 14, 37, 0, 0, 38, 29, 0, 0, 0, 17, 18, 19, 0, 20,
+    21, 39, 0, 15, 16, 0, 0, 0, 0, 0, 41, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 42,
+    0, 0, 43, 44, 40, 0, 0, 0, 0, 0, 23, 0, 0, 0, 0, 35,
+    30, 34, 33, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 49, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 36, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 22, 24, 25, 26, 27, 0, 0, 0, 0, 50, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 28, 0, 31, 0, 0, 0, 0, 32, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 51, 52, 0, 53, 54, 55, 56,
+};
+
+/*  index by platform ID, NULL when unknown */
+static const char *const kt_platform_names[] = {
+    "Unspecified",           // Plat_Unspecified
+    "Mario (Deprecated)",    // MarioDeprecated
+    "Luigi",                 // Luigi
+    "Banjo",                 // Banjo
+    "Yoshi",                 // Yoshi
+    "Yoshime (Prototype)",   // YoshimeProto
+    "Yoshime (Yoshime3)",    // Yoshime
+    "Wario",                 // Wario
+};
+
+/*  index by board ID, NULL when unknown */
+static const char *const kt_board_names[] = {
+    "Unspecified",           // Board_Unspecified
+    NULL,
+    NULL,
+    "Tequila",               // Tequila
+    NULL,
+    "Whitney",               // Whitney
+};
+
+/*  devices behind each -d name, see kt_registry_names */
+static const Device kt_registry_members[] = {
+    Kindle5TouchWifi, Kindle5TouchWifi3G, Kindle5TouchWifi3GEurope, Kindle5TouchUnknown, KindlePaperWhiteWifi, KindlePaperWhiteWifi3G, KindlePaperWhiteWifi3GCanada, KindlePaperWhiteWifi3GEurope, KindlePaperWhiteWifi3GJapan, KindlePaperWhiteWifi3GBrazil, KindlePaperWhite2Wifi, KindlePaperWhite2WifiJapan, KindlePaperWhite2Wifi3G, KindlePaperWhite2Wifi3GCanada, KindlePaperWhite2Wifi3GEurope, KindlePaperWhite2Wifi3GRussia, KindlePaperWhite2Wifi3GJapan, KindlePaperWhite2Wifi4GBInternational, KindlePaperWhite2Wifi3G4GBEurope, KindlePaperWhite2Wifi3G4GB, KindlePaperWhite2Wifi3G4GBCanada, KindlePaperWhite2Unknown_0xF4, KindlePaperWhite2Unknown_0xF9, KindlePaperWhite2Unknown_0x61, KindleBasic, KindleBasicUnknown_0xDD, KindleVoyageWifi, KindleVoyageWifi3G, KindleVoyageWifi3GEurope, KindleVoyageUnknown_0x2A, KindleVoyageUnknown_0x4F, KindleVoyageUnknown_0x52, KindlePaperWhite3Wifi, KindlePaperWhite3Unknown_0G2, KindlePaperWhite3Unknown_0G4, KindlePaperWhite3Unknown_0G5, KindlePaperWhite3Unknown_0G6, KindlePaperWhite3Unknown_0G7,
+    Kindle2US, Kindle2International, KindleDXUS, KindleDXInternational, KindleDXGraphite, Kindle3Wifi, Kindle3Wifi3G, Kindle3Wifi3GEurope,
+    ValidKindleUnknown_0x16, ValidKindleUnknown_0x21, ValidKindleUnknown_0x07, ValidKindleUnknown_0x0B, ValidKindleUnknown_0x0C, ValidKindleUnknown_0x0D, ValidKindleUnknown_0x99,
+    Kindle4NonTouch, Kindle4NonTouchBlack,
+    Kindle1,
+};
+
+#define KT_REGISTRY_SEED 0x811C9DDFu
+#define KT_REGISTRY_BITS 9
+
+/*  every name create knows, slot 0 is the miss */
+static const KTRegistryName kt_registry_names[] = {
+    { NULL, NULL, 0, 0, 0, -1, -1 },
+    { "banjo", NULL, 0, 0, 0, Banjo, -1 },
+    { "basic", "FD04", 24, 2, KT_REGISTRY_ALIAS, -1, -1 },
+    { "bk", "FD04", 24, 1, 0, -1, -1 },
+    { "datamined", "FD04", 46, 7, KT_REGISTRY_ALIAS | KT_REGISTRY_DATAMINED, -1, -1 },
+    { "dx", NULL, 40, 1, 0, -1, -1 },
+    { "dxg", NULL, 42, 1, 0, -1, -1 },
+    { "dxi", NULL, 41, 1, 0, -1, -1 },
+    { "k1", NULL, 55, 1, 0, -1, -1 },
+    { "k2", NULL, 38, 1, 0, -1, -1 },
+    { "k2i", NULL, 39, 1, 0, -1, -1 },
+    { "k3g", NULL, 44, 1, 0, -1, -1 },
+    { "k3gb", NULL, 45, 1, 0, -1, -1 },
+    { "k3w", NULL, 43, 1, 0, -1, -1 },
+    { "k4", "FC04", 53, 1, 0, -1, -1 },
+    { "k4b", "FC04", 54, 1, 0, -1, -1 },
+    { "k5g", "FD04", 1, 1, 0, -1, -1 },
+    { "k5gb", "FD04", 2, 1, 0, -1, -1 },
+    { "k5u", "FD04", 3, 1, 0, -1, -1 },
+    { "k5w", "FD04", 0, 1, 0, -1, -1 },
+    { "kindle2", "FD04", 38, 2, KT_REGISTRY_ALIAS, -1, -1 },
+    { "kindle3", "FD04", 43, 3, KT_REGISTRY_ALIAS, -1, -1 },
+    { "kindle4", "FC04", 53, 2, KT_REGISTRY_ALIAS, -1, -1 },
+    { "kindle5", "FD04", 0, 38, KT_REGISTRY_ALIAS, -1, -1 },
+    { "kindledx", "FD04", 40, 3, KT_REGISTRY_ALIAS, -1, -1 },
+    { "kpw", "FD04", 4, 1, 0, -1, -1 },
+    { "kpw2", "FD04", 10, 1, 0, -1, -1 },
+    { "kpw2g", "FD04", 12, 1, 0, -1, -1 },
+    { "kpw2gb", "FD04", 14, 1, 0, -1, -1 },
+    { "kpw2gbl", "FD04", 18, 1, 0, -1, -1 },
+    { "kpw2gc", "FD04", 13, 1, 0, -1, -1 },
+    { "kpw2gcl", "FD04", 20, 1, 0, -1, -1 },
+    { "kpw2gj", "FD04", 16, 1, 0, -1, -1 },
+    { "kpw2gl", "FD04", 19, 1, 0, -1, -1 },
+    { "kpw2gr", "FD04", 15, 1, 0, -1, -1 },
+    { "kpw2il", "FD04", 17, 1, 0, -1, -1 },
+    { "kpw2j", "FD04", 11, 1, 0, -1, -1 },
+    { "kpw3", "FD04", 32, 1, 0, -1, -1 },
+    { "kpwg", "FD04", 5, 1, 0, -1, -1 },
+    { "kpwgb", "FD04", 7, 1, 0, -1, -1 },
+    { "kpwgbr", "FD04", 9, 1, 0, -1, -1 },
+    { "kpwgc", "FD04", 6, 1, 0, -1, -1 },
+    { "kpwgj", "FD04", 8, 1, 0, -1, -1 },
+    { "kt2", "FD04", 24, 1, 0, -1, -1 },
+    { "kv", "FD04", 26, 1, 0, -1, -1 },
+    { "kvg", "FD04", 27, 1, 0, -1, -1 },
+    { "kvgb", "FD04", 28, 1, 0, -1, -1 },
+    { "legacy", "FD04", 38, 8, KT_REGISTRY_ALIAS, -1, -1 },
+    { "luigi", NULL, 0, 0, 0, Luigi, -1 },
+    { "mario", NULL, 0, 0, 0, MarioDeprecated, -1 },
+    { "paperwhite", "FD04", 4, 6, KT_REGISTRY_ALIAS, -1, -1 },
+    { "paperwhite2", "FD04", 10, 14, KT_REGISTRY_ALIAS, -1, -1 },
+    { "paperwhite3", "FD04", 32, 6, KT_REGISTRY_ALIAS, -1, -1 },
+    { "pw", "FD04", 4, 1, 0, -1, -1 },
+    { "pw2", "FD04", 10, 1, 0, -1, -1 },
+    { "pw2g", "FD04", 12, 1, 0, -1, -1 },
+    { "pw2gb", "FD04", 14, 1, 0, -1, -1 },
+    { "pw2gbl", "FD04", 18, 1, 0, -1, -1 },
+    { "pw2gc", "FD04", 13, 1, 0, -1, -1 },
+    { "pw2gcl", "FD04", 20, 1, 0, -1, -1 },
+    { "pw2gj", "FD04", 16, 1, 0, -1, -1 },
+    { "pw2gl", "FD04", 19, 1, 0, -1, -1 },
+    { "pw2gr", "FD04", 15, 1, 0, -1, -1 },
+    { "pw2il", "FD04", 17, 1, 0, -1, -1 },
+    { "pw2j", "FD04", 11, 1, 0, -1, -1 },
+    { "pw3", "FD04", 32, 1, 0, -1, -1 },
+    { "pwg", "FD04", 5, 1, 0, -1, -1 },
+    { "pwgb", "FD04", 7, 1, 0, -1, -1 },
+    { "pwgbr", "FD04", 9, 1, 0, -1, -1 },
+    { "pwgc", "FD04", 6, 1, 0, -1, -1 },
+    { "pwgj", "FD04", 8, 1, 0, -1, -1 },
+    { "tequila", NULL, 0, 0, 0, -1, Tequila },
+    { "touch", "FD04", 0, 4, KT_REGISTRY_ALIAS, -1, -1 },
+    { "unknown", "FD04", 46, 7, KT_REGISTRY_ALIAS | KT_REGISTRY_DATAMINED, -1, -1 },
+    { "unspecified", NULL, 0, 0, 0, Plat_Unspecified, Board_Unspecified },
+    { "voyage", "FD04", 26, 6, KT_REGISTRY_ALIAS, -1, -1 },
+    { "wario", NULL, 0, 0, 0, Wario, -1 },
+    { "whitney", NULL, 0, 0, 0, -1, Whitney },
+    { "yoshi", NULL, 0, 0, 0, Yoshi, -1 },
+    { "yoshime", NULL, 0, 0, 0, Yoshime, -1 },
+    { "yoshime-p", NULL, 0, 0, 0, YoshimeProto, -1 },
+    { "yoshime-proto", NULL, 0, 0, 0, YoshimeProto, -1 },
+};
+
+/*  index by FNV-1a(name, KT_REGISTRY_SEED) >> (32 - KT_REGISTRY_BITS), result in kt_registry_names */
+static const uint8_t kt_registry_slots[1 << KT_REGISTRY_BITS] = {
+    0, 34, 0, 0, 0, 0, 0, 0, 0, 0, 0, 6, 0, 0, 15, 0,
+    73, 0, 0, 0, 0, 0, 0, 45, 0, 11, 0, 0, 0, 0, 0, 0,
+    12, 28, 0, 30, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 32, 0, 0, 0, 35, 0, 0, 0, 0, 0, 0, 0, 33, 0, 0,
+    0, 0, 68, 0, 78, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 79, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 50, 43, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 48, 0, 0,
+    77, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 0, 40, 0, 0, 71,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 55, 44, 0, 53, 0, 0, 0, 0, 0, 0, 62, 0, 0, 0, 80,
+    0, 0, 0, 0, 0, 0, 0, 64, 0, 0, 0, 60, 0, 0, 0, 61,
+    0, 0, 0, 0, 0, 0, 0, 63, 0, 58, 0, 56, 0, 0, 0, 20,
+    0, 21, 0, 0, 17, 0, 0, 0, 0, 0, 0, 22, 0, 23, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 70, 0, 0, 0,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 69, 0, 67, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 38, 0, 57, 0, 0, 0, 59, 0,
+    0, 0, 0, 31, 0, 0, 0, 0, 51, 0, 52, 0, 0, 0, 14, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 8, 0, 9, 54, 0, 65, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 29, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 27, 0, 0, 0, 0, 42, 0,
+    0, 0, 0, 36, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 39, 0,
+    41, 0, 0, 0, 47, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+    46, 0, 0, 0, 0, 0, 0, 0, 49, 0, 76, 0, 0, 0, 0, 0,
+    37, 0, 26, 0, 0, 0, 0, 0, 75, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 10, 0, 0, 0, 0, 0, 0, 81, 0, 0, 0,
+    0, 0, 0, 0, 0, 66, 0, 25, 16, 0, 0, 0, 0, 0, 0, 2,
+    0, 0, 72, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 7, 19, 13, 0, 0, 18, 0, 74, 0,
+};
+
+#endif
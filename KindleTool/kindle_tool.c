@@ -20,9 +20,7 @@
 
 #include "kindle_tool.h"
 #include "kindle_table.h"
-
-// Ugly global.
-unsigned int kt_with_unknown_devcodes;
+#include "kindle_registry.h"
 
 void md(unsigned char *bytes, size_t length)
 {
@@ -56,19 +54,22 @@ int munger(FILE *input, FILE *output, size_t length, const unsigned int fake_sig
         bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
         if(ferror(output) != 0)
         {
-            fprintf(stderr, "Error munging, cannot write to output: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Error munging, cannot write to output: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
             return -1;
         }
         else if(bytes_written < bytes_read)
         {
-            fprintf(stderr, "Error munging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            fprintf(kt_stderr, "Error munging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            kt_set_error(KT_ERR_IO);
             return -1;
         }
         length -= bytes_read;
     }
     if(ferror(input) != 0)
     {
-        fprintf(stderr, "Error munging, cannot read input: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error munging, cannot read input: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
 
@@ -89,185 +90,121 @@ int demunger(FILE *input, FILE *output, size_t length, const unsigned int fake_s
         bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
         if(ferror(output) != 0)
         {
-            fprintf(stderr, "Error demunging, cannot write to output: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Error demunging, cannot write to output: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
             return -1;
         }
         else if(bytes_written < bytes_read)
         {
-            fprintf(stderr, "Error demunging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            fprintf(kt_stderr, "Error demunging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            kt_set_error(KT_ERR_IO);
             return -1;
         }
         length -= bytes_read;
     }
     if(ferror(input) != 0)
     {
-        fprintf(stderr, "Error demunging, cannot read input: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error demunging, cannot read input: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
 
     return 0;
 }
 
+// NULL if that's not a device we know about
+const char *kt_device_name(Device dev)
+{
+    if((unsigned int) dev > KT_DEVICE_ID_MAX)
+        return NULL;
+    return kt_device_records[kt_device_index[dev]].name;
+}
+
+const char *kt_platform_name(Platform plat)
+{
+    if((unsigned int) plat >= sizeof(kt_platform_names) / sizeof(*kt_platform_names))
+        return NULL;
+    return kt_platform_names[plat];
+}
+
+const char *kt_board_name(Board board)
+{
+    if((unsigned int) board >= sizeof(kt_board_names) / sizeof(*kt_board_names))
+        return NULL;
+    return kt_board_names[board];
+}
+
 const char *convert_device_id(Device dev)
 {
-    switch(dev)
-    {
-        case Kindle1:
-            return "Kindle 1";
-        case Kindle2US:
-            return "Kindle 2 US";
-        case Kindle2International:
-            return "Kindle 2 International";
-        case KindleDXUS:
-            return "Kindle DX US";
-        case KindleDXInternational:
-            return "Kindle DX International";
-        case KindleDXGraphite:
-            return "Kindle DX Graphite";
-        case Kindle3Wifi:
-            return "Kindle 3 Wifi";
-        case Kindle3Wifi3G:
-            return "Kindle 3 Wifi+3G";
-        case Kindle3Wifi3GEurope:
-            return "Kindle 3 Wifi+3G Europe";
-        case Kindle4NonTouch:
-            return "Kindle 4 Non-Touch Silver (2011)";
-        case Kindle5TouchWifi:
-            return "Kindle 5 Touch Wifi";
-        case Kindle5TouchWifi3G:
-            return "Kindle 5 Touch Wifi+3G";
-        case Kindle5TouchWifi3GEurope:
-            return "Kindle 5 Touch Wifi+3G Europe";
-        case Kindle5TouchUnknown:
-            return "Kindle 5 Touch (Unknown Variant)";
-        case Kindle4NonTouchBlack:
-            return "Kindle 4 Non-Touch Black (2012)";
-        case KindlePaperWhiteWifi:
-            return "Kindle PaperWhite Wifi";
-        case KindlePaperWhiteWifi3G:
-            return "Kindle PaperWhite Wifi+3G";
-        case KindlePaperWhiteWifi3GCanada:
-            return "Kindle PaperWhite Wifi+3G Canada";
-        case KindlePaperWhiteWifi3GEurope:
-            return "Kindle PaperWhite Wifi+3G Europe";
-        case KindlePaperWhiteWifi3GJapan:
-            return "Kindle PaperWhite Wifi+3G Japan";
-        case KindlePaperWhiteWifi3GBrazil:
-            return "Kindle PaperWhite Wifi+3G Brazil";
-        case KindlePaperWhite2Wifi:
-            return "Kindle PaperWhite 2 (2013) Wifi";
-        case KindlePaperWhite2WifiJapan:
-            return "Kindle PaperWhite 2 (2013) Wifi Japan";
-        case KindlePaperWhite2Wifi3G:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G";
-        case KindlePaperWhite2Wifi3GCanada:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G Canada";
-        case KindlePaperWhite2Wifi3GEurope:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G Europe";
-        case KindlePaperWhite2Wifi3GRussia:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G Russia";
-        case KindlePaperWhite2Wifi3GJapan:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G Japan";
-        case KindlePaperWhite2Wifi4GBInternational:
-            return "Kindle PaperWhite 2 (2013) Wifi (4GB) International";
-        case KindlePaperWhite2Wifi3G4GBEurope:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Europe";
-        case KindlePaperWhite2Unknown_0xF4:
-            return "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)";
-        case KindlePaperWhite2Unknown_0xF9:
-            return "Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)";
-        case KindlePaperWhite2Wifi3G4GB:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G (4GB)";
-        case KindlePaperWhite2Unknown_0x61:
-            return "Kindle PaperWhite 2 (2013) (Unknown Variant 0x61)";
-        case KindlePaperWhite2Wifi3G4GBCanada:
-            return "Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Canada";
-        case KindleBasic:
-            return "Kindle Basic (2014)";
-        case KindleVoyageWifi:
-            return "Kindle Voyage WiFi";
-        case ValidKindleUnknown_0x16:
-            return "Unknown Kindle (0x16)";
-        case ValidKindleUnknown_0x21:
-            return "Unknown Kindle (0x21)";
-        case KindleVoyageWifi3G:
-            return "Kindle Voyage WiFi+3G";
-        case KindleVoyageUnknown_0x2A:
-            return "Kindle Voyage (Unknown Variant 0x2A)";
-        case KindleVoyageUnknown_0x4F:
-            return "Kindle Voyage (Unknown Variant 0x4F)";
-        case KindleVoyageUnknown_0x52:
-            return "Kindle Voyage (Unknown Variant 0x52)";
-        case KindleVoyageWifi3GEurope:
-            return "Kindle Voyage WiFi+3G Europe";
-        case ValidKindleUnknown_0x07:
-            return "Unknown Kindle (0x07)";
-        case ValidKindleUnknown_0x0B:
-            return "Unknown Kindle (0x0B)";
-        case ValidKindleUnknown_0x0C:
-            return "Unknown Kindle (0x0C)";
-        case ValidKindleUnknown_0x0D:
-            return "Unknown Kindle (0x0D)";
-        case ValidKindleUnknown_0x99:
-            return "Unknown Kindle (0x99)";
-        case KindleBasicUnknown_0xDD:
-            return "Kindle Basic (2014) (Unknown Variant 0xDD)";
-        case KindlePaperWhite3Wifi:
-            return "Kindle PaperWhite 3 (2015) WiFi";
-        case KindlePaperWhite3Unknown_0G2:
-            return "Kindle PaperWhite 3 (2015) (Unknown Variant 0G2)";
-        case KindlePaperWhite3Unknown_0G4:
-            return "Kindle PaperWhite 3 (2015) (Unknown Variant 0G4)";
-        case KindlePaperWhite3Unknown_0G5:
-            return "Kindle PaperWhite 3 (2015) (Unknown Variant 0G5)";
-        case KindlePaperWhite3Unknown_0G6:
-            return "Kindle PaperWhite 3 (2015) (Unknown Variant 0G6)";
-        case KindlePaperWhite3Unknown_0G7:
-            return "Kindle PaperWhite 3 (2015) (Unknown Variant 0G7)";
-        case KindleUnknown:
-        default:
-            return "Unknown";
-    }
+    const char *name = kt_device_name(dev);
+
+    return (name != NULL ? name : "Unknown");
 }
 
 const char *convert_platform_id(Platform plat)
 {
-    switch(plat)
-    {
-        case Plat_Unspecified:
-            return "Unspecified";
-        case MarioDeprecated:
-            return "Mario (Deprecated)";
-        case Luigi:
-            return "Luigi";
-        case Banjo:
-            return "Banjo";
-        case Yoshi:
-            return "Yoshi";
-        case YoshimeProto:
-            return "Yoshime (Prototype)";
-        case Yoshime:
-            return "Yoshime (Yoshime3)";
-        case Wario:
-            return "Wario";
-        default:
-            return "Unknown";
-    }
+    const char *name = kt_platform_name(plat);
+
+    return (name != NULL ? name : "Unknown");
 }
 
 const char *convert_board_id(Board board)
 {
-    switch(board)
+    const char *name = kt_board_name(board);
+
+    return (name != NULL ? name : "Unknown");
+}
+
+// Find what a -d, -p or -B name stands for: one hash, one string compare
+const KTRegistryName *kt_registry_lookup(const char *name)
+{
+    const unsigned char *p;
+    const KTRegistryName *entry;
+    uint32_t h = KT_REGISTRY_SEED;
+
+    for(p = (const unsigned char *) name; *p != '\0'; p++)
     {
-        case Board_Unspecified:
-            return "Unspecified";
-        case Tequila:
-            return "Tequila";
-        case Whitney:
-            return "Whitney";
-        default:
-            return "Unknown";
+        h ^= *p;
+        h *= 16777619u;
     }
+    entry = &kt_registry_names[kt_registry_slots[h >> (32 - KT_REGISTRY_BITS)]];
+    if(entry->name == NULL || strcmp(entry->name, name) != 0)
+        return NULL;
+    if((entry->flags & KT_REGISTRY_DATAMINED) && !kt_with_unknown_devcodes)
+        return NULL;
+
+    return entry;
+}
+
+// Append the devices a -d name stands for to a device list, in one allocation (the unconfirmed ones only with KT_WITH_UNKNOWN_DEVCODES)
+int kt_registry_devices(const KTRegistryName *entry, Device **devices, uint16_t *num_devices)
+{
+    const Device *member;
+    Device *list;
+    unsigned int i;
+
+    if((unsigned int) *num_devices + entry->num_devices > UINT16_MAX)
+    {
+        fprintf(kt_stderr, "Too many devices.\n");
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((list = realloc(*devices, (*num_devices + entry->num_devices) * sizeof(Device))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate the device list.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    *devices = list;
+    member = &kt_registry_members[entry->first_device];
+    for(i = 0; i < entry->num_devices; i++)
+    {
+        if((entry->flags & KT_REGISTRY_ALIAS) && !kt_with_unknown_devcodes && (kt_device_records[kt_device_index[member[i]]].flags & KT_DEVICE_UNCONFIRMED))
+            continue;
+        list[(*num_devices)++] = member[i];
+    }
+
+    return 0;
 }
 
 const char *convert_bundle_version(BundleVersion bundlev)
@@ -290,7 +227,7 @@ const char *convert_bundle_version(BundleVersion bundlev)
     }
 }
 
-BundleVersion get_bundle_version(char magic_number[MAGIC_NUMBER_LENGTH])
+BundleVersion get_bundle_version(const char magic_number[MAGIC_NUMBER_LENGTH])
 {
     if(!strncmp(magic_number, "FB02", MAGIC_NUMBER_LENGTH) || !strncmp(magic_number, "FB01", MAGIC_NUMBER_LENGTH))
         return RecoveryUpdate;
@@ -308,7 +245,7 @@ BundleVersion get_bundle_version(char magic_number[MAGIC_NUMBER_LENGTH])
         return UnknownUpdate;
 }
 
-const char *convert_magic_number(char magic_number[MAGIC_NUMBER_LENGTH])
+const char *convert_magic_number(const char magic_number[MAGIC_NUMBER_LENGTH])
 {
     if(!strncmp(magic_number, "FB02", MAGIC_NUMBER_LENGTH))
         return "(Fullbin [signed?])";           // /mnt/us/update-full.bin
@@ -344,7 +281,8 @@ int md5_sum(FILE *input, char output_string[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE
     }
     if(ferror(input) != 0)
     {
-        fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Error reading input file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
         return -1;
     }
     md5_digest(&md5, MD5_DIGEST_SIZE, digest);
@@ -364,7 +302,7 @@ char *to_base(int64_t num, unsigned int base)
     unsigned int i, len = 0, neg = 0;
     if(base > 36)
     {
-        fprintf(stderr, "base %d too large\n", base);
+        fprintf(kt_stderr, "base %d too large\n", base);
         return 0;
     }
 
@@ -383,57 +321,604 @@ char *to_base(int64_t num, unsigned int base)
     return out;
 }
 
-struct rsa_private_key get_default_key(void)
+// Parse the argument of a -j/--jobs switch (0 means one job per online CPU)
+int parse_jobs(const char *arg, unsigned int *jobs)
+{
+    unsigned long n;
+    char *endptr;
+    long ncpus;
+
+    errno = 0;
+    n = strtoul(arg, &endptr, 10);
+    if(errno != 0 || *endptr != '\0' || endptr == arg || n > 1024)
+    {
+        fprintf(kt_stderr, "Invalid number of jobs '%s'.\n", arg);
+        return -1;
+    }
+    if(n == 0)
+    {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = (ncpus > 0 ? (unsigned long) ncpus : 1);
+    }
+    *jobs = (unsigned int) n;
+
+    return 0;
+}
+
+// Parse a size in bytes, with an optional K/M/G suffix
+int parse_size(const char *arg, uint64_t *size)
+{
+    unsigned long long n;
+    char *endptr;
+    unsigned int shift = 0;
+
+    errno = 0;
+    n = strtoull(arg, &endptr, 10);
+    if(errno == 0 && endptr != arg && *endptr != '\0' && endptr[1] == '\0')
+    {
+        switch(*endptr)
+        {
+            case 'k':
+            case 'K':
+                shift = 10;
+                endptr++;
+                break;
+            case 'm':
+            case 'M':
+                shift = 20;
+                endptr++;
+                break;
+            case 'g':
+            case 'G':
+                shift = 30;
+                endptr++;
+                break;
+            default:
+                break;
+        }
+    }
+    if(errno != 0 || *endptr != '\0' || endptr == arg || n == 0 || n > (UINT64_MAX >> shift))
+    {
+        fprintf(kt_stderr, "Invalid size '%s'.\n", arg);
+        return -1;
+    }
+    *size = (uint64_t) n << shift;
+
+    return 0;
+}
+
+// Remember where a directory walk started: archive_read_disk moves the working directory around while it descends,
+// so the (possibly relative) paths it hands out to other threads have to be resolved against that instead
+int kt_walk_start(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    return -1;
+#else
+    int fd;
+
+    if((fd = open(".", O_RDONLY)) < 0)
+        return AT_FDCWD;
+    return fd;
+#endif
+}
+
+// Open a path found by a walk that started in start_fd (always in binary mode)
+int kt_walk_open(int start_fd, const char *path, int flags)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) start_fd;
+    return open(path, flags | O_BINARY);
+#else
+    return openat(start_fd, path, flags);
+#endif
+}
+
+void kt_walk_end(int start_fd)
+{
+    if(start_fd >= 0)
+        close(start_fd);
+}
+
+// How many paths we let kt_walk_files queue up ahead of the workers
+#define KT_WALK_MAX_QUEUED 1024
+
+struct kt_walk_path
+{
+    char *path;
+    struct kt_walk_path *next;
+};
+
+// Shared state between the directory walk & the worker threads
+struct kt_walk_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct kt_walk_path *head;
+    struct kt_walk_path *tail;
+    size_t queued;
+    int done;                   // The walk won't queue anything else
+    const KTWalkCallbacks *cb;
+    void *arg;
+    KTContext *ctx;             // The caller's context, for the callbacks' diagnostics
+    int start_fd;               // Where the walk started, see kt_walk_start
+};
+
+struct kt_walk_worker
+{
+    pthread_t thread;
+    struct kt_walk_pool *pool;
+    void *scratch;
+};
+
+// Worker thread: pop paths off the queue, and hand them over to the caller
+static void *kt_walk_worker(void *arg)
+{
+    struct kt_walk_worker *worker = arg;
+    struct kt_walk_pool *pool = worker->pool;
+    struct kt_walk_path *item;
+
+    kt_context_attach(pool->ctx);
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->done)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if(pool->head == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        item = pool->head;
+        pool->head = item->next;
+        if(pool->head == NULL)
+            pool->tail = NULL;
+        pool->queued--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->cb->file(pool->arg, worker->scratch, pool->start_fd, item->path);
+        free(item->path);
+        free(item);
+    }
+    kt_context_attach(NULL);
+
+    return NULL;
+}
+
+// Hand a path over to the workers (or deal with it right away if there aren't any)
+static int kt_walk_queue(struct kt_walk_pool *pool, unsigned int num_workers, const char *path, void *scratch)
+{
+    struct kt_walk_path *item;
+
+    if(num_workers == 0)
+    {
+        pool->cb->file(pool->arg, scratch, pool->start_fd, path);
+        return 0;
+    }
+
+    if((item = malloc(sizeof(*item))) == NULL || (item->path = strdup(path)) == NULL)
+    {
+        free(item);
+        fprintf(kt_stderr, "Cannot allocate a queue entry.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    item->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    while(pool->queued >= KT_WALK_MAX_QUEUED)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    if(pool->tail != NULL)
+        pool->tail->next = item;
+    else
+        pool->head = item;
+    pool->tail = item;
+    pool->queued++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+// Walk a file or a directory, and queue every regular file we find
+static int kt_walk_tree(struct kt_walk_pool *pool, unsigned int num_workers, const char *input, void *scratch)
+{
+    struct archive *disk;
+    struct archive_entry *entry;
+    int r;
+    int ret = 0;
+
+    disk = archive_read_disk_new();
+    entry = archive_entry_new();
+    if(disk == NULL || entry == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read_disk archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        archive_read_free(disk);
+        archive_entry_free(entry);
+        return -1;
+    }
+    // We only want names & types: no uname/gname lookups, and don't bother with extended metadata if we can avoid it
+#if defined(ARCHIVE_READDISK_NO_XATTR) && defined(ARCHIVE_READDISK_NO_ACL) && defined(ARCHIVE_READDISK_NO_FFLAGS)
+    archive_read_disk_set_behavior(disk, ARCHIVE_READDISK_NO_XATTR | ARCHIVE_READDISK_NO_ACL | ARCHIVE_READDISK_NO_FFLAGS);
+#endif
+    if(archive_read_disk_open(disk, input) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
+        kt_set_error(KT_ERR_ARCHIVE);
+        archive_read_free(disk);
+        archive_entry_free(entry);
+        return -1;
+    }
+
+    for(;;)
+    {
+        archive_entry_clear(entry);
+        r = archive_read_next_header2(disk, entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        else if(r != ARCHIVE_OK)
+        {
+            fprintf(kt_stderr, "archive_read_next_header2() failed: %s.\n", archive_error_string(disk));
+            if(r == ARCHIVE_FATAL)
+            {
+                kt_set_error(KT_ERR_ARCHIVE);
+                ret = -1;
+                break;
+            }
+            // Keep walking if we can, an unreadable file shouldn't stop the whole thing (but the caller gets to know)
+            if(r < ARCHIVE_WARN)
+            {
+                pool->cb->unreadable(pool->arg, scratch, (archive_entry_pathname(entry) != NULL ? archive_entry_pathname(entry) : input));
+                continue;
+            }
+        }
+        if(archive_read_disk_can_descend(disk))
+            archive_read_disk_descend(disk);
+        if(archive_entry_filetype(entry) != AE_IFREG)
+            continue;
+        if(kt_walk_queue(pool, num_workers, archive_entry_pathname(entry), scratch) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    archive_read_close(disk);
+    archive_read_free(disk);
+    archive_entry_free(entry);
+
+    return ret;
+}
+
+static void kt_walk_scratch_free(const KTWalkCallbacks *cb, void *scratch)
+{
+    if(scratch != NULL && cb->scratch_free != NULL)
+        cb->scratch_free(scratch);
+    free(scratch);
+}
+
+// Call cb->file on every regular file of a bunch of files and/or directories, from up to jobs threads.
+// The walk itself happens on the calling thread, which also gets to deal with the files if we can't spawn any workers.
+int kt_walk_files(char **inputs, unsigned int num_inputs, unsigned int jobs, const KTWalkCallbacks *cb, void *arg, unsigned int *num_threads)
+{
+    struct kt_walk_pool pool;
+    struct kt_walk_path *item;
+    struct kt_walk_worker *workers = NULL;
+    unsigned int num_workers = 0;
+    void *scratch;
+    unsigned int i;
+    int ret = 0;
+
+    if((scratch = calloc(1, cb->scratch_size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate scratch space.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.not_empty, NULL);
+    pthread_cond_init(&pool.not_full, NULL);
+    pool.cb = cb;
+    pool.arg = arg;
+    pool.ctx = kt_context_current();
+    pool.start_fd = kt_walk_start();
+
+    if(jobs > 1 && (workers = calloc(jobs, sizeof(*workers))) != NULL)
+    {
+        for(num_workers = 0; num_workers < jobs; num_workers++)
+        {
+            workers[num_workers].pool = &pool;
+            if((workers[num_workers].scratch = calloc(1, cb->scratch_size)) == NULL)
+                break;
+            if(pthread_create(&workers[num_workers].thread, NULL, kt_walk_worker, &workers[num_workers]) != 0)
+            {
+                free(workers[num_workers].scratch);
+                break;
+            }
+        }
+        if(num_workers == 0)
+            fprintf(kt_stderr, "Cannot spawn worker threads, carrying on sequentially.\n");
+    }
+
+    for(i = 0; i < num_inputs && ret == 0; i++)
+    {
+        if(kt_walk_tree(&pool, num_workers, inputs[i], scratch) < 0)
+            ret = -1;
+    }
+
+    if(num_workers > 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.done = 1;
+        pthread_cond_broadcast(&pool.not_empty);
+        pthread_mutex_unlock(&pool.lock);
+        for(i = 0; i < num_workers; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            kt_walk_scratch_free(cb, workers[i].scratch);
+        }
+    }
+    while((item = pool.head) != NULL)
+    {
+        pool.head = item->next;
+        free(item->path);
+        free(item);
+    }
+    free(workers);
+    kt_walk_scratch_free(cb, scratch);
+    kt_walk_end(pool.start_fd);
+    pthread_cond_destroy(&pool.not_full);
+    pthread_cond_destroy(&pool.not_empty);
+    pthread_mutex_destroy(&pool.lock);
+    if(num_threads != NULL)
+        *num_threads = num_workers;
+
+    return ret;
+}
+
+// rename(), replacing to if it exists, even where rename won't do that (which means it's not atomic there)
+int kt_rename_replace(const char *from, const char *to)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    unlink(to);
+#endif
+    return rename(from, to);
+}
+
+// FNV-1a
+size_t kt_hash_path(const char *path, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619U;
+    }
+    return (size_t) hash;
+}
+
+void kt_hash_table_init(KTHashTable *table, kt_hash_func hash, kt_hash_match_func match, void *arg)
+{
+    memset(table, 0, sizeof(*table));
+    table->hash = hash;
+    table->match = match;
+    table->arg = arg;
+}
+
+// The index of the item that matches key (hashed to hash), or KT_HASH_NONE
+size_t kt_hash_table_find(const KTHashTable *table, size_t hash, const void *key, size_t len)
+{
+    size_t i;
+
+    if(table->capacity == 0)
+        return KT_HASH_NONE;
+    for(i = hash & (table->capacity - 1); table->slots[i] != 0; i = (i + 1) & (table->capacity - 1))
+    {
+        if(table->match(table->arg, table->slots[i] - 1, key, len))
+            return table->slots[i] - 1;
+    }
+    return KT_HASH_NONE;
+}
+
+static void kt_hash_table_place(size_t *slots, size_t capacity, size_t hash, size_t index)
+{
+    size_t i;
+
+    for(i = hash & (capacity - 1); slots[i] != 0; i = (i + 1) & (capacity - 1))
+        ;
+    slots[i] = index + 1;
+}
+
+// Add the item at index (which had better not be there already). Only fails if we can't grow the table, and leaves it alone then.
+int kt_hash_table_insert(KTHashTable *table, size_t index)
 {
-    // Make nettle happy... (Array created from the bin2h output of pkcs1-conv on our pem file)
-    static char sign_key_sexp[] =
-        "\x28\x31\x31\x3A\x70\x72\x69\x76\x61\x74\x65\x2D\x6B\x65\x79\x28\x39\x3A\x72\x73"
-        "\x61\x2D\x70\x6B\x63\x73\x31\x28\x31\x3A\x6E\x31\x32\x39\x3A\x00\xC9\x9F\x58\xD6"
-        "\x53\xEC\x71\x56\xFF\xDE\x44\xA7\xC2\x3D\x1F\x5E\xE3\xB9\x4F\x58\xDD\xAB\x1F\x7D"
-        "\xF3\xF5\x06\xDF\x9E\xA9\x82\xC4\x14\x4B\x3F\xA9\x8C\x8C\x6C\xBA\x00\xFC\xB2\x71"
-        "\x05\xE0\xDE\x73\xE2\xE5\xF7\x1B\xEF\x96\xA5\x66\x8F\x8E\x87\x4D\x76\x1E\x93\x1E"
-        "\xF4\xB9\xE9\x78\x48\x25\xA0\x87\x66\xD4\x4E\x0B\x3A\xCC\xAB\xCF\x89\x2D\xB5\x0B"
-        "\x46\x46\x5C\xC2\x12\xB9\x81\x1A\xDE\xBE\x70\x05\x44\x57\xCE\xB2\xDA\x98\x4E\x27"
-        "\x79\x8B\x93\x41\x24\xF5\x44\x17\x6C\x85\x1F\xAE\xFC\x89\x9D\x2D\x8C\x28\xB1\xB6"
-        "\x71\xCC\xE3\x95\x29\x28\x31\x3A\x65\x33\x3A\x01\x00\x01\x29\x28\x31\x3A\x64\x31"
-        "\x32\x38\x3A\x48\xBC\xA6\xD4\xF3\x83\xDA\x43\xB3\x9D\x21\x11\x90\x5E\x72\xA1\xCD"
-        "\xEF\xBD\x73\x66\xCC\xE4\x58\x91\x19\x35\x78\x99\x09\xB8\x36\x3A\xC8\x06\xD8\x88"
-        "\xEE\xE4\x0E\x9A\x6A\x8F\x89\x7C\xC0\x6A\x20\x4E\x9B\xFD\xF0\xE3\x17\x6A\xE6\x3C"
-        "\x26\x04\x23\xEA\xD8\x0E\xE4\xB9\x18\xDA\xEA\x6D\xB6\xE9\x03\xAF\xCB\xA1\x13\x6C"
-        "\xFD\x0E\x1E\xC7\x31\x95\x7F\xAC\x36\x1A\xFB\xDA\xF2\x6C\x9B\xAC\x46\x20\x10\x0E"
-        "\x61\x7E\x54\x2C\xD8\xD8\x78\xAB\x8E\x9B\x12\xCE\x04\x6E\xD2\xBF\x36\x34\x2F\x33"
-        "\x9C\xD9\xB6\x78\x63\x91\xCA\xCF\x41\xBE\x61\x29\x28\x31\x3A\x70\x36\x35\x3A\x00"
-        "\xE8\x22\x89\x0E\xAF\x47\xD8\xCF\x75\x13\x49\xB1\xDF\x0F\x77\xA7\x81\x71\x4F\x67"
-        "\xE2\x5A\x26\xA5\x3C\xC5\xAC\x91\xEC\x2F\x86\xA7\x92\x34\x0A\x04\xA7\x08\x34\xD0"
-        "\x56\x07\x64\x54\x66\xCF\xB8\xB5\x58\x89\x60\xC8\x70\x46\xB1\x8E\xF5\x6B\x85\x76"
-        "\x2D\xD8\x07\x3D\x29\x28\x31\x3A\x71\x36\x35\x3A\x00\xDE\x59\xC4\x46\x08\x34\x46"
-        "\x65\x81\x0B\x72\xBC\xB6\x80\xB2\x7C\x3B\xEB\xF1\xE5\xDA\xA3\xEC\x60\x50\x9D\xE5"
-        "\x35\x66\xEA\x4B\x41\xED\xC3\x17\x33\xC2\x72\x04\x1F\x8F\x48\x20\x3A\x23\x6D\x39"
-        "\xCB\x52\xBD\xCE\x8A\xD1\x4C\x66\xE6\x89\xB9\x3D\x8C\xB5\x6C\xD3\x39\x29\x28\x31"
-        "\x3A\x61\x36\x35\x3A\x00\xAE\x86\x08\x75\x39\xE2\xD2\x66\x66\xA6\xF1\xA9\x01\x03"
-        "\x27\xFA\x8F\x9F\x19\x0C\x09\x69\xAD\xD4\x5D\x34\x60\xE1\xF4\xA8\x66\x9C\x65\x97"
-        "\x2A\x51\x05\x23\x6E\x51\x93\xDC\x4A\xDA\x09\xD1\xF2\x14\xA5\x53\xE3\xA7\xCE\x81"
-        "\xD7\xCC\x9B\x47\x13\x38\x1E\x8F\x64\x21\x29\x28\x31\x3A\x62\x36\x35\x3A\x00\xC8"
-        "\xB3\x96\x6A\xF0\x74\xDF\x26\x38\x39\x31\x34\x0E\x38\x54\xE3\xB6\xE2\xDE\xD2\x6F"
-        "\x6C\x8F\xAC\xD0\x97\xF5\x91\x22\x78\x51\xBE\x0C\xF3\x90\x39\xF4\x46\x1E\x5A\xAE"
-        "\x66\x98\x50\x62\x31\xF1\x7D\x0A\x0E\xB2\x24\xB3\x8F\x97\x42\x79\x06\x6F\xFC\x56"
-        "\xB7\x08\x61\x29\x28\x31\x3A\x63\x36\x35\x3A\x00\xDC\x57\x67\xAE\xC1\x62\x08\xD3"
-        "\x49\x86\xF8\xAD\xD9\xA4\xE6\xB4\xBC\xD7\xC5\x4E\x3A\x2B\xEB\x15\xE8\xD2\x18\xD6"
-        "\xD1\x09\x1B\xE4\x45\xCC\xB4\x70\x3B\x82\x05\x0D\x8E\x1A\xFD\xDA\x28\x87\x56\x21"
-        "\xD6\x21\x45\x1A\x37\x26\xA6\xAC\xDA\xEA\xD4\x6E\xB5\xAC\x3C\xCC\x29\x29\x29";
+    size_t *slots;
+    size_t capacity;
+    size_t j;
+
+    // Keep the load factor under 1/2
+    if((table->count + 1) * 2 > table->capacity)
+    {
+        capacity = (table->capacity > 0 ? table->capacity * 2 : 256);
+        if((slots = calloc(capacity, sizeof(*slots))) == NULL)
+            return -1;
+        for(j = 0; j < table->capacity; j++)
+        {
+            if(table->slots[j] != 0)
+                kt_hash_table_place(slots, capacity, table->hash(table->arg, table->slots[j] - 1), table->slots[j] - 1);
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    kt_hash_table_place(table->slots, table->capacity, table->hash(table->arg, index), index);
+    table->count++;
+
+    return 0;
+}
+
+void kt_hash_table_free(KTHashTable *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+// Entry paths may or may not start with ./ (or /), and directories may or may not end with /: skip all that, and compare what's left (first *len bytes)
+const char *kt_normalize_entry_path(const char *path, size_t *len)
+{
+    for(;;)
+    {
+        if(path[0] == '/')
+            path++;
+        else if(path[0] == '.' && path[1] == '/')
+            path += 2;
+        else if(path[0] == '.' && path[1] == '\0')
+            path++;
+        else
+            break;
+    }
+    *len = strlen(path);
+    while(*len > 0 && path[*len - 1] == '/')
+        (*len)--;
+
+    return path;
+}
+
+// Parse a line of the bundle index. Returns 1 if it's a record, 0 if it isn't (or is too long to be one)
+int kt_filelist_parse(const char *line, size_t len, KTFilelistRecord *record)
+{
+    char buf[PATH_MAX * 2];
+
+    if(len >= sizeof(buf))
+        return 0;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    if(sscanf(buf, "%d %32s %4095s", &record->type, record->md5, record->path) != 3)
+        return 0;
+    return 1;
+}
+
+void kt_filelist_reader_init(KTFilelistReader *reader, kt_filelist_func func, void *arg)
+{
+    reader->len = 0;
+    reader->overflow = 0;
+    reader->func = func;
+    reader->arg = arg;
+}
 
+static int kt_filelist_reader_line(KTFilelistReader *reader)
+{
+    KTFilelistRecord record;
+    int ret = 0;
+
+    if(!reader->overflow && kt_filelist_parse(reader->line, reader->len, &record))
+        ret = reader->func(reader->arg, &record);
+    reader->len = 0;
+    reader->overflow = 0;
+    return ret;
+}
+
+// Feed the next chunk of the bundle index. Returns whatever the callback failed with (< 0), or 0
+int kt_filelist_reader_feed(KTFilelistReader *reader, const char *buf, size_t size)
+{
+    size_t i;
+
+    for(i = 0; i < size; i++)
+    {
+        if(buf[i] != '\n')
+        {
+            if(reader->len < sizeof(reader->line) - 1)
+                reader->line[reader->len++] = buf[i];
+            else
+                reader->overflow = 1;
+            continue;
+        }
+        if(kt_filelist_reader_line(reader) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// The last line might not be terminated
+int kt_filelist_reader_end(KTFilelistReader *reader)
+{
+    if(reader->len == 0)
+        return 0;
+    return kt_filelist_reader_line(reader);
+}
+
+// The default (jailbreak) key. Make nettle happy... (Array created from the bin2h output of pkcs1-conv on our pem file)
+static const char sign_key_sexp[] =
+    "\x28\x31\x31\x3A\x70\x72\x69\x76\x61\x74\x65\x2D\x6B\x65\x79\x28\x39\x3A\x72\x73"
+    "\x61\x2D\x70\x6B\x63\x73\x31\x28\x31\x3A\x6E\x31\x32\x39\x3A\x00\xC9\x9F\x58\xD6"
+    "\x53\xEC\x71\x56\xFF\xDE\x44\xA7\xC2\x3D\x1F\x5E\xE3\xB9\x4F\x58\xDD\xAB\x1F\x7D"
+    "\xF3\xF5\x06\xDF\x9E\xA9\x82\xC4\x14\x4B\x3F\xA9\x8C\x8C\x6C\xBA\x00\xFC\xB2\x71"
+    "\x05\xE0\xDE\x73\xE2\xE5\xF7\x1B\xEF\x96\xA5\x66\x8F\x8E\x87\x4D\x76\x1E\x93\x1E"
+    "\xF4\xB9\xE9\x78\x48\x25\xA0\x87\x66\xD4\x4E\x0B\x3A\xCC\xAB\xCF\x89\x2D\xB5\x0B"
+    "\x46\x46\x5C\xC2\x12\xB9\x81\x1A\xDE\xBE\x70\x05\x44\x57\xCE\xB2\xDA\x98\x4E\x27"
+    "\x79\x8B\x93\x41\x24\xF5\x44\x17\x6C\x85\x1F\xAE\xFC\x89\x9D\x2D\x8C\x28\xB1\xB6"
+    "\x71\xCC\xE3\x95\x29\x28\x31\x3A\x65\x33\x3A\x01\x00\x01\x29\x28\x31\x3A\x64\x31"
+    "\x32\x38\x3A\x48\xBC\xA6\xD4\xF3\x83\xDA\x43\xB3\x9D\x21\x11\x90\x5E\x72\xA1\xCD"
+    "\xEF\xBD\x73\x66\xCC\xE4\x58\x91\x19\x35\x78\x99\x09\xB8\x36\x3A\xC8\x06\xD8\x88"
+    "\xEE\xE4\x0E\x9A\x6A\x8F\x89\x7C\xC0\x6A\x20\x4E\x9B\xFD\xF0\xE3\x17\x6A\xE6\x3C"
+    "\x26\x04\x23\xEA\xD8\x0E\xE4\xB9\x18\xDA\xEA\x6D\xB6\xE9\x03\xAF\xCB\xA1\x13\x6C"
+    "\xFD\x0E\x1E\xC7\x31\x95\x7F\xAC\x36\x1A\xFB\xDA\xF2\x6C\x9B\xAC\x46\x20\x10\x0E"
+    "\x61\x7E\x54\x2C\xD8\xD8\x78\xAB\x8E\x9B\x12\xCE\x04\x6E\xD2\xBF\x36\x34\x2F\x33"
+    "\x9C\xD9\xB6\x78\x63\x91\xCA\xCF\x41\xBE\x61\x29\x28\x31\x3A\x70\x36\x35\x3A\x00"
+    "\xE8\x22\x89\x0E\xAF\x47\xD8\xCF\x75\x13\x49\xB1\xDF\x0F\x77\xA7\x81\x71\x4F\x67"
+    "\xE2\x5A\x26\xA5\x3C\xC5\xAC\x91\xEC\x2F\x86\xA7\x92\x34\x0A\x04\xA7\x08\x34\xD0"
+    "\x56\x07\x64\x54\x66\xCF\xB8\xB5\x58\x89\x60\xC8\x70\x46\xB1\x8E\xF5\x6B\x85\x76"
+    "\x2D\xD8\x07\x3D\x29\x28\x31\x3A\x71\x36\x35\x3A\x00\xDE\x59\xC4\x46\x08\x34\x46"
+    "\x65\x81\x0B\x72\xBC\xB6\x80\xB2\x7C\x3B\xEB\xF1\xE5\xDA\xA3\xEC\x60\x50\x9D\xE5"
+    "\x35\x66\xEA\x4B\x41\xED\xC3\x17\x33\xC2\x72\x04\x1F\x8F\x48\x20\x3A\x23\x6D\x39"
+    "\xCB\x52\xBD\xCE\x8A\xD1\x4C\x66\xE6\x89\xB9\x3D\x8C\xB5\x6C\xD3\x39\x29\x28\x31"
+    "\x3A\x61\x36\x35\x3A\x00\xAE\x86\x08\x75\x39\xE2\xD2\x66\x66\xA6\xF1\xA9\x01\x03"
+    "\x27\xFA\x8F\x9F\x19\x0C\x09\x69\xAD\xD4\x5D\x34\x60\xE1\xF4\xA8\x66\x9C\x65\x97"
+    "\x2A\x51\x05\x23\x6E\x51\x93\xDC\x4A\xDA\x09\xD1\xF2\x14\xA5\x53\xE3\xA7\xCE\x81"
+    "\xD7\xCC\x9B\x47\x13\x38\x1E\x8F\x64\x21\x29\x28\x31\x3A\x62\x36\x35\x3A\x00\xC8"
+    "\xB3\x96\x6A\xF0\x74\xDF\x26\x38\x39\x31\x34\x0E\x38\x54\xE3\xB6\xE2\xDE\xD2\x6F"
+    "\x6C\x8F\xAC\xD0\x97\xF5\x91\x22\x78\x51\xBE\x0C\xF3\x90\x39\xF4\x46\x1E\x5A\xAE"
+    "\x66\x98\x50\x62\x31\xF1\x7D\x0A\x0E\xB2\x24\xB3\x8F\x97\x42\x79\x06\x6F\xFC\x56"
+    "\xB7\x08\x61\x29\x28\x31\x3A\x63\x36\x35\x3A\x00\xDC\x57\x67\xAE\xC1\x62\x08\xD3"
+    "\x49\x86\xF8\xAD\xD9\xA4\xE6\xB4\xBC\xD7\xC5\x4E\x3A\x2B\xEB\x15\xE8\xD2\x18\xD6"
+    "\xD1\x09\x1B\xE4\x45\xCC\xB4\x70\x3B\x82\x05\x0D\x8E\x1A\xFD\xDA\x28\x87\x56\x21"
+    "\xD6\x21\x45\x1A\x37\x26\xA6\xAC\xDA\xEA\xD4\x6E\xB5\xAC\x3C\xCC\x29\x29\x29";
+
+struct rsa_private_key get_default_key(void)
+{
     struct rsa_private_key rsa_pkey;
     rsa_private_key_init(&rsa_pkey);
 
-    if(!rsa_keypair_from_sexp(NULL, &rsa_pkey, 0, sizeof(sign_key_sexp), (uint8_t *) sign_key_sexp))
+    if(!rsa_keypair_from_sexp(NULL, &rsa_pkey, 0, sizeof(sign_key_sexp), (const uint8_t *) sign_key_sexp))
     {
-        fprintf(stderr, "Invalid default private key!\n");
+        fprintf(kt_stderr, "Invalid default private key!\n");
         // In the unlikely event this ever happens, it'll be caught later on in sign_file ;).
     }
 
     return rsa_pkey;
 }
 
+// The public half of the default key, to check what we signed with it
+struct rsa_public_key get_default_pubkey(void)
+{
+    struct rsa_public_key rsa_pubkey;
+    struct rsa_private_key rsa_pkey;
+    rsa_public_key_init(&rsa_pubkey);
+    rsa_private_key_init(&rsa_pkey);
+
+    if(!rsa_keypair_from_sexp(&rsa_pubkey, &rsa_pkey, 0, sizeof(sign_key_sexp), (const uint8_t *) sign_key_sexp))
+        fprintf(kt_stderr, "Invalid default private key!\n");
+    rsa_private_key_clear(&rsa_pkey);
+
+    return rsa_pubkey;
+}
+
 int kindle_print_help(const char *prog_name)
 {
     printf(
@@ -458,12 +943,65 @@ int kindle_print_help(const char *prog_name)
         "      -k, --keep                  Don't delete the input package.\n"
         "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
         "      -w, --unwrap                Just unwrap the package, if it's wrapped in an UpdateSignature header (especially useful for userdata packages).\n"
+        "      -j, --jobs <num>            Convert up to <num> packages at once (0 means one per CPU). The output of each package is printed in one go, as soon as it's done.\n"
+        "      -I, --index                 Also build a random access index of the package (saved as <input>.ktidx), implies -k.\n"
         "      \n"
-        "  %s extract [options] <input> <output>\n"
+        "  %s extract [options] <input> <output> [<pattern>...]\n"
         "    Extracts a Kindle update package to a directory.\n"
+        "    If patterns (paths, or shell-style globs) are given, only the matching entries are extracted (a directory brings its contents along).\n"
+        "    In that case, the package is read as little as possible: we stop once every literal path has been found, and we seek straight to the entries if the package has been indexed (-I).\n"
+        "    \n"
+        "    Options:\n"
+        "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      -j, --jobs <num>            Write files to disk with <num> threads (0 means one per CPU), while the package is decompressed.\n"
+        "      -U, --io-uring              Batch small file writes through io_uring (Linux only, if enabled at build time). Takes precedence over -j.\n"
+        "      -I, --index                 Also build a random access index of the package (saved as <input>.ktidx), while it is extracted.\n"
+        "      -T, --files-from <file>     Also extract the paths (or patterns) listed in <file>, one per line (- for standard input).\n"
+        "      -S, --store <dir>           Write the contents of regular files once to the content-addressed (SHA-256) object store <dir>, and hardlink them from there\n"
+        "                                    (or reflink/copy them, across filesystems). Packages sharing files share their objects, which are read-only (so the extracted files are too),\n"
+        "                                    and keep the mtime of the entry they were first stored for.\n"
+        "      -i, --incremental           Leave the files that are already identical in <output> alone, and only write the blocks of the others that changed.\n"
+        "                                    Digests are cached in <output>.ktdigest, and taken from update-filelist.dat when the package is indexed (-I).\n"
+        "      -z, --inflate-jobs <num>    Inflate the payload of full extractions with <num> threads (0 means one per CPU), when it's a regular file. Splits on the checkpoints of --seekable packages,\n"
+        "                                    or on gzip members.\n"
+        "      -Z, --speculative           With -z (or one thread per CPU otherwise), also split single-stream payloads, by guessing where deflate blocks start.\n"
+        "      -s, --stats                 Print how fast the files were written once done (entries, files, MiB, files/s and the write path used), cf. tools/extract-bench.sh.\n"
+        "      \n"
+        "  %s list [options] [ <input> ]\n"
+        "    Lists the contents of a Kindle update package (entries, sizes, modes, and the records of its update-filelist.dat).\n"
+        "    Nothing is written to disk, the package is read once, sequentially. Input may be - (the default) for standard input.\n"
         "    \n"
         "    Options:\n"
         "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      -z, --inflate-jobs <num>    Inflate the payload with <num> threads (0 means one per CPU), when it's a regular file. Splits on the checkpoints of --seekable packages,\n"
+        "                                    or on gzip members.\n"
+        "      -Z, --speculative           With -z (or one thread per CPU otherwise), also split single-stream payloads, by guessing where deflate blocks start.\n"
+        "      \n"
+        "  %s verify [options] [ <input> ] | -S [options] <file|dir>...\n"
+        "    Checks the per-file signatures (.sig) & the MD5 hashes listed in update-filelist.dat of a Kindle update package, and prints a PASS/FAIL line for each file.\n"
+        "    The package is streamed once, nothing is written to disk, and RSA checks are spread over a pool of threads. Input may be - (the default) for standard input.\n"
+        "    With -S, checks the SP01 signature envelope of every package found in the given files and/or directories instead, and prints an OK/BAD/NOKEY/SKIP/ERROR line for each one.\n"
+        "    \n"
+        "    Options:\n"
+        "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      -k, --pubkey <file>         PEM file containing the RSA public (or private) key the files were signed with. Default is popular jailbreak key.\n"
+        "                                    With -S, that's the key used for envelopes signed with the developer certificate (pubdevkey01.pem).\n"
+        "      -S, --envelope              Check SP01 envelopes, over any number of files and/or directories (walked recursively).\n"
+        "      -1, --1k-pubkey <file>      With -S, PEM file containing the public key of the official 1K certificate (pubprodkey01.pem). Envelopes signed with it are reported as NOKEY otherwise.\n"
+        "      -2, --2k-pubkey <file>      With -S, PEM file containing the public key of the official 2K certificate (pubprodkey02.pem). Envelopes signed with it are reported as NOKEY otherwise.\n"
+        "      -j, --jobs <num>            Check signatures with <num> threads. Default (and 0) means one per CPU.\n"
+        "      -z, --inflate-jobs <num>    Inflate the payload with <num> threads (0 means one per CPU), when it's a regular file. Splits on the checkpoints of --seekable packages,\n"
+        "                                    or on gzip members.\n"
+        "      -Z, --speculative           With -z (or one thread per CPU otherwise), also split single-stream payloads, by guessing where deflate blocks start.\n"
+        "      \n"
+        "  %s scan [options] <dir|file>...\n"
+        "    Prints what the headers of every package found in the given files and/or directories (walked recursively) say, one record per package, as JSON Lines (the default) or CSV.\n"
+        "    Only the header bytes are read (skipping over the signature of SP01 envelopes), never the payload. Files that aren't packages get an 'unknown' record.\n"
+        "    \n"
+        "    Options:\n"
+        "      -f, --format <fmt>          Output format: jsonl or csv. In CSV, lists (devices, metadata) are semicolon separated.\n"
+        "      -o, --output <file>         Write the records to <file> instead of standard output.\n"
+        "      -j, --jobs <num>            Scan with <num> threads. Default (and 0) means one per CPU.\n"
         "      \n"
         "  %s create <type> <devices> [options] <dir|file>... [ <output> ]\n"
         "    Creates a Kindle update package.\n"
@@ -579,13 +1117,84 @@ int kindle_print_help(const char *prog_name)
         "      -C, --legacy                Emulate the behaviour of yifanlu's KindleTool regarding directories. By default, we behave like tar:\n"
         "                                    every path passed on the commandline is stored as-is in the archive. This switch changes that, and store paths\n"
         "                                    relative to the path passed on the commandline, like if we had chdir'ed into it.\n"
+        "      -D, --delta-from <file>     OTA V2 updates only. Only ship what changed since the (full) package <file>: unchanged files are left out, large files that changed\n"
+        "                                    are shipped as binary deltas, and a kt_delta_apply.sh script rebuilds the full payload on the device before the other scripts run,\n"
+        "                                    from the payload of <file>, which has to be found in the base directory (it is kept up to date, so that deltas can be chained).\n"
+        "      -E, --delta-base <dir>      Where the apply script of a delta or diff package looks for the base on the device. Default is " KT_DELTA_DEFAULT_BASE " (overridden by KT_DELTA_BASE).\n"
+        "      -F, --diff <dir>            OTA updates only. Build a package that turns a copy of the directory <dir> into the (single) input directory: only added & changed\n"
+        "                                    files are shipped, and a kt_delta_apply.sh script updates the base directory on the device, taking care of moved & removed files, symlinks & directories.\n"
+        "      -j, --jobs <num>            Hash both trees of --diff with <num> threads. Default (and 0) means one per CPU.\n"
+        "      -L, --dedup                 Archive files whose content was already archived as hardlinks to their first copy: they're hashed & signed once, and stored once.\n"
+        "                                    Every path still gets its own signature & update-filelist.dat record.\n"
+        "      -S, --seekable[=<size>]     Deflate the payload with a full flush every <size> bytes (at the next entry boundary, if possible), and append an index of\n"
+        "                                    these checkpoints & of the entries as " KT_INDEX_SEEK_NAME ", which the device ignores: extract can then jump straight to what it's\n"
+        "                                    asked for. It's still a single gzip stream. Default size is 1M (K, M & G suffixes are understood).\n"
+        "      \n"
+        "  %s patch [options] <input> [ <output> ]\n"
+        "    Add, replace or remove files in an update package, without going through extract & create. Untouched entries, their signatures and their\n"
+        "      update-filelist.dat records are copied as-is: only the new files and the bundle index get hashed & signed (and the envelope, if any).\n"
+        "    If no output is provided, input is patched in place.\n"
+        "    \n"
+        "    Options:\n"
+        "      -a, --add <file>            Add file to the package, under the path given (minus any leading ./ or /), replacing the entry with the same path, if any.\n"
+        "                                    Can be repeated.\n"
+        "      -r, --remove <path>         Remove path (and its signature) from the package. If it's a directory, everything inside it goes too. Can be repeated.\n"
+        "      -k, --key <file>            PEM file containing RSA private key to sign the new files with. Default is popular jailbreak key.\n"
+        "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      \n"
+        "  %s retarget [options] <input> <output>\n"
+        "    Change the header of an update package (devices, revisions, ...), without rebuilding it. The payload is copied as-is (by the kernel, where possible),\n"
+        "      along with the MD5 stored in the header, and the envelope is signed again.\n"
+        "    If output is -, write to standard output.\n"
+        "    \n"
+        "    Options:\n"
+        "      -d, --device <dev>          Replace the devices the package targets (same names, aliases & codes as create). Multiple \"--device\" options supported.\n"
+        "      -s, --srcrev <ulong|uint>   OTA updates only. New source revision.\n"
+        "      -t, --tgtrev <ulong|uint>   OTA & Recovery V2 updates only. New target revision.\n"
+        "      -p, --platform <platform>   Recovery V2 & Recovery FB02 with header rev 2 updates only. New platform.\n"
+        "      -B, --board <board>         Recovery V2 & Recovery FB02 with header rev 2 updates only. New board.\n"
+        "      -b, --bundle <type>         New package magic number, of the same update type. With OTA V2, it otherwise follows the new devices, like with create.\n"
+        "      -c, --cert <ushort>         The number of the certificate to sign the envelope for. Default is the one the package was signed for (or 0).\n"
+        "      -k, --key <file>            PEM file containing RSA private key to sign the envelope with. Default is popular jailbreak key.\n"
+        "      -o, --opt <uchar>           OTA V1 updates only. New optional byte.\n"
+        "      -r, --crit <uchar>          OTA V2 updates only. New critical byte.\n"
+        "      -x, --meta <str>            OTA V2 updates only. Replace the metastrings. Multiple \"--meta\" options supported.\n"
+        "      -u, --unsigned              Input is an unsigned & mangled userdata package: make a properly signed update package out of it (its payload gets hashed & munged).\n"
+        "      \n"
+        "  %s recompress [options] <input> <output>\n"
+        "    Deflate the payload of an update package again, at another compression level. The tarball itself is left byte for byte as it was (so its files,\n"
+        "      their signatures and update-filelist.dat stay valid), only the header MD5 and the envelope are computed again.\n"
+        "    If output is -, write to standard output.\n"
+        "    \n"
+        "    Options:\n"
+        "      -l, --level <level>         Compression level: max (the default), fast, or 1 to 9.\n"
+        "      -j, --jobs <num>            Deflate with <num> threads. Default (and 0) means one per CPU.\n"
+        "      -k, --key <file>            PEM file containing RSA private key to sign the envelope with. Default is popular jailbreak key.\n"
+        "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      \n"
+        "  %s mount [options] <input> <mountpoint>\n"
+        "    Mount the payload of a package read-only, through FUSE (only if this KindleTool was built with FUSE support). The tarball is scanned once,\n"
+        "      then files are demunged & inflated on demand, starting from the closest checkpoint. Unmount with fusermount3 -u <mountpoint>.\n"
+        "    \n"
+        "    Options:\n"
+        "      -c, --cache <size>          Keep up to <size> bytes of inflated data around. Default is 64M (K, M & G suffixes are understood).\n"
+        "      -f, --foreground            Don't detach, stay in the foreground until the package is unmounted.\n"
+        "      -o, --options <opts>        Extra FUSE mount options (comma separated, like allow_other).\n"
+        "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
         "      \n"
         "  %s info <serialno>\n"
+        "  %s info --batch [options] [<file>...]\n"
         "    Get the default root password.\n"
         "    Unless you changed your password manually, the first password shown will be the right one.\n"
         "    (The Kindle defaults to DES hashed passwords, which are truncated to 8 characters).\n"
         "    If you're looking for the recovery MMC export password, that's the second one.\n"
         "    \n"
+        "    Options:\n"
+        "      -b, --batch                 Read serial numbers from the given files (or stdin), one per line, and print a record for each of them:\n"
+        "                                    serial, status (ok, unknown or invalid), device, device name, platform, root & recovery passwords.\n"
+        "      -f, --format <fmt>          Batch output format: tsv (the default) or jsonl.\n"
+        "      -o, --output <file>         Write the batch records to file instead of stdout.\n"
+        "      \n"
         "  %s version\n"
         "    Show some info about this KindleTool build.\n"
         "    \n"
@@ -597,7 +1206,7 @@ int kindle_print_help(const char *prog_name)
         "  \n"
         "  2)  Kindle 4.0+ has a known bug that prevents some updates with meta-strings to run.\n"
         "  3)  Currently, even though OTA V2 supports updates that run on multiple devices, it is not possible to create an update package that will run on both the Kindle 4 (No Touch) and Kindle 5 (Touch/PW).\n"
-        , prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
+        , prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
     return 0;
 }
 
@@ -627,7 +1236,7 @@ int kindle_obfuscate_main(int argc, char *argv[])
     {
         if((output = fopen(argv[1], "wb")) == NULL)
         {
-            fprintf(stderr, "Cannot open output for writing: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot open output for writing: %s.\n", strerror(errno));
             return -1;
         }
     }
@@ -635,14 +1244,14 @@ int kindle_obfuscate_main(int argc, char *argv[])
     {
         if((input = fopen(argv[0], "rb")) == NULL)
         {
-            fprintf(stderr, "Cannot open input for reading: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot open input for reading: %s.\n", strerror(errno));
             fclose(output);
             return -1;
         }
     }
     if(munger(input, output, 0, 0) < 0)
     {
-        fprintf(stderr, "Cannot obfuscate.\n");
+        fprintf(kt_stderr, "Cannot obfuscate.\n");
         fclose(input);
         fclose(output);
         return -1;
@@ -665,7 +1274,7 @@ int kindle_deobfuscate_main(int argc, char *argv[])
     {
         if((output = fopen(argv[1], "wb")) == NULL)
         {
-            fprintf(stderr, "Cannot open output for writing: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot open output for writing: %s.\n", strerror(errno));
             return -1;
         }
     }
@@ -673,14 +1282,14 @@ int kindle_deobfuscate_main(int argc, char *argv[])
     {
         if((input = fopen(argv[0], "rb")) == NULL)
         {
-            fprintf(stderr, "Cannot open input for reading: %s.\n", strerror(errno));
+            fprintf(kt_stderr, "Cannot open input for reading: %s.\n", strerror(errno));
             fclose(output);
             return -1;
         }
     }
     if(demunger(input, output, 0, 0) < 0)
     {
-        fprintf(stderr, "Cannot deobfuscate.\n");
+        fprintf(kt_stderr, "Cannot deobfuscate.\n");
         fclose(input);
         fclose(output);
         return -1;
@@ -690,161 +1299,4 @@ int kindle_deobfuscate_main(int argc, char *argv[])
     return 0;
 }
 
-int kindle_info_main(int argc, char *argv[])
-{
-    char *serial_no;
-    char md5[MD5_HASH_LENGTH];
-    char device_code[4] = {'\0'};
-    Device device;
-    FILE *temp;
-    unsigned int i;
-    // Skip command
-    argv++;
-    argc--;
-    if(argc < 1)
-    {
-        fprintf(stderr, "Missing argument. You must pass a serial number.\n");
-        return -1;
-    }
-    serial_no = argv[0];
-    temp = tmpfile();
-    if(strlen(serial_no) != SERIAL_NO_LENGTH)
-    {
-        fprintf(stderr, "Serial number must be 16 digits long (no spaces). Example: %s\n", "B0NNXXXXXXXXXXXX");
-        return -1;
-    }
-    for(i = 0; i < SERIAL_NO_LENGTH; i++)
-    {
-        if(islower((int)serial_no[i]))
-        {
-            serial_no[i] = (char)toupper((int)serial_no[i]);
-        }
-    }
-    // Find root password
-    if(fprintf(temp, "%s\n", serial_no) < SERIAL_NO_LENGTH)
-    {
-        fprintf(stderr, "Cannot write serial to temporary file: %s.\n", strerror(errno));
-        fclose(temp);
-        return -1;
-    }
-    rewind(temp);
-    if(md5_sum(temp, md5) < 0)
-    {
-        fprintf(stderr, "Cannot calculate MD5 of serial number.\n");
-        fclose(temp);
-        return -1;
-    }
-
-    snprintf(device_code, 3, "%.*s", 2, &serial_no[2]);
-    device = (Device)strtoul(device_code, NULL, 16);
-    // Handle the new device ID position, since the PW3
-    if(strcmp(convert_device_id(device), "Unknown") == 0)
-    {
-        snprintf(device_code, 4, "%.*s", 3, &serial_no[3]);
-        device = (Device)strtoul(device_code, NULL, 32);
-        if(strcmp(convert_device_id(device), "Unknown") == 0)
-        {
-            fprintf(stderr, "Unknown device!\n");
-            fclose(temp);
-            return -1;
-        }
-        else
-        {
-            fprintf(stderr, "Device uses the new device ID scheme\n");
-        }
-    }
-    // Handle the Wario (>= PW2) passwords while we're at it... Thanks to npoland for this one ;).
-    // NOTE: Remember to check if this is still sane w/ kindle_model_sort.py when new stuff comes out!
-    if(device == KindleVoyageWifi || device == KindlePaperWhite2Wifi4GBInternational || device >= KindleVoyageUnknown_0x2A)
-    {
-        fprintf(stderr, "Platform is Wario or newer\n");
-        fprintf(stderr, "Root PW            %s%.*s\nRecovery PW        %s%.*s\n", "fiona", 3, &md5[13], "fiona", 4, &md5[13]);
-    }
-    else
-    {
-        fprintf(stderr, "Platform is pre Wario\n");
-        fprintf(stderr, "Root PW            %s%.*s\nRecovery PW        %s%.*s\n", "fiona", 3, &md5[7], "fiona", 4, &md5[7]);
-    }
-    // Default root passwords are DES hashed, so we only care about the first 8 chars. On the other hand,
-    // the recovery MMC export option expects a 9 chars password, so, provide both...
-    fclose(temp);
-    return 0;
-}
-
-int main(int argc, char *argv[])
-{
-    const char *prog_name;
-    const char *cmd;
-
-    // Do we want to use unknown devcodes? Very lame test, only check if the var actually exists, we don't check the value...
-    if(getenv("KT_WITH_UNKNOWN_DEVCODES") == NULL)
-        kt_with_unknown_devcodes = 0;
-    else
-        kt_with_unknown_devcodes = 1;
-
-    prog_name = argv[0];
-    // Discard program name for easier parsing
-    argv++;
-    argc--;
-
-    if(argc > 0)
-    {
-        if(strncmp(argv[0], "--", 2) == 0)
-        {
-            // Allow our commands to be passed in longform
-            argv[0] += 2;
-        }
-    }
-    else
-    {
-        // No command was given, print help and die
-        fprintf(stderr, "No command was specified!\n\n");
-        kindle_print_help(prog_name);
-        exit(1);
-    }
-    cmd = argv[0];
-
-#if defined(_WIN32) && !defined(__CYGWIN__)
-    // Set binary mode properly on MingW, MSVCRT craps out when freopen'ing NULL ;)
-    _setmode(_fileno(stdin), _O_BINARY);
-    _setmode(_fileno(stdout), _O_BINARY);
-#else
-    if(freopen(NULL, "rb", stdin) == NULL)
-    {
-        fprintf(stderr, "Cannot set stdin to binary mode: %s.\n", strerror(errno));
-        return -1;
-    }
-    if(freopen(NULL, "wb", stdout) == NULL)
-    {
-        fprintf(stderr, "Cannot set stdout to binary mode: %s.\n", strerror(errno));
-        return -1;
-    }
-#endif
-
-    if(strncmp(cmd, "md", 2) == 0)
-        return kindle_obfuscate_main(argc, argv);
-    else if(strncmp(cmd, "dm", 2) == 0)
-        return kindle_deobfuscate_main(argc, argv);
-    else if(strncmp(cmd, "convert", 7) == 0)
-        return kindle_convert_main(argc, argv);
-    else if(strncmp(cmd, "extract", 7) == 0)
-        return kindle_extract_main(argc, argv);
-    else if(strncmp(cmd, "create", 6) == 0)
-        return kindle_create_main(argc, argv);
-    else if(strncmp(cmd, "info", 4) == 0)
-        return kindle_info_main(argc, argv);
-    else if(strncmp(cmd, "version", 7) == 0)
-        return kindle_print_version(prog_name);
-    else if(strncmp(cmd, "help", 4) == 0 || strncmp(cmd, "-help", 5) == 0 || strncmp(cmd, "-h", 2) == 0 || strncmp(cmd, "-?", 2) == 0 || strncmp(cmd, "/?", 2) == 0 || strncmp(cmd, "/h", 2) == 0 || strncmp(cmd, "/help", 2) == 0)
-        return kindle_print_help(prog_name);
-    else
-    {
-        fprintf(stderr, "Unknown command '%s'!\n\n", cmd);
-        kindle_print_help(prog_name);
-        exit(1);
-    }
-
-    return 1;
-}
-
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -21,6 +21,7 @@
 #ifndef KINDLETOOL
 #define KINDLETOOL
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,15 +33,27 @@
 #include <getopt.h>
 #include <limits.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 // libarchive does not pull that in for us anymore ;).
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
 #include <archive.h>
 #include <archive_entry.h>
 
+// Optional io_uring write backend for extract (Linux only, see the IO_URING Makefile flag)
+#ifdef KT_WITH_IO_URING
+#include <liburing.h>
+// <linux/fs.h> (pulled in by liburing) has its own BLOCK_SIZE, we want ours
+#undef BLOCK_SIZE
+#endif
+
 #include <gmp.h>
 #include <nettle/buffer.h>
 #include <nettle/base16.h>
@@ -48,6 +61,10 @@
 #include <nettle/md5.h>
 #include <nettle/sha2.h>
 #include <nettle/rsa.h>
+#include <nettle/asn1.h>
+
+// We do our own inflating for the random access index
+#include <zlib.h>
 
 // Die in a slightly more graceful manner than by spewing a whole lot of warnings & errors if we're not building against at least libarchive 3.0.3
 #if ARCHIVE_VERSION_NUMBER < 3000003
@@ -227,6 +244,30 @@ typedef enum
     */
 } Board;
 
+// What we know about a device ID (the tables live in kindle_registry.h, generated by tools/kindle_registry.py)
+typedef struct
+{
+    const char *name;
+    uint8_t flags;
+} KTDeviceRecord;
+
+#define KT_DEVICE_UNCONFIRMED 0x01          // Datamined, the aliases only pull it in with KT_WITH_UNKNOWN_DEVCODES
+
+// A name accepted by the -d, -p or -B switches of create
+typedef struct
+{
+    const char *name;
+    const char *magic_number;   // What -d switches the bundle to (NULL to leave it alone)
+    uint16_t first_device;      // The devices -d stands for, in kt_registry_members
+    uint16_t num_devices;
+    uint8_t flags;
+    int platform;               // -1 if that's not a -p name
+    int board;                  // -1 if that's not a -B name
+} KTRegistryName;
+
+#define KT_REGISTRY_ALIAS 0x01              // A whole family: skip its unconfirmed members without KT_WITH_UNKNOWN_DEVCODES
+#define KT_REGISTRY_DATAMINED 0x02          // Doesn't exist without KT_WITH_UNKNOWN_DEVCODES
+
 // For reference, list of boards (AFAICT, in chronological order):
 // ADS                        // K1 proto? (w/ ETH)
 // Mario                      // Kindle 1? (w/ ETH) [Also a platform]
@@ -251,57 +292,45 @@ typedef enum
 // Icewine (on Wario)         // Kindle Voyage
 // Muscat                     // Kindle PW3
 
-typedef struct
-{
-    CertificateNumber certificate_number;
-} UpdateSignatureHeader;
-
-typedef struct
-{
-    uint32_t source_revision;
-    uint32_t target_revision;
-    uint16_t device;
-    unsigned char optional;
-    unsigned char unused;
-    char md5_sum[MD5_HASH_LENGTH];
-} OTAUpdateHeader;
-
-typedef struct
-{
-    unsigned char unused[12];
-    char md5_sum[MD5_HASH_LENGTH];
-    uint32_t magic_1;
-    uint32_t magic_2;
-    uint32_t minor;
-    uint32_t device;
-} RecoveryUpdateHeader;
+// Update package headers, as described by the field tables in header.c. Parsing one points into the caller's buffer instead of copying the variable parts out of it.
+#define KT_HEADER_MAX_SIZE (1024 * 1024)       // We don't expect headers (magic number included, signature excluded) bigger than this
 
 typedef struct
 {
-    unsigned char unused[12];
-    char md5_sum[MD5_HASH_LENGTH];
+    char magic_number[MAGIC_NUMBER_LENGTH];
+    BundleVersion version;
+    size_t header_size;         // On the wire, magic number included (but not the signature, for UpdateSignature)
+    uint64_t source_revision;
+    uint64_t target_revision;
     uint32_t magic_1;
     uint32_t magic_2;
     uint32_t minor;
+    uint32_t device;            // OTA V1 & Recovery without a V2 header rev
     uint32_t platform;
     uint32_t header_rev;
     uint32_t board;
-} RecoveryH2UpdateHeader;       // FB02 with V2 Header, not FB03
+    uint32_t certificate_number;
+    uint8_t optional;
+    uint8_t critical;
+    uint8_t padding;
+    char md5_sum[MD5_HASH_LENGTH + 1];  // Demunged
+    uint16_t num_devices;
+    const unsigned char *devices;       // Parsed: num_devices little-endian uint16_t, in place
+    const Device *device_list;          // Serialized instead of devices when set
+    uint16_t num_meta;
+    const unsigned char *meta;          // Parsed: num_meta (big-endian uint16_t length, munged string) records, in place
+    size_t meta_size;
+    char **metastrings;                 // Serialized (munged) instead of meta when set
+} KTHeader;
 
+// Where the bytes a KTHeader points to live: either a mapping of the input, or a heap buffer we reuse between reads
 typedef struct
 {
-    char magic_number[MAGIC_NUMBER_LENGTH];
-    union
-    {
-        OTAUpdateHeader ota_update;
-        RecoveryUpdateHeader recovery_update;
-        RecoveryH2UpdateHeader recovery_h2_update;
-        UpdateSignatureHeader signature;
-        unsigned char ota_header_data[OTA_UPDATE_BLOCK_SIZE];
-        unsigned char signature_header_data[UPDATE_SIGNATURE_BLOCK_SIZE];
-        unsigned char recovery_header_data[RECOVERY_UPDATE_BLOCK_SIZE];
-    } data;
-} UpdateHeader;
+    unsigned char *data;
+    size_t size;
+    void *map;
+    size_t map_len;
+} KTHeaderBuffer;
 
 typedef struct
 {
@@ -325,6 +354,30 @@ typedef struct
     char **metastrings;
 } UpdateInformation;
 
+// Open addressing hash table over the items of an array the caller owns (cf. kt_hash_table_*): the slots only hold indices
+#define KT_HASH_NONE ((size_t) -1)
+typedef size_t (*kt_hash_func)(void *, size_t);                             // Hash of the item at that index
+typedef int (*kt_hash_match_func)(void *, size_t, const void *, size_t);    // Is the item at that index the key (of that length)?
+typedef struct
+{
+    size_t *slots;              // Indices + 1 (0 is an empty slot)
+    size_t capacity;            // Always a power of two
+    size_t count;
+    kt_hash_func hash;
+    kt_hash_match_func match;
+    void *arg;                  // Passed to the callbacks
+} KTHashTable;
+
+// What we know about the content of a file we archived, when we look for duplicates (create --dedup)
+typedef struct
+{
+    int first;                  // Index of the first file with the same content (itself for the first one), -1 if we couldn't hash it during the walk
+    char md5[MD5_HASH_LENGTH + 1];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    struct sha256_ctx hash;     // Ready to be signed, without reading the file again
+    unsigned char *sig;         // Signature of the first copy, once we have it
+} KTTarContent;
+
 // This is modeled after libarchive's bsdtar...
 struct kttar
 {
@@ -335,44 +388,352 @@ struct kttar
     unsigned int sign_and_bundle_index;
     unsigned int has_script;
     size_t tweak_pointer_index;
+    unsigned int dedup;         // Archive duplicate contents as hardlinks to their first copy
+    KTTarContent *contents;     // One per file of to_sign_and_bundle_list (when dedup is set)
+    unsigned int num_contents;
+    KTHashTable content_table;  // The first copies, by SHA-256
+    unsigned int num_unique;
+    unsigned int num_linked;
 };
 
-// Ugly global. Used to cache the state of the KT_WITH_UNKNOWN_DEVCODES env var...
-extern unsigned int kt_with_unknown_devcodes;
+// Parallel inflation settings (cf. inflate.c)
+typedef struct
+{
+    unsigned int jobs;          // Number of inflater threads (0 or 1 to inflate serially)
+    unsigned int speculative;   // Also guess where deflate blocks start in single-stream payloads, instead of only splitting on gzip members or checkpoints
+} KTInflateOptions;
+
+// Extraction settings
+typedef struct
+{
+    unsigned int fake_sign;     // Input is an unsigned & mangled userdata package
+    unsigned int jobs;          // Number of writer threads (0 or 1 to write everything from the decompression thread)
+    unsigned int io_uring;      // Batch small file writes through io_uring (if built with it, falls back to the classic path otherwise)
+    const char *index_file;     // Sidecar random access index of the package (NULL if there's none): used to seek to the wanted entries, or rebuilt if build_index is set
+    unsigned int build_index;   // Build the index while we're at it (full extractions only)
+    char **patterns;            // Only extract the entries matching one of these (literal paths, or globs), everything if NULL
+    unsigned int num_patterns;
+    const char *store;          // Content-addressed object store (cf. store.c): regular files are written there once, and hardlinked into the output directory
+    unsigned int incremental;   // Leave the files that are already identical on disk alone, and only write what changed (cf. digest.c)
+    KTInflateOptions inflate;   // How to inflate the payload, for full extractions
+    unsigned int stats;         // Print how fast the files were written once we're done
+} ExtractOptions;
+
+// Patch settings
+typedef struct
+{
+    unsigned int fake_sign;     // Input is an unsigned & mangled userdata package (and so is the output)
+    struct rsa_private_key sign_pkey;   // What we sign the new files, the bundle index & the envelope with
+    char **add;                 // Files to add (or replace), stored under the path they were given with
+    unsigned int num_add;
+    char **remove;              // Entries to remove (a directory takes its contents along)
+    unsigned int num_remove;
+} PatchOptions;
+
+// What retarget overrides in a package header (cf. retarget.c)
+#define KT_RETARGET_DEVICES  (1 << 0)
+#define KT_RETARGET_SRCREV   (1 << 1)
+#define KT_RETARGET_TGTREV   (1 << 2)
+#define KT_RETARGET_PLATFORM (1 << 3)
+#define KT_RETARGET_BOARD    (1 << 4)
+#define KT_RETARGET_BUNDLE   (1 << 5)
+#define KT_RETARGET_CERT     (1 << 6)
+#define KT_RETARGET_OPTIONAL (1 << 7)
+#define KT_RETARGET_CRITICAL (1 << 8)
+#define KT_RETARGET_META     (1 << 9)
+
+typedef struct
+{
+    UpdateInformation info;     // The new values (and the signing key)
+    unsigned int set;           // Which of them to use (KT_RETARGET_*), everything else is kept as-is
+    unsigned int fake_sign;     // Input is a fake package, which we turn into a properly signed one
+} RetargetOptions;
+
+typedef struct
+{
+    unsigned int fake_sign;
+    struct rsa_private_key sign_pkey;
+    int level;                  // zlib compression level
+    unsigned int jobs;          // Deflate threads
+} RecompressOptions;
+
+// A 'type md5 path blocks displayname' record of the bundle index (update-filelist.dat)
+typedef struct
+{
+    int type;
+    char md5[MD5_HASH_LENGTH + 1];
+    char path[PATH_MAX];
+} KTFilelistRecord;
+
+typedef int (*kt_filelist_func)(void *, const KTFilelistRecord *);
+
+// Splits the bundle index in records as it's fed, with a bounded line buffer (overlong lines are skipped)
+typedef struct
+{
+    char line[PATH_MAX * 2];
+    size_t len;
+    int overflow;
+    kt_filelist_func func;      // Called for every record
+    void *arg;
+} KTFilelistReader;
+
+// What kt_walk_files does with the files it finds. The callbacks can be called from any thread, at the same time.
+typedef struct
+{
+    size_t scratch_size;        // Per thread scratch space, zeroed
+    void (*file)(void *arg, void *scratch, int start_fd, const char *path);    // Every regular file (open it with kt_walk_open)
+    void (*unreadable)(void *arg, void *scratch, const char *path);            // Whatever the walk couldn't read, it carries on
+    void (*scratch_free)(void *scratch);                                        // Optional, frees what the callbacks hung off the scratch space
+} KTWalkCallbacks;
+
+// Content-addressed object store (cf. store.c)
+typedef struct kt_store KTStore;
+
+// Persistent digest cache of an extracted tree (cf. digest.c)
+#define KT_DIGEST_SUFFIX ".ktdigest"
+typedef struct kt_digest_cache KTDigestCache;
+
+// Staging area of a delta package (cf. delta.c): what create archives instead of its inputs
+typedef struct
+{
+    char *dir;                  // Temporary directory everything lives in
+    char *inputs[2];            // The directory of the apply script, then the payload tree
+    char **files;               // What we created in there, to clean up after ourselves
+    unsigned int num_files;
+    char **dirs;
+    unsigned int num_dirs;
+} KTDeltaStage;
+
+#define KT_DELTA_DEFAULT_BASE "/var/local/kindletool/delta"
+
+// Random access index of a package's payload (cf. index.c): inflate checkpoints & tar entry offsets, keyed to the package they were built from
+#define KT_INDEX_SUFFIX ".ktidx"
+#define KT_INDEX_SPAN (1024 * 1024)     // Distance between checkpoints, in uncompressed bytes
+#define KT_INDEX_WINDOW_SIZE 32768      // The size of a deflate window
+// What create --seekable appends to the tarball: its own index, found through a gzip header extra field, and ignored by the device
+#define KT_INDEX_SEEK_NAME ".kindletool.ktidx"
+
+typedef enum
+{
+    KTIndexPointWindow = 0,     // Somewhere in a deflate stream, restart with the saved window
+    KTIndexPointMember,         // Start of a gzip member, nothing to remember
+    KTIndexPointFlush           // Right after a full flush (create --seekable), raw deflate without a window
+} KTIndexPointType;
+
+typedef struct
+{
+    uint64_t out;               // Offset in the uncompressed tarball
+    uint64_t in;                // Offset in the (munged) compressed payload
+    uint8_t bits;               // Number of bits of the byte before 'in' that belong to the next deflate block
+    uint8_t type;               // KTIndexPointType
+    uint32_t window_size;       // Size of the (zlib compressed) window
+    unsigned char *window;
+} KTIndexPoint;
+
+typedef struct
+{
+    uint64_t offset;            // Offset of the tar header in the uncompressed tarball
+    uint64_t size;
+    uint32_t mode;
+    int64_t mtime;
+    char *pathname;
+} KTIndexEntry;
+
+typedef struct
+{
+    uint64_t bin_size;          // What we know about the package this index belongs to
+    int64_t bin_mtime;
+    uint64_t payload_offset;
+    uint8_t munged;
+    uint8_t header_digest[MD5_DIGEST_SIZE];     // MD5 of everything before the payload
+    uint64_t span;
+    uint32_t num_points;
+    KTIndexPoint *points;
+    uint32_t num_entries;
+    KTIndexEntry *entries;
+} KTIndex;
+
+// Thread-local storage, used to keep track of the libkindletool context attached to the current thread
+#if defined(_MSC_VER)
+#define KT_TLS __declspec(thread)
+#else
+#define KT_TLS __thread
+#endif
+
+// Structured error codes, returned by the libkindletool entry points (and stashed in the context)
+typedef enum
+{
+    KT_OK = 0,
+    KT_ERR_GENERIC = -1,        // Something failed, but we didn't flag anything more specific
+    KT_ERR_IO = -2,             // Read/Write/Open failure
+    KT_ERR_NOMEM = -3,          // Allocation failure
+    KT_ERR_FORMAT = -4,         // Unknown or malformed package/header
+    KT_ERR_INTEGRITY = -5,      // Hash mismatch
+    KT_ERR_CRYPTO = -6,         // Signing/Key failure
+    KT_ERR_ARCHIVE = -7,        // libarchive failure
+    KT_ERR_INVALID = -8,        // Invalid arguments
+    KT_ERR_UNSUPPORTED = -9     // Not supported on this platform/build
+} KTError;
+
+// Everything that used to be global state lives here. One context per thread (or per caller), never shared between concurrently running threads.
+typedef struct
+{
+    unsigned int with_unknown_devcodes; // Cached state of the KT_WITH_UNKNOWN_DEVCODES env var (for the CLI)
+    FILE *log;                          // Where diagnostics go (stderr if NULL)
+    KTError last_error;                 // The first error flagged since the last entry point call
+} KTContext;
+
+// Callback based I/O, for sources/sinks that aren't real files
+typedef ssize_t (*kt_read_func)(void *, char *, size_t);
+typedef ssize_t (*kt_write_func)(void *, const char *, size_t);
+typedef int (*kt_seek_func)(void *, int64_t *, int);
+typedef int (*kt_close_func)(void *);
+
+typedef struct
+{
+    kt_read_func read;
+    kt_write_func write;
+    kt_seek_func seek;          // Optional, but creating packages needs a seekable input
+    kt_close_func close;        // Optional
+} KTIOCallbacks;
+
+// What used to be an ugly global is now part of the context attached to the current thread...
+#define kt_with_unknown_devcodes (kt_context_current()->with_unknown_devcodes)
+// Same thing for our diagnostics
+#define kt_stderr (kt_log_stream())
+
+KTContext *kt_context_new(void);
+void kt_context_free(KTContext *);
+KTContext *kt_context_attach(KTContext *);
+KTContext *kt_context_current(void);
+void kt_context_set_log(KTContext *, FILE *);
+KTError kt_context_error(const KTContext *);
+FILE *kt_log_stream(void);
+void kt_set_error(KTError);
+const char *kt_strerror(KTError);
+FILE *kt_fmemopen(void *, size_t, const char *);
+FILE *kt_open_memstream(char **, size_t *);
+FILE *kt_fopen_callbacks(void *, const KTIOCallbacks *, const char *);
+char *kt_basename(const char *, char *, size_t);
+int kt_convert(KTContext *, FILE *, FILE *, FILE *, const unsigned int, char *);
+int kt_extract(KTContext *, FILE *, const char *, const ExtractOptions *);
+int kt_create_package_archive(KTContext *, const int, char **, const unsigned int, struct rsa_private_key *, const unsigned int, const unsigned int, const unsigned int);
+int kt_create(KTContext *, UpdateInformation *, FILE *, FILE *, const unsigned int);
 
 void md(unsigned char *, size_t);
 void dm(unsigned char *, size_t);
 int munger(FILE *, FILE *, size_t, const unsigned int);
 int demunger(FILE *, FILE *, size_t, const unsigned int);
+const char *kt_device_name(Device);
+const char *kt_platform_name(Platform);
+const char *kt_board_name(Board);
 const char *convert_device_id(Device);
 const char *convert_platform_id(Platform);
 const char *convert_board_id(Board);
+const KTRegistryName *kt_registry_lookup(const char *);
+int kt_registry_devices(const KTRegistryName *, Device **, uint16_t *);
 const char *convert_bundle_version(BundleVersion);
-BundleVersion get_bundle_version(char *);
-const char *convert_magic_number(char *);
+BundleVersion get_bundle_version(const char *);
+const char *convert_magic_number(const char *);
 int md5_sum(FILE *, char *);
 char *to_base(int64_t, unsigned int);
+int parse_jobs(const char *, unsigned int *);
+int parse_size(const char *, uint64_t *);
+int kt_walk_start(void);
+int kt_walk_open(int, const char *, int);
+void kt_walk_end(int);
+int kt_walk_files(char **, unsigned int, unsigned int, const KTWalkCallbacks *, void *, unsigned int *);
+int kt_rename_replace(const char *, const char *);
+size_t kt_hash_path(const char *, size_t);
+void kt_hash_table_init(KTHashTable *, kt_hash_func, kt_hash_match_func, void *);
+size_t kt_hash_table_find(const KTHashTable *, size_t, const void *, size_t);
+int kt_hash_table_insert(KTHashTable *, size_t);
+void kt_hash_table_free(KTHashTable *);
+const char *kt_normalize_entry_path(const char *, size_t *);
+int kt_filelist_parse(const char *, size_t, KTFilelistRecord *);
+void kt_filelist_reader_init(KTFilelistReader *, kt_filelist_func, void *);
+int kt_filelist_reader_feed(KTFilelistReader *, const char *, size_t);
+int kt_filelist_reader_end(KTFilelistReader *);
 struct rsa_private_key get_default_key(void);
+struct rsa_public_key get_default_pubkey(void);
 int kindle_print_help(const char *);
 int kindle_print_version(const char *);
 int kindle_deobfuscate_main(int, char **);
 int kindle_obfuscate_main(int, char **);
+int kindle_info_batch(FILE *, FILE *, unsigned int, unsigned int *);
 int kindle_info_main(int, char **);
 
-int kindle_read_bundle_header(UpdateHeader *, FILE *);
+int kt_header_parse(KTHeader *, const unsigned char *, size_t);
+uint16_t kt_header_device(const KTHeader *, unsigned int);
+const unsigned char *kt_header_next_meta(const unsigned char **, uint16_t *);
+size_t kt_header_size(const KTHeader *);
+int kt_header_serialize(const KTHeader *, unsigned char *, size_t);
+int kt_header_read(KTHeader *, KTHeaderBuffer *, FILE *);
+int kt_header_write(const KTHeader *, FILE *);
+void kt_header_buffer_free(KTHeaderBuffer *);
+
 int kindle_convert(FILE *, FILE *, FILE *, const unsigned int, const unsigned int, FILE *, char *);
-int kindle_convert_ota_update_v2(FILE *, FILE *, const unsigned int, char *);
-int kindle_convert_signature(UpdateHeader *, FILE *, FILE *);
-int kindle_convert_ota_update(UpdateHeader *, FILE *, FILE *, const unsigned int, char *);
-int kindle_convert_recovery(UpdateHeader *, FILE *, FILE *, const unsigned int, char *);
-int kindle_convert_recovery_v2(FILE *, FILE *, const unsigned int, char *);
+int kindle_convert_ota_update_v2(const KTHeader *, FILE *, FILE *, const unsigned int, char *);
+int kindle_convert_signature(const KTHeader *, FILE *, FILE *);
+int kindle_convert_ota_update(const KTHeader *, FILE *, FILE *, const unsigned int, char *);
+int kindle_convert_recovery(const KTHeader *, FILE *, FILE *, const unsigned int, char *);
+int kindle_convert_recovery_v2(const KTHeader *, FILE *, FILE *, const unsigned int, char *);
 int kindle_convert_main(int, char **);
-int libarchive_extract(const char *, const char *);
+int libarchive_extract(const char *, const char *, const ExtractOptions *, KTIndex *, KTDigestCache *);
+int kindle_extract(FILE *, const char *, const ExtractOptions *);
 int kindle_extract_main(int, char **);
 
+KTIndex *kt_index_probe(FILE *, const unsigned int);
+void kt_index_free(KTIndex *);
+char *kt_index_default_name(const char *);
+int kt_index_read_open_prefixed(struct archive *, KTIndex *, FILE *, const unsigned int, const unsigned char *, size_t);
+int kt_index_read_open(struct archive *, KTIndex *, FILE *, const unsigned int);
+int kt_index_add_entry(KTIndex *, int64_t, struct archive_entry *);
+int kt_index_save(const KTIndex *, const char *);
+KTIndex *kt_index_load(const char *, FILE *, const unsigned int);
+long kt_index_find(const KTIndex *, const char *);
+int kt_index_read_open_at(struct archive *, const KTIndex *, FILE *, uint64_t);
+int kt_index_build(const char *, const char *, const unsigned int);
+int kt_index_make_seekable(FILE *, FILE *, uint64_t);
+KTIndex *kt_index_load_embedded(FILE *, const unsigned int);
+
+KTStore *kt_store_open(const char *);
+void kt_store_close(KTStore *);
+int kt_store_add_data(KTStore *, const void *, size_t, struct archive_entry *, const char *);
+int kt_store_add_entry(KTStore *, struct archive *, struct archive_entry *, const char *);
+
+char *kt_digest_cache_default_name(const char *);
+KTDigestCache *kt_digest_cache_open(const char *);
+unsigned int kt_digest_cache_size(const KTDigestCache *);
+const char *kt_digest_cache_name(const KTDigestCache *);
+int kt_digest_cache_expect(KTDigestCache *, const char *, const char *);
+const char *kt_digest_cache_expected(KTDigestCache *, const char *);
+const char *kt_digest_cache_lookup(KTDigestCache *, const char *, const struct stat *);
+int kt_digest_cache_update(KTDigestCache *, const char *, const struct stat *, const char *);
+void kt_digest_cache_forget(KTDigestCache *, const char *);
+int kt_digest_cache_save(KTDigestCache *);
+void kt_digest_cache_free(KTDigestCache *);
+
+int kt_inflate_read_open(struct archive *, FILE *, const unsigned int, const KTInflateOptions *);
+
+int kt_payload_read_open(struct archive *, KTIndex *, FILE *, const unsigned int, const KTInflateOptions *);
+int kindle_list(FILE *, const unsigned int, const KTInflateOptions *, FILE *);
+int kindle_list_main(int, char **);
+
+int kindle_verify(FILE *, const unsigned int, const struct rsa_public_key *, unsigned int, const KTInflateOptions *, FILE *);
+int kindle_verify_envelopes(char **, unsigned int, const struct rsa_public_key **, unsigned int, FILE *);
+int kindle_verify_main(int, char **);
+
+int kindle_scan(char **, unsigned int, const unsigned int, unsigned int, FILE *);
+int kindle_scan_main(int, char **);
+
 int sign_file(FILE *, struct rsa_private_key *, FILE *);
-int kindle_create_package_archive(const int, char **, const unsigned int, struct rsa_private_key *, const unsigned int, const unsigned int);
+int kindle_create_package_archive(const int, char **, const unsigned int, struct rsa_private_key *, const unsigned int, const unsigned int, const unsigned int);
 int kindle_create(UpdateInformation *, FILE *, FILE *, const unsigned int);
+int kindle_create_add_device(UpdateInformation *, const char *);
+int kindle_create_bundle(KTHeader *, FILE *, FILE *, const unsigned int);
+int kindle_create_envelope(uint32_t, struct rsa_private_key *, FILE *, FILE *);
+int kindle_create_signed_bundle(KTHeader *, FILE *, FILE *, uint32_t, struct rsa_private_key *);
 int kindle_create_ota_update_v2(UpdateInformation *, FILE *, FILE *, const unsigned int);
 int kindle_create_signature(UpdateInformation *, FILE *, FILE *);
 int kindle_create_ota_update(UpdateInformation *, FILE *, FILE *, const unsigned int);
@@ -380,7 +741,23 @@ int kindle_create_recovery(UpdateInformation *, FILE *, FILE *, const unsigned i
 int kindle_create_recovery_v2(UpdateInformation *, FILE *, FILE *, const unsigned int);
 int kindle_create_main(int, char **);
 
+int kindle_patch(FILE *, FILE *, PatchOptions *);
+int kindle_patch_main(int, char **);
+
+int kindle_retarget(FILE *, FILE *, RetargetOptions *);
+int kindle_retarget_main(int, char **);
+
+int kindle_recompress(FILE *, FILE *, RecompressOptions *);
+int kindle_recompress_main(int, char **);
+
+int kindle_mount_main(int, char **);
+
+int kt_delta_stage(KTDeltaStage *, const char *, char **, const unsigned int, const unsigned int, const char *);
+int kt_delta_stage_trees(KTDeltaStage *, const char *, const char *, unsigned int, const char *);
+void kt_delta_stage_free(KTDeltaStage *);
+
 int nettle_rsa_privkey_from_pem(char *, struct rsa_private_key *);
+int nettle_rsa_pubkey_from_pem(char *, struct rsa_public_key *);
 
 #endif
 
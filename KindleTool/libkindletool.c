@@ -0,0 +1,422 @@
+//
+//  libkindletool.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// We need fopencookie, fmemopen & open_memstream
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "kindle_tool.h"
+
+// The context used by threads that never attached one of their own (i.e., the CLI)
+static KTContext kt_default_context = { 0, NULL, KT_OK };
+// The context attached to the current thread, if any
+static KT_TLS KTContext *kt_thread_context = NULL;
+
+KTContext *kt_context_new(void)
+{
+    KTContext *ctx;
+
+    if((ctx = calloc(1, sizeof(*ctx))) == NULL)
+        return NULL;
+    ctx->with_unknown_devcodes = 0;
+    ctx->log = NULL;
+    ctx->last_error = KT_OK;
+
+    return ctx;
+}
+
+void kt_context_free(KTContext *ctx)
+{
+    if(ctx == NULL || ctx == &kt_default_context)
+        return;
+    // Don't leave a dangling pointer behind if we're still attached to it
+    if(kt_thread_context == ctx)
+        kt_thread_context = NULL;
+    free(ctx);
+}
+
+// Attach a context to the current thread (NULL reverts to the default one), returns whatever was attached before
+KTContext *kt_context_attach(KTContext *ctx)
+{
+    KTContext *prev = kt_thread_context;
+
+    kt_thread_context = ctx;
+    return prev;
+}
+
+KTContext *kt_context_current(void)
+{
+    if(kt_thread_context != NULL)
+        return kt_thread_context;
+    else
+        return &kt_default_context;
+}
+
+void kt_context_set_log(KTContext *ctx, FILE *log)
+{
+    if(ctx == NULL)
+        ctx = kt_context_current();
+    ctx->log = log;
+}
+
+KTError kt_context_error(const KTContext *ctx)
+{
+    if(ctx == NULL)
+        ctx = kt_context_current();
+    return ctx->last_error;
+}
+
+FILE *kt_log_stream(void)
+{
+    KTContext *ctx = kt_context_current();
+
+    if(ctx->log != NULL)
+        return ctx->log;
+    else
+        return stderr;
+}
+
+// Only keep the first error: it's usually the most specific one, the following ones tend to be the callers bailing out.
+void kt_set_error(KTError err)
+{
+    KTContext *ctx = kt_context_current();
+
+    if(ctx->last_error == KT_OK)
+        ctx->last_error = err;
+}
+
+const char *kt_strerror(KTError err)
+{
+    switch(err)
+    {
+        case KT_OK:
+            return "Success";
+        case KT_ERR_IO:
+            return "I/O error";
+        case KT_ERR_NOMEM:
+            return "Out of memory";
+        case KT_ERR_FORMAT:
+            return "Invalid package format";
+        case KT_ERR_INTEGRITY:
+            return "Integrity check failed";
+        case KT_ERR_CRYPTO:
+            return "Cryptographic failure";
+        case KT_ERR_ARCHIVE:
+            return "Archive error";
+        case KT_ERR_INVALID:
+            return "Invalid argument";
+        case KT_ERR_UNSUPPORTED:
+            return "Not supported";
+        case KT_ERR_GENERIC:
+        default:
+            return "Unknown error";
+    }
+}
+
+// Read from (or write to) a caller-provided memory buffer
+FILE *kt_fmemopen(void *buf, size_t size, const char *mode)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) buf;
+    (void) size;
+    (void) mode;
+    errno = ENOSYS;
+    return NULL;
+#else
+    return fmemopen(buf, size, mode);
+#endif
+}
+
+// Write to a dynamically growing memory buffer (the caller has to free *buf after fclose)
+FILE *kt_open_memstream(char **buf, size_t *size)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) buf;
+    (void) size;
+    errno = ENOSYS;
+    return NULL;
+#else
+    return open_memstream(buf, size);
+#endif
+}
+
+// Callback based streams: fopencookie on glibc, funopen on the BSDs & OS X. We keep a copy of the callbacks alongside the user's cookie.
+struct kt_cookie
+{
+    void *cookie;
+    KTIOCallbacks cb;
+};
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+static int kt_cookie_read(void *c, char *buf, int size)
+{
+    struct kt_cookie *kc = c;
+
+    if(kc->cb.read == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return (int) kc->cb.read(kc->cookie, buf, (size_t) size);
+}
+
+static int kt_cookie_write(void *c, const char *buf, int size)
+{
+    struct kt_cookie *kc = c;
+
+    if(kc->cb.write == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return (int) kc->cb.write(kc->cookie, buf, (size_t) size);
+}
+
+static fpos_t kt_cookie_seek(void *c, fpos_t offset, int whence)
+{
+    struct kt_cookie *kc = c;
+    int64_t pos = (int64_t) offset;
+
+    if(kc->cb.seek == NULL)
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+    if(kc->cb.seek(kc->cookie, &pos, whence) != 0)
+        return -1;
+    return (fpos_t) pos;
+}
+#else
+static ssize_t kt_cookie_read(void *c, char *buf, size_t size)
+{
+    struct kt_cookie *kc = c;
+
+    if(kc->cb.read == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return kc->cb.read(kc->cookie, buf, size);
+}
+
+static ssize_t kt_cookie_write(void *c, const char *buf, size_t size)
+{
+    struct kt_cookie *kc = c;
+
+    if(kc->cb.write == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return kc->cb.write(kc->cookie, buf, size);
+}
+
+static int kt_cookie_seek(void *c, off64_t *offset, int whence)
+{
+    struct kt_cookie *kc = c;
+    int64_t pos = (int64_t) *offset;
+
+    if(kc->cb.seek == NULL)
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+    if(kc->cb.seek(kc->cookie, &pos, whence) != 0)
+        return -1;
+    *offset = (off64_t) pos;
+    return 0;
+}
+#endif
+
+static int kt_cookie_close(void *c)
+{
+    struct kt_cookie *kc = c;
+    int ret = 0;
+
+    if(kc->cb.close != NULL)
+        ret = kc->cb.close(kc->cookie);
+    free(kc);
+    return ret;
+}
+#endif
+
+FILE *kt_fopen_callbacks(void *cookie, const KTIOCallbacks *callbacks, const char *mode)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) cookie;
+    (void) callbacks;
+    (void) mode;
+    errno = ENOSYS;
+    return NULL;
+#else
+    struct kt_cookie *kc;
+    FILE *stream;
+
+    if(callbacks == NULL || (callbacks->read == NULL && callbacks->write == NULL))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if((kc = malloc(sizeof(*kc))) == NULL)
+        return NULL;
+    kc->cookie = cookie;
+    kc->cb = *callbacks;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    (void) mode;
+    stream = funopen(kc, kt_cookie_read, kt_cookie_write, kt_cookie_seek, kt_cookie_close);
+#else
+    {
+        cookie_io_functions_t io_funcs = { kt_cookie_read, kt_cookie_write, kt_cookie_seek, kt_cookie_close };
+        stream = fopencookie(kc, mode, io_funcs);
+    }
+#endif
+    if(stream == NULL)
+        free(kc);
+
+    return stream;
+#endif
+}
+
+// Reentrant basename: never touches path, writes the last component to buf (POSIX semantics for trailing slashes & empty paths)
+char *kt_basename(const char *path, char *buf, size_t size)
+{
+    const char *end;
+    const char *start;
+    size_t len;
+
+    if(buf == NULL || size == 0)
+        return NULL;
+
+    if(path == NULL || *path == '\0')
+    {
+        snprintf(buf, size, ".");
+        return buf;
+    }
+
+    // Skip trailing slashes
+    end = path + strlen(path);
+    while(end > path + 1 && *(end - 1) == '/')
+        end--;
+    // Only slashes?
+    if(end == path + 1 && *path == '/')
+    {
+        snprintf(buf, size, "/");
+        return buf;
+    }
+    // Find the beginning of the last component
+    start = end;
+    while(start > path && *(start - 1) != '/')
+        start--;
+
+    len = (size_t) (end - start);
+    if(len >= size)
+        len = size - 1;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    return buf;
+}
+
+// Attach the caller's context for the duration of an entry point call
+static KTContext *kt_enter(KTContext *ctx)
+{
+    KTContext *prev = kt_thread_context;
+
+    if(ctx != NULL)
+        kt_thread_context = ctx;
+    kt_context_current()->last_error = KT_OK;
+
+    return prev;
+}
+
+// Restore the previous context, and translate our usual 0/-1 returns into a KTError
+static int kt_leave(KTContext *prev, int ret)
+{
+    KTContext *ctx = kt_context_current();
+
+    if(ret != 0 && ctx->last_error == KT_OK)
+        ctx->last_error = KT_ERR_GENERIC;
+    if(ret == 0)
+        ctx->last_error = KT_OK;
+    ret = ctx->last_error;
+    kt_thread_context = prev;
+
+    return ret;
+}
+
+int kt_convert(KTContext *ctx, FILE *input, FILE *output, FILE *sig_output, const unsigned int fake_sign, char *header_md5)
+{
+    KTContext *prev = kt_enter(ctx);
+
+    if(input == NULL || output == NULL)
+    {
+        kt_set_error(KT_ERR_INVALID);
+        return kt_leave(prev, -1);
+    }
+    return kt_leave(prev, kindle_convert(input, output, sig_output, fake_sign, 0, NULL, header_md5) < 0 ? -1 : 0);
+}
+
+int kt_extract(KTContext *ctx, FILE *input, const char *output_dir, const ExtractOptions *opts)
+{
+    KTContext *prev = kt_enter(ctx);
+    ExtractOptions default_opts;
+
+    if(input == NULL || output_dir == NULL)
+    {
+        kt_set_error(KT_ERR_INVALID);
+        return kt_leave(prev, -1);
+    }
+    // Defaults: signed package, sequential extraction
+    if(opts == NULL)
+    {
+        memset(&default_opts, 0, sizeof(default_opts));
+        opts = &default_opts;
+    }
+    return kt_leave(prev, kindle_extract(input, output_dir, opts) < 0 ? -1 : 0);
+}
+
+int kt_create_package_archive(KTContext *ctx, const int outfd, char **filenames, const unsigned int total_files, struct rsa_private_key *rsa_pkey_file, const unsigned int legacy, const unsigned int real_blocksize, const unsigned int dedup)
+{
+    KTContext *prev = kt_enter(ctx);
+
+    if(outfd < 0 || filenames == NULL || total_files == 0 || rsa_pkey_file == NULL)
+    {
+        kt_set_error(KT_ERR_INVALID);
+        return kt_leave(prev, -1);
+    }
+    return kt_leave(prev, kindle_create_package_archive(outfd, filenames, total_files, rsa_pkey_file, legacy, real_blocksize, dedup) != 0 ? -1 : 0);
+}
+
+int kt_create(KTContext *ctx, UpdateInformation *info, FILE *input_tgz, FILE *output, const unsigned int fake_sign)
+{
+    KTContext *prev = kt_enter(ctx);
+
+    if(info == NULL || input_tgz == NULL || output == NULL)
+    {
+        kt_set_error(KT_ERR_INVALID);
+        return kt_leave(prev, -1);
+    }
+    return kt_leave(prev, kindle_create(info, input_tgz, output, fake_sign) < 0 ? -1 : 0);
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,341 @@
+//
+//  list.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Longest update-filelist.dat line we care about, the rest of a longer one is ignored
+#define KT_LIST_LINE_MAX (PATH_MAX * 2)
+
+// ls -l style mode string
+static void kt_mode_string(unsigned int mode, char str[11])
+{
+    switch(mode & AE_IFMT)
+    {
+        case AE_IFDIR:
+            str[0] = 'd';
+            break;
+        case AE_IFLNK:
+            str[0] = 'l';
+            break;
+        case AE_IFCHR:
+            str[0] = 'c';
+            break;
+        case AE_IFBLK:
+            str[0] = 'b';
+            break;
+        case AE_IFIFO:
+            str[0] = 'p';
+            break;
+        case AE_IFSOCK:
+            str[0] = 's';
+            break;
+        default:
+            str[0] = '-';
+            break;
+    }
+    str[1] = (mode & 0400) ? 'r' : '-';
+    str[2] = (mode & 0200) ? 'w' : '-';
+    str[3] = (mode & 04000) ? ((mode & 0100) ? 's' : 'S') : ((mode & 0100) ? 'x' : '-');
+    str[4] = (mode & 040) ? 'r' : '-';
+    str[5] = (mode & 020) ? 'w' : '-';
+    str[6] = (mode & 02000) ? ((mode & 010) ? 's' : 'S') : ((mode & 010) ? 'x' : '-');
+    str[7] = (mode & 04) ? 'r' : '-';
+    str[8] = (mode & 02) ? 'w' : '-';
+    str[9] = (mode & 01000) ? ((mode & 01) ? 't' : 'T') : ((mode & 01) ? 'x' : '-');
+    str[10] = '\0';
+}
+
+// Print a single 'type md5 path blocks displayname' record
+static void kt_list_print_record(char *line, FILE *out)
+{
+    char *fields[4];
+    char *saveptr = NULL;
+    unsigned int i;
+
+    for(i = 0; i < 4; i++)
+    {
+        if((fields[i] = strtok_r(i == 0 ? line : NULL, " \t", &saveptr)) == NULL)
+            break;
+    }
+    if(i < 4)
+    {
+        // Not something we know how to parse, print it as-is
+        if(i > 0)
+            fprintf(out, "    ?   %s\n", fields[0]);
+        return;
+    }
+    fprintf(out, "    %-3s %-32s %8s %s\n", fields[0], fields[1], fields[3], fields[2]);
+}
+
+// Stream the index file's data, and parse it line by line with a bounded buffer
+static int kt_list_filelist(struct archive *a, FILE *out)
+{
+    char line[KT_LIST_LINE_MAX + 1];
+    char buf[BUFFER_SIZE];
+    size_t len = 0;
+    int overflow = 0;
+    ssize_t bytes_read;
+    ssize_t i;
+
+    fprintf(out, "    %-3s %-32s %8s %s\n", "Typ", "MD5", "Blocks", "Path");
+    while((bytes_read = archive_read_data(a, buf, sizeof(buf))) > 0)
+    {
+        for(i = 0; i < bytes_read; i++)
+        {
+            if(buf[i] == '\n')
+            {
+                line[len] = '\0';
+                if(len > 0 && line[len - 1] == '\r')
+                    line[len - 1] = '\0';
+                if(!overflow && line[0] != '\0')
+                    kt_list_print_record(line, out);
+                len = 0;
+                overflow = 0;
+            }
+            else if(len < KT_LIST_LINE_MAX)
+                line[len++] = buf[i];
+            else
+                overflow = 1;
+        }
+    }
+    if(bytes_read < 0)
+    {
+        fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    // Last line might not be terminated
+    if(len > 0 && !overflow)
+    {
+        line[len] = '\0';
+        kt_list_print_record(line, out);
+    }
+
+    return 0;
+}
+
+// Parse (and print) the header, then hook the demunged & inflated payload up to a read archive, straight from the (possibly non-seekable) input.
+// If inflate isn't NULL and the input is a regular file, the payload may be inflated by a pool of threads instead (cf. inflate.c).
+int kt_payload_read_open(struct archive *a, KTIndex *stream, FILE *input, const unsigned int fake_sign, const KTInflateOptions *inflate)
+{
+    char header_md5[MD5_HASH_LENGTH + 1];
+    unsigned char prefix[MAGIC_NUMBER_LENGTH + 2];
+    unsigned char peek[2];
+    size_t prefix_len;
+    unsigned int munged;
+    off_t start = -1;
+    off_t payload;
+    int r;
+
+    if(inflate != NULL && inflate->jobs > 1)
+        start = ftello(input);
+    // Parsing the header leaves us at the start of the payload...
+    if(kindle_convert(input, NULL, NULL, fake_sign, 0, NULL, header_md5) < 0)
+    {
+        fprintf(kt_stderr, "Cannot parse the package's header.\n");
+        return -1;
+    }
+    memset(stream, 0, sizeof(*stream));
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(start >= 0 && (payload = ftello(input)) >= 0 && fseeko(input, start, SEEK_SET) == 0)
+    {
+        if((r = kt_inflate_read_open(a, input, fake_sign, inflate)) <= 0)
+            return r;
+        // Not worth it, back to where we were
+        if(fseeko(input, payload, SEEK_SET) != 0)
+        {
+            fprintf(kt_stderr, "Cannot seek back to the package's payload: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+    }
+    // ...except for userdata packages, where it ate the GZIP magic number. Since we might not be able to seek back, sniff what comes next.
+    if(fread(peek, sizeof(unsigned char), sizeof(peek), input) < sizeof(peek))
+    {
+        fprintf(kt_stderr, "Cannot read the package's payload: %s.\n", (ferror(input) ? strerror(errno) : "unexpected end of file"));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    munged = (fake_sign ? 0 : 1);
+    memcpy(prefix, peek, sizeof(peek));
+    if(munged)
+        dm(prefix, sizeof(peek));
+    prefix_len = sizeof(peek);
+    if(prefix[0] != 0x1F || prefix[1] != 0x8B)
+    {
+        memcpy(prefix, "\x1F\x8B\x08\x00", MAGIC_NUMBER_LENGTH);
+        memcpy(prefix + MAGIC_NUMBER_LENGTH, peek, sizeof(peek));
+        prefix_len = MAGIC_NUMBER_LENGTH + sizeof(peek);
+        munged = 0;
+    }
+
+    // Reuse the index machinery as a plain streaming inflater (the caller frees stream->points)
+    stream->span = UINT64_MAX;
+    return kt_index_read_open_prefixed(a, stream, input, munged, prefix, prefix_len);
+}
+
+// List the contents of a package, without writing anything anywhere
+int kindle_list(FILE *input, const unsigned int fake_sign, const KTInflateOptions *inflate, FILE *out)
+{
+    KTIndex stream;
+    struct archive *a;
+    struct archive_entry *entry;
+    char mode[11];
+    char name[PATH_MAX];
+    unsigned int num_entries = 0;
+    int64_t total_size = 0;
+    int r;
+    int ret = -1;
+
+    memset(&stream, 0, sizeof(stream));
+    if((a = archive_read_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if(kt_payload_read_open(a, &stream, input, fake_sign, inflate) < 0)
+        goto cleanup;
+
+    fprintf(kt_stderr, "\n");
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        num_entries++;
+        total_size += archive_entry_size(entry);
+
+        kt_mode_string((unsigned int) archive_entry_mode(entry), mode);
+        fprintf(out, "%s %12lld %s", mode, (long long) archive_entry_size(entry), archive_entry_pathname(entry));
+        if(archive_entry_hardlink(entry) != NULL)
+            fprintf(out, " link to %s", archive_entry_hardlink(entry));
+        else if(archive_entry_symlink(entry) != NULL)
+            fprintf(out, " -> %s", archive_entry_symlink(entry));
+        fprintf(out, "\n");
+
+        // Show what the index file says about the package's contents
+        kt_basename(archive_entry_pathname(entry), name, sizeof(name));
+        if(archive_entry_filetype(entry) == AE_IFREG && strcmp(name, INDEX_FILE_NAME) == 0)
+        {
+            if(kt_list_filelist(a, out) < 0)
+                goto cleanup;
+        }
+        else if(archive_read_data_skip(a) < ARCHIVE_WARN)
+        {
+            fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+    }
+    fprintf(kt_stderr, "\n%u entries, %lld bytes.\n", num_entries, (long long) total_size);
+    ret = 0;
+
+cleanup:
+    archive_read_free(a);
+    free(stream.points);
+
+    return ret;
+}
+
+int kindle_list_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "unsigned", no_argument, NULL, 'u' },
+        { "inflate-jobs", required_argument, NULL, 'z' },
+        { "speculative", no_argument, NULL, 'Z' },
+        { NULL, 0, NULL, 0 }
+    };
+    KTInflateOptions inflate = { 0, 0 };
+    unsigned int fake_sign = 0;
+    const char *in_name = "-";
+    FILE *input;
+    int ret;
+
+    while((opt = getopt_long(argc, argv, "uz:Z", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'u':
+                fake_sign = 1;
+                break;
+            case 'z':
+                if(parse_jobs(optarg, &inflate.jobs) < 0)
+                    return -1;
+                break;
+            case 'Z':
+                inflate.speculative = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    if(inflate.speculative && inflate.jobs == 0 && parse_jobs("0", &inflate.jobs) < 0)
+        return -1;
+
+    // One input at most, standard input if there's none
+    if(optind + 1 < argc)
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need at most one input).\n");
+        return -1;
+    }
+    if(optind < argc)
+        in_name = argv[optind];
+
+    if(strcmp(in_name, "-") == 0)
+        input = stdin;
+    else if((input = fopen(in_name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input '%s' for reading: %s.\n", in_name, strerror(errno));
+        return -1;
+    }
+    fprintf(kt_stderr, "Listing %s%s package '%s'.\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) || IS_TGZ(in_name) || IS_TARBALL(in_name) ? "userdata" : "update"), (input == stdin ? "standard input" : in_name));
+    ret = kindle_list(input, fake_sign, &inflate, stdout);
+    if(ret < 0)
+        fprintf(kt_stderr, "Error listing package '%s'.\n", (input == stdin ? "standard input" : in_name));
+    if(input != stdin)
+        fclose(input);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,114 @@
+//
+//  main.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+int main(int argc, char *argv[])
+{
+    const char *prog_name;
+    const char *cmd;
+
+    // The CLI simply runs everything in the default context (diagnostics to stderr).
+    // Do we want to use unknown devcodes? Very lame test, only check if the var actually exists, we don't check the value...
+    if(getenv("KT_WITH_UNKNOWN_DEVCODES") == NULL)
+        kt_with_unknown_devcodes = 0;
+    else
+        kt_with_unknown_devcodes = 1;
+
+    prog_name = argv[0];
+    // Discard program name for easier parsing
+    argv++;
+    argc--;
+
+    if(argc > 0)
+    {
+        if(strncmp(argv[0], "--", 2) == 0)
+        {
+            // Allow our commands to be passed in longform
+            argv[0] += 2;
+        }
+    }
+    else
+    {
+        // No command was given, print help and die
+        fprintf(stderr, "No command was specified!\n\n");
+        kindle_print_help(prog_name);
+        exit(1);
+    }
+    cmd = argv[0];
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    // Set binary mode properly on MingW, MSVCRT craps out when freopen'ing NULL ;)
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#else
+    if(freopen(NULL, "rb", stdin) == NULL)
+    {
+        fprintf(stderr, "Cannot set stdin to binary mode: %s.\n", strerror(errno));
+        return -1;
+    }
+    if(freopen(NULL, "wb", stdout) == NULL)
+    {
+        fprintf(stderr, "Cannot set stdout to binary mode: %s.\n", strerror(errno));
+        return -1;
+    }
+#endif
+
+    if(strncmp(cmd, "md", 2) == 0)
+        return kindle_obfuscate_main(argc, argv);
+    else if(strncmp(cmd, "dm", 2) == 0)
+        return kindle_deobfuscate_main(argc, argv);
+    else if(strncmp(cmd, "convert", 7) == 0)
+        return kindle_convert_main(argc, argv);
+    else if(strncmp(cmd, "extract", 7) == 0)
+        return kindle_extract_main(argc, argv);
+    else if(strncmp(cmd, "create", 6) == 0)
+        return kindle_create_main(argc, argv);
+    else if(strncmp(cmd, "patch", 5) == 0)
+        return kindle_patch_main(argc, argv);
+    else if(strncmp(cmd, "retarget", 8) == 0)
+        return kindle_retarget_main(argc, argv);
+    else if(strncmp(cmd, "recompress", 10) == 0)
+        return kindle_recompress_main(argc, argv);
+    else if(strncmp(cmd, "mount", 5) == 0)
+        return kindle_mount_main(argc, argv);
+    else if(strncmp(cmd, "info", 4) == 0)
+        return kindle_info_main(argc, argv);
+    else if(strncmp(cmd, "list", 4) == 0)
+        return kindle_list_main(argc, argv);
+    else if(strncmp(cmd, "verify", 6) == 0)
+        return kindle_verify_main(argc, argv);
+    else if(strncmp(cmd, "scan", 4) == 0)
+        return kindle_scan_main(argc, argv);
+    else if(strncmp(cmd, "version", 7) == 0)
+        return kindle_print_version(prog_name);
+    else if(strncmp(cmd, "help", 4) == 0 || strncmp(cmd, "-help", 5) == 0 || strncmp(cmd, "-h", 2) == 0 || strncmp(cmd, "-?", 2) == 0 || strncmp(cmd, "/?", 2) == 0 || strncmp(cmd, "/h", 2) == 0 || strncmp(cmd, "/help", 2) == 0)
+        return kindle_print_help(prog_name);
+    else
+    {
+        fprintf(stderr, "Unknown command '%s'!\n\n", cmd);
+        kindle_print_help(prog_name);
+        exit(1);
+    }
+
+    return 1;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,764 @@
+//
+//  mount.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Mount a package read-only, through FUSE (build with FUSE=true, cf. COMPILING).
+// The payload is scanned once when we mount it: that gives us the directory tree, where the contents of every file start in the tarball,
+// and the checkpoints of a random access index (cf. index.c). Reads then demunge & inflate from the closest checkpoint,
+// in blocks that we keep in an LRU cache, and a read that follows the previous one just keeps inflating from where it stopped.
+
+#ifdef KT_WITH_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+
+#define KT_MOUNT_BLOCK_SIZE (128 * 1024)                // Uncompressed bytes per cached block
+#define KT_MOUNT_CACHE_SIZE (64 * 1024 * 1024)          // Default size of the cache
+#define KT_MOUNT_NONE UINT32_MAX
+
+struct kt_mount_node
+{
+    char *path;                 // Normalized (no leading or trailing slash), empty for the root
+    const char *name;           // Last component of path
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+    char *link;                 // Symlink target
+    uint32_t hardlink;          // Node this one is a hardlink to (KT_MOUNT_NONE otherwise)
+    uint64_t data;              // Offset of the contents in the uncompressed tarball
+    uint32_t nlink;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t last_child;
+    uint32_t next_sibling;
+};
+
+struct kt_mount_block
+{
+    uint32_t node;
+    uint64_t index;
+    unsigned char *data;
+    uint32_t prev;              // LRU list, most recently used first
+    uint32_t next;
+    uint32_t chain;             // Next block in the same bucket
+};
+
+struct kt_mount
+{
+    FILE *bin;
+    KTIndex *idx;
+    struct kt_mount_node *nodes;
+    uint32_t num_nodes;
+    KTHashTable index;          // Of the nodes, by path
+    struct kt_mount_block *blocks;
+    uint32_t num_blocks;
+    uint32_t used_blocks;
+    uint32_t *buckets;          // Hash table of the blocks, by node & index
+    uint32_t bucket_mask;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    struct archive *stream;     // What we inflated the last block with, in case the next read follows it
+    uint32_t stream_node;
+    uint64_t stream_next;
+    uid_t uid;
+    gid_t gid;
+};
+
+static size_t kt_mount_hash(void *arg, size_t index)
+{
+    const struct kt_mount *m = arg;
+
+    return kt_hash_path(m->nodes[index].path, strlen(m->nodes[index].path));
+}
+
+static int kt_mount_match(void *arg, size_t index, const void *path, size_t len)
+{
+    const struct kt_mount *m = arg;
+
+    return strncmp(m->nodes[index].path, path, len) == 0 && m->nodes[index].path[len] == '\0';
+}
+
+static uint32_t kt_mount_lookup(const struct kt_mount *m, const char *path, size_t len)
+{
+    size_t n;
+
+    if((n = kt_hash_table_find(&m->index, kt_hash_path(path, len), path, len)) == KT_HASH_NONE)
+        return KT_MOUNT_NONE;
+    return (uint32_t) n;
+}
+
+// Find a node, creating it (& the directories leading to it, which tarballs don't always bother with) if need be
+static uint32_t kt_mount_add(struct kt_mount *m, const char *path, size_t len, int64_t mtime)
+{
+    struct kt_mount_node *nodes;
+    struct kt_mount_node *node;
+    const char *slash;
+    uint32_t parent = KT_MOUNT_NONE;
+    uint32_t n;
+
+    if((n = kt_mount_lookup(m, path, len)) != KT_MOUNT_NONE)
+        return n;
+    if(len > 0)
+    {
+        for(slash = path + len; slash > path && slash[-1] != '/'; slash--)
+            ;
+        if((parent = kt_mount_add(m, path, (slash > path ? (size_t) (slash - 1 - path) : 0), mtime)) == KT_MOUNT_NONE)
+            return KT_MOUNT_NONE;
+    }
+    if((nodes = realloc(m->nodes, (m->num_nodes + 1) * sizeof(*nodes))) == NULL)
+        return KT_MOUNT_NONE;
+    m->nodes = nodes;
+    n = m->num_nodes;
+    node = &m->nodes[n];
+    memset(node, 0, sizeof(*node));
+    if((node->path = malloc(len + 1)) == NULL)
+        return KT_MOUNT_NONE;
+    memcpy(node->path, path, len);
+    node->path[len] = '\0';
+    node->name = strrchr(node->path, '/');
+    node->name = (node->name != NULL ? node->name + 1 : node->path);
+    node->mode = S_IFDIR | 0755;
+    node->mtime = mtime;
+    node->hardlink = KT_MOUNT_NONE;
+    node->nlink = 1;
+    node->parent = parent;
+    node->first_child = KT_MOUNT_NONE;
+    node->last_child = KT_MOUNT_NONE;
+    node->next_sibling = KT_MOUNT_NONE;
+    if(kt_hash_table_insert(&m->index, n) < 0)
+    {
+        free(node->path);
+        return KT_MOUNT_NONE;
+    }
+    m->num_nodes++;
+    // Keep the tarball's order
+    if(parent != KT_MOUNT_NONE)
+    {
+        if(m->nodes[parent].last_child == KT_MOUNT_NONE)
+            m->nodes[parent].first_child = n;
+        else
+            m->nodes[m->nodes[parent].last_child].next_sibling = n;
+        m->nodes[parent].last_child = n;
+    }
+
+    return n;
+}
+
+// Read the whole payload once: build the tree, and the checkpoints we'll inflate from
+static int kt_mount_scan(struct kt_mount *m, const unsigned int fake_sign)
+{
+    struct archive *a = NULL;
+    struct archive_entry *entry;
+    struct kt_mount_node *node;
+    const char *path;
+    size_t len;
+    int64_t pos;
+    uint32_t pending = KT_MOUNT_NONE;
+    uint32_t link;
+    uint32_t n;
+    uint32_t num_entries = 0;
+    struct stat st;
+    int r;
+    int ret = -1;
+
+    if((m->idx = kt_index_probe(m->bin, fake_sign)) == NULL)
+        return -1;
+    if(fseeko(m->bin, (off_t) m->idx->payload_offset, SEEK_SET) != 0)
+    {
+        fprintf(kt_stderr, "Cannot seek in package: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    fstat(fileno(m->bin), &st);
+    if(kt_mount_add(m, "", 0, (int64_t) st.st_mtime) == KT_MOUNT_NONE)
+        goto nomem;
+
+    a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(kt_index_read_open(a, m->idx, m->bin, m->idx->munged) < 0)
+        goto cleanup;
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        // The contents of the previous file are padded to a block right before this header
+        pos = archive_read_header_position(a);
+        if(pending != KT_MOUNT_NONE)
+        {
+            m->nodes[pending].data = (uint64_t) pos - ((m->nodes[pending].size + 511) & ~(uint64_t) 511);
+            pending = KT_MOUNT_NONE;
+        }
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        num_entries++;
+        path = kt_normalize_entry_path(archive_entry_pathname(entry), &len);
+        if(len > 0 && strcmp(path, KT_INDEX_SEEK_NAME) != 0)
+        {
+            if((n = kt_mount_add(m, path, len, (int64_t) archive_entry_mtime(entry))) == KT_MOUNT_NONE)
+                goto nomem;
+            node = &m->nodes[n];
+            link = KT_MOUNT_NONE;
+            if(archive_entry_hardlink(entry) != NULL)
+            {
+                path = kt_normalize_entry_path(archive_entry_hardlink(entry), &len);
+                link = kt_mount_lookup(m, path, len);
+            }
+            // Later entries win, like on extraction (but tar stores a file it's given twice as a hardlink to itself)
+            if(link != n)
+            {
+                free(node->link);
+                node->link = NULL;
+                node->hardlink = link;
+                node->mode = (uint32_t) archive_entry_mode(entry);
+                node->size = 0;
+                node->mtime = (int64_t) archive_entry_mtime(entry);
+                if(link == KT_MOUNT_NONE && archive_entry_symlink(entry) != NULL)
+                {
+                    if((node->link = strdup(archive_entry_symlink(entry))) == NULL)
+                        goto nomem;
+                    node->mode = S_IFLNK | 0777;
+                    node->size = strlen(node->link);
+                }
+                else if(link == KT_MOUNT_NONE && S_ISREG(node->mode))
+                {
+                    node->size = (uint64_t) archive_entry_size(entry);
+                    if(node->size > 0)
+                        pending = n;
+                }
+            }
+        }
+        if(archive_read_data_skip(a) < ARCHIVE_WARN)
+        {
+            fprintf(kt_stderr, "archive_read_data_skip() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+    }
+    // Hardlinks share everything with their target
+    for(n = 0; n < m->num_nodes; n++)
+    {
+        node = &m->nodes[n];
+        if(node->hardlink == KT_MOUNT_NONE || node->hardlink == n)
+            continue;
+        node->mode = m->nodes[node->hardlink].mode;
+        node->size = m->nodes[node->hardlink].size;
+        node->mtime = m->nodes[node->hardlink].mtime;
+        node->data = m->nodes[node->hardlink].data;
+        m->nodes[node->hardlink].nlink++;
+    }
+    for(n = 0; n < m->num_nodes; n++)
+    {
+        node = &m->nodes[n];
+        if(node->hardlink != KT_MOUNT_NONE && node->hardlink != n)
+            node->nlink = m->nodes[node->hardlink].nlink;
+    }
+    fprintf(kt_stderr, "Scanned %u entries (%u checkpoints).\n", num_entries, m->idx->num_points);
+    ret = 0;
+    goto cleanup;
+
+nomem:
+    fprintf(kt_stderr, "Cannot allocate the package's tree: %s.\n", strerror(errno));
+    kt_set_error(KT_ERR_NOMEM);
+cleanup:
+    if(a != NULL)
+        archive_read_free(a);
+
+    return ret;
+}
+
+static int kt_mount_cache_init(struct kt_mount *m, uint64_t cache_size)
+{
+    uint32_t i;
+
+    m->num_blocks = (uint32_t) (cache_size / KT_MOUNT_BLOCK_SIZE > UINT16_MAX ? UINT16_MAX : cache_size / KT_MOUNT_BLOCK_SIZE);
+    if(m->num_blocks < 2)
+        m->num_blocks = 2;
+    for(m->bucket_mask = 1; m->bucket_mask < m->num_blocks * 2; m->bucket_mask <<= 1)
+        ;
+    if((m->blocks = calloc(m->num_blocks, sizeof(*m->blocks))) == NULL || (m->buckets = malloc(m->bucket_mask * sizeof(*m->buckets))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate the block cache: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    for(i = 0; i < m->bucket_mask; i++)
+        m->buckets[i] = KT_MOUNT_NONE;
+    m->bucket_mask--;
+    m->lru_head = KT_MOUNT_NONE;
+    m->lru_tail = KT_MOUNT_NONE;
+
+    return 0;
+}
+
+static uint32_t kt_mount_bucket(const struct kt_mount *m, uint32_t node, uint64_t index)
+{
+    return (uint32_t) ((node * 2654435761U) ^ (uint32_t) (index * 40503U) ^ (uint32_t) (index >> 32)) & m->bucket_mask;
+}
+
+static void kt_mount_lru_unlink(struct kt_mount *m, uint32_t b)
+{
+    struct kt_mount_block *block = &m->blocks[b];
+
+    if(block->prev != KT_MOUNT_NONE)
+        m->blocks[block->prev].next = block->next;
+    else
+        m->lru_head = block->next;
+    if(block->next != KT_MOUNT_NONE)
+        m->blocks[block->next].prev = block->prev;
+    else
+        m->lru_tail = block->prev;
+}
+
+static void kt_mount_lru_push(struct kt_mount *m, uint32_t b)
+{
+    m->blocks[b].prev = KT_MOUNT_NONE;
+    m->blocks[b].next = m->lru_head;
+    if(m->lru_head != KT_MOUNT_NONE)
+        m->blocks[m->lru_head].prev = b;
+    m->lru_head = b;
+    if(m->lru_tail == KT_MOUNT_NONE)
+        m->lru_tail = b;
+}
+
+static uint32_t kt_mount_cache_find(struct kt_mount *m, uint32_t node, uint64_t index)
+{
+    uint32_t b;
+
+    for(b = m->buckets[kt_mount_bucket(m, node, index)]; b != KT_MOUNT_NONE; b = m->blocks[b].chain)
+    {
+        if(m->blocks[b].node == node && m->blocks[b].index == index)
+        {
+            kt_mount_lru_unlink(m, b);
+            kt_mount_lru_push(m, b);
+            return b;
+        }
+    }
+
+    return KT_MOUNT_NONE;
+}
+
+// A block for node's index-th block of contents, the least recently used one if the cache is full
+static uint32_t kt_mount_cache_take(struct kt_mount *m, uint32_t node, uint64_t index)
+{
+    uint32_t *link;
+    uint32_t b;
+
+    if((b = kt_mount_cache_find(m, node, index)) != KT_MOUNT_NONE)
+        return b;
+    if(m->used_blocks < m->num_blocks)
+    {
+        b = m->used_blocks;
+        if((m->blocks[b].data = malloc(KT_MOUNT_BLOCK_SIZE)) == NULL)
+            return KT_MOUNT_NONE;
+        m->used_blocks++;
+    }
+    else
+    {
+        b = m->lru_tail;
+        kt_mount_lru_unlink(m, b);
+        for(link = &m->buckets[kt_mount_bucket(m, m->blocks[b].node, m->blocks[b].index)]; *link != b; link = &m->blocks[*link].chain)
+            ;
+        *link = m->blocks[b].chain;
+    }
+    m->blocks[b].node = node;
+    m->blocks[b].index = index;
+    m->blocks[b].chain = m->buckets[kt_mount_bucket(m, node, index)];
+    m->buckets[kt_mount_bucket(m, node, index)] = b;
+    kt_mount_lru_push(m, b);
+
+    return b;
+}
+
+static void kt_mount_stream_close(struct kt_mount *m)
+{
+    if(m->stream != NULL)
+        archive_read_free(m->stream);
+    m->stream = NULL;
+}
+
+// Inflate node's index-th block into the cache (and the ones before it, if we had to start from further back). Returns a negative errno on failure.
+static int kt_mount_fill(struct kt_mount *m, uint32_t node, uint64_t index, uint32_t *block)
+{
+    const struct kt_mount_node *n = &m->nodes[node];
+    struct archive_entry *entry;
+    unsigned char *p;
+    size_t len;
+    size_t done;
+    ssize_t count;
+    uint32_t b;
+
+    // Starting over from the closest checkpoint is cheaper than inflating our way through more than a span
+    if(m->stream == NULL || m->stream_node != node || m->stream_next > index || (index - m->stream_next) * KT_MOUNT_BLOCK_SIZE > m->idx->span)
+    {
+        kt_mount_stream_close(m);
+        if((m->stream = archive_read_new()) == NULL)
+            return -ENOMEM;
+        archive_read_support_format_raw(m->stream);
+        if(kt_index_read_open_at(m->stream, m->idx, m->bin, n->data + index * KT_MOUNT_BLOCK_SIZE) < 0 || archive_read_next_header(m->stream, &entry) != ARCHIVE_OK)
+        {
+            kt_mount_stream_close(m);
+            return -EIO;
+        }
+        m->stream_node = node;
+        m->stream_next = index;
+    }
+    while(m->stream_next <= index)
+    {
+        if((b = kt_mount_cache_take(m, node, m->stream_next)) == KT_MOUNT_NONE)
+        {
+            kt_mount_stream_close(m);
+            return -ENOMEM;
+        }
+        p = m->blocks[b].data;
+        len = (n->size - m->stream_next * KT_MOUNT_BLOCK_SIZE < KT_MOUNT_BLOCK_SIZE ? (size_t) (n->size - m->stream_next * KT_MOUNT_BLOCK_SIZE) : KT_MOUNT_BLOCK_SIZE);
+        for(done = 0; done < len; done += (size_t) count)
+        {
+            if((count = archive_read_data(m->stream, p + done, len - done)) <= 0)
+            {
+                // Don't keep a block we couldn't fill
+                m->blocks[b].node = KT_MOUNT_NONE;
+                kt_mount_stream_close(m);
+                return -EIO;
+            }
+        }
+        m->stream_next++;
+        *block = b;
+    }
+    // The padding up to the next block, if we were to follow up with another file
+    if(m->stream_next * KT_MOUNT_BLOCK_SIZE >= n->size)
+        kt_mount_stream_close(m);
+
+    return 0;
+}
+
+static struct kt_mount *kt_mount_current(void)
+{
+    return fuse_get_context()->private_data;
+}
+
+static uint32_t kt_mount_find(const struct kt_mount *m, const char *path)
+{
+    size_t len;
+
+    path = kt_normalize_entry_path(path, &len);
+    return kt_mount_lookup(m, path, len);
+}
+
+static void kt_mount_stat(const struct kt_mount *m, const struct kt_mount_node *n, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = (ino_t) (n - m->nodes) + 1;
+    st->st_mode = (mode_t) n->mode;
+    st->st_nlink = (S_ISDIR(n->mode) ? 2 : n->nlink);
+    st->st_uid = m->uid;
+    st->st_gid = m->gid;
+    st->st_size = (off_t) n->size;
+    st->st_blksize = KT_MOUNT_BLOCK_SIZE;
+    st->st_blocks = (blkcnt_t) ((n->size + 511) / 512);
+    st->st_mtime = (time_t) n->mtime;
+    st->st_ctime = (time_t) n->mtime;
+    st->st_atime = (time_t) n->mtime;
+}
+
+static void *kt_mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void) conn;
+    // Nothing ever changes under us
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = 3600;
+    cfg->attr_timeout = 3600;
+    cfg->negative_timeout = 3600;
+
+    return kt_mount_current();
+}
+
+static int kt_mount_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    struct kt_mount *m = kt_mount_current();
+    uint32_t n;
+
+    (void) fi;
+    if((n = kt_mount_find(m, path)) == KT_MOUNT_NONE)
+        return -ENOENT;
+    kt_mount_stat(m, &m->nodes[n], st);
+
+    return 0;
+}
+
+static int kt_mount_readlink(const char *path, char *buf, size_t size)
+{
+    struct kt_mount *m = kt_mount_current();
+    uint32_t n;
+
+    if((n = kt_mount_find(m, path)) == KT_MOUNT_NONE)
+        return -ENOENT;
+    if(m->nodes[n].link == NULL)
+        return -EINVAL;
+    if(size == 0)
+        return -EINVAL;
+    strncpy(buf, m->nodes[n].link, size - 1);
+    buf[size - 1] = '\0';
+
+    return 0;
+}
+
+static int kt_mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    struct kt_mount *m = kt_mount_current();
+    struct stat st;
+    uint32_t n;
+    uint32_t c;
+
+    (void) offset;
+    (void) fi;
+    (void) flags;
+    if((n = kt_mount_find(m, path)) == KT_MOUNT_NONE)
+        return -ENOENT;
+    if(!S_ISDIR(m->nodes[n].mode))
+        return -ENOTDIR;
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for(c = m->nodes[n].first_child; c != KT_MOUNT_NONE; c = m->nodes[c].next_sibling)
+    {
+        kt_mount_stat(m, &m->nodes[c], &st);
+        if(filler(buf, m->nodes[c].name, &st, 0, 0) != 0)
+            break;
+    }
+
+    return 0;
+}
+
+static int kt_mount_open(const char *path, struct fuse_file_info *fi)
+{
+    struct kt_mount *m = kt_mount_current();
+    uint32_t n;
+
+    if((n = kt_mount_find(m, path)) == KT_MOUNT_NONE)
+        return -ENOENT;
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+    if(S_ISDIR(m->nodes[n].mode))
+        return -EISDIR;
+    fi->fh = n;
+    fi->keep_cache = 1;
+
+    return 0;
+}
+
+static int kt_mount_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct kt_mount *m = kt_mount_current();
+    const struct kt_mount_node *n;
+    uint64_t pos;
+    uint64_t index;
+    size_t done = 0;
+    size_t len;
+    uint32_t b;
+    int r;
+
+    (void) path;
+    n = &m->nodes[fi->fh];
+    if(offset < 0 || (uint64_t) offset >= n->size)
+        return 0;
+    if(size > n->size - (uint64_t) offset)
+        size = (size_t) (n->size - (uint64_t) offset);
+    if(size > INT_MAX)
+        size = INT_MAX;
+    while(done < size)
+    {
+        pos = (uint64_t) offset + done;
+        index = pos / KT_MOUNT_BLOCK_SIZE;
+        if((b = kt_mount_cache_find(m, (uint32_t) fi->fh, index)) == KT_MOUNT_NONE && (r = kt_mount_fill(m, (uint32_t) fi->fh, index, &b)) < 0)
+            return (done > 0 ? (int) done : r);
+        len = KT_MOUNT_BLOCK_SIZE - (size_t) (pos % KT_MOUNT_BLOCK_SIZE);
+        if(len > size - done)
+            len = size - done;
+        memcpy(buf + done, m->blocks[b].data + pos % KT_MOUNT_BLOCK_SIZE, len);
+        done += len;
+    }
+
+    return (int) done;
+}
+
+static int kt_mount_statfs(const char *path, struct statvfs *st)
+{
+    struct kt_mount *m = kt_mount_current();
+
+    (void) path;
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = 512;
+    st->f_frsize = 512;
+    st->f_blocks = (fsblkcnt_t) ((m->idx->bin_size + 511) / 512);
+    st->f_files = m->num_nodes;
+    st->f_namemax = 255;
+
+    return 0;
+}
+
+static const struct fuse_operations kt_mount_ops =
+{
+    .init = kt_mount_init,
+    .getattr = kt_mount_getattr,
+    .readlink = kt_mount_readlink,
+    .readdir = kt_mount_readdir,
+    .open = kt_mount_open,
+    .read = kt_mount_read,
+    .statfs = kt_mount_statfs,
+};
+
+static void kt_mount_free(struct kt_mount *m)
+{
+    uint32_t i;
+
+    kt_mount_stream_close(m);
+    for(i = 0; i < m->num_nodes; i++)
+    {
+        free(m->nodes[i].path);
+        free(m->nodes[i].link);
+    }
+    free(m->nodes);
+    kt_hash_table_free(&m->index);
+    for(i = 0; i < m->used_blocks; i++)
+        free(m->blocks[i].data);
+    free(m->blocks);
+    free(m->buckets);
+    kt_index_free(m->idx);
+}
+#endif
+
+int kindle_mount_main(int argc, char *argv[])
+{
+#ifdef KT_WITH_FUSE
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "unsigned", no_argument, NULL, 'u' },
+        { "cache", required_argument, NULL, 'c' },
+        { "foreground", no_argument, NULL, 'f' },
+        { "options", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct kt_mount m;
+    unsigned int fake_sign = 0;
+    unsigned int foreground = 0;
+    uint64_t cache_size = KT_MOUNT_CACHE_SIZE;
+    char *fuse_opts = NULL;
+    char *fuse_argv[8];
+    int fuse_argc = 0;
+    char *bin_filename;
+    char *mountpoint;
+    int ret = -1;
+
+    memset(&m, 0, sizeof(m));
+    kt_hash_table_init(&m.index, kt_mount_hash, kt_mount_match, &m);
+    while((opt = getopt_long(argc, argv, "uc:fo:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'u':
+                fake_sign = 1;
+                break;
+            case 'c':
+                if(parse_size(optarg, &cache_size) < 0)
+                    return -1;
+                break;
+            case 'f':
+                foreground = 1;
+                break;
+            case 'o':
+                fuse_opts = optarg;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    if(optind + 2 != argc)
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need input & mountpoint).\n");
+        return -1;
+    }
+    bin_filename = argv[optind];
+    mountpoint = argv[optind + 1];
+
+    if((m.bin = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input package '%s': %s.\n", bin_filename, strerror(errno));
+        return -1;
+    }
+    fprintf(kt_stderr, "Mounting %spackage '%s' on '%s'.\n", (fake_sign ? "fake " : ""), bin_filename, mountpoint);
+    if(kt_mount_scan(&m, fake_sign) < 0 || kt_mount_cache_init(&m, cache_size) < 0)
+    {
+        fprintf(kt_stderr, "Error scanning package '%s'.\n", bin_filename);
+        goto cleanup;
+    }
+    m.uid = getuid();
+    m.gid = getgid();
+
+    // Single-threaded: the cache & the stream we keep around aren't shared
+    fuse_argv[fuse_argc++] = argv[0];
+    fuse_argv[fuse_argc++] = mountpoint;
+    fuse_argv[fuse_argc++] = "-s";
+    fuse_argv[fuse_argc++] = "-oro,default_permissions,fsname=kindletool,subtype=kindletool";
+    if(foreground)
+        fuse_argv[fuse_argc++] = "-f";
+    if(fuse_opts != NULL)
+    {
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = fuse_opts;
+    }
+    fuse_argv[fuse_argc] = NULL;
+    if(fuse_main(fuse_argc, fuse_argv, &kt_mount_ops, &m) != 0)
+        fprintf(kt_stderr, "Error mounting package '%s' on '%s'.\n", bin_filename, mountpoint);
+    else
+        ret = 0;
+
+cleanup:
+    kt_mount_free(&m);
+    fclose(m.bin);
+
+    return ret;
+#else
+    (void) argc;
+    (void) argv;
+    fprintf(kt_stderr, "This KindleTool was built without FUSE support, it can't mount packages (build it with FUSE=true).\n");
+    return -1;
+#endif
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
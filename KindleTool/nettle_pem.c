@@ -46,7 +46,7 @@ static int read_line(struct nettle_buffer *buffer, FILE *f)
     }
     if(ferror(f))
     {
-        fprintf(stderr, "Read failed: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Read failed: %s.\n", strerror(errno));
         return 0;
     }
 
@@ -64,7 +64,7 @@ static int read_file(struct nettle_buffer *buffer, FILE *f)
 
     if(ferror(f))
     {
-        fprintf(stderr, "Read failed: %s.\n", strerror(errno));
+        fprintf(kt_stderr, "Read failed: %s.\n", strerror(errno));
         return 0;
     }
     else
@@ -167,7 +167,7 @@ static int read_pem(struct nettle_buffer *buffer, FILE *f, struct pem_info *info
             case 0:
                 break;
             case -1:
-                fprintf(stderr, "PEM END line doesn't match BEGIN.\n");
+                fprintf(kt_stderr, "PEM END line doesn't match BEGIN.\n");
                 return 0;
             case 1:
                 /* Return base 64 data; let caller do the decoding */
@@ -188,56 +188,130 @@ static int decode_base64(struct nettle_buffer *buffer, size_t start, size_t *len
         return 1;
     else
     {
-        fprintf(stderr, "Invalid base64 data.\n");
+        fprintf(kt_stderr, "Invalid base64 data.\n");
         return 0;
     }
 }
 
-static int convert_rsa_private_key(struct nettle_buffer *buffer, size_t length, const uint8_t *data, struct rsa_private_key *rsa_pkey)
+static int convert_rsa_private_key(struct nettle_buffer *buffer, size_t length, const uint8_t *data, struct rsa_public_key *rsa_pubkey, struct rsa_private_key *rsa_pkey)
 {
     struct rsa_public_key pub;
+    struct rsa_private_key priv;
     int res;
 
     // NOTE: Unlike rsa_keypair_from_sexp, we *HAVE* to init the pubkey too, or everything blows up, the from_der codepath expects it to be setup...
     rsa_public_key_init(&pub);
+    rsa_private_key_init(&priv);
 
-    if(rsa_keypair_from_der(&pub, rsa_pkey, 0, length, data))
+    // We might only be after the public half of the pair
+    if(rsa_keypair_from_der(rsa_pubkey ? rsa_pubkey : &pub, rsa_pkey ? rsa_pkey : &priv, 0, length, data))
     {
         nettle_buffer_reset(buffer);
         res = 1;
     }
     else
     {
-        fprintf(stderr, "Invalid PKCS#1 private key.\n");
+        fprintf(kt_stderr, "Invalid PKCS#1 private key.\n");
         res = 0;
     }
 
     rsa_public_key_clear(&pub);
+    rsa_private_key_clear(&priv);
 
     return res;
 }
 
+static int convert_rsa_public_key(struct nettle_buffer *buffer, size_t length, const uint8_t *data, struct rsa_public_key *rsa_pubkey)
+{
+    if(rsa_keypair_from_der(rsa_pubkey, NULL, 0, length, data))
+    {
+        nettle_buffer_reset(buffer);
+        return 1;
+    }
+    else
+    {
+        fprintf(kt_stderr, "Invalid PKCS#1 public key.\n");
+        return 0;
+    }
+}
+
+static int convert_public_key(struct nettle_buffer *buffer, size_t length, const uint8_t *data, struct rsa_public_key *rsa_pubkey)
+{
+    /* SubjectPublicKeyInfo ::= SEQUENCE {
+           algorithm            AlgorithmIdentifier,
+           subjectPublicKey     BIT STRING
+       }
+       AlgorithmIdentifier ::= SEQUENCE {
+           algorithm            OBJECT IDENTIFIER,
+           parameters           OPTIONAL
+       }
+    */
+    struct asn1_der_iterator i;
+    struct asn1_der_iterator j;
+    /* rsaEncryption OBJECT IDENTIFIER ::= { pkcs-1 1 } */
+    static const uint8_t id_rsaEncryption[9] = { 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01 };
+
+    if(asn1_der_iterator_first(&i, length, data) == ASN1_ITERATOR_CONSTRUCTED && i.type == ASN1_SEQUENCE && asn1_der_decode_constructed_last(&i) == ASN1_ITERATOR_CONSTRUCTED && i.type == ASN1_SEQUENCE
+       /* Use the j iterator to parse the algorithm identifier */
+       && asn1_der_decode_constructed(&i, &j) == ASN1_ITERATOR_PRIMITIVE && j.type == ASN1_IDENTIFIER && asn1_der_iterator_next(&i) == ASN1_ITERATOR_PRIMITIVE && i.type == ASN1_BITSTRING
+       /* Use i to parse the object wrapped in the bit string */
+       && asn1_der_decode_bitstring_last(&i))
+    {
+        if(j.length != sizeof(id_rsaEncryption) || memcmp(j.data, id_rsaEncryption, sizeof(id_rsaEncryption)) != 0)
+        {
+            fprintf(kt_stderr, "Unsupported public key algorithm!\n");
+            return -1;
+        }
+        /* When rsaEncryption is used in an AlgorithmIdentifier the parameters MUST be present and MUST be NULL */
+        if(asn1_der_iterator_next(&j) == ASN1_ITERATOR_PRIMITIVE && j.type == ASN1_NULL && j.length == 0 && asn1_der_iterator_next(&j) == ASN1_ITERATOR_END && rsa_public_key_from_der_iterator(rsa_pubkey, 0, &i))
+        {
+            nettle_buffer_reset(buffer);
+            return 1;
+        }
+    }
+    fprintf(kt_stderr, "Invalid SubjectPublicKeyInfo.\n");
+    return 0;
+}
+
 // NOTE: Destroys contents of buffer
-// Returns 1 on success, 0 on error, and -1 for unsupported algorithms.
-static int convert_type(struct nettle_buffer *buffer, enum object_type type, size_t length, const uint8_t *data, struct rsa_private_key *rsa_pkey)
+// Returns 1 on success, 0 on error, and -1 for unsupported algorithms (or for a key type that doesn't give us what we asked for).
+static int convert_type(struct nettle_buffer *buffer, enum object_type type, size_t length, const uint8_t *data, struct rsa_public_key *rsa_pubkey, struct rsa_private_key *rsa_pkey)
 {
     int res;
 
     switch(type)
     {
         default:
-            fprintf(stderr, "Unsupported key type!\n");
+            fprintf(kt_stderr, "Unsupported key type!\n");
             return -1;
 
         case RSA_PRIVATE_KEY:
-            res = convert_rsa_private_key(buffer, length, data, rsa_pkey);
+            res = convert_rsa_private_key(buffer, length, data, rsa_pubkey, rsa_pkey);
+            break;
+
+        case RSA_PUBLIC_KEY:
+            if(rsa_pubkey == NULL)
+            {
+                fprintf(kt_stderr, "Expected a private key, not a public key!\n");
+                return -1;
+            }
+            res = convert_rsa_public_key(buffer, length, data, rsa_pubkey);
+            break;
+
+        case GENERAL_PUBLIC_KEY:
+            if(rsa_pubkey == NULL)
+            {
+                fprintf(kt_stderr, "Expected a private key, not a public key!\n");
+                return -1;
+            }
+            res = convert_public_key(buffer, length, data, rsa_pubkey);
             break;
     }
 
     return res;
 }
 
-static int load_pem(struct nettle_buffer *buffer, FILE *f, struct rsa_private_key *rsa_pkey, enum object_type type, int base64)
+static int load_pem(struct nettle_buffer *buffer, FILE *f, struct rsa_public_key *rsa_pubkey, struct rsa_private_key *rsa_pkey, enum object_type type, int base64)
 {
     if(type)
     {
@@ -245,7 +319,7 @@ static int load_pem(struct nettle_buffer *buffer, FILE *f, struct rsa_private_ke
         if(base64 && !decode_base64(buffer, 0, &buffer->size))
             return 0;
 
-        if(convert_type(buffer, type, buffer->size, buffer->contents, rsa_pkey) != 1)
+        if(convert_type(buffer, type, buffer->size, buffer->contents, rsa_pubkey, rsa_pkey) != 1)
             return 0;
 
         return 1;
@@ -272,7 +346,7 @@ static int load_pem(struct nettle_buffer *buffer, FILE *f, struct rsa_private_ke
 
             if(!decode_base64(buffer, info.data_start, &info.data_length))
             {
-                fprintf(stderr, "decode_base64 failed!\n");
+                fprintf(kt_stderr, "decode_base64 failed!\n");
                 return 0;
             }
 
@@ -308,11 +382,11 @@ static int load_pem(struct nettle_buffer *buffer, FILE *f, struct rsa_private_ke
             }
 
             if(!type)
-                fprintf(stderr, "Ignoring unsupported object type `%s'.\n", marker);
+                fprintf(kt_stderr, "Ignoring unsupported object type `%s'.\n", marker);
 
-            else if(convert_type(buffer, type, info.data_length, buffer->contents + info.data_start, rsa_pkey) != 1)
+            else if(convert_type(buffer, type, info.data_length, buffer->contents + info.data_start, rsa_pubkey, rsa_pkey) != 1)
             {
-                fprintf(stderr, "convert_type failed!\n");
+                fprintf(kt_stderr, "convert_type failed!\n");
                 return 0;
             }
         }
@@ -332,13 +406,13 @@ int nettle_rsa_privkey_from_pem(char *pem_filename, struct rsa_private_key *rsa_
     FILE *f = fopen(pem_filename, mode);
     if(!f)
     {
-        fprintf(stderr, "Failed to open `%s': %s.\n", pem_filename, strerror(errno));
+        fprintf(kt_stderr, "Failed to open `%s': %s.\n", pem_filename, strerror(errno));
         return EXIT_FAILURE;
     }
 
-    if(!load_pem(&buffer, f, rsa_pkey, type, base64))
+    if(!load_pem(&buffer, f, NULL, rsa_pkey, type, base64))
     {
-        fprintf(stderr, "load_pem failed!\n");
+        fprintf(kt_stderr, "load_pem failed!\n");
         return EXIT_FAILURE;
     }
 
@@ -348,4 +422,39 @@ int nettle_rsa_privkey_from_pem(char *pem_filename, struct rsa_private_key *rsa_
     return EXIT_SUCCESS;
 }
 
+// Same thing, but we're only after a public key (which may also come from a private key, or from an X.509 SubjectPublicKeyInfo)
+int nettle_rsa_pubkey_from_pem(char *pem_filename, struct rsa_public_key *rsa_pubkey)
+{
+    struct nettle_buffer buffer;
+    FILE *f;
+    int ret = EXIT_SUCCESS;
+
+    nettle_buffer_init_realloc(&buffer, NULL, nettle_xrealloc);
+
+    f = fopen(pem_filename, "rb");
+    if(!f)
+    {
+        fprintf(kt_stderr, "Failed to open `%s': %s.\n", pem_filename, strerror(errno));
+        nettle_buffer_clear(&buffer);
+        return EXIT_FAILURE;
+    }
+
+    if(!load_pem(&buffer, f, rsa_pubkey, NULL, 0, 0))
+    {
+        fprintf(kt_stderr, "load_pem failed!\n");
+        ret = EXIT_FAILURE;
+    }
+    // An empty (or keyless) file leaves us with an empty key
+    else if(rsa_pubkey->size == 0)
+    {
+        fprintf(kt_stderr, "No RSA key found in `%s'.\n", pem_filename);
+        ret = EXIT_FAILURE;
+    }
+
+    fclose(f);
+    nettle_buffer_clear(&buffer);
+
+    return ret;
+}
+
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,938 @@
+//
+//  patch.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Add, replace or remove a few files in an existing package, instead of going through a full extract & create cycle.
+// The tar members we don't touch are copied across as-is, and so are their signatures & their update-filelist.dat records,
+// so only the new files & the bundle index get hashed and signed (plus the envelope, if there's one).
+// The payload still has to be inflated & deflated again, but that's the cheap part next to an RSA signature per file.
+
+// A file we were asked to add
+struct kt_patch_file
+{
+    const char *source;         // Where it is on disk
+    const char *name;           // Where it goes in the package
+    struct stat st;
+    char md5[MD5_HASH_LENGTH + 1];
+    unsigned char *sig;
+    size_t sig_size;
+    int written;                // Over an existing entry
+    int sig_written;
+    int listed;                 // Over an existing update-filelist.dat record
+};
+
+struct kt_patch
+{
+    PatchOptions *opts;
+    unsigned int real_blocksize;
+    struct kt_patch_file *files;
+    unsigned int num_files;
+    char *filelist;             // The original update-filelist.dat
+    size_t filelist_size;
+    unsigned char buff[BUFFER_SIZE];
+    unsigned int num_kept;
+    unsigned int num_replaced;
+    unsigned int num_added;
+    unsigned int num_removed;
+    unsigned char *remove_hits; // Which of the --remove paths matched something
+};
+
+// Entries are compared as kt_normalize_entry_path sees them (name is the first len bytes)
+static struct kt_patch_file *kt_patch_find(struct kt_patch *patch, const char *name, size_t len)
+{
+    unsigned int i;
+
+    for(i = 0; i < patch->num_files; i++)
+    {
+        if(strncmp(patch->files[i].name, name, len) == 0 && patch->files[i].name[len] == '\0')
+            return &patch->files[i];
+    }
+    return NULL;
+}
+
+// The signature of an added file
+static struct kt_patch_file *kt_patch_find_sig(struct kt_patch *patch, const char *name)
+{
+    size_t len = strlen(name);
+    unsigned int i;
+
+    if(len <= 4 || strcasecmp(name + len - 4, ".sig") != 0)
+        return NULL;
+    for(i = 0; i < patch->num_files; i++)
+    {
+        if(strlen(patch->files[i].name) == len - 4 && strncmp(patch->files[i].name, name, len - 4) == 0)
+            return &patch->files[i];
+    }
+    return NULL;
+}
+
+// Is name something we were asked to remove, inside a directory we were asked to remove, or the signature of either? (1-based index of the match)
+static unsigned int kt_patch_removed(const struct kt_patch *patch, const char *name, size_t name_len)
+{
+    const char *path;
+    size_t len;
+    unsigned int i;
+
+    if(name_len > 4 && strncasecmp(name + name_len - 4, ".sig", 4) == 0)
+        name_len -= 4;
+    for(i = 0; i < patch->opts->num_remove; i++)
+    {
+        path = kt_normalize_entry_path(patch->opts->remove[i], &len);
+        if(name_len < len || strncmp(name, path, len) != 0)
+            continue;
+        if(name_len == len || name[len] == '/')
+            return i + 1;
+    }
+    return 0;
+}
+
+// Sign what's left of input, in memory
+static int kt_patch_sign(FILE *input, struct rsa_private_key *rsa_pkey, unsigned char **sig, size_t *sig_size)
+{
+    FILE *sigfile;
+    long size;
+
+    if((sigfile = tmpfile()) == NULL)
+    {
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    if(sign_file(input, rsa_pkey, sigfile) < 0 || (size = ftell(sigfile)) <= 0)
+    {
+        fclose(sigfile);
+        return -1;
+    }
+    rewind(sigfile);
+    if((*sig = malloc((size_t) size)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate signature: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        fclose(sigfile);
+        return -1;
+    }
+    if(fread(*sig, sizeof(unsigned char), (size_t) size, sigfile) < (size_t) size)
+    {
+        fprintf(kt_stderr, "Cannot read signature back: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(sigfile);
+        free(*sig);
+        *sig = NULL;
+        return -1;
+    }
+    *sig_size = (size_t) size;
+    fclose(sigfile);
+
+    return 0;
+}
+
+// Hash & sign everything we're about to add, before we start writing anything
+static int kt_patch_prepare(struct kt_patch *patch)
+{
+    struct kt_patch_file *file;
+    FILE *in;
+    size_t len;
+    unsigned int i;
+
+    if(patch->opts->num_add > 0 && (patch->files = calloc(patch->opts->num_add, sizeof(*patch->files))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate file list: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    for(i = 0; i < patch->opts->num_add; i++)
+    {
+        file = &patch->files[patch->num_files];
+        file->source = patch->opts->add[i];
+        file->name = kt_normalize_entry_path(file->source, &len);
+        if(kt_patch_find(patch, file->name, len) != NULL)
+        {
+            fprintf(kt_stderr, "'%s' is added more than once.\n", file->name);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        if(stat(file->source, &file->st) != 0)
+        {
+            fprintf(kt_stderr, "Cannot stat '%s': %s.\n", file->source, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        if(!S_ISREG(file->st.st_mode))
+        {
+            fprintf(kt_stderr, "Cannot add '%s', only regular files can be added.\n", file->source);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        // Keep the bundle index & the signatures ours
+        if(strcmp(file->name, INDEX_FILE_NAME) == 0 || kt_patch_find_sig(patch, file->name) != NULL || (strlen(file->name) > 4 && strcasecmp(file->name + strlen(file->name) - 4, ".sig") == 0))
+        {
+            fprintf(kt_stderr, "Cannot add '%s', signatures & the bundle index are taken care of.\n", file->name);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        if((in = fopen(file->source, "rb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open '%s' for reading: %s!\n", file->source, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        if(md5_sum(in, file->md5) != 0)
+        {
+            fprintf(kt_stderr, "Cannot calculate hash sum for '%s'.\n", file->source);
+            fclose(in);
+            return -1;
+        }
+        file->md5[MD5_HASH_LENGTH] = '\0';
+        rewind(in);
+        if(kt_patch_sign(in, &patch->opts->sign_pkey, &file->sig, &file->sig_size) < 0)
+        {
+            fprintf(kt_stderr, "Cannot sign '%s'.\n", file->source);
+            fclose(in);
+            return -1;
+        }
+        fclose(in);
+        patch->num_files++;
+    }
+
+    return 0;
+}
+
+static void kt_patch_set_owner(struct archive_entry *entry)
+{
+    archive_entry_set_uid(entry, 0);
+    archive_entry_set_uname(entry, "root");
+    archive_entry_set_gid(entry, 0);
+    archive_entry_set_gname(entry, "root");
+}
+
+static int kt_patch_write_header(struct archive *out, struct archive_entry *entry)
+{
+    int r;
+
+    r = archive_write_header(out, entry);
+    if(r != ARCHIVE_OK)
+        fprintf(kt_stderr, "archive_write_header() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(out));
+    if(r < ARCHIVE_WARN)
+    {
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    return 0;
+}
+
+static int kt_patch_write_data(struct archive *out, struct archive_entry *entry, const void *data, size_t size)
+{
+    if(kt_patch_write_header(out, entry) < 0)
+        return -1;
+    if(size > 0 && archive_write_data(out, data, size) < 0)
+    {
+        fprintf(kt_stderr, "archive_write_data() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(out));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy a member across
+static int kt_patch_copy_entry(struct kt_patch *patch, struct archive *a, struct archive *out, struct archive_entry *entry)
+{
+    ssize_t count;
+
+    if(kt_patch_write_header(out, entry) < 0)
+        return -1;
+    while((count = archive_read_data(a, patch->buff, sizeof(patch->buff))) > 0)
+    {
+        if(archive_write_data(out, patch->buff, (size_t) count) < 0)
+        {
+            fprintf(kt_stderr, "archive_write_data() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(out));
+            kt_set_error(KT_ERR_ARCHIVE);
+            return -1;
+        }
+    }
+    if(count < 0)
+    {
+        fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    return 0;
+}
+
+// Write an added file, with entry's metadata (it's either a clone of the entry it replaces, or a brand new one)
+static int kt_patch_write_file(struct kt_patch *patch, struct archive *out, struct archive_entry *entry, const struct kt_patch_file *file)
+{
+    FILE *in;
+    size_t count;
+
+    archive_entry_set_hardlink(entry, NULL);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, file->st.st_size);
+    archive_entry_set_mtime(entry, file->st.st_mtime, 0);
+    if((in = fopen(file->source, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s!\n", file->source, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    if(kt_patch_write_header(out, entry) < 0)
+    {
+        fclose(in);
+        return -1;
+    }
+    while((count = fread(patch->buff, sizeof(unsigned char), sizeof(patch->buff), in)) > 0)
+    {
+        if(archive_write_data(out, patch->buff, count) < 0)
+        {
+            fprintf(kt_stderr, "archive_write_data() failed for '%s': %s.\n", archive_entry_pathname(entry), archive_error_string(out));
+            kt_set_error(KT_ERR_ARCHIVE);
+            fclose(in);
+            return -1;
+        }
+    }
+    if(ferror(in))
+    {
+        fprintf(kt_stderr, "Cannot read '%s': %s.\n", file->source, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    return 0;
+}
+
+// A brand new regular file entry, with the same metadata create would have given it
+static struct archive_entry *kt_patch_new_entry(const char *name, mode_t perm, int64_t size, time_t mtime)
+{
+    struct archive_entry *entry;
+
+    if((entry = archive_entry_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate archive entry.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return NULL;
+    }
+    archive_entry_copy_pathname(entry, name);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, perm);
+    archive_entry_set_size(entry, size);
+    archive_entry_set_mtime(entry, mtime, 0);
+    kt_patch_set_owner(entry);
+
+    return entry;
+}
+
+static int kt_patch_write_sig(struct archive *out, struct archive_entry *entry, const unsigned char *sig, size_t sig_size)
+{
+    archive_entry_set_hardlink(entry, NULL);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, (int64_t) sig_size);
+    archive_entry_set_mtime(entry, time(NULL), 0);
+    return kt_patch_write_data(out, entry, sig, sig_size);
+}
+
+// The update-filelist.dat record of an added file, like create would have written it
+static int kt_patch_record(const struct kt_patch *patch, const struct kt_patch_file *file, FILE *out)
+{
+    char displayname[PATH_MAX];
+    int type;
+
+    kt_basename(file->source, displayname, sizeof(displayname));
+    type = ((patch->real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(file->source)) ? 1 : ((IS_SCRIPT(file->source) || IS_SHELL(file->source)) ? 129 : 128));
+    if(fprintf(out, "%d %s %s %lld %s_ktool_file\n", type, file->md5, file->name, (long long) file->st.st_size / patch->real_blocksize, displayname) < 0)
+    {
+        fprintf(kt_stderr, "Cannot write to index file.\n");
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    return 0;
+}
+
+// Rewrite the bundle index: keep the records of the files we didn't touch verbatim, and update or append the others
+static int kt_patch_filelist(struct kt_patch *patch, FILE *out)
+{
+    struct kt_patch_file *file;
+    KTFilelistRecord record;
+    const char *name;
+    size_t name_len;
+    char *line = patch->filelist;
+    char *end;
+    size_t len;
+    unsigned int i;
+
+    while(line != NULL && line < patch->filelist + patch->filelist_size)
+    {
+        end = memchr(line, '\n', patch->filelist_size - (size_t) (line - patch->filelist));
+        len = (end != NULL ? (size_t) (end - line) : patch->filelist_size - (size_t) (line - patch->filelist));
+        // Whatever isn't a record is kept as is
+        if(kt_filelist_parse(line, len, &record))
+        {
+            name = kt_normalize_entry_path(record.path, &name_len);
+            if(kt_patch_removed(patch, name, name_len))
+            {
+                line = (end != NULL ? end + 1 : NULL);
+                continue;
+            }
+            if((file = kt_patch_find(patch, name, name_len)) != NULL)
+            {
+                if(!file->listed && kt_patch_record(patch, file, out) < 0)
+                    return -1;
+                file->listed = 1;
+                line = (end != NULL ? end + 1 : NULL);
+                continue;
+            }
+        }
+        if(len > 0 && (fwrite(line, sizeof(char), len, out) < len || fputc('\n', out) == EOF))
+        {
+            fprintf(kt_stderr, "Cannot write to index file.\n");
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        line = (end != NULL ? end + 1 : NULL);
+    }
+    for(i = 0; i < patch->num_files; i++)
+    {
+        if(!patch->files[i].listed && kt_patch_record(patch, &patch->files[i], out) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Keep the old bundle index around, we'll only know what to do with it once we've seen everything
+static int kt_patch_read_filelist(struct kt_patch *patch, struct archive *a, struct archive_entry *entry)
+{
+    size_t size = (size_t) archive_entry_size(entry);
+    ssize_t count;
+    size_t total = 0;
+
+    free(patch->filelist);
+    if((patch->filelist = malloc(size + 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate %zu bytes for the bundle index: %s.\n", size, strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    while(total < size && (count = archive_read_data(a, patch->filelist + total, size - total)) > 0)
+        total += (size_t) count;
+    if(total < size)
+    {
+        fprintf(kt_stderr, "Cannot read the bundle index: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    patch->filelist_size = size;
+
+    return 0;
+}
+
+// Go through the original payload, and write the patched one to out
+static int kt_patch_payload(struct kt_patch *patch, struct archive *a, struct archive *out)
+{
+    struct archive_entry *entry;
+    struct archive_entry *new_entry;
+    struct kt_patch_file *file;
+    const char *name;
+    const char *hardlink;
+    size_t name_len;
+    size_t hardlink_len;
+    char *signame;
+    unsigned int removed;
+    unsigned char *sig = NULL;
+    size_t sig_size = 0;
+    FILE *filelist = NULL;
+    unsigned int i;
+    int r;
+    int ret = -1;
+
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        name = kt_normalize_entry_path(archive_entry_pathname(entry), &name_len);
+
+        // We'll write a new bundle index at the end
+        if(strcmp(name, INDEX_FILE_NAME) == 0)
+        {
+            if(kt_patch_read_filelist(patch, a, entry) < 0)
+                goto cleanup;
+            continue;
+        }
+        if(strcmp(name, INDEX_FILE_NAME ".sig") == 0)
+            continue;
+        // The embedded index of a seekable package (create --seekable) would be stale, and we don't keep the gzip header that points to it
+        if(strcmp(name, KT_INDEX_SEEK_NAME) == 0)
+            continue;
+
+        // A hardlink (cf. create --dedup) would end up pointing to content its signature & record don't match
+        if((hardlink = archive_entry_hardlink(entry)) != NULL)
+            hardlink = kt_normalize_entry_path(hardlink, &hardlink_len);
+        if(hardlink != NULL && kt_patch_find(patch, name, name_len) == NULL && !kt_patch_removed(patch, name, name_len) && (kt_patch_find(patch, hardlink, hardlink_len) != NULL || kt_patch_removed(patch, hardlink, hardlink_len)))
+        {
+            fprintf(kt_stderr, "Cannot patch '%s', '%s' is a hardlink to it (the package was built with --dedup).\n", hardlink, name);
+            kt_set_error(KT_ERR_INVALID);
+            goto cleanup;
+        }
+
+        if((removed = kt_patch_removed(patch, name, name_len)) != 0)
+        {
+            patch->remove_hits[removed - 1] = 1;
+            fprintf(kt_stderr, "d %s\n", name);
+            patch->num_removed++;
+        }
+        else if((file = kt_patch_find(patch, name, name_len)) != NULL)
+        {
+            // Replace it where it was, keeping its metadata
+            fprintf(kt_stderr, "r %s\n", name);
+            if(kt_patch_write_file(patch, out, entry, file) < 0)
+                goto cleanup;
+            file->written = 1;
+            patch->num_replaced++;
+        }
+        else if((file = kt_patch_find_sig(patch, name)) != NULL)
+        {
+            if(kt_patch_write_sig(out, entry, file->sig, file->sig_size) < 0)
+                goto cleanup;
+            file->sig_written = 1;
+        }
+        else
+        {
+            if(kt_patch_copy_entry(patch, a, out, entry) < 0)
+                goto cleanup;
+            patch->num_kept++;
+        }
+    }
+
+    // Append the brand new files, each followed by its signature
+    for(i = 0; i < patch->num_files; i++)
+    {
+        file = &patch->files[i];
+        if(!file->written)
+        {
+            fprintf(kt_stderr, "a %s\n", file->name);
+            if((new_entry = kt_patch_new_entry(file->name, ((IS_SCRIPT(file->name) || IS_SHELL(file->name)) ? 0755 : 0644), file->st.st_size, file->st.st_mtime)) == NULL)
+                goto cleanup;
+            r = kt_patch_write_file(patch, out, new_entry, file);
+            archive_entry_free(new_entry);
+            if(r < 0)
+                goto cleanup;
+            patch->num_added++;
+        }
+        if(!file->sig_written)
+        {
+            if((signame = malloc(strlen(file->name) + sizeof(".sig"))) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate signature name: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            sprintf(signame, "%s.sig", file->name);
+            new_entry = kt_patch_new_entry(signame, 0644, (int64_t) file->sig_size, time(NULL));
+            free(signame);
+            if(new_entry == NULL)
+                goto cleanup;
+            r = kt_patch_write_data(out, new_entry, file->sig, file->sig_size);
+            archive_entry_free(new_entry);
+            if(r < 0)
+                goto cleanup;
+        }
+    }
+
+    // And finally, the new bundle index & its signature, in the same order as create
+    if((filelist = tmpfile()) == NULL)
+    {
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if(kt_patch_filelist(patch, filelist) < 0)
+        goto cleanup;
+    free(patch->filelist);
+    patch->filelist_size = (size_t) ftell(filelist);
+    if((patch->filelist = malloc(patch->filelist_size + 1)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate %zu bytes for the bundle index: %s.\n", patch->filelist_size, strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    rewind(filelist);
+    if(fread(patch->filelist, sizeof(char), patch->filelist_size, filelist) < patch->filelist_size)
+    {
+        fprintf(kt_stderr, "Cannot read the bundle index back: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    rewind(filelist);
+    if(kt_patch_sign(filelist, &patch->opts->sign_pkey, &sig, &sig_size) < 0)
+    {
+        fprintf(kt_stderr, "Cannot sign the bundle index.\n");
+        goto cleanup;
+    }
+    if((new_entry = kt_patch_new_entry(INDEX_FILE_NAME ".sig", 0644, (int64_t) sig_size, time(NULL))) == NULL)
+        goto cleanup;
+    r = kt_patch_write_data(out, new_entry, sig, sig_size);
+    archive_entry_free(new_entry);
+    if(r < 0)
+        goto cleanup;
+    if((new_entry = kt_patch_new_entry(INDEX_FILE_NAME, 0644, (int64_t) patch->filelist_size, time(NULL))) == NULL)
+        goto cleanup;
+    r = kt_patch_write_data(out, new_entry, patch->filelist, patch->filelist_size);
+    archive_entry_free(new_entry);
+    if(r < 0)
+        goto cleanup;
+    ret = 0;
+
+cleanup:
+    if(filelist != NULL)
+        fclose(filelist);
+    free(sig);
+
+    return ret;
+}
+
+int kindle_patch(FILE *input, FILE *output, PatchOptions *opts)
+{
+    struct kt_patch patch;
+    KTHeader header;
+    KTHeaderBuffer envelope_buf;
+    KTHeaderBuffer bundle_buf;
+    uint32_t certificate_number = 0;
+    int has_envelope = 0;
+    KTIndex *probe = NULL;
+    struct archive *a = NULL;
+    struct archive *out = NULL;
+    FILE *tgz = NULL;
+    unsigned int i;
+    int ret = -1;
+
+    memset(&patch, 0, sizeof(patch));
+    memset(&envelope_buf, 0, sizeof(envelope_buf));
+    memset(&bundle_buf, 0, sizeof(bundle_buf));
+    patch.opts = opts;
+
+    // Keep the headers, we'll write them back as they are (save for the payload's MD5)
+    if(kt_header_read(&header, &envelope_buf, input) < 0)
+        goto cleanup;
+    if(header.version == UpdateSignature)
+    {
+        has_envelope = 1;
+        certificate_number = header.certificate_number;
+        if(kindle_convert_signature(&header, input, NULL) < 0 || kt_header_read(&header, &bundle_buf, input) < 0)
+            goto cleanup;
+    }
+    switch(header.version)
+    {
+        case OTAUpdateV2:
+        case OTAUpdate:
+            patch.real_blocksize = BLOCK_SIZE;
+            break;
+        case RecoveryUpdate:
+        case RecoveryUpdateV2:
+            patch.real_blocksize = RECOVERY_BLOCK_SIZE;
+            break;
+        default:
+            fprintf(kt_stderr, "Only OTA & recovery update packages can be patched, this is a %.*s bundle.\n", MAGIC_NUMBER_LENGTH, header.magic_number);
+            kt_set_error(KT_ERR_FORMAT);
+            goto cleanup;
+    }
+    fprintf(kt_stderr, "Bundle         %.*s %s\n", MAGIC_NUMBER_LENGTH, header.magic_number, convert_magic_number(header.magic_number));
+
+    if(kt_patch_prepare(&patch) < 0)
+        goto cleanup;
+    if(opts->num_remove > 0 && (patch.remove_hits = calloc(opts->num_remove, sizeof(*patch.remove_hits))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate file list: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+
+    // Stream the original payload...
+    rewind(input);
+    if((probe = kt_index_probe(input, opts->fake_sign)) == NULL)
+        goto cleanup;
+    probe->span = UINT64_MAX;
+    if(fseeko(input, (off_t) probe->payload_offset, SEEK_SET) != 0)
+    {
+        fprintf(kt_stderr, "Cannot seek in package: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if((a = archive_read_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    if(kt_index_read_open(a, probe, input, probe->munged) < 0)
+        goto cleanup;
+
+    // ...to a new one, set up like create's
+    if((tgz = tmpfile()) == NULL)
+    {
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if((out = archive_write_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a write archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    archive_write_add_filter_gzip(out);
+    archive_write_set_format_gnutar(out);
+    archive_write_set_bytes_per_block(out, DEFAULT_BYTES_PER_BLOCK);
+    archive_write_set_bytes_in_last_block(out, -1);
+    if(archive_write_open_fd(out, fileno(tgz)) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_write_open_fd() failed: %s.\n", archive_error_string(out));
+        kt_set_error(KT_ERR_ARCHIVE);
+        goto cleanup;
+    }
+    if(kt_patch_payload(&patch, a, out) < 0)
+        goto cleanup;
+    if(archive_write_close(out) != ARCHIVE_OK)
+    {
+        fprintf(kt_stderr, "archive_write_close() failed: %s.\n", archive_error_string(out));
+        kt_set_error(KT_ERR_ARCHIVE);
+        goto cleanup;
+    }
+    for(i = 0; i < opts->num_remove; i++)
+    {
+        // Like tar, complain about what we didn't find
+        if(!patch.remove_hits[i])
+            fprintf(kt_stderr, "Nothing matched '%s' in the package.\n", opts->remove[i]);
+    }
+
+    // Wrap it up like the original: same header, and the same kind of envelope, if any
+    rewind(tgz);
+    if(has_envelope && !opts->fake_sign)
+    {
+        if(kindle_create_signed_bundle(&header, tgz, output, certificate_number, &opts->sign_pkey) < 0)
+            goto cleanup;
+    }
+    else if(kindle_create_bundle(&header, tgz, output, opts->fake_sign) < 0)
+        goto cleanup;
+
+    fprintf(kt_stderr, "Kept %u entries, replaced %u, added %u & removed %u (signed %u files & the bundle index).\n", patch.num_kept, patch.num_replaced, patch.num_added, patch.num_removed, patch.num_files);
+    ret = 0;
+
+cleanup:
+    if(out != NULL)
+        archive_write_free(out);
+    if(a != NULL)
+        archive_read_free(a);
+    if(tgz != NULL)
+        fclose(tgz);
+    kt_index_free(probe);
+    for(i = 0; i < patch.num_files; i++)
+        free(patch.files[i].sig);
+    free(patch.files);
+    free(patch.filelist);
+    free(patch.remove_hits);
+    kt_header_buffer_free(&envelope_buf);
+    kt_header_buffer_free(&bundle_buf);
+
+    return ret;
+}
+
+int kindle_patch_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "add", required_argument, NULL, 'a' },
+        { "remove", required_argument, NULL, 'r' },
+        { "key", required_argument, NULL, 'k' },
+        { "unsigned", no_argument, NULL, 'u' },
+        { NULL, 0, NULL, 0 }
+    };
+    PatchOptions patch_opts;
+    char **list;
+    char *bin_filename = NULL;
+    char *output_filename = NULL;
+    char *temp_filename = NULL;
+    FILE *bin_input = NULL;
+    FILE *output = NULL;
+    int temp_fd;
+    int ret = -1;
+
+    memset(&patch_opts, 0, sizeof(patch_opts));
+    patch_opts.sign_pkey = get_default_key();
+    while((opt = getopt_long(argc, argv, "a:r:k:u", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+            case 'r':
+                if((list = realloc((opt == 'a' ? patch_opts.add : patch_opts.remove), ((opt == 'a' ? patch_opts.num_add : patch_opts.num_remove) + 1) * sizeof(char *))) == NULL)
+                {
+                    fprintf(kt_stderr, "Cannot allocate file list: %s.\n", strerror(errno));
+                    goto cleanup;
+                }
+                if(opt == 'a')
+                {
+                    patch_opts.add = list;
+                    patch_opts.add[patch_opts.num_add++] = optarg;
+                }
+                else
+                {
+                    patch_opts.remove = list;
+                    patch_opts.remove[patch_opts.num_remove++] = optarg;
+                }
+                break;
+            case 'k':
+                if(nettle_rsa_privkey_from_pem(optarg, &patch_opts.sign_pkey) != 0)
+                {
+                    fprintf(kt_stderr, "Key '%s' cannot be loaded.\n", optarg);
+                    goto cleanup;
+                }
+                break;
+            case 'u':
+                patch_opts.fake_sign = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                goto cleanup;
+                break;
+        }
+    }
+
+    // One input, and an optional output (we patch the input in place otherwise)
+    if(optind < argc && optind + 2 >= argc)
+    {
+        bin_filename = argv[optind];
+        output_filename = (optind + 1 < argc ? argv[optind + 1] : bin_filename);
+    }
+    else
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need an input, and an optional output).\n");
+        goto cleanup;
+    }
+    if(patch_opts.num_add == 0 && patch_opts.num_remove == 0)
+    {
+        fprintf(kt_stderr, "Nothing to do, use --add and/or --remove.\n");
+        goto cleanup;
+    }
+    if(patch_opts.fake_sign ? !IS_STGZ(bin_filename) : !IS_BIN(bin_filename))
+    {
+        fprintf(kt_stderr, "Input file '%s' isn't a '%s' update package.\n", bin_filename, (patch_opts.fake_sign ? ".stgz" : ".bin"));
+        goto cleanup;
+    }
+    if((bin_input = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input update package '%s': %s.\n", bin_filename, strerror(errno));
+        goto cleanup;
+    }
+
+    // Always go through a tempfile right next to the output, so that we can patch in place, and never leave a half-written package behind
+    if((temp_filename = malloc(strlen(output_filename) + sizeof(".XXXXXX"))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate temp filename: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    sprintf(temp_filename, "%s.XXXXXX", output_filename);
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    if(_mktemp(temp_filename) == NULL)
+    {
+        fprintf(kt_stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    temp_fd = open(temp_filename, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+#else
+    temp_fd = mkstemp(temp_filename);
+#endif
+    if(temp_fd == -1)
+    {
+        fprintf(kt_stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    if((output = fdopen(temp_fd, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open temp output '%s' for writing: %s.\n", temp_filename, strerror(errno));
+        close(temp_fd);
+        unlink(temp_filename);
+        goto cleanup;
+    }
+
+    fprintf(kt_stderr, "Patching update package '%s' to '%s'.\n", bin_filename, output_filename);
+    if(kindle_patch(bin_input, output, &patch_opts) < 0)
+    {
+        fprintf(kt_stderr, "Error patching update package '%s'.\n", bin_filename);
+        fclose(output);
+        output = NULL;
+        unlink(temp_filename);
+        goto cleanup;
+    }
+    if(fclose(output) != 0)
+    {
+        fprintf(kt_stderr, "Cannot write '%s': %s.\n", temp_filename, strerror(errno));
+        output = NULL;
+        unlink(temp_filename);
+        goto cleanup;
+    }
+    output = NULL;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // mkstemp is a bit too strict for a package
+    chmod(temp_filename, 0644);
+#else
+    // The input may well be what we're about to replace, and it can't be open then
+    fclose(bin_input);
+    bin_input = NULL;
+#endif
+    if(kt_rename_replace(temp_filename, output_filename) != 0)
+    {
+        fprintf(kt_stderr, "Cannot rename '%s' to '%s': %s.\n", temp_filename, output_filename, strerror(errno));
+        unlink(temp_filename);
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if(bin_input != NULL)
+        fclose(bin_input);
+    free(temp_filename);
+    free(patch_opts.add);
+    free(patch_opts.remove);
+    rsa_private_key_clear(&patch_opts.sign_pkey);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
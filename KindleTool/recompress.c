@@ -0,0 +1,695 @@
+//
+//  recompress.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Deflate the payload of an existing package again, at another level, without touching the tarball itself:
+// the tar stream we inflate is the one we deflate, byte for byte, so the members, their signatures & the bundle index stay valid,
+// and only the header MD5 & the envelope have to be computed again.
+// Like pigz, the tar stream is cut in blocks that are deflated in parallel, each one primed with the last 32KB before it,
+// and ended with a sync flush, so that the pieces can simply be concatenated into a single gzip member.
+
+#define KT_RECOMPRESS_BLOCK (128 * 1024)
+#define KT_RECOMPRESS_WINDOW (32 * 1024)
+#define KT_RECOMPRESS_READ_SIZE (64 * 1024)
+
+enum
+{
+    KT_RECOMPRESS_FREE,
+    KT_RECOMPRESS_QUEUED,
+    KT_RECOMPRESS_BUSY,
+    KT_RECOMPRESS_DONE
+};
+
+struct kt_recompress_slot
+{
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *dict;        // The end of the previous block (or less, at the start of the stream)
+    size_t dict_len;
+    unsigned char *out;
+    size_t out_size;
+    size_t out_len;
+    uLong crc;
+    int last;
+    int state;
+};
+
+struct kt_recompress_pool
+{
+    KTContext *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // A block is waiting for a worker
+    pthread_cond_t done;        // A block was deflated
+    struct kt_recompress_slot *slots;
+    unsigned int num_slots;
+    uint64_t next_queue;        // Sequence number of the next block we fill...
+    uint64_t next_deflate;      // ...a worker deflates...
+    uint64_t next_write;        // ...and we write
+    int level;
+    int finished;               // We won't queue anything else
+    int failed;
+};
+
+// Inflates the original payload, member after member
+struct kt_recompress_reader
+{
+    FILE *input;
+    unsigned int fake_sign;
+    z_stream strm;
+    unsigned char buf[KT_RECOMPRESS_READ_SIZE];
+    int input_eof;
+    int eof;                    // We've seen the end of the last member
+    uint64_t payload_size;
+};
+
+static int kt_recompress_read(struct kt_recompress_reader *r)
+{
+    size_t len;
+
+    if(r->input_eof)
+        return 0;
+    len = fread(r->buf, sizeof(unsigned char), sizeof(r->buf), r->input);
+    if(len == 0)
+    {
+        if(ferror(r->input) != 0)
+        {
+            fprintf(kt_stderr, "Error reading the payload: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        r->input_eof = 1;
+        return 0;
+    }
+    if(!r->fake_sign)
+        dm(r->buf, len);
+    r->strm.next_in = r->buf;
+    r->strm.avail_in = (uInt) len;
+    r->payload_size += len;
+    return 1;
+}
+
+// Fill buf with as much of the tar stream as we can
+static int kt_recompress_fill(struct kt_recompress_reader *r, unsigned char *buf, size_t size, size_t *len)
+{
+    int z;
+    int more;
+
+    r->strm.next_out = buf;
+    r->strm.avail_out = (uInt) size;
+    while(!r->eof && r->strm.avail_out > 0)
+    {
+        if(r->strm.avail_in == 0)
+        {
+            if((more = kt_recompress_read(r)) < 0)
+                return -1;
+            if(more == 0)
+            {
+                fprintf(kt_stderr, "The payload is truncated.\n");
+                kt_set_error(KT_ERR_FORMAT);
+                return -1;
+            }
+        }
+        z = inflate(&r->strm, Z_NO_FLUSH);
+        if(z == Z_STREAM_END)
+        {
+            // Another member, or the end of the payload?
+            if(r->strm.avail_in == 0 && (more = kt_recompress_read(r)) < 0)
+                return -1;
+            if(r->strm.avail_in >= 2 && r->strm.next_in[0] == 0x1F && r->strm.next_in[1] == 0x8B)
+                inflateReset(&r->strm);
+            else
+            {
+                if(r->strm.avail_in > 0)
+                    fprintf(kt_stderr, "Ignoring what follows the gzip stream of the payload.\n");
+                r->eof = 1;
+            }
+        }
+        else if(z != Z_OK && z != Z_BUF_ERROR)
+        {
+            fprintf(kt_stderr, "Cannot inflate the payload: %s.\n", (r->strm.msg != NULL ? r->strm.msg : "corrupted data"));
+            kt_set_error(KT_ERR_FORMAT);
+            return -1;
+        }
+    }
+    *len = size - r->strm.avail_out;
+    return 0;
+}
+
+static int kt_recompress_deflate(struct kt_recompress_slot *slot, int level)
+{
+    z_stream strm;
+    int z;
+
+    memset(&strm, 0, sizeof(strm));
+    if(deflateInit2(&strm, level, Z_DEFLATED, -15, (level == Z_BEST_COMPRESSION ? 9 : 8), Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize deflate.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if(slot->dict_len > 0 && deflateSetDictionary(&strm, slot->dict, (uInt) slot->dict_len) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot prime deflate.\n");
+        kt_set_error(KT_ERR_GENERIC);
+        deflateEnd(&strm);
+        return -1;
+    }
+    strm.next_in = slot->in;
+    strm.avail_in = (uInt) slot->in_len;
+    strm.next_out = slot->out;
+    strm.avail_out = (uInt) slot->out_size;
+    z = deflate(&strm, (slot->last ? Z_FINISH : Z_SYNC_FLUSH));
+    // There's always room enough for a whole block, so it's done in one go
+    if((slot->last ? z != Z_STREAM_END : (z != Z_OK || strm.avail_out == 0)) || strm.avail_in != 0)
+    {
+        fprintf(kt_stderr, "Cannot deflate a block of the payload (%d).\n", z);
+        kt_set_error(KT_ERR_GENERIC);
+        deflateEnd(&strm);
+        return -1;
+    }
+    slot->out_len = slot->out_size - strm.avail_out;
+    slot->crc = crc32(0L, slot->in, (uInt) slot->in_len);
+    deflateEnd(&strm);
+
+    return 0;
+}
+
+static void kt_recompress_loop(struct kt_recompress_pool *pool)
+{
+    struct kt_recompress_slot *slot;
+    int r;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->failed && !pool->finished && pool->next_deflate >= pool->next_queue)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if(pool->failed || pool->next_deflate >= pool->next_queue)
+            break;
+        slot = &pool->slots[pool->next_deflate++ % pool->num_slots];
+        slot->state = KT_RECOMPRESS_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+
+        r = kt_recompress_deflate(slot, pool->level);
+
+        pthread_mutex_lock(&pool->lock);
+        if(r < 0)
+            pool->failed = 1;
+        slot->state = KT_RECOMPRESS_DONE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *kt_recompress_worker(void *arg)
+{
+    struct kt_recompress_pool *pool = arg;
+
+    kt_context_attach(pool->ctx);
+    kt_recompress_loop(pool);
+    kt_context_attach(NULL);
+
+    return NULL;
+}
+
+// Write the blocks that are ready, in order. Called (and returns) with the lock held.
+static int kt_recompress_drain(struct kt_recompress_pool *pool, FILE *output, uLong *crc, uint64_t *total)
+{
+    struct kt_recompress_slot *slot;
+    size_t written;
+
+    while(!pool->failed && pool->next_write < pool->next_queue && (slot = &pool->slots[pool->next_write % pool->num_slots])->state == KT_RECOMPRESS_DONE)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        written = fwrite(slot->out, sizeof(unsigned char), slot->out_len, output);
+        *crc = crc32_combine(*crc, slot->crc, (z_off_t) slot->in_len);
+        *total += slot->in_len;
+        pthread_mutex_lock(&pool->lock);
+        if(written < slot->out_len)
+        {
+            fprintf(kt_stderr, "Error writing the new payload: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            pool->failed = 1;
+            return -1;
+        }
+        slot->state = KT_RECOMPRESS_FREE;
+        pool->next_write++;
+    }
+    return (pool->failed ? -1 : 0);
+}
+
+static void kt_recompress_put_le32(unsigned char *buf, uint32_t value)
+{
+    buf[0] = (unsigned char) (value & 0xFF);
+    buf[1] = (unsigned char) ((value >> 8) & 0xFF);
+    buf[2] = (unsigned char) ((value >> 16) & 0xFF);
+    buf[3] = (unsigned char) ((value >> 24) & 0xFF);
+}
+
+// Inflate the payload input is positioned at, and write it deflated again (as a single gzip member) to output
+static int kt_recompress_payload(FILE *input, FILE *output, const RecompressOptions *opts, uint64_t *payload_size, uint64_t *tar_size)
+{
+    struct kt_recompress_reader *reader = NULL;
+    struct kt_recompress_pool pool;
+    struct kt_recompress_slot *slot;
+    unsigned char window[KT_RECOMPRESS_WINDOW];
+    size_t window_len = 0;
+    unsigned char gz[10] = { 0x1F, 0x8B, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned char trailer[8];
+    pthread_t *workers = NULL;
+    unsigned int num_workers = 0;
+    unsigned int jobs = opts->jobs;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t total = 0;
+    unsigned int i;
+    int r;
+    int ret = -1;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.queued, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.ctx = kt_context_current();
+    pool.level = opts->level;
+
+    if((reader = calloc(1, sizeof(*reader))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate the payload reader: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    reader->input = input;
+    reader->fake_sign = opts->fake_sign;
+    if(inflateInit2(&reader->strm, 15 + 16) != Z_OK)
+    {
+        fprintf(kt_stderr, "Cannot initialize inflate.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        free(reader);
+        reader = NULL;
+        goto cleanup;
+    }
+
+    // A few blocks in flight per worker, so that nobody waits on the writer
+    pool.num_slots = (jobs > 1 ? jobs * 4 : 1);
+    if((pool.slots = calloc(pool.num_slots, sizeof(*pool.slots))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate %u blocks: %s.\n", pool.num_slots, strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    for(i = 0; i < pool.num_slots; i++)
+    {
+        pool.slots[i].out_size = compressBound(KT_RECOMPRESS_BLOCK) + 64;
+        if((pool.slots[i].in = malloc(KT_RECOMPRESS_BLOCK)) == NULL || (pool.slots[i].dict = malloc(KT_RECOMPRESS_WINDOW)) == NULL || (pool.slots[i].out = malloc(pool.slots[i].out_size)) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate %u blocks: %s.\n", pool.num_slots, strerror(errno));
+            kt_set_error(KT_ERR_NOMEM);
+            goto cleanup;
+        }
+    }
+    if(jobs > 1 && (workers = malloc(jobs * sizeof(*workers))) != NULL)
+    {
+        for(num_workers = 0; num_workers < jobs; num_workers++)
+        {
+            if(pthread_create(&workers[num_workers], NULL, kt_recompress_worker, &pool) != 0)
+                break;
+        }
+    }
+
+    // The gzip header, with the usual hint in XFL for the extreme levels
+    gz[8] = (unsigned char) (opts->level == Z_BEST_COMPRESSION ? 2 : (opts->level == Z_BEST_SPEED ? 4 : 0));
+    if(fwrite(gz, sizeof(unsigned char), sizeof(gz), output) < sizeof(gz))
+    {
+        fprintf(kt_stderr, "Error writing the new payload: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    for(;;)
+    {
+        // Wait for the slot of the next block to be written out
+        slot = &pool.slots[pool.next_queue % pool.num_slots];
+        while(slot->state != KT_RECOMPRESS_FREE)
+        {
+            if(kt_recompress_drain(&pool, output, &crc, &total) < 0)
+                break;
+            if(slot->state != KT_RECOMPRESS_FREE)
+                pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        if(pool.failed)
+            break;
+        pthread_mutex_unlock(&pool.lock);
+
+        // The slot is ours until it's queued
+        memcpy(slot->dict, window, window_len);
+        slot->dict_len = window_len;
+        if(kt_recompress_fill(reader, slot->in, KT_RECOMPRESS_BLOCK, &slot->in_len) < 0)
+        {
+            pthread_mutex_lock(&pool.lock);
+            pool.failed = 1;
+            break;
+        }
+        slot->last = reader->eof;
+        if(slot->in_len >= KT_RECOMPRESS_WINDOW)
+        {
+            memcpy(window, slot->in + slot->in_len - KT_RECOMPRESS_WINDOW, KT_RECOMPRESS_WINDOW);
+            window_len = KT_RECOMPRESS_WINDOW;
+        }
+        else if(slot->in_len > 0)
+        {
+            if(window_len + slot->in_len > KT_RECOMPRESS_WINDOW)
+            {
+                memmove(window, window + (window_len + slot->in_len - KT_RECOMPRESS_WINDOW), KT_RECOMPRESS_WINDOW - slot->in_len);
+                window_len = KT_RECOMPRESS_WINDOW - slot->in_len;
+            }
+            memcpy(window + window_len, slot->in, slot->in_len);
+            window_len += slot->in_len;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        if(num_workers == 0)
+        {
+            // Nobody to hand it to
+            pthread_mutex_unlock(&pool.lock);
+            r = kt_recompress_deflate(slot, pool.level);
+            pthread_mutex_lock(&pool.lock);
+            if(r < 0)
+            {
+                pool.failed = 1;
+                break;
+            }
+            slot->state = KT_RECOMPRESS_DONE;
+            pool.next_queue++;
+            pool.next_deflate++;
+        }
+        else
+        {
+            slot->state = KT_RECOMPRESS_QUEUED;
+            pool.next_queue++;
+            pthread_cond_signal(&pool.queued);
+        }
+        if(slot->last)
+            break;
+    }
+    pool.finished = 1;
+    pthread_cond_broadcast(&pool.queued);
+    // Write what's left
+    while(!pool.failed && pool.next_write < pool.next_queue)
+    {
+        if(kt_recompress_drain(&pool, output, &crc, &total) < 0)
+            break;
+        if(pool.next_write < pool.next_queue)
+            pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    if(pool.failed)
+        pthread_cond_broadcast(&pool.queued);
+    pthread_mutex_unlock(&pool.lock);
+    for(i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+    num_workers = 0;
+    if(pool.failed)
+        goto cleanup;
+
+    kt_recompress_put_le32(trailer, (uint32_t) crc);
+    kt_recompress_put_le32(trailer + 4, (uint32_t) (total & 0xFFFFFFFF));
+    if(fwrite(trailer, sizeof(unsigned char), sizeof(trailer), output) < sizeof(trailer))
+    {
+        fprintf(kt_stderr, "Error writing the new payload: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    *payload_size = reader->payload_size;
+    *tar_size = total;
+    ret = 0;
+
+cleanup:
+    if(num_workers > 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.failed = 1;
+        pthread_cond_broadcast(&pool.queued);
+        pthread_mutex_unlock(&pool.lock);
+        for(i = 0; i < num_workers; i++)
+            pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if(pool.slots != NULL)
+    {
+        for(i = 0; i < pool.num_slots; i++)
+        {
+            free(pool.slots[i].in);
+            free(pool.slots[i].dict);
+            free(pool.slots[i].out);
+        }
+        free(pool.slots);
+    }
+    if(reader != NULL)
+    {
+        inflateEnd(&reader->strm);
+        free(reader);
+    }
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.queued);
+    pthread_mutex_destroy(&pool.lock);
+
+    return ret;
+}
+
+int kindle_recompress(FILE *input, FILE *output, RecompressOptions *opts)
+{
+    KTHeader header;
+    KTHeaderBuffer envelope_buf;
+    KTHeaderBuffer bundle_buf;
+    uint32_t certificate_number = 0;
+    int has_envelope = 0;
+    FILE *tgz = NULL;
+    uint64_t payload_size = 0;
+    uint64_t tar_size = 0;
+    off_t tgz_size;
+    int ret = -1;
+
+    memset(&envelope_buf, 0, sizeof(envelope_buf));
+    memset(&bundle_buf, 0, sizeof(bundle_buf));
+
+    if(kt_header_read(&header, &envelope_buf, input) < 0)
+        goto cleanup;
+    if(header.version == UpdateSignature)
+    {
+        has_envelope = 1;
+        certificate_number = header.certificate_number;
+        if(kindle_convert_signature(&header, input, NULL) < 0 || kt_header_read(&header, &bundle_buf, input) < 0)
+            goto cleanup;
+    }
+    switch(header.version)
+    {
+        case OTAUpdateV2:
+        case OTAUpdate:
+        case RecoveryUpdate:
+        case RecoveryUpdateV2:
+            break;
+        default:
+            fprintf(kt_stderr, "Only OTA & recovery update packages can be recompressed, this is a %.*s bundle.\n", MAGIC_NUMBER_LENGTH, header.magic_number);
+            kt_set_error(KT_ERR_FORMAT);
+            goto cleanup;
+    }
+    fprintf(kt_stderr, "Bundle         %.*s %s\n", MAGIC_NUMBER_LENGTH, header.magic_number, convert_magic_number(header.magic_number));
+
+    if((tgz = tmpfile()) == NULL)
+    {
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if(kt_recompress_payload(input, tgz, opts, &payload_size, &tar_size) < 0)
+        goto cleanup;
+    if(fflush(tgz) != 0 || (tgz_size = ftello(tgz)) < 0)
+    {
+        fprintf(kt_stderr, "Error writing the new payload: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+
+    // Same header (but for the MD5), and the same kind of envelope, if any
+    rewind(tgz);
+    if(has_envelope && !opts->fake_sign)
+    {
+        if(kindle_create_signed_bundle(&header, tgz, output, certificate_number, &opts->sign_pkey) < 0)
+            goto cleanup;
+    }
+    else if(kindle_create_bundle(&header, tgz, output, opts->fake_sign) < 0)
+        goto cleanup;
+
+    fprintf(kt_stderr, "Recompressed %.1f MiB of tar at level %d: %.1f MiB -> %.1f MiB (%+.1f%%).\n", (double) tar_size / (1024 * 1024), opts->level, (double) payload_size / (1024 * 1024), (double) tgz_size / (1024 * 1024), (payload_size > 0 ? ((double) tgz_size - (double) payload_size) * 100.0 / (double) payload_size : 0.0));
+    ret = 0;
+
+cleanup:
+    if(tgz != NULL)
+        fclose(tgz);
+    kt_header_buffer_free(&envelope_buf);
+    kt_header_buffer_free(&bundle_buf);
+
+    return ret;
+}
+
+int kindle_recompress_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "level", required_argument, NULL, 'l' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "key", required_argument, NULL, 'k' },
+        { "unsigned", no_argument, NULL, 'u' },
+        { NULL, 0, NULL, 0 }
+    };
+    RecompressOptions recompress_opts;
+    char *bin_filename = NULL;
+    char *output_filename = NULL;
+    char *endptr;
+    FILE *bin_input = NULL;
+    FILE *output = NULL;
+    struct stat in_st;
+    struct stat out_st;
+    int ret = -1;
+
+    memset(&recompress_opts, 0, sizeof(recompress_opts));
+    recompress_opts.sign_pkey = get_default_key();
+    recompress_opts.level = Z_BEST_COMPRESSION;
+    if(parse_jobs("0", &recompress_opts.jobs) < 0)
+        goto cleanup;
+    while((opt = getopt_long(argc, argv, "l:j:k:u", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'l':
+                if(strcmp(optarg, "max") == 0 || strcmp(optarg, "best") == 0)
+                    recompress_opts.level = Z_BEST_COMPRESSION;
+                else if(strcmp(optarg, "fast") == 0)
+                    recompress_opts.level = Z_BEST_SPEED;
+                else
+                {
+                    recompress_opts.level = (int) strtol(optarg, &endptr, 10);
+                    if(*endptr != '\0' || recompress_opts.level < 1 || recompress_opts.level > 9)
+                    {
+                        fprintf(kt_stderr, "Invalid compression level '%s' (max, fast, or 1 to 9).\n", optarg);
+                        goto cleanup;
+                    }
+                }
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &recompress_opts.jobs) < 0)
+                    goto cleanup;
+                break;
+            case 'k':
+                if(nettle_rsa_privkey_from_pem(optarg, &recompress_opts.sign_pkey) != 0)
+                {
+                    fprintf(kt_stderr, "Key '%s' cannot be loaded.\n", optarg);
+                    goto cleanup;
+                }
+                break;
+            case 'u':
+                recompress_opts.fake_sign = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                goto cleanup;
+                break;
+        }
+    }
+
+    if(optind + 2 == argc)
+    {
+        bin_filename = argv[optind];
+        output_filename = argv[optind + 1];
+    }
+    else
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need an input and an output).\n");
+        goto cleanup;
+    }
+    if((bin_input = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input update package '%s': %s.\n", bin_filename, strerror(errno));
+        goto cleanup;
+    }
+    if(strcmp(output_filename, "-") == 0)
+        output = stdout;
+    else
+    {
+        // We stream the payload from the input while we write the output, so they can't be the same file
+        if(stat(output_filename, &out_st) == 0 && fstat(fileno(bin_input), &in_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+        {
+            fprintf(kt_stderr, "The output can't be the input, recompress doesn't work in place.\n");
+            goto cleanup;
+        }
+        if((output = fopen(output_filename, "wb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open output '%s' for writing: %s.\n", output_filename, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    fprintf(kt_stderr, "Recompressing %supdate package '%s' to '%s' (%u threads).\n", (recompress_opts.fake_sign ? "fake " : ""), bin_filename, (output == stdout ? "-" : output_filename), recompress_opts.jobs);
+    if(kindle_recompress(bin_input, output, &recompress_opts) < 0)
+    {
+        fprintf(kt_stderr, "Error recompressing update package '%s'.\n", bin_filename);
+        if(output != stdout)
+        {
+            fclose(output);
+            output = NULL;
+            unlink(output_filename);
+        }
+        goto cleanup;
+    }
+    if(output != stdout)
+    {
+        if(fclose(output) != 0)
+        {
+            fprintf(kt_stderr, "Cannot write '%s': %s.\n", output_filename, strerror(errno));
+            output = NULL;
+            unlink(output_filename);
+            goto cleanup;
+        }
+        output = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    if(output != NULL && output != stdout)
+        fclose(output);
+    if(bin_input != NULL)
+        fclose(bin_input);
+    rsa_private_key_clear(&recompress_opts.sign_pkey);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
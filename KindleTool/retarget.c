@@ -0,0 +1,501 @@
+//
+//  retarget.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+// We need copy_file_range
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "kindle_tool.h"
+
+// Move an existing package to another set of devices, or another revision range, without rebuilding it.
+// Neither the payload nor its MD5 depend on the header, so we write a new header with the MD5 we already have,
+// copy the (munged) payload as-is (letting the kernel do it where it can), and sign the result again if it needs an envelope.
+// A fake package is the exception: its payload has to be hashed & munged properly on the way, since we make a signed one out of it.
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define KT_RETARGET_COPY_FILE_RANGE
+#endif
+
+// Copy the rest of input to output, through the kernel when both are regular files
+static int kt_retarget_copy(FILE *input, FILE *output)
+{
+    unsigned char buffer[BUFFER_SIZE];
+    size_t count;
+#ifdef KT_RETARGET_COPY_FILE_RANGE
+    off_t in_pos;
+    off_t out_pos;
+    ssize_t copied;
+    int started = 0;
+
+    if(fflush(output) == 0 && (in_pos = ftello(input)) >= 0 && (out_pos = ftello(output)) >= 0)
+    {
+        for(;;)
+        {
+            copied = copy_file_range(fileno(input), &in_pos, fileno(output), &out_pos, 1 << 30, 0);
+            if(copied == 0)
+                break;
+            if(copied < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                // Not supported here (old kernel, another filesystem, a pipe...), fall back to a plain copy if we haven't started yet
+                if(!started && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF))
+                    goto fallback;
+                fprintf(kt_stderr, "Error copying the payload: %s.\n", strerror(errno));
+                kt_set_error(KT_ERR_IO);
+                return -1;
+            }
+            started = 1;
+        }
+        if(fseeko(input, in_pos, SEEK_SET) != 0 || fseeko(output, out_pos, SEEK_SET) != 0)
+        {
+            fprintf(kt_stderr, "Cannot seek after copying the payload: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        return 0;
+    }
+
+fallback:
+#endif
+    while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, input)) > 0)
+    {
+        if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
+        {
+            fprintf(kt_stderr, "Error writing update to output: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+    }
+    if(ferror(input) != 0)
+    {
+        fprintf(kt_stderr, "Error reading the payload: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    return 0;
+}
+
+// Apply what we were asked to change to header, with the same rules as create
+static int kt_retarget_header(KTHeader *header, const RetargetOptions *opts)
+{
+    const UpdateInformation *info = &opts->info;
+    const char *type = convert_bundle_version(header->version);
+
+    if((opts->set & KT_RETARGET_BUNDLE) && get_bundle_version(info->magic_number) != header->version)
+    {
+        fprintf(kt_stderr, "Bundle version %.*s isn't a %s one, retarget doesn't change the update type.\n", MAGIC_NUMBER_LENGTH, info->magic_number, type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((opts->set & KT_RETARGET_SRCREV) && header->version != OTAUpdateV2 && header->version != OTAUpdate)
+    {
+        fprintf(kt_stderr, "This update type (%s) doesn't have a source revision.\n", type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((opts->set & KT_RETARGET_TGTREV) && header->version == RecoveryUpdate)
+    {
+        fprintf(kt_stderr, "This update type (%s) doesn't have a target revision.\n", type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if(header->version == OTAUpdate && (info->source_revision > UINT32_MAX || ((opts->set & KT_RETARGET_TGTREV) && info->target_revision > UINT32_MAX)))
+    {
+        fprintf(kt_stderr, "Source/target revision for this update type (%s) cannot exceed %u.\n", type, UINT32_MAX);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((opts->set & (KT_RETARGET_PLATFORM | KT_RETARGET_BOARD)) && header->version != RecoveryUpdateV2 && !(header->version == RecoveryUpdate && header->header_rev == 2))
+    {
+        fprintf(kt_stderr, "This update type (%s) doesn't have a platform or a board.\n", type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((opts->set & (KT_RETARGET_CRITICAL | KT_RETARGET_META)) && header->version != OTAUpdateV2)
+    {
+        fprintf(kt_stderr, "This update type (%s) doesn't have a critical flag or metastrings.\n", type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+    if((opts->set & KT_RETARGET_OPTIONAL) && header->version != OTAUpdate)
+    {
+        fprintf(kt_stderr, "This update type (%s) doesn't have an optional flag.\n", type);
+        kt_set_error(KT_ERR_INVALID);
+        return -1;
+    }
+
+    if(opts->set & KT_RETARGET_DEVICES)
+    {
+        // Same validation as create (Allow 0 devices in Recovery V2, allow multiple devices in OTA V2 & Recovery V2)
+        if((info->num_devices < 1 && header->version != RecoveryUpdateV2) || ((header->version != OTAUpdateV2 && header->version != RecoveryUpdateV2) && info->num_devices > 1))
+        {
+            fprintf(kt_stderr, "Invalid number of supported devices (%d) for this update type (%s).\n", info->num_devices, type);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        if(header->version == RecoveryUpdate && header->header_rev == 2)
+        {
+            fprintf(kt_stderr, "This update type (%s, header rev 2) doesn't have a device.\n", type);
+            kt_set_error(KT_ERR_INVALID);
+            return -1;
+        }
+        if(header->version == OTAUpdateV2 || header->version == RecoveryUpdateV2)
+        {
+            header->num_devices = info->num_devices;
+            header->device_list = info->devices;
+        }
+        else
+            header->device = (uint32_t) info->devices[0];
+        // The only type where the devices decide of the bundle version (i.e., FC04 for the K4, FD04 for everything after it)
+        if(header->version == OTAUpdateV2 && !(opts->set & KT_RETARGET_BUNDLE) && get_bundle_version(info->magic_number) == OTAUpdateV2)
+            memcpy(header->magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);
+    }
+    if(opts->set & KT_RETARGET_BUNDLE)
+        memcpy(header->magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);
+    if(opts->set & KT_RETARGET_SRCREV)
+        header->source_revision = info->source_revision;
+    if(opts->set & KT_RETARGET_TGTREV)
+        header->target_revision = info->target_revision;
+    if(opts->set & KT_RETARGET_PLATFORM)
+        header->platform = (uint32_t) info->platform;
+    if(opts->set & KT_RETARGET_BOARD)
+        header->board = (uint32_t) info->board;
+    if(opts->set & KT_RETARGET_OPTIONAL)
+        header->optional = info->optional;
+    if(opts->set & KT_RETARGET_CRITICAL)
+        header->critical = info->critical;
+    if(opts->set & KT_RETARGET_META)
+    {
+        header->num_meta = info->num_meta;
+        header->metastrings = info->metastrings;
+    }
+
+    return 0;
+}
+
+int kindle_retarget(FILE *input, FILE *output, RetargetOptions *opts)
+{
+    KTHeader header;
+    KTHeaderBuffer envelope_buf;
+    KTHeaderBuffer bundle_buf;
+    uint32_t certificate_number = CertificateDeveloper;
+    int has_envelope = 0;
+    int needs_envelope;
+    FILE *inner = NULL;
+    FILE *payload = NULL;
+    int ret = -1;
+
+    memset(&envelope_buf, 0, sizeof(envelope_buf));
+    memset(&bundle_buf, 0, sizeof(bundle_buf));
+
+    if(kt_header_read(&header, &envelope_buf, input) < 0)
+        goto cleanup;
+    if(header.version == UpdateSignature)
+    {
+        has_envelope = 1;
+        certificate_number = header.certificate_number;
+        if(kindle_convert_signature(&header, input, NULL) < 0 || kt_header_read(&header, &bundle_buf, input) < 0)
+            goto cleanup;
+    }
+    switch(header.version)
+    {
+        case OTAUpdateV2:
+        case OTAUpdate:
+        case RecoveryUpdate:
+        case RecoveryUpdateV2:
+            break;
+        default:
+            fprintf(kt_stderr, "Only OTA & recovery update packages can be retargeted, this is a %.*s bundle.\n", MAGIC_NUMBER_LENGTH, header.magic_number);
+            kt_set_error(KT_ERR_FORMAT);
+            goto cleanup;
+    }
+    fprintf(kt_stderr, "Bundle         %.*s %s\n", MAGIC_NUMBER_LENGTH, header.magic_number, convert_magic_number(header.magic_number));
+    if(kt_retarget_header(&header, opts) < 0)
+        goto cleanup;
+    if(opts->set & KT_RETARGET_CERT)
+        certificate_number = (uint32_t) opts->info.certificate_number;
+    // Like create: OTA V2 & Recovery V2 always come in an envelope, and we keep the one we had for the others
+    needs_envelope = (has_envelope || header.version == OTAUpdateV2 || header.version == RecoveryUpdateV2);
+
+    if(needs_envelope && (inner = tmpfile()) == NULL)
+    {
+        fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        goto cleanup;
+    }
+    if(opts->fake_sign)
+    {
+        // The payload of a fake package isn't munged, and its MD5 is the one of the demunged payload: start from scratch
+        if((payload = tmpfile()) == NULL)
+        {
+            fprintf(kt_stderr, "Error opening temp file: %s.\n", strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            goto cleanup;
+        }
+        if(kt_retarget_copy(input, payload) < 0)
+            goto cleanup;
+        rewind(payload);
+        if(kindle_create_bundle(&header, payload, (needs_envelope ? inner : output), 0) < 0)
+            goto cleanup;
+        fprintf(kt_stderr, "Hashed & munged the payload of the fake package (MD5 %s).\n", header.md5_sum);
+    }
+    else
+    {
+        if(kt_header_write(&header, (needs_envelope ? inner : output)) < 0 || kt_retarget_copy(input, (needs_envelope ? inner : output)) < 0)
+            goto cleanup;
+        fprintf(kt_stderr, "Kept the payload as-is (MD5 %s).\n", header.md5_sum);
+    }
+
+    if(needs_envelope)
+    {
+        rewind(inner);
+        if(kindle_create_envelope(certificate_number, &opts->info.sign_pkey, inner, output) < 0)
+            goto cleanup;
+        rewind(inner);
+        if(kt_retarget_copy(inner, output) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if(inner != NULL)
+        fclose(inner);
+    if(payload != NULL)
+        fclose(payload);
+    kt_header_buffer_free(&envelope_buf);
+    kt_header_buffer_free(&bundle_buf);
+
+    return ret;
+}
+
+int kindle_retarget_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "device", required_argument, NULL, 'd' },
+        { "key", required_argument, NULL, 'k' },
+        { "bundle", required_argument, NULL, 'b' },
+        { "srcrev", required_argument, NULL, 's' },
+        { "tgtrev", required_argument, NULL, 't' },
+        { "platform", required_argument, NULL, 'p' },
+        { "board", required_argument, NULL, 'B' },
+        { "cert", required_argument, NULL, 'c' },
+        { "opt", required_argument, NULL, 'o' },
+        { "crit", required_argument, NULL, 'r' },
+        { "meta", required_argument, NULL, 'x' },
+        { "unsigned", no_argument, NULL, 'u' },
+        { NULL, 0, NULL, 0 }
+    };
+    RetargetOptions retarget_opts;
+    const KTRegistryName *reg_name;
+    char *bin_filename = NULL;
+    char *output_filename = NULL;
+    FILE *bin_input = NULL;
+    FILE *output = NULL;
+    struct stat in_st;
+    struct stat out_st;
+    unsigned int i;
+    int ret = -1;
+
+    memset(&retarget_opts, 0, sizeof(retarget_opts));
+    retarget_opts.info.sign_pkey = get_default_key();
+    retarget_opts.info.certificate_number = CertificateDeveloper;
+    while((opt = getopt_long(argc, argv, "d:k:b:s:t:p:B:c:o:r:x:u", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                if(kindle_create_add_device(&retarget_opts.info, optarg) < 0)
+                    goto cleanup;
+                retarget_opts.set |= KT_RETARGET_DEVICES;
+                break;
+            case 'k':
+                if(nettle_rsa_privkey_from_pem(optarg, &retarget_opts.info.sign_pkey) != 0)
+                {
+                    fprintf(kt_stderr, "Key '%s' cannot be loaded.\n", optarg);
+                    goto cleanup;
+                }
+                break;
+            case 'b':
+                if(get_bundle_version(optarg) == UnknownUpdate)
+                {
+                    fprintf(kt_stderr, "Invalid bundle version %s.\n", optarg);
+                    goto cleanup;
+                }
+                // A known magic number, so there's at least MAGIC_NUMBER_LENGTH bytes to copy
+                memcpy(retarget_opts.info.magic_number, optarg, MAGIC_NUMBER_LENGTH);
+                retarget_opts.set |= KT_RETARGET_BUNDLE;
+                break;
+            case 's':
+                retarget_opts.info.source_revision = strtoull(optarg, NULL, 0);
+                retarget_opts.set |= KT_RETARGET_SRCREV;
+                break;
+            case 't':
+                retarget_opts.info.target_revision = strtoull(optarg, NULL, 0);
+                retarget_opts.set |= KT_RETARGET_TGTREV;
+                break;
+            case 'p':
+                if((reg_name = kt_registry_lookup(optarg)) != NULL && reg_name->platform >= 0)
+                    retarget_opts.info.platform = (Platform) reg_name->platform;
+                else
+                {
+                    fprintf(kt_stderr, "Unknown platform %s.\n", optarg);
+                    goto cleanup;
+                }
+                retarget_opts.set |= KT_RETARGET_PLATFORM;
+                break;
+            case 'B':
+                if((reg_name = kt_registry_lookup(optarg)) != NULL && reg_name->board >= 0)
+                    retarget_opts.info.board = (Board) reg_name->board;
+                else
+                {
+                    fprintf(kt_stderr, "Unknown board %s.\n", optarg);
+                    goto cleanup;
+                }
+                retarget_opts.set |= KT_RETARGET_BOARD;
+                break;
+            case 'c':
+                retarget_opts.info.certificate_number = (CertificateNumber) atoi(optarg);
+                retarget_opts.set |= KT_RETARGET_CERT;
+                break;
+            case 'o':
+                retarget_opts.info.optional = (uint8_t) atoi(optarg);
+                retarget_opts.set |= KT_RETARGET_OPTIONAL;
+                break;
+            case 'r':
+                retarget_opts.info.critical = (uint8_t) atoi(optarg);
+                retarget_opts.set |= KT_RETARGET_CRITICAL;
+                break;
+            case 'x':
+                if(strchr(optarg, '=') == NULL) // A metastring must contain an '=' character (remember, it's a key=value pair ;))
+                {
+                    fprintf(kt_stderr, "Invalid metastring. Format: key=value, input: %s\n", optarg);
+                    goto cleanup;
+                }
+                if(strlen(optarg) > 0xFFFF)
+                {
+                    fprintf(kt_stderr, "Metastring too long. Max length: %d, input: %s\n", 0xFFFF, optarg);
+                    goto cleanup;
+                }
+                retarget_opts.info.metastrings = realloc(retarget_opts.info.metastrings, ++retarget_opts.info.num_meta * sizeof(char *));
+                retarget_opts.info.metastrings[retarget_opts.info.num_meta - 1] = strdup(optarg);
+                retarget_opts.set |= KT_RETARGET_META;
+                break;
+            case 'u':
+                retarget_opts.fake_sign = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                goto cleanup;
+                break;
+        }
+    }
+
+    if(optind + 2 == argc)
+    {
+        bin_filename = argv[optind];
+        output_filename = argv[optind + 1];
+    }
+    else
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need an input and an output).\n");
+        goto cleanup;
+    }
+    if(retarget_opts.set == 0 && !retarget_opts.fake_sign)
+    {
+        fprintf(kt_stderr, "Nothing to do, tell me what to change (or use --unsigned to sign a fake package).\n");
+        goto cleanup;
+    }
+    if((bin_input = fopen(bin_filename, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input update package '%s': %s.\n", bin_filename, strerror(errno));
+        goto cleanup;
+    }
+    if(strcmp(output_filename, "-") == 0)
+        output = stdout;
+    else
+    {
+        // We read the payload from the input while we write the output, so they can't be the same file
+        if(stat(output_filename, &out_st) == 0 && fstat(fileno(bin_input), &in_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+        {
+            fprintf(kt_stderr, "The output can't be the input, retarget doesn't work in place.\n");
+            goto cleanup;
+        }
+        if(!IS_BIN(output_filename))
+            fprintf(kt_stderr, "Your output file '%s' needs to follow the proper naming scheme (update*.bin) in order to be picked up by the Kindle.\n", output_filename);
+        if((output = fopen(output_filename, "wb")) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot open output '%s' for writing: %s.\n", output_filename, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    fprintf(kt_stderr, "Retargeting %supdate package '%s' to '%s'.\n", (retarget_opts.fake_sign ? "fake " : ""), bin_filename, (output == stdout ? "-" : output_filename));
+    if(kindle_retarget(bin_input, output, &retarget_opts) < 0)
+    {
+        fprintf(kt_stderr, "Error retargeting update package '%s'.\n", bin_filename);
+        if(output != stdout)
+        {
+            fclose(output);
+            output = NULL;
+            unlink(output_filename);
+        }
+        goto cleanup;
+    }
+    if(output != stdout)
+    {
+        if(fclose(output) != 0)
+        {
+            fprintf(kt_stderr, "Cannot write '%s': %s.\n", output_filename, strerror(errno));
+            output = NULL;
+            unlink(output_filename);
+            goto cleanup;
+        }
+        output = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    if(output != NULL && output != stdout)
+        fclose(output);
+    if(bin_input != NULL)
+        fclose(bin_input);
+    for(i = 0; i < retarget_opts.info.num_meta; i++)
+        free(retarget_opts.info.metastrings[i]);
+    free(retarget_opts.info.metastrings);
+    free(retarget_opts.info.devices);
+    rsa_private_key_clear(&retarget_opts.info.sign_pkey);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,623 @@
+//
+//  scan.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// Bulk header scanner: walk a bunch of directories, and dump what the headers of the packages in there say, one record per package.
+// We only ever read the header bytes (skipping over the signature of SP01 envelopes), never the payload, nor the padding of fixed size headers.
+
+// What we read of a package at first: enough for an SP01 envelope (signature included), and for every field of the fixed size header behind it
+#define KT_SCAN_READ 4096
+
+
+enum kt_scan_status
+{
+    KT_SCAN_OK = 0,
+    KT_SCAN_UNKNOWN,            // Not a package
+    KT_SCAN_TRUNCATED,          // The header (or the signature) goes past the end of the file
+    KT_SCAN_MALFORMED,          // The header doesn't make sense
+    KT_SCAN_ERROR,              // Couldn't read it
+    KT_SCAN_STATUS_COUNT
+};
+
+static const char *kt_scan_status_names[KT_SCAN_STATUS_COUNT] = { "ok", "unknown", "truncated", "malformed", "error" };
+
+enum kt_scan_format
+{
+    KT_SCAN_JSONL = 0,
+    KT_SCAN_CSV
+};
+
+static const char kt_scan_csv_columns[] = "path,size,status,envelope,magic,type,source_revision,target_revision,devices,device_names,platform,platform_name,board,board_name,header_rev,magic_1,magic_2,minor,optional,critical,md5,metadata\n";
+
+// Per thread scratch space, reused for every package
+struct kt_scan_buffer
+{
+    unsigned char *data;        // Header bytes, starting at offset 'offset' of the package
+    size_t size;
+    size_t len;
+    off_t offset;
+    char *line;                 // The record we're formatting
+    size_t line_len;
+    size_t line_size;
+    int line_failed;
+};
+
+// What we found out about a package
+struct kt_scan_result
+{
+    const char *path;
+    int64_t size;
+    enum kt_scan_status status;
+    int parsed;                 // We got every field of the header
+    int wrapped;                // It's in an SP01 envelope
+    CertificateNumber cert_num;
+    KTHeader header;            // Of the wrapped bundle, for envelopes (points into the scan buffer)
+};
+
+// Shared state between the scanner threads
+struct kt_scan_pool
+{
+    pthread_mutex_t lock;       // Serializes the records
+    enum kt_scan_format format;
+    FILE *out;
+    unsigned int counts[KT_SCAN_STATUS_COUNT];
+};
+
+// Read up to len bytes at offset, without moving the file position (so that's safe to do from any thread)
+static ssize_t kt_scan_pread(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t total = 0;
+    ssize_t n;
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    // No pread there, but every thread opens its own packages anyway
+    if(lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+#endif
+    while(total < len)
+    {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        n = read(fd, buf + total, (unsigned int)(len - total));
+#else
+        n = pread(fd, buf + total, len - total, offset + (off_t) total);
+#endif
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0)
+            break;
+        total += (size_t) n;
+    }
+    return (ssize_t) total;
+}
+
+// Get the len bytes at offset in the scan buffer (or whatever's left of the file, if that's less)
+static int kt_scan_fill(int fd, struct kt_scan_buffer *sb, off_t offset, size_t len, int64_t file_size)
+{
+    unsigned char *data;
+    ssize_t n;
+
+    if((int64_t) len > file_size - offset)
+        len = (size_t)(file_size - offset);
+    if(len > sb->size)
+    {
+        if((data = realloc(sb->data, len)) == NULL)
+        {
+            fprintf(kt_stderr, "Cannot allocate %zu bytes for a header.\n", len);
+            return -1;
+        }
+        sb->data = data;
+        sb->size = len;
+    }
+    if((n = kt_scan_pread(fd, sb->data, len, offset)) < 0)
+        return -1;
+    sb->len = (size_t) n;
+    sb->offset = offset;
+    return 0;
+}
+
+// Parse the header at offset, reading only as much as the parser asks for (and nothing at all if we already have it)
+static enum kt_scan_status kt_scan_header(int fd, struct kt_scan_buffer *sb, off_t offset, int64_t file_size, KTHeader *header, int *parsed)
+{
+    int r;
+
+    *parsed = 0;
+    if(offset < sb->offset || offset >= sb->offset + (off_t) sb->len)
+    {
+        if(offset >= file_size)
+        {
+            kt_header_parse(header, NULL, 0);
+            return KT_SCAN_TRUNCATED;
+        }
+        if(kt_scan_fill(fd, sb, offset, KT_SCAN_READ, file_size) < 0)
+            return KT_SCAN_ERROR;
+    }
+    for(;;)
+    {
+        r = kt_header_parse(header, sb->data + (offset - sb->offset), sb->len - (size_t)(offset - sb->offset));
+        if(r < 0)
+            return KT_SCAN_MALFORMED;
+        if(r == 0)
+        {
+            *parsed = 1;
+            if(header->version == UnknownUpdate)
+                return KT_SCAN_UNKNOWN;
+            return (offset + (off_t) header->header_size > file_size ? KT_SCAN_TRUNCATED : KT_SCAN_OK);
+        }
+        if(offset + (off_t) header->header_size > file_size)
+            return KT_SCAN_TRUNCATED;
+        if(kt_scan_fill(fd, sb, offset, header->header_size, file_size) < 0)
+            return KT_SCAN_ERROR;
+    }
+}
+
+// Scan a single package
+static void kt_scan_file(int start_fd, const char *path, struct kt_scan_buffer *sb, struct kt_scan_result *res)
+{
+    struct stat st;
+    size_t sig_len;
+    int fd;
+
+    memset(res, 0, sizeof(*res));
+    res->path = path;
+    res->cert_num = CertificateUnknown;
+    res->header.version = UnknownUpdate;
+    if((fd = kt_walk_open(start_fd, path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", path, strerror(errno));
+        res->status = KT_SCAN_ERROR;
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+    res->size = (int64_t) st.st_size;
+    sb->len = 0;
+    sb->offset = 0;
+
+    res->status = kt_scan_header(fd, sb, 0, res->size, &res->header, &res->parsed);
+    // Skip the signature of SP01 envelopes, and look at what's inside
+    if(res->status == KT_SCAN_OK && res->header.version == UpdateSignature)
+    {
+        res->wrapped = 1;
+        res->cert_num = (CertificateNumber)(res->header.certificate_number);
+        switch(res->cert_num)
+        {
+            case CertificateDeveloper:
+                sig_len = CERTIFICATE_DEV_SIZE;
+                break;
+            case Certificate1K:
+                sig_len = CERTIFICATE_1K_SIZE;
+                break;
+            case Certificate2K:
+                sig_len = CERTIFICATE_2K_SIZE;
+                break;
+            case CertificateUnknown:
+            default:
+                res->parsed = 0;
+                res->status = KT_SCAN_MALFORMED;
+                close(fd);
+                return;
+        }
+        res->status = kt_scan_header(fd, sb, (off_t)(res->header.header_size + sig_len), res->size, &res->header, &res->parsed);
+    }
+    if(res->status == KT_SCAN_ERROR)
+        fprintf(kt_stderr, "Cannot read '%s': %s.\n", path, strerror(errno));
+    close(fd);
+}
+
+static void kt_scan_append(struct kt_scan_buffer *sb, const char *str, size_t len)
+{
+    char *line;
+    size_t size;
+
+    if(sb->line_len + len + 1 > sb->line_size)
+    {
+        size = (sb->line_size ? sb->line_size : 1024);
+        while(sb->line_len + len + 1 > size)
+            size *= 2;
+        if((line = realloc(sb->line, size)) == NULL)
+        {
+            sb->line_failed = 1;
+            return;
+        }
+        sb->line = line;
+        sb->line_size = size;
+    }
+    memcpy(sb->line + sb->line_len, str, len);
+    sb->line_len += len;
+}
+
+static void kt_scan_append_uint(struct kt_scan_buffer *sb, uint64_t value)
+{
+    char str[24];
+
+    kt_scan_append(sb, str, (size_t) snprintf(str, sizeof(str), "%llu", (unsigned long long) value));
+}
+
+// Quote a string for the output format (in CSV, we always quote, it's simpler, and it also keeps list separators safe)
+static void kt_scan_append_string(struct kt_scan_buffer *sb, enum kt_scan_format format, const unsigned char *str, size_t len, int munged, int in_list)
+{
+    char esc[8];
+    unsigned char c;
+    size_t i;
+
+    if(format == KT_SCAN_JSONL || !in_list)
+        kt_scan_append(sb, "\"", 1);
+    for(i = 0; i < len; i++)
+    {
+        c = str[i];
+        if(munged)
+            dm(&c, 1);
+        if(format == KT_SCAN_CSV)
+        {
+            if(c == '"')
+                kt_scan_append(sb, "\"\"", 2);
+            else
+                kt_scan_append(sb, (const char *) &c, 1);
+        }
+        else if(c == '"' || c == '\\')
+        {
+            esc[0] = '\\';
+            esc[1] = (char) c;
+            kt_scan_append(sb, esc, 2);
+        }
+        else if(c < 0x20)
+            kt_scan_append(sb, esc, (size_t) snprintf(esc, sizeof(esc), "\\u%04x", c));
+        else
+            kt_scan_append(sb, (const char *) &c, 1);
+    }
+    if(format == KT_SCAN_JSONL || !in_list)
+        kt_scan_append(sb, "\"", 1);
+}
+
+// Start a field: in JSON, fields that don't apply are left out, in CSV, they're left empty. Returns whether to write its value.
+static int kt_scan_field(struct kt_scan_buffer *sb, enum kt_scan_format format, const char *key, int present)
+{
+    if(format == KT_SCAN_CSV)
+    {
+        // Path is the first column, no separator before it
+        if(strcmp(key, "path") != 0)
+            kt_scan_append(sb, ",", 1);
+        return present;
+    }
+    if(!present)
+        return 0;
+    if(strcmp(key, "path") != 0)
+        kt_scan_append(sb, ",", 1);
+    kt_scan_append(sb, "\"", 1);
+    kt_scan_append(sb, key, strlen(key));
+    kt_scan_append(sb, "\":", 2);
+    return 1;
+}
+
+static void kt_scan_list_begin(struct kt_scan_buffer *sb, enum kt_scan_format format)
+{
+    kt_scan_append(sb, (format == KT_SCAN_CSV ? "\"" : "["), 1);
+}
+
+static void kt_scan_list_next(struct kt_scan_buffer *sb, enum kt_scan_format format, unsigned int i)
+{
+    if(i > 0)
+        kt_scan_append(sb, (format == KT_SCAN_CSV ? ";" : ","), 1);
+}
+
+static void kt_scan_list_end(struct kt_scan_buffer *sb, enum kt_scan_format format)
+{
+    kt_scan_append(sb, (format == KT_SCAN_CSV ? "\"" : "]"), 1);
+}
+
+// Format a result as a single JSON object or CSV row
+static void kt_scan_format_result(struct kt_scan_buffer *sb, enum kt_scan_format format, const struct kt_scan_result *res)
+{
+    static const char *cert_names[] = { "dev", "1K", "2K" };
+    const KTHeader *header = &res->header;
+    const unsigned char *cursor;
+    const unsigned char *metastring;
+    uint16_t metastring_length;
+    const char *name;
+    char magic[2 * MAGIC_NUMBER_LENGTH + 1];
+    int has_magic;
+    int has_devices;
+    int has_platform;
+    int ota;
+    int recovery;
+    int h2;
+    unsigned int num_devices;
+    unsigned int i;
+
+    // Magic numbers that aren't printable (userdata, garbage) are dumped in hex
+    has_magic = (res->parsed || header->version != UnknownUpdate);
+    for(i = 0; i < MAGIC_NUMBER_LENGTH && isprint((unsigned char) header->magic_number[i]); i++)
+        ;
+    if(i == MAGIC_NUMBER_LENGTH)
+        snprintf(magic, sizeof(magic), "%.*s", MAGIC_NUMBER_LENGTH, header->magic_number);
+    else
+        snprintf(magic, sizeof(magic), "%02X%02X%02X%02X", (unsigned char) header->magic_number[0], (unsigned char) header->magic_number[1], (unsigned char) header->magic_number[2], (unsigned char) header->magic_number[3]);
+
+    // What the different kinds of headers have to say
+    ota = (res->parsed && (header->version == OTAUpdate || header->version == OTAUpdateV2));
+    recovery = (res->parsed && (header->version == RecoveryUpdate || header->version == RecoveryUpdateV2));
+    h2 = (recovery && (header->version == RecoveryUpdateV2 || header->header_rev == 2));
+    has_devices = (res->parsed && (header->version == OTAUpdate || header->version == OTAUpdateV2 || header->version == RecoveryUpdateV2 || (header->version == RecoveryUpdate && !h2)));
+    has_platform = h2;
+    num_devices = ((header->version == OTAUpdate || header->version == RecoveryUpdate) ? 1 : header->num_devices);
+
+    sb->line_len = 0;
+    sb->line_failed = 0;
+    if(format == KT_SCAN_JSONL)
+        kt_scan_append(sb, "{", 1);
+    if(kt_scan_field(sb, format, "path", 1))
+        kt_scan_append_string(sb, format, (const unsigned char *) res->path, strlen(res->path), 0, 0);
+    if(kt_scan_field(sb, format, "size", 1))
+        kt_scan_append_uint(sb, (uint64_t) res->size);
+    if(kt_scan_field(sb, format, "status", 1))
+        kt_scan_append_string(sb, format, (const unsigned char *) kt_scan_status_names[res->status], strlen(kt_scan_status_names[res->status]), 0, 0);
+    if(kt_scan_field(sb, format, "envelope", res->wrapped))
+    {
+        name = (res->cert_num <= Certificate2K ? cert_names[res->cert_num] : "unknown");
+        kt_scan_append_string(sb, format, (const unsigned char *) name, strlen(name), 0, 0);
+    }
+    if(kt_scan_field(sb, format, "magic", has_magic))
+        kt_scan_append_string(sb, format, (const unsigned char *) magic, strlen(magic), 0, 0);
+    if(kt_scan_field(sb, format, "type", has_magic))
+    {
+        name = (header->version == UserDataPackage ? "Userdata" : convert_bundle_version(header->version));
+        kt_scan_append_string(sb, format, (const unsigned char *) name, strlen(name), 0, 0);
+    }
+    if(kt_scan_field(sb, format, "source_revision", ota))
+        kt_scan_append_uint(sb, header->source_revision);
+    if(kt_scan_field(sb, format, "target_revision", ota || (recovery && header->version == RecoveryUpdateV2)))
+        kt_scan_append_uint(sb, header->target_revision);
+    if(kt_scan_field(sb, format, "devices", has_devices))
+    {
+        kt_scan_list_begin(sb, format);
+        for(i = 0; i < num_devices; i++)
+        {
+            kt_scan_list_next(sb, format, i);
+            kt_scan_append_uint(sb, (num_devices == 1 && header->devices == NULL ? header->device : kt_header_device(header, i)));
+        }
+        kt_scan_list_end(sb, format);
+    }
+    if(kt_scan_field(sb, format, "device_names", has_devices))
+    {
+        kt_scan_list_begin(sb, format);
+        for(i = 0; i < num_devices; i++)
+        {
+            kt_scan_list_next(sb, format, i);
+            name = convert_device_id((Device)(num_devices == 1 && header->devices == NULL ? header->device : kt_header_device(header, i)));
+            kt_scan_append_string(sb, format, (const unsigned char *) name, strlen(name), 0, 1);
+        }
+        kt_scan_list_end(sb, format);
+    }
+    if(kt_scan_field(sb, format, "platform", has_platform))
+        kt_scan_append_uint(sb, header->platform);
+    if(kt_scan_field(sb, format, "platform_name", has_platform))
+    {
+        name = convert_platform_id((Platform) header->platform);
+        kt_scan_append_string(sb, format, (const unsigned char *) name, strlen(name), 0, 0);
+    }
+    if(kt_scan_field(sb, format, "board", has_platform))
+        kt_scan_append_uint(sb, header->board);
+    if(kt_scan_field(sb, format, "board_name", has_platform))
+    {
+        name = convert_board_id((Board) header->board);
+        kt_scan_append_string(sb, format, (const unsigned char *) name, strlen(name), 0, 0);
+    }
+    if(kt_scan_field(sb, format, "header_rev", has_platform))
+        kt_scan_append_uint(sb, header->header_rev);
+    if(kt_scan_field(sb, format, "magic_1", recovery))
+        kt_scan_append_uint(sb, header->magic_1);
+    if(kt_scan_field(sb, format, "magic_2", recovery))
+        kt_scan_append_uint(sb, header->magic_2);
+    if(kt_scan_field(sb, format, "minor", recovery))
+        kt_scan_append_uint(sb, header->minor);
+    if(kt_scan_field(sb, format, "optional", ota && header->version == OTAUpdate))
+        kt_scan_append_uint(sb, header->optional);
+    if(kt_scan_field(sb, format, "critical", ota && header->version == OTAUpdateV2))
+        kt_scan_append_uint(sb, header->critical);
+    if(kt_scan_field(sb, format, "md5", ota || recovery))
+        kt_scan_append_string(sb, format, (const unsigned char *) header->md5_sum, MD5_HASH_LENGTH, 0, 0);
+    if(kt_scan_field(sb, format, "metadata", ota && header->version == OTAUpdateV2))
+    {
+        kt_scan_list_begin(sb, format);
+        cursor = header->meta;
+        for(i = 0; i < header->num_meta; i++)
+        {
+            kt_scan_list_next(sb, format, i);
+            metastring = kt_header_next_meta(&cursor, &metastring_length);
+            kt_scan_append_string(sb, format, metastring, metastring_length, 1, 1);
+        }
+        kt_scan_list_end(sb, format);
+    }
+    kt_scan_append(sb, (format == KT_SCAN_JSONL ? "}\n" : "\n"), (format == KT_SCAN_JSONL ? 2 : 1));
+}
+
+static void kt_scan_report(struct kt_scan_pool *pool, struct kt_scan_buffer *sb, const struct kt_scan_result *res)
+{
+    kt_scan_format_result(sb, pool->format, res);
+    pthread_mutex_lock(&pool->lock);
+    pool->counts[res->status]++;
+    if(sb->line_failed)
+        fprintf(kt_stderr, "Cannot allocate the record of '%s'.\n", res->path);
+    else
+        fwrite(sb->line, sizeof(char), sb->line_len, pool->out);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void kt_scan_buffer_free(struct kt_scan_buffer *sb)
+{
+    free(sb->data);
+    free(sb->line);
+    memset(sb, 0, sizeof(*sb));
+}
+
+// kt_walk_files callbacks: scan every file, with the scan buffer of the current thread
+static void kt_scan_walk_file(void *arg, void *scratch, int start_fd, const char *path)
+{
+    struct kt_scan_result res;
+
+    kt_scan_file(start_fd, path, scratch, &res);
+    kt_scan_report(arg, scratch, &res);
+}
+
+// An unreadable file gets a record too
+static void kt_scan_walk_unreadable(void *arg, void *scratch, const char *path)
+{
+    struct kt_scan_result res;
+
+    memset(&res, 0, sizeof(res));
+    res.header.version = UnknownUpdate;
+    res.path = path;
+    res.status = KT_SCAN_ERROR;
+    kt_scan_report(arg, scratch, &res);
+}
+
+static void kt_scan_walk_free(void *scratch)
+{
+    kt_scan_buffer_free(scratch);
+}
+
+// Scan the headers of every package in a bunch of files and/or directories, in parallel, and write a record per package to out
+int kindle_scan(char **inputs, unsigned int num_inputs, const unsigned int csv, unsigned int jobs, FILE *out)
+{
+    static const KTWalkCallbacks callbacks = { sizeof(struct kt_scan_buffer), kt_scan_walk_file, kt_scan_walk_unreadable, kt_scan_walk_free };
+    struct kt_scan_pool pool;
+    unsigned int num_workers = 0;
+    unsigned int total;
+    unsigned int i;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    int ret = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.format = (csv ? KT_SCAN_CSV : KT_SCAN_JSONL);
+    pool.out = out;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if(csv)
+        fputs(kt_scan_csv_columns, out);
+    if(kt_walk_files(inputs, num_inputs, jobs, &callbacks, &pool, &num_workers) < 0)
+        ret = -1;
+    pthread_mutex_destroy(&pool.lock);
+    if(fflush(out) != 0)
+    {
+        fprintf(kt_stderr, "Cannot write the scan results: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        ret = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    total = 0;
+    for(i = 0; i < KT_SCAN_STATUS_COUNT; i++)
+        total += pool.counts[i];
+    fprintf(kt_stderr, "Scanned %u files in %.2fs (%.0f files/s, %s): %u packages, %u unknown, %u truncated, %u malformed, %u unreadable.\n", total, elapsed, elapsed > 0 ? (double) total / elapsed : 0.0, (num_workers > 0 ? "threaded" : "sequential"), pool.counts[KT_SCAN_OK], pool.counts[KT_SCAN_UNKNOWN], pool.counts[KT_SCAN_TRUNCATED], pool.counts[KT_SCAN_MALFORMED], pool.counts[KT_SCAN_ERROR]);
+
+    return ret;
+}
+
+int kindle_scan_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "jobs", required_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned int csv = 0;
+    unsigned int jobs = 0;
+    const char *out_name = NULL;
+    FILE *out;
+    int ret;
+
+    // One worker per CPU by default
+    if(parse_jobs("0", &jobs) < 0)
+        jobs = 1;
+
+    while((opt = getopt_long(argc, argv, "f:o:j:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+                if(strcmp(optarg, "jsonl") == 0 || strcmp(optarg, "json") == 0)
+                    csv = 0;
+                else if(strcmp(optarg, "csv") == 0)
+                    csv = 1;
+                else
+                {
+                    fprintf(kt_stderr, "Unknown output format '%s' (jsonl or csv).\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'o':
+                out_name = optarg;
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &jobs) < 0)
+                    return -1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need at least one directory or package to scan).\n");
+        return -1;
+    }
+    if(out_name == NULL || strcmp(out_name, "-") == 0)
+        out = stdout;
+    else if((out = fopen(out_name, "wb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open output '%s' for writing: %s.\n", out_name, strerror(errno));
+        return -1;
+    }
+    fprintf(kt_stderr, "Scanning %d input%s (%s, %u job%s).\n", argc - optind, (argc - optind > 1 ? "s" : ""), (csv ? "CSV" : "JSON Lines"), jobs, (jobs > 1 ? "s" : ""));
+    ret = kindle_scan(&argv[optind], (unsigned int) (argc - optind), csv, jobs, out);
+    if(out != stdout && fclose(out) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Cannot write output '%s': %s.\n", out_name, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,467 @@
+//
+//  store.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+// A content-addressed object store for extract --store: every regular file is hashed (SHA-256) while it's decompressed,
+// written once to objects/<2 hex digits>/<62 hex digits>, and the extracted tree only gets hardlinks to it.
+// Packages built from the same firmware share most of their files, so extracting a bunch of them mostly costs inodes.
+// Objects are read-only (so that nobody edits the store through a hardlink by mistake), and executable files get their own objects.
+// An object is dated like the entry it was first stored for: the packages that share it later on share its mtime too.
+// When the output directory is on another filesystem, we fall back to a reflink (where supported), and to a plain copy.
+
+#define KT_STORE_READ_SIZE (256 * 1024)
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#define KT_STORE_BINARY O_BINARY
+#else
+#define KT_STORE_BINARY 0
+#endif
+// objects/xx/<62 hex digits>-x
+#define KT_STORE_OBJECT_LENGTH (sizeof("/objects/") - 1 + SHA256_DIGEST_SIZE * 2 + 1 + sizeof("-x"))
+
+struct kt_store
+{
+    char *dir;
+    pthread_mutex_t lock;       // Only protects the counters, the filesystem takes care of the rest
+    unsigned int num_new;
+    unsigned int num_reused;
+    unsigned int num_copied;    // Couldn't be hardlinked
+    uint64_t new_bytes;
+    uint64_t reused_bytes;
+};
+
+static int kt_store_mkdir(const char *path)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    if(mkdir(path) != 0 && errno != EEXIST)
+#else
+    if(mkdir(path, 0755) != 0 && errno != EEXIST)
+#endif
+    {
+        fprintf(kt_stderr, "Cannot create directory '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    return 0;
+}
+
+KTStore *kt_store_open(const char *dir)
+{
+    KTStore *store;
+    char *path;
+
+    if((store = calloc(1, sizeof(*store))) == NULL || (store->dir = strdup(dir)) == NULL || (path = malloc(strlen(dir) + sizeof("/objects"))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate object store: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        if(store != NULL)
+            free(store->dir);
+        free(store);
+        return NULL;
+    }
+    sprintf(path, "%s/tmp", dir);
+    if(kt_store_mkdir(dir) < 0 || kt_store_mkdir(path) < 0)
+    {
+        free(path);
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    sprintf(path, "%s/objects", dir);
+    if(kt_store_mkdir(path) < 0)
+    {
+        free(path);
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    free(path);
+    pthread_mutex_init(&store->lock, NULL);
+
+    return store;
+}
+
+void kt_store_close(KTStore *store)
+{
+    if(store == NULL)
+        return;
+    fprintf(kt_stderr, "Store '%s': %u new objects (%.1f MiB written), %u reused (%.1f MiB saved)", store->dir, store->num_new, (double) store->new_bytes / (1024.0 * 1024.0), store->num_reused, (double) store->reused_bytes / (1024.0 * 1024.0));
+    if(store->num_copied > 0)
+        fprintf(kt_stderr, ", %u files had to be copied", store->num_copied);
+    fprintf(kt_stderr, ".\n");
+    pthread_mutex_destroy(&store->lock);
+    free(store->dir);
+    free(store);
+}
+
+// Where the object of that digest lives (its directory is created on the fly)
+static char *kt_store_object_name(KTStore *store, const uint8_t *digest, const unsigned int exec)
+{
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    char *name;
+    size_t len;
+
+    base16_encode_update(hex, SHA256_DIGEST_SIZE, digest);
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+    if((name = malloc(strlen(store->dir) + KT_STORE_OBJECT_LENGTH)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate object name: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return NULL;
+    }
+    len = (size_t) sprintf(name, "%s/objects/%.2s", store->dir, hex);
+    if(kt_store_mkdir(name) < 0)
+    {
+        free(name);
+        return NULL;
+    }
+    sprintf(name + len, "/%s%s", hex + 2, (exec ? "-x" : ""));
+
+    return name;
+}
+
+// A temporary file in the store, on the same filesystem as the objects, so that we can rename it into place
+static int kt_store_temp(KTStore *store, char **temp_name)
+{
+    int fd;
+
+    if((*temp_name = malloc(strlen(store->dir) + sizeof("/tmp/object_XXXXXX"))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate temporary object name: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    sprintf(*temp_name, "%s/tmp/object_XXXXXX", store->dir);
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    if(_mktemp(*temp_name) == NULL)
+        fd = -1;
+    else
+        fd = open(*temp_name, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600);
+#else
+    fd = mkstemp(*temp_name);
+#endif
+    if(fd == -1)
+    {
+        fprintf(kt_stderr, "Cannot create temporary object '%s': %s.\n", *temp_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        free(*temp_name);
+        *temp_name = NULL;
+    }
+    return fd;
+}
+
+static int kt_store_write(int fd, const char *name, const unsigned char *data, size_t size)
+{
+    ssize_t written;
+
+    while(size > 0)
+    {
+        if((written = write(fd, data, size)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(kt_stderr, "Cannot write to '%s': %s.\n", name, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            return -1;
+        }
+        data += written;
+        size -= (size_t) written;
+    }
+    return 0;
+}
+
+// Restore the entry's mtime, like write_disk would have
+static void kt_store_set_times(int fd, const char *name, struct archive_entry *entry)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    struct timespec times[2];
+
+    times[0].tv_sec = archive_entry_mtime(entry);
+    times[0].tv_nsec = archive_entry_mtime_nsec(entry);
+    times[1] = times[0];
+    if(futimens(fd, times) != 0)
+        fprintf(kt_stderr, "Cannot restore the times of '%s': %s.\n", name, strerror(errno));
+#else
+    (void) fd;
+    (void) name;
+    (void) entry;
+#endif
+}
+
+// Turn a complete temporary file into an object. If someone beat us to it, the content is the same anyway.
+static int kt_store_commit(const char *temp_name, int fd, const char *object, const unsigned int exec, struct archive_entry *entry)
+{
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    fchmod(fd, (exec ? 0555 : 0444));
+#endif
+    kt_store_set_times(fd, temp_name, entry);
+    if(close(fd) != 0)
+    {
+        fprintf(kt_stderr, "Cannot write to '%s': %s.\n", temp_name, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        unlink(temp_name);
+        return -1;
+    }
+    if(kt_rename_replace(temp_name, object) != 0)
+    {
+        fprintf(kt_stderr, "Cannot move '%s' to '%s': %s.\n", temp_name, object, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        unlink(temp_name);
+        return -1;
+    }
+    return 0;
+}
+
+// When we can't hardlink, clone the object (reflink, where the filesystem supports it), or copy it
+static int kt_store_copy(const char *object, const char *path, const unsigned int exec, struct archive_entry *entry)
+{
+    unsigned char *buf = NULL;
+    ssize_t len;
+    int in;
+    int out;
+    int ret = -1;
+
+    if((in = open(object, O_RDONLY | KT_STORE_BINARY)) == -1)
+    {
+        fprintf(kt_stderr, "Cannot open object '%s': %s.\n", object, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+    if((out = open(path, O_WRONLY | O_CREAT | O_TRUNC | KT_STORE_BINARY, (exec ? 0755 : 0644))) == -1)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for writing: %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        close(in);
+        return -1;
+    }
+#if defined(__linux__) && defined(FICLONE)
+    if(ioctl(out, FICLONE, in) == 0)
+    {
+        ret = 0;
+        goto cleanup;
+    }
+#endif
+    if((buf = malloc(KT_STORE_READ_SIZE)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a copy buffer: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        goto cleanup;
+    }
+    while((len = read(in, buf, KT_STORE_READ_SIZE)) != 0)
+    {
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(kt_stderr, "Cannot read object '%s': %s.\n", object, strerror(errno));
+            kt_set_error(KT_ERR_IO);
+            goto cleanup;
+        }
+        if(kt_store_write(out, path, buf, (size_t) len) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if(ret == 0)
+        kt_store_set_times(out, path, entry);
+    free(buf);
+    close(in);
+    if(close(out) != 0 && ret == 0)
+    {
+        fprintf(kt_stderr, "Cannot write to '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        ret = -1;
+    }
+    return ret;
+}
+
+// Make path point to the object
+static int kt_store_materialize(KTStore *store, const char *object, const char *path, const unsigned int exec, struct archive_entry *entry, const unsigned int is_new, uint64_t size)
+{
+    unsigned int copied = 0;
+
+    // Like tar, replace whatever was there
+    if(unlink(path) != 0 && errno != ENOENT)
+    {
+        fprintf(kt_stderr, "Cannot replace '%s': %s.\n", path, strerror(errno));
+        kt_set_error(KT_ERR_IO);
+        return -1;
+    }
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    if(!CreateHardLinkA(path, object, NULL))
+#else
+    if(link(object, path) != 0)
+#endif
+    {
+        if(kt_store_copy(object, path, exec, entry) < 0)
+            return -1;
+        copied = 1;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    if(is_new)
+    {
+        store->num_new++;
+        store->new_bytes += size;
+    }
+    else
+    {
+        store->num_reused++;
+        store->reused_bytes += size;
+    }
+    store->num_copied += copied;
+    pthread_mutex_unlock(&store->lock);
+
+    return 0;
+}
+
+static int kt_store_exists(const char *object)
+{
+    struct stat st;
+
+    return (stat(object, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+// A file we already have in memory (from the writer pool): we only touch the disk if it's a new object
+int kt_store_add_data(KTStore *store, const void *data, size_t size, struct archive_entry *entry, const char *path)
+{
+    struct sha256_ctx sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    unsigned int exec = ((archive_entry_mode(entry) & 0111) != 0);
+    unsigned int is_new = 0;
+    char *object;
+    char *temp_name;
+    int fd;
+    int ret = -1;
+
+    sha256_init(&sha256);
+    sha256_update(&sha256, size, data);
+    sha256_digest(&sha256, SHA256_DIGEST_SIZE, digest);
+    if((object = kt_store_object_name(store, digest, exec)) == NULL)
+        return -1;
+
+    if(!kt_store_exists(object))
+    {
+        if((fd = kt_store_temp(store, &temp_name)) == -1)
+            goto cleanup;
+        if(kt_store_write(fd, temp_name, data, size) < 0)
+        {
+            close(fd);
+            unlink(temp_name);
+            free(temp_name);
+            goto cleanup;
+        }
+        if(kt_store_commit(temp_name, fd, object, exec, entry) < 0)
+        {
+            free(temp_name);
+            goto cleanup;
+        }
+        free(temp_name);
+        is_new = 1;
+    }
+    ret = kt_store_materialize(store, object, path, exec, entry, is_new, size);
+
+cleanup:
+    free(object);
+    return ret;
+}
+
+// Stream the current entry of a read archive to the store (we only know its digest once we're done, so it always goes through a temporary file)
+int kt_store_add_entry(KTStore *store, struct archive *a, struct archive_entry *entry, const char *path)
+{
+    struct sha256_ctx sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    unsigned int exec = ((archive_entry_mode(entry) & 0111) != 0);
+    unsigned int is_new = 0;
+    unsigned char *buf;
+    char *object = NULL;
+    char *temp_name = NULL;
+    uint64_t size = 0;
+    ssize_t len;
+    int fd;
+    int ret = -1;
+
+    if((buf = malloc(KT_STORE_READ_SIZE)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read buffer: %s.\n", strerror(errno));
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if((fd = kt_store_temp(store, &temp_name)) == -1)
+    {
+        free(buf);
+        return -1;
+    }
+    sha256_init(&sha256);
+    // archive_read_data fills the holes of sparse entries for us, so that they hash like anything else
+    while((len = archive_read_data(a, buf, KT_STORE_READ_SIZE)) != 0)
+    {
+        if(len < 0)
+        {
+            fprintf(kt_stderr, "archive_read_data() failed: %s.\n", archive_error_string(a));
+            kt_set_error(KT_ERR_ARCHIVE);
+            close(fd);
+            unlink(temp_name);
+            goto cleanup;
+        }
+        sha256_update(&sha256, (size_t) len, buf);
+        if(kt_store_write(fd, temp_name, buf, (size_t) len) < 0)
+        {
+            close(fd);
+            unlink(temp_name);
+            goto cleanup;
+        }
+        size += (uint64_t) len;
+    }
+    sha256_digest(&sha256, SHA256_DIGEST_SIZE, digest);
+    if((object = kt_store_object_name(store, digest, exec)) == NULL)
+    {
+        close(fd);
+        unlink(temp_name);
+        goto cleanup;
+    }
+
+    if(kt_store_exists(object))
+    {
+        close(fd);
+        unlink(temp_name);
+    }
+    else
+    {
+        if(kt_store_commit(temp_name, fd, object, exec, entry) < 0)
+            goto cleanup;
+        is_new = 1;
+    }
+    ret = kt_store_materialize(store, object, path, exec, entry, is_new, size);
+
+cleanup:
+    free(buf);
+    free(temp_name);
+    free(object);
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,878 @@
+//
+//  verify.c
+//  KindleTool
+//
+//  Copyright (C) 2011-2015  Yifan Lu
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+enum kt_verify_status
+{
+    KT_VERIFY_NONE = 0,         // Nothing to check against
+    KT_VERIFY_PENDING,          // Waiting for a worker
+    KT_VERIFY_OK,
+    KT_VERIFY_BAD
+};
+
+// Everything we learn about a single path while streaming the package
+struct kt_verify_file
+{
+    char *path;
+    int has_data;               // We've seen the file itself (and hashed it)
+    int has_sig;                // We've seen its .sig
+    int is_filelist;
+    char md5[MD5_HASH_LENGTH + 1];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    uint8_t sig[CERTIFICATE_2K_SIZE];
+    size_t sig_len;
+    int listed;                 // update-filelist.dat has a record for it
+    char listed_md5[MD5_HASH_LENGTH + 1];
+    enum kt_verify_status sig_status;
+};
+
+struct kt_verify_table
+{
+    struct kt_verify_file *files;
+    size_t count;
+    size_t size;
+    KTHashTable index;          // Of files, by path
+};
+
+// An RSA check, waiting for a worker thread
+struct kt_verify_job
+{
+    size_t index;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t sig[CERTIFICATE_2K_SIZE];
+    size_t sig_len;
+    int ok;
+    struct kt_verify_job *next;
+};
+
+// Shared state between the decompression thread & the RSA workers
+struct kt_verify_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct kt_verify_job *head;
+    struct kt_verify_job *tail;
+    struct kt_verify_job *finished;
+    int done;                   // The decompression thread won't queue anything else
+    const struct rsa_public_key *pubkey;
+};
+
+static size_t kt_verify_hash(void *arg, size_t index)
+{
+    const struct kt_verify_table *table = arg;
+
+    return kt_hash_path(table->files[index].path, strlen(table->files[index].path));
+}
+
+static int kt_verify_match(void *arg, size_t index, const void *path, size_t len)
+{
+    const struct kt_verify_table *table = arg;
+
+    return strncmp(table->files[index].path, path, len) == 0 && table->files[index].path[len] == '\0';
+}
+
+// Find the record for path (first len bytes), or create it
+static struct kt_verify_file *kt_verify_lookup(struct kt_verify_table *table, const char *path, size_t len)
+{
+    struct kt_verify_file *file;
+    size_t i;
+
+    if((i = kt_hash_table_find(&table->index, kt_hash_path(path, len), path, len)) != KT_HASH_NONE)
+        return &table->files[i];
+
+    if(table->count == table->size)
+    {
+        file = realloc(table->files, (table->size ? table->size * 2 : 256) * sizeof(*file));
+        if(file == NULL)
+            return NULL;
+        table->files = file;
+        table->size = (table->size ? table->size * 2 : 256);
+    }
+    file = &table->files[table->count];
+    memset(file, 0, sizeof(*file));
+    if((file->path = malloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(file->path, path, len);
+    file->path[len] = '\0';
+    if(kt_hash_table_insert(&table->index, table->count) < 0)
+    {
+        free(file->path);
+        return NULL;
+    }
+    table->count++;
+
+    return file;
+}
+
+static void kt_verify_table_free(struct kt_verify_table *table)
+{
+    size_t i;
+
+    for(i = 0; i < table->count; i++)
+        free(table->files[i].path);
+    free(table->files);
+    kt_hash_table_free(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+static int kt_verify_check_sig(const struct rsa_public_key *pubkey, const uint8_t *digest, const uint8_t *sig, size_t sig_len)
+{
+    mpz_t s;
+    int ok;
+
+    // The sig has to be exactly as large as the key
+    if(sig_len != pubkey->size)
+        return 0;
+    mpz_init(s);
+    mpz_import(s, sig_len, 1, 1, 1, 0, sig);
+    ok = rsa_sha256_verify_digest(pubkey, digest, s);
+    mpz_clear(s);
+
+    return ok;
+}
+
+// Worker thread: pop jobs off the queue, check them, and move them to the finished list
+static void *kt_verify_worker(void *arg)
+{
+    struct kt_verify_pool *pool = arg;
+    struct kt_verify_job *job;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->done)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if(pool->head == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if(pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->ok = kt_verify_check_sig(pool->pubkey, job->digest, job->sig, job->sig_len);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->finished;
+        pool->finished = job;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+// Once we've got both a file & its signature, check it (on the pool if we have one)
+static int kt_verify_submit(struct kt_verify_table *table, struct kt_verify_file *file, struct kt_verify_pool *pool, unsigned int num_workers)
+{
+    struct kt_verify_job *job;
+
+    if(!file->has_data || !file->has_sig || file->sig_status != KT_VERIFY_NONE)
+        return 0;
+    // Too large to be a sig
+    if(file->sig_len > sizeof(file->sig))
+    {
+        file->sig_status = KT_VERIFY_BAD;
+        return 0;
+    }
+    if(num_workers == 0)
+    {
+        file->sig_status = (kt_verify_check_sig(pool->pubkey, file->sha256, file->sig, file->sig_len) ? KT_VERIFY_OK : KT_VERIFY_BAD);
+        return 0;
+    }
+
+    if((job = malloc(sizeof(*job))) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a verification job.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    job->index = (size_t) (file - table->files);
+    memcpy(job->digest, file->sha256, sizeof(job->digest));
+    memcpy(job->sig, file->sig, file->sig_len);
+    job->sig_len = file->sig_len;
+    job->ok = 0;
+    job->next = NULL;
+    file->sig_status = KT_VERIFY_PENDING;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+// Remember what a 'type md5 path blocks displayname' record of the index file says
+static int kt_verify_filelist_record(void *arg, const KTFilelistRecord *record)
+{
+    struct kt_verify_table *table = arg;
+    struct kt_verify_file *listed;
+    const char *path;
+    size_t len;
+
+    path = kt_normalize_entry_path(record->path, &len);
+    if((listed = kt_verify_lookup(table, path, len)) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a file record.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    listed->listed = 1;
+    snprintf(listed->listed_md5, sizeof(listed->listed_md5), "%s", record->md5);
+
+    return 0;
+}
+
+// Hash the current entry's data, and pick up the index file's records on the way if that's what it is.
+// NOTE: The table may grow while we parse the index file, so we work with an index, not a pointer.
+static int kt_verify_hash_entry(struct archive *a, struct kt_verify_table *table, size_t index)
+{
+    struct kt_verify_file *file;
+    struct md5_ctx md5;
+    struct sha256_ctx sha256;
+    uint8_t md5_buf[MD5_DIGEST_SIZE];
+    KTFilelistReader reader;
+    int is_filelist = table->files[index].is_filelist;
+    const char *buff;
+    size_t size;
+    int64_t offset;
+    int r;
+
+    kt_filelist_reader_init(&reader, kt_verify_filelist_record, table);
+    md5_init(&md5);
+    sha256_init(&sha256);
+    while((r = archive_read_data_block(a, (const void **) &buff, &size, &offset)) == ARCHIVE_OK)
+    {
+        md5_update(&md5, size, (const uint8_t *) buff);
+        sha256_update(&sha256, size, (const uint8_t *) buff);
+        if(is_filelist && kt_filelist_reader_feed(&reader, buff, size) < 0)
+            return -1;
+    }
+    if(r != ARCHIVE_EOF)
+    {
+        fprintf(kt_stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
+        kt_set_error(KT_ERR_ARCHIVE);
+        return -1;
+    }
+    if(is_filelist && kt_filelist_reader_end(&reader) < 0)
+        return -1;
+
+    file = &table->files[index];
+    md5_digest(&md5, sizeof(md5_buf), md5_buf);
+    base16_encode_update(file->md5, sizeof(md5_buf), md5_buf);
+    file->md5[MD5_HASH_LENGTH] = '\0';
+    sha256_digest(&sha256, sizeof(file->sha256), file->sha256);
+    file->has_data = 1;
+
+    return 0;
+}
+
+// Stream the package once, hash everything, check the signatures, then cross-check the index file
+int kindle_verify(FILE *input, const unsigned int fake_sign, const struct rsa_public_key *pubkey, unsigned int jobs, const KTInflateOptions *inflate, FILE *out)
+{
+    KTIndex stream;
+    struct archive *a;
+    struct archive_entry *entry;
+    struct kt_verify_table table;
+    struct kt_verify_pool pool;
+    struct kt_verify_job *job;
+    pthread_t *workers = NULL;
+    unsigned int num_workers = 0;
+    struct kt_verify_file *file;
+    char name[PATH_MAX];
+    const char *path;
+    size_t len;
+    const void *buff;
+    size_t size;
+    int64_t offset;
+    unsigned int num_passed = 0;
+    unsigned int num_failed = 0;
+    unsigned int num_sigs = 0;
+    int failed;
+    int r;
+    size_t i;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    int ret = -1;
+
+    memset(&stream, 0, sizeof(stream));
+    memset(&table, 0, sizeof(table));
+    kt_hash_table_init(&table.index, kt_verify_hash, kt_verify_match, &table);
+    memset(&pool, 0, sizeof(pool));
+    pool.pubkey = pubkey;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if((a = archive_read_new()) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot allocate a read archive.\n");
+        kt_set_error(KT_ERR_NOMEM);
+        return -1;
+    }
+    if(kt_payload_read_open(a, &stream, input, fake_sign, inflate) < 0)
+    {
+        archive_read_free(a);
+        free(stream.points);
+        return -1;
+    }
+
+    // RSA checks happen on the pool while we keep decompressing
+    if(jobs > 1)
+    {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.not_empty, NULL);
+        if((workers = malloc(jobs * sizeof(*workers))) != NULL)
+        {
+            for(num_workers = 0; num_workers < jobs; num_workers++)
+            {
+                if(pthread_create(&workers[num_workers], NULL, kt_verify_worker, &pool) != 0)
+                    break;
+            }
+        }
+        if(num_workers == 0)
+            fprintf(kt_stderr, "Cannot spawn worker threads, verifying sequentially.\n");
+    }
+
+    for(;;)
+    {
+        r = archive_read_next_header(a, &entry);
+        if(r == ARCHIVE_EOF)
+            break;
+        if(r != ARCHIVE_OK)
+            fprintf(kt_stderr, "archive_read_next_header() failed: %s.\n", archive_error_string(a));
+        if(r < ARCHIVE_WARN)
+        {
+            kt_set_error(KT_ERR_ARCHIVE);
+            goto cleanup;
+        }
+        // Our own index (create --seekable) isn't signed, the device doesn't care about it
+        if((archive_entry_filetype(entry) != AE_IFREG && archive_entry_hardlink(entry) == NULL) || strcmp(archive_entry_pathname(entry), KT_INDEX_SEEK_NAME) == 0)
+        {
+            archive_read_data_skip(a);
+            continue;
+        }
+
+        path = kt_normalize_entry_path(archive_entry_pathname(entry), &len);
+        if(len > 4 && IS_SIG(path))
+        {
+            // Signatures are attached to the file they sign
+            if((file = kt_verify_lookup(&table, path, len - 4)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate a file record.\n");
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            file->has_sig = 1;
+            file->sig_len = 0;
+            while((r = archive_read_data_block(a, &buff, &size, &offset)) == ARCHIVE_OK)
+            {
+                // Anything larger than a 2K sig can't be right anyway, remember it's too large, but don't keep it
+                if(file->sig_len + size > sizeof(file->sig))
+                    file->sig_len = sizeof(file->sig) + 1;
+                else
+                {
+                    memcpy(file->sig + file->sig_len, buff, size);
+                    file->sig_len += size;
+                }
+            }
+            if(r != ARCHIVE_EOF)
+            {
+                fprintf(kt_stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
+                kt_set_error(KT_ERR_ARCHIVE);
+                goto cleanup;
+            }
+        }
+        else
+        {
+            if((file = kt_verify_lookup(&table, path, len)) == NULL)
+            {
+                fprintf(kt_stderr, "Cannot allocate a file record.\n");
+                kt_set_error(KT_ERR_NOMEM);
+                goto cleanup;
+            }
+            kt_basename(path, name, sizeof(name));
+            file->is_filelist = (strcmp(name, INDEX_FILE_NAME) == 0);
+            i = (size_t) (file - table.files);
+            if(archive_entry_hardlink(entry) != NULL)
+            {
+                // A duplicate archived as a hardlink (create --dedup) has the content of its target
+                struct kt_verify_file *target;
+                size_t target_len;
+
+                path = kt_normalize_entry_path(archive_entry_hardlink(entry), &target_len);
+                if((target = kt_verify_lookup(&table, path, target_len)) == NULL)
+                {
+                    fprintf(kt_stderr, "Cannot allocate a file record.\n");
+                    kt_set_error(KT_ERR_NOMEM);
+                    goto cleanup;
+                }
+                file = &table.files[i];
+                memcpy(file->md5, target->md5, sizeof(file->md5));
+                memcpy(file->sha256, target->sha256, sizeof(file->sha256));
+                file->has_data = target->has_data;
+            }
+            else if(kt_verify_hash_entry(a, &table, i) < 0)
+                goto cleanup;
+            file = &table.files[i];
+        }
+        if(kt_verify_submit(&table, file, &pool, num_workers) < 0)
+            goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    if(num_workers > 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.done = 1;
+        pthread_cond_broadcast(&pool.not_empty);
+        pthread_mutex_unlock(&pool.lock);
+        for(i = 0; i < num_workers; i++)
+            pthread_join(workers[i], NULL);
+    }
+    if(workers != NULL)
+    {
+        // Collect the results (and whatever didn't get a chance to run if we bailed out)
+        while((job = pool.finished) != NULL)
+        {
+            pool.finished = job->next;
+            table.files[job->index].sig_status = (job->ok ? KT_VERIFY_OK : KT_VERIFY_BAD);
+            free(job);
+        }
+        while((job = pool.head) != NULL)
+        {
+            pool.head = job->next;
+            free(job);
+        }
+        free(workers);
+        pthread_cond_destroy(&pool.not_empty);
+        pthread_mutex_destroy(&pool.lock);
+    }
+    archive_read_free(a);
+    free(stream.points);
+
+    if(ret < 0)
+    {
+        kt_verify_table_free(&table);
+        return -1;
+    }
+
+    // Report, in archive order
+    fprintf(kt_stderr, "\n");
+    for(i = 0; i < table.count; i++)
+    {
+        const char *sig_str;
+        const char *md5_str;
+
+        file = &table.files[i];
+        failed = 0;
+        if(file->has_sig)
+            num_sigs++;
+        if(!file->has_data)
+        {
+            // A signature or an index record for something that isn't there
+            if(file->has_sig)
+                fprintf(out, "FAIL  sig=%-7s md5=%-7s %s.sig\n", "orphan", "-", file->path);
+            if(file->listed)
+                fprintf(out, "FAIL  sig=%-7s md5=%-7s %s\n", "-", "missing", file->path);
+            num_failed++;
+            continue;
+        }
+        switch(file->sig_status)
+        {
+            case KT_VERIFY_OK:
+                sig_str = "ok";
+                break;
+            case KT_VERIFY_BAD:
+                sig_str = "BAD";
+                failed = 1;
+                break;
+            default:
+                sig_str = "none";
+                failed = 1;
+                break;
+        }
+        if(file->listed)
+        {
+            if(strcasecmp(file->md5, file->listed_md5) == 0)
+                md5_str = "ok";
+            else
+            {
+                md5_str = "BAD";
+                failed = 1;
+            }
+        }
+        else
+            md5_str = "-";
+        fprintf(out, "%s  sig=%-7s md5=%-7s %s\n", (failed ? "FAIL" : "PASS"), sig_str, md5_str, file->path);
+        if(failed)
+            num_failed++;
+        else
+            num_passed++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    fprintf(kt_stderr, "\nVerified %zu files (%u signatures, %s) in %.2fs: %u passed, %u failed.\n", table.count, num_sigs, (num_workers > 0 ? "threaded" : "sequential"), elapsed, num_passed, num_failed);
+    kt_verify_table_free(&table);
+
+    if(num_failed > 0)
+    {
+        kt_set_error(KT_ERR_INTEGRITY);
+        return 1;
+    }
+    return 0;
+}
+
+// How much of a package each worker reads at once
+#define KT_ENVELOPE_CHUNK (64 * 1024)
+
+enum kt_envelope_status
+{
+    KT_ENVELOPE_OK = 0,
+    KT_ENVELOPE_BAD,            // Signature doesn't match the wrapped content
+    KT_ENVELOPE_NOKEY,          // We don't have the key for this certificate
+    KT_ENVELOPE_SKIPPED,        // Not an SP01 envelope
+    KT_ENVELOPE_ERROR,          // Couldn't read it
+    KT_ENVELOPE_STATUS_COUNT
+};
+
+static const char *kt_envelope_status_names[KT_ENVELOPE_STATUS_COUNT] = { "OK", "BAD", "NOKEY", "SKIP", "ERROR" };
+
+// Shared state between the envelope workers
+struct kt_envelope_pool
+{
+    pthread_mutex_t lock;       // Serializes the reports
+    const struct rsa_public_key **keys;     // Indexed by CertificateNumber
+    FILE *out;
+    unsigned int counts[KT_ENVELOPE_STATUS_COUNT];
+};
+
+// Check the signature of an SP01 envelope against the bytes it wraps, with a single, fixed size buffer
+static enum kt_envelope_status kt_verify_envelope_file(int start_fd, const char *path, const struct rsa_public_key **keys, unsigned char *buffer, CertificateNumber *cert_num)
+{
+    KTHeader header;
+    unsigned char header_data[MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE];
+    struct sha256_ctx sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t sig[CERTIFICATE_2K_SIZE];
+    size_t sig_len;
+    size_t len;
+    FILE *input;
+    int fd;
+    enum kt_envelope_status status;
+
+    *cert_num = CertificateUnknown;
+    if((fd = kt_walk_open(start_fd, path, O_RDONLY)) < 0 || (input = fdopen(fd, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open '%s' for reading: %s.\n", path, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return KT_ENVELOPE_ERROR;
+    }
+    // The whole SP01 header, in one read
+    len = fread(header_data, sizeof(unsigned char), sizeof(header_data), input);
+    if(len < MAGIC_NUMBER_LENGTH || memcmp(header_data, "SP01", MAGIC_NUMBER_LENGTH) != 0)
+    {
+        status = KT_ENVELOPE_SKIPPED;
+        goto cleanup;
+    }
+    if(kt_header_parse(&header, header_data, len) != 0)
+    {
+        fprintf(kt_stderr, "Cannot read the signature header of '%s'.\n", path);
+        status = KT_ENVELOPE_ERROR;
+        goto cleanup;
+    }
+    *cert_num = (CertificateNumber)(header.certificate_number);
+    switch(*cert_num)
+    {
+        case CertificateDeveloper:
+            sig_len = CERTIFICATE_DEV_SIZE;
+            break;
+        case Certificate1K:
+            sig_len = CERTIFICATE_1K_SIZE;
+            break;
+        case Certificate2K:
+            sig_len = CERTIFICATE_2K_SIZE;
+            break;
+        case CertificateUnknown:
+        default:
+            fprintf(kt_stderr, "Unknown certificate number %u in '%s'.\n", (unsigned int) *cert_num, path);
+            status = KT_ENVELOPE_ERROR;
+            goto cleanup;
+    }
+    if(keys[*cert_num] == NULL)
+    {
+        status = KT_ENVELOPE_NOKEY;
+        goto cleanup;
+    }
+    if(fread(sig, sizeof(unsigned char), sig_len, input) < sig_len)
+    {
+        fprintf(kt_stderr, "Cannot read the signature of '%s'.\n", path);
+        status = KT_ENVELOPE_ERROR;
+        goto cleanup;
+    }
+
+    // The signature covers everything after it
+    sha256_init(&sha256);
+    while((len = fread(buffer, sizeof(unsigned char), KT_ENVELOPE_CHUNK, input)) > 0)
+        sha256_update(&sha256, len, buffer);
+    if(ferror(input))
+    {
+        fprintf(kt_stderr, "Cannot read '%s': %s.\n", path, strerror(errno));
+        status = KT_ENVELOPE_ERROR;
+        goto cleanup;
+    }
+    sha256_digest(&sha256, sizeof(digest), digest);
+    status = (kt_verify_check_sig(keys[*cert_num], digest, sig, sig_len) ? KT_ENVELOPE_OK : KT_ENVELOPE_BAD);
+
+cleanup:
+    fclose(input);
+    return status;
+}
+
+static void kt_envelope_report(struct kt_envelope_pool *pool, const char *path, enum kt_envelope_status status, CertificateNumber cert_num)
+{
+    static const char *cert_names[] = { "dev", "1K", "2K" };
+
+    pthread_mutex_lock(&pool->lock);
+    pool->counts[status]++;
+    fprintf(pool->out, "%-5s  %-3s  %s\n", kt_envelope_status_names[status], (cert_num <= Certificate2K ? cert_names[cert_num] : "-"), path);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// kt_walk_files callbacks: check every file, reading it through the current thread's buffer
+static void kt_envelope_walk_file(void *arg, void *scratch, int start_fd, const char *path)
+{
+    struct kt_envelope_pool *pool = arg;
+    enum kt_envelope_status status;
+    CertificateNumber cert_num;
+
+    status = kt_verify_envelope_file(start_fd, path, pool->keys, scratch, &cert_num);
+    kt_envelope_report(pool, path, status, cert_num);
+}
+
+// An unreadable file counts
+static void kt_envelope_walk_unreadable(void *arg, void *scratch, const char *path)
+{
+    (void) scratch;
+    kt_envelope_report(arg, path, KT_ENVELOPE_ERROR, CertificateUnknown);
+}
+
+// Check the SP01 signature of every package in a bunch of files and/or directories, in parallel
+int kindle_verify_envelopes(char **inputs, unsigned int num_inputs, const struct rsa_public_key **keys, unsigned int jobs, FILE *out)
+{
+    static const KTWalkCallbacks callbacks = { KT_ENVELOPE_CHUNK, kt_envelope_walk_file, kt_envelope_walk_unreadable, NULL };
+    struct kt_envelope_pool pool;
+    unsigned int num_workers = 0;
+    unsigned int total;
+    unsigned int i;
+    struct timespec start_time;
+    struct timespec end_time;
+    double elapsed;
+    int ret = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.keys = keys;
+    pool.out = out;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if(kt_walk_files(inputs, num_inputs, jobs, &callbacks, &pool, &num_workers) < 0)
+        ret = -1;
+    pthread_mutex_destroy(&pool.lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed = (double) (end_time.tv_sec - start_time.tv_sec) + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    total = 0;
+    for(i = 0; i < KT_ENVELOPE_STATUS_COUNT; i++)
+        total += pool.counts[i];
+    fprintf(kt_stderr, "\nChecked %u files in %.2fs (%.0f files/s, %s): %u valid, %u invalid, %u without a key, %u not wrapped, %u unreadable.\n", total, elapsed, elapsed > 0 ? (double) total / elapsed : 0.0, (num_workers > 0 ? "threaded" : "sequential"), pool.counts[KT_ENVELOPE_OK], pool.counts[KT_ENVELOPE_BAD], pool.counts[KT_ENVELOPE_NOKEY], pool.counts[KT_ENVELOPE_SKIPPED], pool.counts[KT_ENVELOPE_ERROR]);
+
+    if(ret < 0)
+        return -1;
+    if(pool.counts[KT_ENVELOPE_BAD] > 0 || pool.counts[KT_ENVELOPE_ERROR] > 0)
+    {
+        kt_set_error(KT_ERR_INTEGRITY);
+        return 1;
+    }
+    return 0;
+}
+
+// Load a PEM key in one of our slots, replacing whatever was there
+static int kt_verify_load_key(char *filename, struct rsa_public_key *key, int *loaded)
+{
+    if(*loaded)
+        rsa_public_key_clear(key);
+    rsa_public_key_init(key);
+    *loaded = 1;
+    if(nettle_rsa_pubkey_from_pem(filename, key) != 0)
+    {
+        fprintf(kt_stderr, "Key %s cannot be loaded.\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int kindle_verify_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "unsigned", no_argument, NULL, 'u' },
+        { "pubkey", required_argument, NULL, 'k' },
+        { "1k-pubkey", required_argument, NULL, '1' },
+        { "2k-pubkey", required_argument, NULL, '2' },
+        { "envelope", no_argument, NULL, 'S' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "inflate-jobs", required_argument, NULL, 'z' },
+        { "speculative", no_argument, NULL, 'Z' },
+        { NULL, 0, NULL, 0 }
+    };
+    KTInflateOptions inflate = { 0, 0 };
+    unsigned int fake_sign = 0;
+    unsigned int envelope = 0;
+    unsigned int jobs = 0;
+    // Indexed by CertificateNumber: the developer key (which is also the one used for the per-file signatures), then the official 1K & 2K keys
+    struct rsa_public_key pubkeys[3];
+    int loaded[3] = { 0, 0, 0 };
+    const struct rsa_public_key *keys[3] = { NULL, NULL, NULL };
+    const char *in_name = "-";
+    FILE *input;
+    unsigned int i;
+    int ret = -1;
+
+    pubkeys[CertificateDeveloper] = get_default_pubkey();
+    loaded[CertificateDeveloper] = 1;
+    if(parse_jobs("0", &jobs) < 0)
+        jobs = 1;
+    while((opt = getopt_long(argc, argv, "uk:1:2:Sj:z:Z", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'u':
+                fake_sign = 1;
+                break;
+            case 'k':
+                if(kt_verify_load_key(optarg, &pubkeys[CertificateDeveloper], &loaded[CertificateDeveloper]) < 0)
+                    goto cleanup;
+                break;
+            case '1':
+                if(kt_verify_load_key(optarg, &pubkeys[Certificate1K], &loaded[Certificate1K]) < 0)
+                    goto cleanup;
+                break;
+            case '2':
+                if(kt_verify_load_key(optarg, &pubkeys[Certificate2K], &loaded[Certificate2K]) < 0)
+                    goto cleanup;
+                break;
+            case 'S':
+                envelope = 1;
+                break;
+            case 'j':
+                if(parse_jobs(optarg, &jobs) < 0)
+                    goto cleanup;
+                break;
+            case 'z':
+                if(parse_jobs(optarg, &inflate.jobs) < 0)
+                    goto cleanup;
+                break;
+            case 'Z':
+                inflate.speculative = 1;
+                break;
+            case ':':
+                fprintf(kt_stderr, "Missing argument for switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            case '?':
+                fprintf(kt_stderr, "Unknown switch '%c'.\n", optopt);
+                goto cleanup;
+                break;
+            default:
+                fprintf(kt_stderr, "?? Unknown option code 0%o ??\n", opt);
+                goto cleanup;
+                break;
+        }
+    }
+
+    if(envelope)
+    {
+        // Any number of files and/or directories
+        if(optind >= argc)
+        {
+            fprintf(kt_stderr, "No input specified.\n");
+            goto cleanup;
+        }
+        for(i = 0; i < 3; i++)
+            keys[i] = (loaded[i] ? &pubkeys[i] : NULL);
+        fprintf(kt_stderr, "Verifying the SP01 envelopes of %d input%s (keys: dev %s, 1K %s, 2K %s).\n", argc - optind, (argc - optind > 1 ? "s" : ""), (keys[0] ? "yes" : "no"), (keys[1] ? "yes" : "no"), (keys[2] ? "yes" : "no"));
+        ret = kindle_verify_envelopes(&argv[optind], (unsigned int) (argc - optind), keys, jobs, stdout);
+        if(ret > 0)
+            fprintf(kt_stderr, "Some packages failed verification.\n");
+        goto cleanup;
+    }
+
+    if(inflate.speculative && inflate.jobs == 0 && parse_jobs("0", &inflate.jobs) < 0)
+        goto cleanup;
+
+    // One input at most, standard input if there's none
+    if(optind + 1 < argc)
+    {
+        fprintf(kt_stderr, "Invalid number of arguments (need at most one input).\n");
+        goto cleanup;
+    }
+    if(optind < argc)
+        in_name = argv[optind];
+
+    if(strcmp(in_name, "-") == 0)
+        input = stdin;
+    else if((input = fopen(in_name, "rb")) == NULL)
+    {
+        fprintf(kt_stderr, "Cannot open input '%s' for reading: %s.\n", in_name, strerror(errno));
+        goto cleanup;
+    }
+    fprintf(kt_stderr, "Verifying %spackage '%s' against a %zu bits key.\n", (fake_sign ? "fake " : ""), (input == stdin ? "standard input" : in_name), pubkeys[CertificateDeveloper].size * 8);
+    ret = kindle_verify(input, fake_sign, &pubkeys[CertificateDeveloper], jobs, &inflate, stdout);
+    if(ret < 0)
+        fprintf(kt_stderr, "Error verifying package '%s'.\n", (input == stdin ? "standard input" : in_name));
+    else if(ret > 0)
+        fprintf(kt_stderr, "Package '%s' failed verification.\n", (input == stdin ? "standard input" : in_name));
+    if(input != stdin)
+        fclose(input);
+
+cleanup:
+    for(i = 0; i < 3; i++)
+    {
+        if(loaded[i])
+            rsa_public_key_clear(&pubkeys[i]);
+    }
+
+    return (ret == 0 ? 0 : -1);
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,77 @@
+#!/bin/bash -e
+#
+# Delta & diff packages round trip: build a delta (-D) and a diff (-F) package between two trees (with symlinks & empty directories in them),
+# apply them to the old payload like the device would, and check that we end up with the new one.
+# Usage: delta-test.sh [kindletool binary]
+#
+##
+
+KT="${1:-$(dirname "$0")/../KindleTool/Release/kindletool}"
+
+if [[ ! -x "${KT}" ]] ; then
+	echo "* Can't find a KindleTool binary at '${KT}', build it first (or pass its path)."
+	exit 1
+fi
+KT="$(cd "$(dirname "${KT}")" && pwd)/$(basename "${KT}")"
+
+TEST_DIR="$(mktemp -d "${TMPDIR:-/tmp}/kt-delta-test.XXXXXX")"
+trap 'rm -rf "${TEST_DIR}"' EXIT
+cd "${TEST_DIR}"
+
+Fail() {
+	echo "* FAILED: $*"
+	exit 1
+}
+
+# Ignore what create generates by itself
+Compare() {
+	diff -r --no-dereference -x '*.sig' -x 'update-filelist.dat' -x 'kt_delta_apply.sh' "${1}" "${2}" || Fail "${1} doesn't match ${2}"
+}
+
+## The old tree
+mkdir -p old/sub old/gone old/empty-kept old/empty-gone old/node
+head -c 300000 /dev/urandom > old/sub/f1.bin
+echo "f2" > old/sub/f2.txt
+echo "gone" > old/gone/f3.txt
+ln -s sub/f2.txt old/link-kept
+ln -s sub/f1.bin old/link-retargeted
+ln -s sub/f2.txt old/link-gone
+echo "#!/bin/sh" > old/install.sh
+
+## The new one: a few blocks of f1.bin changed, links added, retargeted & removed, directories added & removed, and a directory replaced by a symlink
+cp -a old new
+dd if=/dev/urandom of=new/sub/f1.bin bs=4096 seek=10 count=2 conv=notrunc 2> /dev/null
+rm -rf new/gone new/empty-gone new/link-gone new/node
+mkdir -p new/pl new/empty-new
+ln -s ../sub/f2.txt new/pl/link
+ln -sfn sub/f2.txt new/link-retargeted
+ln -s sub new/node
+
+## Delta package (-D): rebuild the full payload from the old one
+"${KT}" create ota2 -d kindle5 -C old update_old.bin > /dev/null 2>&1 < /dev/null || Fail "create old"
+"${KT}" create ota2 -d kindle5 -C new update_new.bin > /dev/null 2>&1 < /dev/null || Fail "create new"
+"${KT}" create ota2 -d kindle5 -C -D update_old.bin new update_delta.bin > /dev/null 2>&1 < /dev/null || Fail "create delta"
+"${KT}" extract update_old.bin base > /dev/null 2>&1 < /dev/null || Fail "extract old"
+# The base only holds the payload itself
+find base -name '*.sig' -o -name 'update-filelist.dat' | xargs rm -f
+"${KT}" extract update_new.bin ref > /dev/null 2>&1 < /dev/null || Fail "extract new"
+"${KT}" extract update_delta.bin payload > /dev/null 2>&1 < /dev/null || Fail "extract delta"
+[[ -L payload/pl/link ]] && Fail "the delta package ships symlinks"
+KT_DELTA_BASE="${TEST_DIR}/base" sh payload/kt_delta_apply.sh || Fail "apply delta"
+[[ "$(readlink payload/pl/link)" == "../sub/f2.txt" ]] || Fail "pl/link wasn't rebuilt"
+Compare payload ref
+Compare base ref
+echo "* Delta package: OK"
+
+## Diff package (-F): update a copy of the old tree in place (pl/f4.txt is gone/f3.txt, moved)
+cp old/gone/f3.txt new/pl/f4.txt
+"${KT}" create ota2 -d kindle5 -F old new update_diff.bin > /dev/null 2>&1 < /dev/null || Fail "create diff"
+"${KT}" extract update_diff.bin diff > /dev/null 2>&1 < /dev/null || Fail "extract diff"
+[[ -L diff/pl/link ]] && Fail "the diff package ships symlinks"
+cp -a old base-diff
+KT_DELTA_BASE="${TEST_DIR}/base-diff" sh diff/kt_delta_apply.sh || Fail "apply diff"
+[[ "$(readlink base-diff/pl/link)" == "../sub/f2.txt" ]] || Fail "pl/link wasn't created"
+Compare base-diff new
+# Applying it again has to fail, the base isn't what it was built against anymore
+KT_DELTA_BASE="${TEST_DIR}/base-diff" sh diff/kt_delta_apply.sh 2> /dev/null && Fail "applied a diff package twice"
+echo "* Diff package: OK"
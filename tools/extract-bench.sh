@@ -0,0 +1,63 @@
+#!/bin/bash -e
+#
+# Extraction benchmark: compare the write paths of extract (write_disk, -j, -U) on a package made of many small files.
+# Usage: extract-bench.sh [kindletool binary] [number of files] [runs]
+# (The package & the extracted trees live in a temporary directory, point TMPDIR at the disk you want to measure).
+#
+##
+
+KT="${1:-$(dirname "$0")/../KindleTool/Release/kindletool}"
+NUM_FILES="${2:-20000}"
+RUNS="${3:-3}"
+JOBS="$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 2)"
+# The writer pool needs at least 2 threads, -j 1 is the plain write_disk path
+(( JOBS < 2 )) && JOBS=2
+
+if [[ ! -x "${KT}" ]] ; then
+	echo "* Can't find a KindleTool binary at '${KT}', build it first (or pass its path)."
+	exit 1
+fi
+
+BENCH_DIR="$(mktemp -d "${TMPDIR:-/tmp}/kt-extract-bench.XXXXXX")"
+trap 'rm -rf "${BENCH_DIR}"' EXIT
+
+## Build a tree of small files (1 to 16KiB, 100 per directory), and package it
+echo "* Building a package of ${NUM_FILES} files in ${BENCH_DIR} . . ."
+mkdir -p "${BENCH_DIR}/tree"
+for (( i = 0 ; i < NUM_FILES ; i++ )) ; do
+	if (( i % 100 == 0 )) ; then
+		dir="${BENCH_DIR}/tree/d$(( i / 100 ))"
+		mkdir -p "${dir}"
+	fi
+	head -c $(( (RANDOM % 16 + 1) * 1024 )) /dev/urandom > "${dir}/f${i}"
+done
+"${KT}" create ota2 -d kindle5 "${BENCH_DIR}/tree" "${BENCH_DIR}/update_bench.bin" > /dev/null 2>&1
+rm -rf "${BENCH_DIR}/tree"
+
+## Extract it a few times with each write path, and keep the best run
+Bench() {
+	local name="${1}"
+	shift
+	local best=""
+	local line=""
+	for (( run = 0 ; run < RUNS ; run++ )) ; do
+		rm -rf "${BENCH_DIR}/out"
+		sync
+		if ! line="$("${KT}" extract --stats "$@" "${BENCH_DIR}/update_bench.bin" "${BENCH_DIR}/out" 2>&1 < /dev/null)" ; then
+			echo "* extract $* failed:"
+			tail -n 5 <<< "${line}"
+			exit 1
+		fi
+		line="$(grep '^Extracted ' <<< "${line}")"
+		rate="$(sed -e 's/.*(\([0-9]*\) files\/s.*/\1/' <<< "${line}")"
+		if [[ -z "${best}" ]] || (( rate > best )) ; then
+			best="${rate}"
+		fi
+	done
+	printf "%-24s %8s files/s   (%s)\n" "${name}" "${best}" "$(sed -e 's/.*files\/s, \(.*\))\./\1/' <<< "${line}")"
+}
+
+echo "* Best of ${RUNS} runs:"
+Bench "write_disk" -j 1
+Bench "writer pool (-j ${JOBS})" -j "${JOBS}"
+Bench "io_uring (-U)" -U
@@ -0,0 +1,339 @@
+#!/usr/bin/env python
+"""
+    Registry generator for the devices, platforms & boards KindleTool knows about.
+    Output is to stdout, the result is KindleTool/kindle_registry.h:
+
+        tools/kindle_registry.py > KindleTool/kindle_registry.h
+
+    This is the one place to edit when Amazon comes up with a new device: the
+    descriptions, the names create accepts for -d/-p/-B & the aliases all live
+    here. The enums in kindle_tool.h still have to be updated by hand, the
+    generated header refuses to build if they drift apart.
+
+    IDs index dense arrays directly, and names are looked up through a perfect
+    hash (FNV-1a with a searched seed), so every lookup is a single probe.
+"""
+
+from __future__ import print_function
+
+import sys
+
+# Unconfirmed (datamined) devices are only pulled in by the aliases with KT_WITH_UNKNOWN_DEVCODES set
+# (enum, id, description, unconfirmed)
+devices = [
+    ('Kindle1', 0x01, 'Kindle 1', False),
+    ('Kindle2US', 0x02, 'Kindle 2 US', False),
+    ('Kindle2International', 0x03, 'Kindle 2 International', False),
+    ('KindleDXUS', 0x04, 'Kindle DX US', False),
+    ('KindleDXInternational', 0x05, 'Kindle DX International', False),
+    ('KindleDXGraphite', 0x09, 'Kindle DX Graphite', False),
+    ('Kindle3Wifi', 0x08, 'Kindle 3 Wifi', False),
+    ('Kindle3Wifi3G', 0x06, 'Kindle 3 Wifi+3G', False),
+    ('Kindle3Wifi3GEurope', 0x0A, 'Kindle 3 Wifi+3G Europe', False),
+    ('Kindle4NonTouch', 0x0E, 'Kindle 4 Non-Touch Silver (2011)', False),
+    ('Kindle5TouchWifi', 0x11, 'Kindle 5 Touch Wifi', False),
+    ('Kindle5TouchWifi3G', 0x0F, 'Kindle 5 Touch Wifi+3G', False),
+    ('Kindle5TouchWifi3GEurope', 0x10, 'Kindle 5 Touch Wifi+3G Europe', False),
+    ('Kindle5TouchUnknown', 0x12, 'Kindle 5 Touch (Unknown Variant)', True),
+    ('Kindle4NonTouchBlack', 0x23, 'Kindle 4 Non-Touch Black (2012)', False),
+    ('KindlePaperWhiteWifi', 0x24, 'Kindle PaperWhite Wifi', False),
+    ('KindlePaperWhiteWifi3G', 0x1B, 'Kindle PaperWhite Wifi+3G', False),
+    ('KindlePaperWhiteWifi3GCanada', 0x1C, 'Kindle PaperWhite Wifi+3G Canada', False),
+    ('KindlePaperWhiteWifi3GEurope', 0x1D, 'Kindle PaperWhite Wifi+3G Europe', False),
+    ('KindlePaperWhiteWifi3GJapan', 0x1F, 'Kindle PaperWhite Wifi+3G Japan', False),
+    ('KindlePaperWhiteWifi3GBrazil', 0x20, 'Kindle PaperWhite Wifi+3G Brazil', False),
+    ('KindlePaperWhite2Wifi', 0xD4, 'Kindle PaperWhite 2 (2013) Wifi', False),
+    ('KindlePaperWhite2WifiJapan', 0x5A, 'Kindle PaperWhite 2 (2013) Wifi Japan', False),
+    ('KindlePaperWhite2Wifi3G', 0xD5, 'Kindle PaperWhite 2 (2013) Wifi+3G', False),
+    ('KindlePaperWhite2Wifi3GCanada', 0xD6, 'Kindle PaperWhite 2 (2013) Wifi+3G Canada', False),
+    ('KindlePaperWhite2Wifi3GEurope', 0xD7, 'Kindle PaperWhite 2 (2013) Wifi+3G Europe', False),
+    ('KindlePaperWhite2Wifi3GRussia', 0xD8, 'Kindle PaperWhite 2 (2013) Wifi+3G Russia', False),
+    ('KindlePaperWhite2Wifi3GJapan', 0xF2, 'Kindle PaperWhite 2 (2013) Wifi+3G Japan', False),
+    ('KindlePaperWhite2Wifi4GBInternational', 0x17, 'Kindle PaperWhite 2 (2013) Wifi (4GB) International', False),
+    ('KindlePaperWhite2Wifi3G4GBEurope', 0x60, 'Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Europe', False),
+    ('KindlePaperWhite2Unknown_0xF4', 0xF4, 'Kindle PaperWhite 2 (2013) (Unknown Variant 0xF4)', True),
+    ('KindlePaperWhite2Unknown_0xF9', 0xF9, 'Kindle PaperWhite 2 (2013) (Unknown Variant 0xF9)', True),
+    ('KindlePaperWhite2Wifi3G4GB', 0x62, 'Kindle PaperWhite 2 (2013) Wifi+3G (4GB)', False),
+    ('KindlePaperWhite2Unknown_0x61', 0x61, 'Kindle PaperWhite 2 (2013) (Unknown Variant 0x61)', True),
+    ('KindlePaperWhite2Wifi3G4GBCanada', 0x5F, 'Kindle PaperWhite 2 (2013) Wifi+3G (4GB) Canada', False),
+    ('KindleBasic', 0xC6, 'Kindle Basic (2014)', False),
+    ('KindleVoyageWifi', 0x13, 'Kindle Voyage WiFi', False),
+    ('ValidKindleUnknown_0x16', 0x16, 'Unknown Kindle (0x16)', True),
+    ('ValidKindleUnknown_0x21', 0x21, 'Unknown Kindle (0x21)', True),
+    ('KindleVoyageWifi3G', 0x54, 'Kindle Voyage WiFi+3G', False),
+    ('KindleVoyageUnknown_0x2A', 0x2A, 'Kindle Voyage (Unknown Variant 0x2A)', True),
+    ('KindleVoyageUnknown_0x4F', 0x4F, 'Kindle Voyage (Unknown Variant 0x4F)', True),
+    ('KindleVoyageUnknown_0x52', 0x52, 'Kindle Voyage (Unknown Variant 0x52)', True),
+    ('KindleVoyageWifi3GEurope', 0x53, 'Kindle Voyage WiFi+3G Europe', False),
+    ('ValidKindleUnknown_0x07', 0x07, 'Unknown Kindle (0x07)', True),
+    ('ValidKindleUnknown_0x0B', 0x0B, 'Unknown Kindle (0x0B)', True),
+    ('ValidKindleUnknown_0x0C', 0x0C, 'Unknown Kindle (0x0C)', True),
+    ('ValidKindleUnknown_0x0D', 0x0D, 'Unknown Kindle (0x0D)', True),
+    ('ValidKindleUnknown_0x99', 0x99, 'Unknown Kindle (0x99)', True),
+    ('KindleBasicUnknown_0xDD', 0xDD, 'Kindle Basic (2014) (Unknown Variant 0xDD)', True),
+    ('KindlePaperWhite3Wifi', int('0G1', 32), 'Kindle PaperWhite 3 (2015) WiFi', False),
+    ('KindlePaperWhite3Unknown_0G2', int('0G2', 32), 'Kindle PaperWhite 3 (2015) (Unknown Variant 0G2)', True),
+    ('KindlePaperWhite3Unknown_0G4', int('0G4', 32), 'Kindle PaperWhite 3 (2015) (Unknown Variant 0G4)', True),
+    ('KindlePaperWhite3Unknown_0G5', int('0G5', 32), 'Kindle PaperWhite 3 (2015) (Unknown Variant 0G5)', True),
+    ('KindlePaperWhite3Unknown_0G6', int('0G6', 32), 'Kindle PaperWhite 3 (2015) (Unknown Variant 0G6)', True),
+    ('KindlePaperWhite3Unknown_0G7', int('0G7', 32), 'Kindle PaperWhite 3 (2015) (Unknown Variant 0G7)', True),
+]
+
+# (enum, id, description, create -p names)
+platforms = [
+    ('Plat_Unspecified', 0x00, 'Unspecified', ['unspecified']),
+    ('MarioDeprecated', 0x01, 'Mario (Deprecated)', ['mario']),
+    ('Luigi', 0x02, 'Luigi', ['luigi']),
+    ('Banjo', 0x03, 'Banjo', ['banjo']),
+    ('Yoshi', 0x04, 'Yoshi', ['yoshi']),
+    ('YoshimeProto', 0x05, 'Yoshime (Prototype)', ['yoshime-proto', 'yoshime-p']),
+    ('Yoshime', 0x06, 'Yoshime (Yoshime3)', ['yoshime']),
+    ('Wario', 0x07, 'Wario', ['wario']),
+]
+
+# (enum, id, description, create -B names)
+boards = [
+    ('Board_Unspecified', 0x00, 'Unspecified', ['unspecified']),
+    ('Tequila', 0x03, 'Tequila', ['tequila']),
+    ('Whitney', 0x05, 'Whitney', ['whitney']),
+]
+
+# create -d names for a single device: (names, enum, magic number it switches to, if any)
+device_names = [
+    (['k1'], 'Kindle1', None),
+    (['k2'], 'Kindle2US', None),
+    (['k2i'], 'Kindle2International', None),
+    (['dx'], 'KindleDXUS', None),
+    (['dxi'], 'KindleDXInternational', None),
+    (['dxg'], 'KindleDXGraphite', None),
+    (['k3w'], 'Kindle3Wifi', None),
+    (['k3g'], 'Kindle3Wifi3G', None),
+    (['k3gb'], 'Kindle3Wifi3GEurope', None),
+    (['k4'], 'Kindle4NonTouch', 'FC04'),
+    (['k4b'], 'Kindle4NonTouchBlack', 'FC04'),
+    # NOTE: Magic number switch to 'versionless' update types here... FW >= 5.6.1 apparently dropped support for these...
+    (['k5w'], 'Kindle5TouchWifi', 'FD04'),
+    (['k5g'], 'Kindle5TouchWifi3G', 'FD04'),
+    (['k5gb'], 'Kindle5TouchWifi3GEurope', 'FD04'),
+    (['k5u'], 'Kindle5TouchUnknown', 'FD04'),
+    (['pw', 'kpw'], 'KindlePaperWhiteWifi', 'FD04'),
+    (['pwg', 'kpwg'], 'KindlePaperWhiteWifi3G', 'FD04'),
+    (['pwgc', 'kpwgc'], 'KindlePaperWhiteWifi3GCanada', 'FD04'),
+    (['pwgb', 'kpwgb'], 'KindlePaperWhiteWifi3GEurope', 'FD04'),
+    (['pwgj', 'kpwgj'], 'KindlePaperWhiteWifi3GJapan', 'FD04'),
+    (['pwgbr', 'kpwgbr'], 'KindlePaperWhiteWifi3GBrazil', 'FD04'),
+    (['pw2', 'kpw2'], 'KindlePaperWhite2Wifi', 'FD04'),
+    (['pw2j', 'kpw2j'], 'KindlePaperWhite2WifiJapan', 'FD04'),
+    (['pw2g', 'kpw2g'], 'KindlePaperWhite2Wifi3G', 'FD04'),
+    (['pw2gc', 'kpw2gc'], 'KindlePaperWhite2Wifi3GCanada', 'FD04'),
+    (['pw2gb', 'kpw2gb'], 'KindlePaperWhite2Wifi3GEurope', 'FD04'),
+    (['pw2gr', 'kpw2gr'], 'KindlePaperWhite2Wifi3GRussia', 'FD04'),
+    (['pw2gj', 'kpw2gj'], 'KindlePaperWhite2Wifi3GJapan', 'FD04'),
+    (['pw2il', 'kpw2il'], 'KindlePaperWhite2Wifi4GBInternational', 'FD04'),
+    (['pw2gbl', 'kpw2gbl'], 'KindlePaperWhite2Wifi3G4GBEurope', 'FD04'),
+    (['pw2gl', 'kpw2gl'], 'KindlePaperWhite2Wifi3G4GB', 'FD04'),
+    (['pw2gcl', 'kpw2gcl'], 'KindlePaperWhite2Wifi3G4GBCanada', 'FD04'),
+    (['kt2', 'bk'], 'KindleBasic', 'FD04'),
+    (['kv'], 'KindleVoyageWifi', 'FD04'),
+    (['kvg'], 'KindleVoyageWifi3G', 'FD04'),
+    (['kvgb'], 'KindleVoyageWifi3GEurope', 'FD04'),
+    (['pw3', 'kpw3'], 'KindlePaperWhite3Wifi', 'FD04'),
+]
+
+# create -d aliases for a whole family: (names, magic number, members, only with -U)
+# Unconfirmed members are skipped unless KT_WITH_UNKNOWN_DEVCODES is set, and so are the datamined aliases.
+touch = ['Kindle5TouchWifi', 'Kindle5TouchWifi3G', 'Kindle5TouchWifi3GEurope', 'Kindle5TouchUnknown']
+paperwhite = ['KindlePaperWhiteWifi', 'KindlePaperWhiteWifi3G', 'KindlePaperWhiteWifi3GCanada', 'KindlePaperWhiteWifi3GEurope', 'KindlePaperWhiteWifi3GJapan', 'KindlePaperWhiteWifi3GBrazil']
+paperwhite2 = ['KindlePaperWhite2Wifi', 'KindlePaperWhite2WifiJapan', 'KindlePaperWhite2Wifi3G', 'KindlePaperWhite2Wifi3GCanada', 'KindlePaperWhite2Wifi3GEurope', 'KindlePaperWhite2Wifi3GRussia', 'KindlePaperWhite2Wifi3GJapan', 'KindlePaperWhite2Wifi4GBInternational', 'KindlePaperWhite2Wifi3G4GBEurope', 'KindlePaperWhite2Wifi3G4GB', 'KindlePaperWhite2Wifi3G4GBCanada', 'KindlePaperWhite2Unknown_0xF4', 'KindlePaperWhite2Unknown_0xF9', 'KindlePaperWhite2Unknown_0x61']
+basic = ['KindleBasic', 'KindleBasicUnknown_0xDD']
+voyage = ['KindleVoyageWifi', 'KindleVoyageWifi3G', 'KindleVoyageWifi3GEurope', 'KindleVoyageUnknown_0x2A', 'KindleVoyageUnknown_0x4F', 'KindleVoyageUnknown_0x52']
+paperwhite3 = ['KindlePaperWhite3Wifi', 'KindlePaperWhite3Unknown_0G2', 'KindlePaperWhite3Unknown_0G4', 'KindlePaperWhite3Unknown_0G5', 'KindlePaperWhite3Unknown_0G6', 'KindlePaperWhite3Unknown_0G7']
+kindle2 = ['Kindle2US', 'Kindle2International']
+kindledx = ['KindleDXUS', 'KindleDXInternational', 'KindleDXGraphite']
+kindle3 = ['Kindle3Wifi', 'Kindle3Wifi3G', 'Kindle3Wifi3GEurope']
+
+aliases = [
+    (['kindle4'], 'FC04', ['Kindle4NonTouch', 'Kindle4NonTouchBlack'], False),
+    (['touch'], 'FD04', touch, False),
+    (['paperwhite'], 'FD04', paperwhite, False),
+    (['paperwhite2'], 'FD04', paperwhite2, False),
+    (['basic'], 'FD04', basic, False),
+    (['voyage'], 'FD04', voyage, False),
+    (['paperwhite3'], 'FD04', paperwhite3, False),
+    (['kindle5'], 'FD04', touch + paperwhite + paperwhite2 + basic + voyage + paperwhite3, False),
+    (['unknown', 'datamined'], 'FD04', ['ValidKindleUnknown_0x16', 'ValidKindleUnknown_0x21', 'ValidKindleUnknown_0x07', 'ValidKindleUnknown_0x0B', 'ValidKindleUnknown_0x0C', 'ValidKindleUnknown_0x0D', 'ValidKindleUnknown_0x99'], True),
+    (['kindle2'], 'FD04', kindle2, False),
+    (['kindledx'], 'FD04', kindledx, False),
+    (['kindle3'], 'FD04', kindle3, False),
+    (['legacy'], 'FD04', kindle2 + kindledx + kindle3, False),
+]
+
+HASH_BITS = 9
+FNV_PRIME = 16777619
+
+
+def fnv1a(name, seed):
+    h = seed
+    for c in bytearray(name.encode('ascii')):
+        h ^= c
+        h = (h * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def find_seed(names):
+    seed = 2166136261    # The stock FNV-1a offset basis, we just walk from there
+    while True:
+        slots = set()
+        for name in names:
+            slot = fnv1a(name, seed) >> (32 - HASH_BITS)
+            if slot in slots:
+                break
+            slots.add(slot)
+        else:
+            return seed
+        seed = (seed + 1) & 0xFFFFFFFF
+
+
+def c_string(s):
+    return 'NULL' if s is None else '"%s"' % s
+
+
+def main():
+    out = sys.stdout
+    device_by_enum = dict((d[0], d) for d in devices)
+    max_id = max(d[1] for d in devices)
+
+    # Merge every name into a single namespace: -p & -B happen to share 'unspecified'
+    records = {}
+
+    def record(name):
+        if name not in records:
+            records[name] = {'magic': None, 'members': [], 'alias': False, 'datamined': False, 'platform': -1, 'board': -1}
+        return records[name]
+
+    members = []
+    for names, enum, magic in device_names:
+        for name in names:
+            r = record(name)
+            r['magic'] = magic
+            r['members'] = [enum]
+    for names, magic, group, datamined in aliases:
+        for name in names:
+            r = record(name)
+            r['magic'] = magic
+            r['members'] = group
+            r['alias'] = True
+            r['datamined'] = datamined
+    for enum, plat, desc, names in platforms:
+        for name in names:
+            record(name)['platform'] = enum
+    for enum, board, desc, names in boards:
+        for name in names:
+            record(name)['board'] = enum
+
+    ordered = sorted(records)
+    if len(ordered) >= 255:
+        raise ValueError('Too many names for 8-bit slots')
+    seed = find_seed(ordered)
+
+    out.write('/*\n')
+    out.write('   Device, platform & board registry: dense ID -> record look-up tables, and a perfect hash of the names create accepts.\n')
+    out.write('   Generated by: tools/kindle_registry.py (edit that instead, and regenerate)\n')
+    out.write('*/\n\n')
+    out.write('#ifndef KINDLEREGISTRY\n#define KINDLEREGISTRY\n\n')
+
+    # Catch enums that don't match the registry anymore at build time (negative array size otherwise)
+    checks = ['%s == 0x%02X' % (d[0], d[1]) for d in devices]
+    checks += ['%s == 0x%02X' % (p[0], p[1]) for p in platforms]
+    checks += ['%s == 0x%02X' % (b[0], b[1]) for b in boards]
+    out.write('/*  the enums in kindle_tool.h have to agree with us */\n')
+    out.write('typedef char kt_registry_enum_check[(\n')
+    out.write(' &&\n'.join('    ' + c for c in checks))
+    out.write('\n) ? 1 : -1];\n\n')
+
+    out.write('/*  device records, kt_device_index points into this (0 is the unknown device) */\n')
+    out.write('static const KTDeviceRecord kt_device_records[] = {\n')
+    out.write('    { NULL, 0 },\n')
+    record_index = {}
+    for i, (enum, dev, desc, unconfirmed) in enumerate(devices):
+        record_index[dev] = i + 1
+        entry = '{ %s, %s },' % (c_string(desc), 'KT_DEVICE_UNCONFIRMED' if unconfirmed else '0')
+        out.write('    %s // %s\n' % (entry.ljust(72), enum))
+    out.write('};\n\n')
+
+    out.write('#define KT_DEVICE_ID_MAX 0x%03X\n\n' % max_id)
+    out.write('/*  index by device ID, result in kt_device_records */\n')
+    out.write('static const uint8_t kt_device_index[KT_DEVICE_ID_MAX + 1] = {\n')
+    row = []
+    for dev in range(max_id + 1):
+        row.append('%d' % record_index.get(dev, 0))
+        if len(row) == 16 or dev == max_id:
+            out.write('    %s,\n' % ', '.join(row))
+            row = []
+    out.write('};\n\n')
+
+    for kind, table in (('platform', platforms), ('board', boards)):
+        names = dict((t[1], t) for t in table)
+        out.write('/*  index by %s ID, NULL when unknown */\n' % kind)
+        out.write('static const char *const kt_%s_names[] = {\n' % kind)
+        for i in range(max(names) + 1):
+            if i in names:
+                out.write('    %s // %s\n' % ((c_string(names[i][2]) + ',').ljust(24), names[i][0]))
+            else:
+                out.write('    NULL,\n')
+        out.write('};\n\n')
+
+    # Lay the biggest families out first, so that the smaller ones & single devices can reuse a slice of them
+    spans = {}
+    chunks = []
+    for name in sorted(ordered, key=lambda n: -len(records[n]['members'])):
+        group = records[name]['members']
+        for enum in group:
+            if enum not in device_by_enum:
+                raise ValueError('Unknown device %s in %s' % (enum, name))
+        if not group or tuple(group) in spans:
+            continue
+        for start in range(len(members) - len(group) + 1):
+            if members[start:start + len(group)] == group:
+                spans[tuple(group)] = start
+                break
+        else:
+            spans[tuple(group)] = len(members)
+            members.extend(group)
+            chunks.append(group)
+    out.write('/*  devices behind each -d name, see kt_registry_names */\n')
+    out.write('static const Device kt_registry_members[] = {\n')
+    for group in chunks:
+        out.write('    %s,\n' % ', '.join(group))
+    out.write('};\n\n')
+
+    out.write('#define KT_REGISTRY_SEED 0x%08Xu\n' % seed)
+    out.write('#define KT_REGISTRY_BITS %d\n\n' % HASH_BITS)
+    out.write('/*  every name create knows, slot 0 is the miss */\n')
+    out.write('static const KTRegistryName kt_registry_names[] = {\n')
+    out.write('    { NULL, NULL, 0, 0, 0, -1, -1 },\n')
+    for name in ordered:
+        r = records[name]
+        group = tuple(r['members'])
+        flags = []
+        if r['alias']:
+            flags.append('KT_REGISTRY_ALIAS')
+        if r['datamined']:
+            flags.append('KT_REGISTRY_DATAMINED')
+        out.write('    { %s, %s, %d, %d, %s, %s, %s },\n' % (c_string(name), c_string(r['magic']), spans[group] if group else 0, len(group), ' | '.join(flags) if flags else '0', r['platform'], r['board']))
+    out.write('};\n\n')
+
+    slots = [0] * (1 << HASH_BITS)
+    for i, name in enumerate(ordered):
+        slots[fnv1a(name, seed) >> (32 - HASH_BITS)] = i + 1
+    out.write('/*  index by FNV-1a(name, KT_REGISTRY_SEED) >> (32 - KT_REGISTRY_BITS), result in kt_registry_names */\n')
+    out.write('static const uint8_t kt_registry_slots[1 << KT_REGISTRY_BITS] = {\n')
+    for i in range(0, len(slots), 16):
+        out.write('    %s,\n' % ', '.join('%d' % s for s in slots[i:i + 16]))
+    out.write('};\n\n')
+
+    out.write('#endif\n')
+
+
+if __name__ == '__main__':
+    main()